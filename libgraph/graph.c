@@ -17,6 +17,7 @@
 #include <string.h>
 
 #include <sys/threads.h>
+#include <sys/time.h>
 
 #include "libgraph.h"
 #include "soft.h"
@@ -95,6 +96,12 @@ typedef struct {
 } __attribute__((packed)) graph_task_t;
 
 
+/* Screen refresh rates in Hz (indexed by graph_freq_t, 60Hz if not specified) */
+static const unsigned short graph_rates[] = {
+	60, 24, 30, 43, 56, 60, 70, 72, 75, 80, 85, 87, 90, 120, 144, 165, 240, 300, 360
+};
+
+
 #ifdef GRAPH_CT69000
 extern int ct69000_open(graph_t *);
 extern void ct69000_done(void);
@@ -208,6 +215,63 @@ int graph_schedule(graph_t *graph)
 }
 
 
+/* Advances vertical retrace clock to given time, returns number of passed retraces */
+unsigned int graph_vsynctick(graph_t *graph, time_t now)
+{
+	graph_vsched_t *vs = &graph->vsched;
+	unsigned int n;
+
+	if ((now <= vs->last) || !(n = (now - vs->last) / vs->period))
+		return 0;
+
+	vs->last += n * vs->period;
+	vs->count += n;
+
+	return n;
+}
+
+
+/* Synchronizes vertical retrace clock with retrace detected at given time */
+void graph_vsyncadjust(graph_t *graph, time_t now)
+{
+	graph_vsched_t *vs = &graph->vsched;
+	time_t delta, sample;
+	unsigned int n;
+
+	/* Learn retrace period from consecutive detected retraces */
+	if (vs->seen && ((delta = now - vs->seen) > 0)) {
+		if ((n = (delta + (vs->period >> 1)) / vs->period)) {
+			sample = delta / n;
+			if ((sample > vs->period - (vs->period >> 2)) && (sample < vs->period + (vs->period >> 2)))
+				vs->period += (sample - vs->period) / 8;
+		}
+	}
+	vs->seen = now;
+
+	/* Count retrace unless it has already been predicted, adjust clock phase */
+	graph_vsynctick(graph, now);
+	if (now - vs->last >= (vs->period >> 1))
+		vs->count++;
+	vs->last = now;
+}
+
+
+/* Resets vertical retrace clock to nominal refresh rate */
+static void graph_vsyncreset(graph_t *graph, graph_freq_t freq)
+{
+	graph_vsched_t *vs = &graph->vsched;
+
+	if (freq >= sizeof(graph_rates) / sizeof(graph_rates[0]))
+		freq = GRAPH_NOFREQ;
+
+	gettime(&vs->last, NULL);
+	vs->period = 1000000 / graph_rates[freq];
+	vs->seen = 0;
+	vs->cost = 0;
+	vs->count = 0;
+}
+
+
 static int _graph_queue(graph_t *graph, graph_task_t *task, graph_taskq_t *q)
 {
 	if (q->stop)
@@ -462,16 +526,56 @@ int graph_reset(graph_t *graph, graph_queue_t queue)
 
 int graph_vsync(graph_t *graph)
 {
-	return graph->vsync(graph);
+	int ret;
+
+	if ((ret = graph->vsync(graph)) < 0)
+		return ret;
+
+	ret = graph->vsched.count;
+	graph->vsched.count = 0;
+
+	return ret;
+}
+
+
+int graph_waitvsync(graph_t *graph)
+{
+	graph_vsched_t *vs = &graph->vsched;
+	time_t start, end;
+	int err;
+
+	if ((err = graph->waitvsync(graph)) < 0)
+		return err;
+	vs->count = 0;
+
+	/* Execute queued tasks and commit framebuffer in vertical blank */
+	graph_schedule(graph);
+	gettime(&start, NULL);
+	err = graph->commit(graph);
+	gettime(&end, NULL);
+
+	/* Update average commit time (adapters start commit ahead of retrace) */
+	vs->cost += (end - start - vs->cost) / 8;
+
+	return err;
 }
 
 
 int graph_mode(graph_t *graph, graph_mode_t mode, graph_freq_t freq)
 {
+	int err;
+
 	graph_reset(graph, GRAPH_QUEUE_BOTH);
 	while (graph->isbusy(graph));
 
-	return graph->mode(graph, mode, freq);
+	if ((err = graph->mode(graph, mode, freq)) < 0)
+		return err;
+
+	/* Graphics mode change resets vertical retrace timing */
+	if (mode >= GRAPH_320x200x8)
+		graph_vsyncreset(graph, freq);
+
+	return EOK;
 }
 
 
@@ -560,9 +664,12 @@ int graph_open(graph_t *graph, unsigned int mem, unsigned int adapter)
 	if (err < 0) {
 		resourceDestroy(graph->lock);
 		free(graph->hi.fifo);
+		return err;
 	}
 
-	return err;
+	graph_vsyncreset(graph, GRAPH_NOFREQ);
+
+	return EOK;
 }
 
 
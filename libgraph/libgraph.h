@@ -152,6 +152,15 @@ typedef struct {
 } graph_taskq_t;
 
 
+typedef struct {
+	time_t period;             /* Vertical retrace period [us] */
+	time_t last;               /* Last vertical retrace timestamp [us] */
+	time_t seen;               /* Last detected vertical retrace timestamp [us] */
+	time_t cost;               /* Average commit time [us] */
+	unsigned int count;        /* Vertical retraces since last graph_vsync() */
+} graph_vsched_t;
+
+
 typedef struct _graph_t graph_t;
 
 
@@ -169,6 +178,9 @@ struct _graph_t {
 	graph_taskq_t hi;          /* High priority tasks queue */
 	graph_taskq_t lo;          /* Low priority tasks queue */
 
+	/* Frame scheduler */
+	graph_vsched_t vsched;     /* Vertical retrace scheduler */
+
 	/* Synchronization */
 	handle_t lock;             /* Graph synchronization mutex */
 
@@ -176,6 +188,7 @@ struct _graph_t {
 	void (*close)(graph_t *);
 	int (*mode)(graph_t *, graph_mode_t, graph_freq_t);
 	int (*vsync)(graph_t *);
+	int (*waitvsync)(graph_t *);
 	int (*isbusy)(graph_t *);
 	int (*trigger)(graph_t *);
 	int (*commit)(graph_t *);
@@ -278,6 +291,10 @@ extern int graph_reset(graph_t *graph, graph_queue_t queue);
 extern int graph_vsync(graph_t *graph);
 
 
+/* Waits for vertical retrace, executes queued tasks and commits framebuffer */
+extern int graph_waitvsync(graph_t *graph);
+
+
 /* Sets graphics mode */
 extern int graph_mode(graph_t *graph, graph_mode_t mode, graph_freq_t freq);
 
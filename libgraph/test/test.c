@@ -33,8 +33,7 @@ int test_lines1(graph_t *graph, unsigned int dx, unsigned int dy, int step)
 
 	/* Slow lines */
 	for (i = 0; i < 500; i++) {
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_line(graph, rand() % (graph->width - dx - 2 * step) + step, rand() % (graph->height - dx - 2 * step) + step, rand() % dx, rand() % dy, 1, rand() % (1ULL << 8 * graph->depth), GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -51,8 +50,7 @@ int test_lines1(graph_t *graph, unsigned int dx, unsigned int dy, int step)
 
 	/* Move */
 	for (i = 0; i < graph->height; i += step) {
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_move(graph, 0, step, graph->width, graph->height - step, 0, -step, GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -71,16 +69,14 @@ int test_lines2(graph_t *graph, unsigned int dx, unsigned int dy, int step)
 		return err;
 
 	for (i = 0; i < graph->height - 199; i += step) {
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_line(graph, 100, 100 + i, graph->width - 200, graph->height - 200 - i * step, 1, (pal) ? 100 : 0x00ff00ff, GRAPH_QUEUE_HIGH)) < 0)
 			return err;
 	}
 
 	for (i = 0; i < graph->width - 199; i += step) {
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_line(graph, 100 + i, graph->height - 100, graph->width - 200 - i * step, 200 - graph->height, 1, (pal) ? 100 : 0x00ff00ff, GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -100,8 +96,7 @@ int test_rectangles(graph_t *graph, unsigned int dx, unsigned int dy, int step)
 
 	/* Slow rectangles */
 	for (i = 0; i < 300; i++) {
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_rect(graph, rand() % (graph->width - dx - 2 * step) + step, rand() % (graph->height - dy - 2 * step) + step, dx, dy, rand() % (1ULL << 8 * graph->depth), GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -118,8 +113,7 @@ int test_rectangles(graph_t *graph, unsigned int dx, unsigned int dy, int step)
 
 	/* Move */
 	for (i = 0; i < graph->width; i += step) {
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_move(graph, 0, 0, graph->width - step, graph->height, step, 0, GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -149,7 +143,8 @@ int test_logo(graph_t *graph, int step)
 
 	/* Compose logo at bottom left corner */
 	data = (void *)((uintptr_t)graph->data + graph->depth * ((graph->height - dy - step) * graph->width + step));
-	while (graph_trigger(graph), !graph_vsync(graph));
+	if ((err = graph_waitvsync(graph)) < 0)
+		return err;
 	if ((err = graph_rect(graph, 0, 0, graph->width, graph->height, *(uint32_t *)logo[0], GRAPH_QUEUE_HIGH)) < 0)
 		return err;
 	if ((err = graph_copy(graph, logo[0], data, lx, ly, graph->depth * lx, graph->depth * graph->width, GRAPH_QUEUE_HIGH)) < 0)
@@ -159,8 +154,7 @@ int test_logo(graph_t *graph, int step)
 
 	/* Move right */
 	for (i = 0; i < x; i += step) {
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_move(graph, 0, graph->height - dy - step, graph->width - step, dy, step, 0, GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -170,8 +164,7 @@ int test_logo(graph_t *graph, int step)
 	for (i = 0, ay = 0; i < x; i += step, ay += sy) {
 		sy = i * y / x;
 		sy = (ay < sy) ? sy - ay : 0;
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_move(graph, step, step, graph->width - step, graph->height - step, -step, -sy, GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -179,8 +172,7 @@ int test_logo(graph_t *graph, int step)
 
 	/* Move right */
 	for (i = 0; i < x; i += step) {
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_move(graph, 0, 0, graph->width - step, dy, step, 0, GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -190,8 +182,7 @@ int test_logo(graph_t *graph, int step)
 	for (i = 0, ay = 0, x >>= 1, y >>= 1; i < x; i += step, ay += sy) {
 		sy = i * y / x;
 		sy = (ay < sy) ? sy - ay : 0;
-		while (graph_trigger(graph), !graph_vsync(graph));
-		if ((err = graph_commit(graph)) < 0)
+		if ((err = graph_waitvsync(graph)) < 0)
 			return err;
 		if ((err = graph_move(graph, step, 0, graph->width - step, graph->height - step, -step, sy, GRAPH_QUEUE_HIGH)) < 0)
 			return err;
@@ -213,7 +204,8 @@ int test_cursor(graph_t *graph)
 		return err;
 
 	for (i = 0; i < graph->height; i++) {
-		while (graph_trigger(graph), !graph_vsync(graph));
+		if ((err = graph_waitvsync(graph)) < 0)
+			return err;
 		if ((err = graph_cursorpos(graph, i * graph->width / graph->height, i)) < 0)
 			return err;
 	}
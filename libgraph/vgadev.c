@@ -63,6 +63,7 @@
 #include <unistd.h>
 
 #include <sys/minmax.h>
+#include <sys/time.h>
 
 #include <libvga.h>
 
@@ -110,11 +111,8 @@ typedef struct {
 
 typedef struct {
 	vga_t vga;                       /* VGA data */
-	vga_state_t state;               /* Saved state */
-	unsigned char cmap[VGA_CMAPSZ];  /* Saved color map */
-	unsigned char font1[VGA_FONTSZ]; /* Saved font1 */
-	unsigned char font2[VGA_FONTSZ]; /* Saved font2 */
-	unsigned char text[VGA_TEXTSZ];  /* Saved text */
+	vga_state_t state;               /* Saved state (buffers allocated on demand) */
+	unsigned char retrace;           /* Vertical retrace status */
 } vgadev_t;
 
 
@@ -133,6 +131,14 @@ static const vgadev_mode_t modes[] = {
 extern int graph_schedule(graph_t *graph);
 
 
+/* Advances vertical retrace clock to given time */
+extern unsigned int graph_vsynctick(graph_t *graph, time_t now);
+
+
+/* Synchronizes vertical retrace clock with detected retrace */
+extern void graph_vsyncadjust(graph_t *graph, time_t now);
+
+
 int vgadev_cursorpos(graph_t *graph, unsigned int x, unsigned int y)
 {
 	return EOK;
@@ -187,12 +193,68 @@ int vgadev_trigger(graph_t *graph)
 }
 
 
-int vgadev_vsync(graph_t *graph)
+/* Detects vertical retrace start (input status register bit 3 rising edge) */
+static int vgadev_retrace(vgadev_t *vgadev)
 {
+	if (!(vga_status(&vgadev->vga) & 0x08)) {
+		vgadev->retrace = 0;
+		return 0;
+	}
+
+	if (vgadev->retrace)
+		return 0;
+	vgadev->retrace = 1;
+
 	return 1;
 }
 
 
+int vgadev_vsync(graph_t *graph)
+{
+	vgadev_t *vgadev = (vgadev_t *)graph->adapter;
+	time_t now;
+
+	gettime(&now, NULL);
+	if (vgadev_retrace(vgadev))
+		graph_vsyncadjust(graph, now);
+	else
+		graph_vsynctick(graph, now);
+
+	return EOK;
+}
+
+
+int vgadev_waitvsync(graph_t *graph)
+{
+	vgadev_t *vgadev = (vgadev_t *)graph->adapter;
+	graph_vsched_t *vs = &graph->vsched;
+	time_t now, next, win;
+
+	gettime(&now, NULL);
+	graph_vsynctick(graph, now);
+	next = vs->last + vs->period;
+
+	/* Poll only around predicted retrace once its timing is learned */
+	win = (vs->seen) ? vs->period >> 4 : vs->period;
+	if (next - win > now)
+		usleep(next - win - now);
+
+	do {
+		if (vgadev_retrace(vgadev)) {
+			gettime(&now, NULL);
+			graph_vsyncadjust(graph, now);
+			return EOK;
+		}
+		gettime(&now, NULL);
+	} while (now < next + win);
+
+	/* Retrace not detected, fall back to predicted timing */
+	graph_vsynctick(graph, now);
+
+	return EOK;
+}
+
+
 int vgadev_mode(graph_t *graph, graph_mode_t mode, graph_freq_t freq)
 {
 	unsigned int i, tmp, hblanks, hblanke, vres, vsyncs, vsynce, vtotal, vblanks, vblanke;
@@ -339,7 +401,7 @@ int vgadev_mode(graph_t *graph, graph_mode_t mode, graph_freq_t freq)
 	vga_munlock(vga);
 
 	/* Clear screen and update graph data */
-	memset(vga->mem, 0, VGA_MEMSZ);
+	vga_fillmem(vga, 0, VGA_MEMSZ);
 	graph->depth = modes[i].depth;
 	graph->width = modes[i].gfx.hres;
 	graph->height = modes[i].gfx.vres;
@@ -348,6 +410,50 @@ int vgadev_mode(graph_t *graph, graph_mode_t mode, graph_freq_t freq)
 }
 
 
+/* Releases saved state buffers */
+static void vgadev_freestate(vga_state_t *state)
+{
+	free(state->cmap);
+	free(state->font1);
+	free(state->font2);
+	free(state->text);
+}
+
+
+/* Allocates buffers for state that needs to be saved */
+static int vgadev_allocstate(vga_t *vga, vga_state_t *state)
+{
+	state->cmap = NULL;
+	state->font1 = NULL;
+	state->font2 = NULL;
+	state->text = NULL;
+
+	do {
+		if ((state->cmap = malloc(VGA_CMAPSZ)) == NULL)
+			break;
+
+		/* No fonts and text in graphics mode */
+		if (vga_readattr(vga, 0x10) & 0x01)
+			return EOK;
+
+		if ((state->font1 = malloc(VGA_FONTSZ)) == NULL)
+			break;
+
+		if ((state->font2 = malloc(VGA_FONTSZ)) == NULL)
+			break;
+
+		if ((state->text = malloc(VGA_TEXTSZ)) == NULL)
+			break;
+
+		return EOK;
+	} while (0);
+
+	vgadev_freestate(state);
+
+	return -ENOMEM;
+}
+
+
 void vgadev_close(graph_t *graph)
 {
 	vgadev_t *vgadev = (vgadev_t *)graph->adapter;
@@ -360,6 +466,7 @@ void vgadev_close(graph_t *graph)
 	/* Lock VGA registers and destroy device handle */
 	vga_lock(&vgadev->vga);
 	vga_done(&vgadev->vga);
+	vgadev_freestate(&vgadev->state);
 	free(vgadev);
 }
 
@@ -377,11 +484,14 @@ int vgadev_open(graph_t *graph)
 		return err;
 	}
 
+	if ((err = vgadev_allocstate(&vgadev->vga, &vgadev->state)) < 0) {
+		vga_done(&vgadev->vga);
+		free(vgadev);
+		return err;
+	}
+
 	/* Unlock VGA registers and save current state */
-	vgadev->state.cmap = vgadev->cmap;
-	vgadev->state.font1 = vgadev->font1;
-	vgadev->state.font2 = vgadev->font2;
-	vgadev->state.text = vgadev->text;
+	vgadev->retrace = 0;
 	vga_unlock(&vgadev->vga);
 	vga_save(&vgadev->vga, &vgadev->state);
 
@@ -396,6 +506,7 @@ int vgadev_open(graph_t *graph)
 	graph->close = vgadev_close;
 	graph->mode = vgadev_mode;
 	graph->vsync = vgadev_vsync;
+	graph->waitvsync = vgadev_waitvsync;
 	graph->isbusy = vgadev_isbusy;
 	graph->trigger = vgadev_trigger;
 	graph->commit = vgadev_commit;
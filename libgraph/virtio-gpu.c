@@ -13,13 +13,14 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <sys/interrupt.h>
 #include <sys/mman.h>
 #include <sys/threads.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 #include <libvirtio.h>
@@ -27,12 +28,16 @@
 #include "libgraph.h"
 
 
-/* Use polling on RISCV64 (interrupts trigger memory protection exception) */
+/* Use polling on RISCV64 (interrupts trigger memory protection exception), polling thread sleeps when all requests are completed */
 #ifdef TARGET_RISCV64
 #define USE_POLLING
 #endif
 
 
+/* Maximum number of requests sent with single notification */
+#define VIRTIOGPU_BATCH 4
+
+
 typedef struct {
 	uint32_t x;                     /* Horizontal coordinate */
 	uint32_t y;                     /* Vertical coordinate */
@@ -145,11 +150,7 @@ typedef struct {
 	virtio_seg_t rseg;              /* Device readable segment */
 	virtio_seg_t wseg;              /* Device writeable segment */
 	virtio_req_t vreq;              /* VirtIO request */
-
-	/* Custom helper fields */
-	volatile int done;              /* Indicates request completion */
-	handle_t lock;                  /* Request mutex */
-	handle_t cond;                  /* Request condition variable */
+	virtio_buf_t reg;               /* Registered request context memory */
 } virtiogpu_req_t;
 
 
@@ -157,6 +158,7 @@ typedef struct {
 	void *buff;                     /* Buffer */
 	unsigned int len;               /* Buffer length */
 	unsigned int rid;               /* Resource ID */
+	virtio_buf_t reg;               /* Registered buffer */
 } virtiogpu_resource_t;
 
 
@@ -167,7 +169,18 @@ typedef struct {
 	virtqueue_t curq;               /* Cursor virtqueue */
 	unsigned int rbmp;              /* Resource bitmap */
 	virtiogpu_req_t *req;           /* Request context */
-	volatile unsigned int done;     /* Destroy device? */
+	virtiogpu_req_t *breq;          /* Batched request context */
+	handle_t rlock;                 /* Request contexts mutex */
+
+	/* Cursor move (sent without waiting for completion) */
+	virtiogpu_req_t *mreq;          /* Cursor move request context */
+	unsigned char mbusy;            /* Cursor move in progress */
+	unsigned char mpend;            /* Cursor move pending */
+	unsigned int mx;                /* Pending cursor horizontal coordinate */
+	unsigned int my;                /* Pending cursor vertical coordinate */
+	unsigned int msid;              /* Pending cursor scanout ID */
+	handle_t mlock;                 /* Cursor move mutex */
+	handle_t mcond;                 /* Cursor move condition variable */
 
 	/* Device resources */
 	virtiogpu_resource_t fb;        /* Framebuffer resource */
@@ -175,16 +188,23 @@ typedef struct {
 	unsigned char curst;            /* Cursor state */
 	unsigned int curx;              /* Cursor horizontal coordinate */
 	unsigned int cury;              /* Cursor vertical coordinate */
+	time_t vsync;                   /* Last paced virtual retrace */
 
-	/* Interrupt/polling thread */
-	volatile unsigned int isr;      /* Interrupt status */
-	handle_t lock;                  /* Interrupt mutex */
-	handle_t cond;                  /* Interrupt condition variable */
-	handle_t inth;                  /* Interrupt handle */
-	char istack[2048] __attribute__((aligned(8)));
+	/* Completion service */
+	virtqueue_t *vqs[2];            /* Serviced virtqueues */
+	virtio_client_t client;         /* Completion service client */
 } virtiogpu_dev_t;
 
 
+typedef struct {
+	time_t start;                   /* Device detected */
+	time_t dev;                     /* Device initialized */
+	time_t reqs;                    /* Request contexts created */
+	time_t info;                    /* Display info, EDID and cursor resource ready */
+	time_t scanout;                 /* Framebuffer resource ready and scanned out */
+} virtiogpu_boot_t;
+
+
 typedef struct {
 	graph_mode_t mode;              /* Graphics mode */
 	unsigned int width;             /* Screen width */
@@ -196,6 +216,10 @@ typedef struct {
 /* VirtIO GPU device descriptors */
 static const virtio_devinfo_t info[] = {
 	{ .type = vdevPCI, .id = 0x1050 },
+#ifdef VIRTIO_HOST
+	/* Loopback GPU device (host builds) */
+	{ .type = vdevLOOP, .id = 0x10 },
+#endif
 #ifdef TARGET_RISCV64
 	/* Direct VirtIO MMIO QEMU GPU device descriptors */
 	{ .type = vdevMMIO, .id = 0x10, .irq = 8, .base = { (void *)0x10008000, 0x1000 } },
@@ -260,6 +284,10 @@ struct {
 extern int graph_schedule(graph_t *graph);
 
 
+/* Advances vertical retrace clock to given time */
+extern unsigned int graph_vsynctick(graph_t *graph, time_t now);
+
+
 /* Returns host framebuffer resource format (RGBA big endian, ABGR little endian) */
 static inline int virtiogpu_rgba(void)
 {
@@ -282,41 +310,72 @@ static inline int virtiogpu_argb(void)
 }
 
 
-/* Sends request to device */
-static int _virtiogpu_send(virtiogpu_dev_t *vgpu, virtqueue_t *vq, virtiogpu_req_t *req, unsigned int resp)
+/* Returns processed request response type */
+static inline unsigned int virtiogpu_resp(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req)
+{
+	return virtio_vtog32(&vgpu->vdev, *(volatile uint32_t *)(&req->hdr.type));
+}
+
+
+/* Exposes requests to device with single notification, returns number of enqueued requests */
+static int _virtiogpu_post(virtiogpu_dev_t *vgpu, virtqueue_t *vq, virtiogpu_req_t **reqs, unsigned int n)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int err;
+	virtio_req_t *vreqs[VIRTIOGPU_BATCH];
+	int i, ret;
 
+	if (n > VIRTIOGPU_BATCH)
+		return -EINVAL;
+
+	for (i = 0; i < n; i++)
+		vreqs[i] = &reqs[i]->vreq;
+
+	if ((ret = virtqueue_enqueueBatch(vdev, vq, vreqs, n)) > 0) {
+		virtqueue_notify(vdev, vq);
 #ifdef USE_POLLING
-	mutexLock(vgpu->lock);
-#endif
-	req->done = 0;
-	if ((err = virtqueue_enqueue(vdev, vq, &req->vreq)) < 0)
-		return err;
-	virtqueue_notify(vdev, vq);
-#ifdef USE_POLLING
-	vgpu->isr |= (1 << 0);
-	condSignal(vgpu->cond);
-	mutexUnlock(vgpu->lock);
+		virtio_wakeup(&vgpu->client);
 #endif
+	}
 
-	while (!req->done)
-		condWait(req->cond, req->lock, 0);
+	return ret;
+}
 
-	if (resp && (virtio_vtog32(vdev, *(volatile uint32_t *)(&req->hdr.type)) != resp))
-		return -EFAULT;
 
-	return EOK;
+/* Sends requests to device with single notification and waits for their completion (request contexts have to be locked by caller) */
+static int _virtiogpu_sendBatch(virtiogpu_dev_t *vgpu, virtqueue_t *vq, virtiogpu_req_t **reqs, unsigned int n, unsigned int resp)
+{
+	virtio_dev_t *vdev = &vgpu->vdev;
+	int i, ret, err = EOK;
+
+	if ((ret = _virtiogpu_post(vgpu, vq, reqs, n)) < 0)
+		return ret;
+	else if (ret < n)
+		err = -EFAULT;
+
+	/* Wait for enqueued requests completion */
+	for (i = 0; i < ret; i++) {
+		virtqueue_wait(vdev, vq, &reqs[i]->vreq, 0);
+
+		if (resp && (virtiogpu_resp(vgpu, reqs[i]) != resp))
+			err = -EFAULT;
+	}
+
+	return err;
+}
+
+
+/* Sends request to device */
+static int _virtiogpu_send(virtiogpu_dev_t *vgpu, virtqueue_t *vq, virtiogpu_req_t *req, unsigned int resp)
+{
+	return _virtiogpu_sendBatch(vgpu, vq, &req, 1, resp);
 }
 
 
 /* Destroys request context */
 static void virtiogpu_put(virtiogpu_req_t *req)
 {
-	resourceDestroy(req->cond);
-	resourceDestroy(req->lock);
-	munmap(req, (sizeof(virtiogpu_req_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1));
+	virtio_bufUnregister(&req->reg);
+	virtio_memFree(req, sizeof(virtiogpu_req_t));
 }
 
 
@@ -325,20 +384,16 @@ static virtiogpu_req_t *virtiogpu_get(void)
 {
 	virtiogpu_req_t *req;
 
-	if ((req = mmap(NULL, (sizeof(virtiogpu_req_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1), PROT_READ | PROT_WRITE, MAP_UNCACHED | MAP_ANONYMOUS, OID_CONTIGUOUS, 0)) == MAP_FAILED)
-		return NULL;
-
-	if (mutexCreate(&req->lock) < 0) {
-		munmap(req, (sizeof(virtiogpu_req_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1));
+	if ((req = virtio_memAlloc(sizeof(virtiogpu_req_t), NULL)) == NULL)
 		return NULL;
-	}
 
-	if (condCreate(&req->cond) < 0) {
-		resourceDestroy(req->lock);
-		munmap(req, (sizeof(virtiogpu_req_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1));
+	/* Request segments are translated without syscalls */
+	if (virtio_bufRegister(&req->reg, req, sizeof(virtiogpu_req_t)) < 0) {
+		virtio_memFree(req, sizeof(virtiogpu_req_t));
 		return NULL;
 	}
-
+	req->rseg.buf = &req->reg;
+	req->wseg.buf = &req->reg;
 	req->rseg.prev = &req->wseg;
 	req->rseg.next = &req->wseg;
 	req->wseg.prev = &req->rseg;
@@ -346,18 +401,18 @@ static virtiogpu_req_t *virtiogpu_get(void)
 	req->vreq.segs = &req->rseg;
 	req->vreq.rsegs = 1;
 	req->vreq.wsegs = 1;
+	req->vreq.cb = NULL;
+	req->vreq.arg = NULL;
+	req->vreq.done = 1;
 
 	return req;
 }
 
 
-/* Returns display info */
-static int virtiogpu_info(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, virtiogpu_info_t *info)
+/* Prepares display info request */
+static void _virtiogpu_info(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int i, ret;
-
-	mutexLock(req->lock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr);
@@ -366,39 +421,30 @@ static int virtiogpu_info(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, virtiogpu
 
 	req->hdr.type = virtio_gtov32(vdev, 0x100);
 	req->hdr.flags = virtio_gtov32(vdev, 1 << 0);
-
-	do {
-		if ((ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1101)) < 0)
-			break;
-
-		for (i = 0; i < sizeof(info->pmodes) / sizeof(info->pmodes[0]); i++) {
-			info->pmodes[i].r.x = virtio_vtog32(vdev, req->info.pmodes[i].r.x);
-			info->pmodes[i].r.y = virtio_vtog32(vdev, req->info.pmodes[i].r.y);
-			info->pmodes[i].r.w = virtio_vtog32(vdev, req->info.pmodes[i].r.w);
-			info->pmodes[i].r.h = virtio_vtog32(vdev, req->info.pmodes[i].r.h);
-			info->pmodes[i].enabled = virtio_vtog32(vdev, req->info.pmodes[i].enabled);
-			info->pmodes[i].flags = virtio_vtog32(vdev, req->info.pmodes[i].flags);
-		}
-	} while (0);
-
-	mutexUnlock(req->lock);
-
-	return ret;
 }
 
 
-/* Returns scanout EDID */
-static int virtiogpu_edid(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int sid, unsigned char *edid, unsigned int *len)
+/* Returns display info from processed request */
+static void virtiogpu_getinfo(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, virtiogpu_info_t *info)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	unsigned int l;
-	int i, ret;
+	int i;
+
+	for (i = 0; i < sizeof(info->pmodes) / sizeof(info->pmodes[0]); i++) {
+		info->pmodes[i].r.x = virtio_vtog32(vdev, req->info.pmodes[i].r.x);
+		info->pmodes[i].r.y = virtio_vtog32(vdev, req->info.pmodes[i].r.y);
+		info->pmodes[i].r.w = virtio_vtog32(vdev, req->info.pmodes[i].r.w);
+		info->pmodes[i].r.h = virtio_vtog32(vdev, req->info.pmodes[i].r.h);
+		info->pmodes[i].enabled = virtio_vtog32(vdev, req->info.pmodes[i].enabled);
+		info->pmodes[i].flags = virtio_vtog32(vdev, req->info.pmodes[i].flags);
+	}
+}
 
-	/* Check EDID support */
-	if (!(virtio_readFeatures(vdev) & (1ULL << 1)))
-		return -ENOTSUP;
 
-	mutexLock(req->lock);
+/* Prepares scanout EDID request */
+static void _virtiogpu_edid(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int sid)
+{
+	virtio_dev_t *vdev = &vgpu->vdev;
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->edid) - sizeof(req->edid.data);
@@ -408,32 +454,32 @@ static int virtiogpu_edid(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned
 	req->hdr.type = virtio_gtov32(vdev, 0x10a);
 	req->hdr.flags = virtio_gtov32(vdev, 1 << 0);
 	req->edid.sid = virtio_gtov32(vdev, sid);
+}
 
-	do {
-		if ((ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1104)) < 0)
-			break;
 
-		l = virtio_vtog32(vdev, req->edid.sid);
-		if (len != NULL)
-			*len = l;
+/* Returns scanout EDID from processed request */
+static void virtiogpu_getedid(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned char *edid, unsigned int *len)
+{
+	virtio_dev_t *vdev = &vgpu->vdev;
+	unsigned int i, l;
 
-		for (i = 0; i < l; i++)
-			edid[i] = req->edid.data[i];
-	} while (0);
+	l = virtio_vtog32(vdev, req->edid.sid);
+	if (l > sizeof(req->edid.data))
+		l = sizeof(req->edid.data);
 
-	mutexUnlock(req->lock);
+	if (len != NULL)
+		*len = l;
 
-	return ret;
+	for (i = 0; i < l; i++)
+		edid[i] = req->edid.data[i];
 }
 
 
-/* Allocates host resource */
-static int virtiogpu_alloc(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int format, unsigned int width, unsigned int height)
+/* Prepares host resource allocation request, returns reserved resource ID */
+static unsigned int _virtiogpu_alloc(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int format, unsigned int width, unsigned int height)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int ret;
-
-	mutexLock(req->lock);
+	unsigned int rid = 1 << (__builtin_ffsl(vgpu->rbmp) - 1);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->alloc);
@@ -445,17 +491,28 @@ static int virtiogpu_alloc(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned
 	req->alloc.fmt = virtio_gtov32(vdev, format);
 	req->alloc.w = virtio_gtov32(vdev, width);
 	req->alloc.h = virtio_gtov32(vdev, height);
-	req->alloc.rid = virtio_gtov32(vdev, 1 << (__builtin_ffsl(vgpu->rbmp) - 1));
+	req->alloc.rid = virtio_gtov32(vdev, rid);
+	vgpu->rbmp &= ~rid;
 
-	do {
-		if ((ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1100)) < 0)
-			break;
+	return rid;
+}
 
-		ret = virtio_vtog32(vdev, req->alloc.rid);
-		vgpu->rbmp &= ~ret;
-	} while (0);
 
-	mutexUnlock(req->lock);
+/* Allocates host resource */
+static int virtiogpu_alloc(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int format, unsigned int width, unsigned int height)
+{
+	unsigned int rid;
+	int ret;
+
+	mutexLock(vgpu->rlock);
+
+	rid = _virtiogpu_alloc(vgpu, req, format, width, height);
+	if ((ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1100)) < 0)
+		vgpu->rbmp |= rid;
+	else
+		ret = rid;
+
+	mutexUnlock(vgpu->rlock);
 
 	return ret;
 }
@@ -467,7 +524,7 @@ static int virtiogpu_free(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned
 	virtio_dev_t *vdev = &vgpu->vdev;
 	int ret;
 
-	mutexLock(req->lock);
+	mutexLock(vgpu->rlock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->free);
@@ -485,19 +542,16 @@ static int virtiogpu_free(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned
 		vgpu->rbmp |= rid;
 	} while (0);
 
-	mutexUnlock(req->lock);
+	mutexUnlock(vgpu->rlock);
 
 	return ret;
 }
 
 
-/* Attaches buffer to host resource */
-static int virtiogpu_attach(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int rid, void *buff, unsigned int len)
+/* Prepares attach resource buffer to host resource request */
+static void _virtiogpu_attach(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, virtiogpu_resource_t *res)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int ret;
-
-	mutexLock(req->lock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->attach);
@@ -506,14 +560,24 @@ static int virtiogpu_attach(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigne
 
 	req->hdr.type = virtio_gtov32(vdev, 0x106);
 	req->hdr.flags = virtio_gtov32(vdev, 1 << 0);
-	req->attach.rid = virtio_gtov32(vdev, rid);
+	req->attach.rid = virtio_gtov32(vdev, res->rid);
 	req->attach.n = virtio_gtov32(vdev, 1);
-	req->attach.addr = virtio_gtov64(vdev, va2pa(buff));
-	req->attach.len = virtio_gtov32(vdev, len);
+	req->attach.addr = virtio_gtov64(vdev, virtio_bufPA(&res->reg, res->buff));
+	req->attach.len = virtio_gtov32(vdev, res->len);
+}
 
+
+/* Attaches resource buffer to host resource */
+static int virtiogpu_attach(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, virtiogpu_resource_t *res)
+{
+	int ret;
+
+	mutexLock(vgpu->rlock);
+
+	_virtiogpu_attach(vgpu, req, res);
 	ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1100);
 
-	mutexUnlock(req->lock);
+	mutexUnlock(vgpu->rlock);
 
 	return ret;
 }
@@ -525,7 +589,7 @@ static int virtiogpu_detach(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigne
 	virtio_dev_t *vdev = &vgpu->vdev;
 	int ret;
 
-	mutexLock(req->lock);
+	mutexLock(vgpu->rlock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->detach);
@@ -538,19 +602,16 @@ static int virtiogpu_detach(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigne
 
 	ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1100);
 
-	mutexUnlock(req->lock);
+	mutexUnlock(vgpu->rlock);
 
 	return ret;
 }
 
 
-/* Sets scanout host resource */
-static int virtiogpu_scanout(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int sid, unsigned int rid)
+/* Prepares set scanout host resource request */
+static void _virtiogpu_scanout(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int sid, unsigned int rid)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int ret;
-
-	mutexLock(req->lock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->scanout);
@@ -565,22 +626,29 @@ static int virtiogpu_scanout(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsign
 	req->scanout.r.h = virtio_gtov32(vdev, height);
 	req->scanout.sid = virtio_gtov32(vdev, sid);
 	req->scanout.rid = virtio_gtov32(vdev, rid);
+}
+
+
+/* Sets scanout host resource */
+static int virtiogpu_scanout(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int sid, unsigned int rid)
+{
+	int ret;
+
+	mutexLock(vgpu->rlock);
 
+	_virtiogpu_scanout(vgpu, req, x, y, width, height, sid, rid);
 	ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1100);
 
-	mutexUnlock(req->lock);
+	mutexUnlock(vgpu->rlock);
 
 	return ret;
 }
 
 
-/* Transfers data to host resource */
-static int virtiogpu_transfer(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int offs, unsigned int rid)
+/* Prepares transfer to host resource request */
+static void _virtiogpu_transfer(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int offs, unsigned int rid)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int ret;
-
-	mutexLock(req->lock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->transfer);
@@ -595,22 +663,29 @@ static int virtiogpu_transfer(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsig
 	req->transfer.r.h = virtio_gtov32(vdev, height);
 	req->transfer.offs = virtio_gtov64(vdev, offs);
 	req->transfer.rid = virtio_gtov32(vdev, rid);
+}
+
+
+/* Transfers data to host resource */
+static int virtiogpu_transfer(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int offs, unsigned int rid)
+{
+	int ret;
+
+	mutexLock(vgpu->rlock);
 
+	_virtiogpu_transfer(vgpu, req, x, y, width, height, offs, rid);
 	ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1100);
 
-	mutexUnlock(req->lock);
+	mutexUnlock(vgpu->rlock);
 
 	return ret;
 }
 
 
-/* Flushes host resource to connected scanouts displays */
-static int virtiogpu_flush(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int rid)
+/* Prepares host resource flush request */
+static void _virtiogpu_flush(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int rid)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int ret;
-
-	mutexLock(req->lock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->flush);
@@ -624,22 +699,31 @@ static int virtiogpu_flush(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned
 	req->flush.r.w = virtio_gtov32(vdev, width);
 	req->flush.r.h = virtio_gtov32(vdev, height);
 	req->flush.rid = virtio_gtov32(vdev, rid);
+}
 
-	ret = _virtiogpu_send(vgpu, &vgpu->ctlq, req, 0x1100);
 
-	mutexUnlock(req->lock);
+/* Transfers data to host resource and flushes it to connected scanouts displays */
+static int virtiogpu_update(virtiogpu_dev_t *vgpu, unsigned int x, unsigned int y, unsigned int width, unsigned int height, unsigned int offs, unsigned int rid)
+{
+	virtiogpu_req_t *reqs[2] = { vgpu->req, vgpu->breq };
+	int ret;
+
+	mutexLock(vgpu->rlock);
+
+	_virtiogpu_transfer(vgpu, vgpu->req, x, y, width, height, offs, rid);
+	_virtiogpu_flush(vgpu, vgpu->breq, x, y, width, height, rid);
+	ret = _virtiogpu_sendBatch(vgpu, &vgpu->ctlq, reqs, 2, 0x1100);
+
+	mutexUnlock(vgpu->rlock);
 
 	return ret;
 }
 
 
-/* Moves cursor */
-static int virtiogpu_movecursor(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int sid)
+/* Prepares move cursor request */
+static void _virtiogpu_movecursor(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int x, unsigned int y, unsigned int sid)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int ret;
-
-	mutexLock(req->lock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->cursor);
@@ -651,10 +735,53 @@ static int virtiogpu_movecursor(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, uns
 	req->cursor.pos.sid = virtio_gtov32(vdev, sid);
 	req->cursor.pos.x = virtio_gtov32(vdev, x);
 	req->cursor.pos.y = virtio_gtov32(vdev, y);
+}
 
-	ret = _virtiogpu_send(vgpu, &vgpu->curq, req, 0);
 
-	mutexUnlock(req->lock);
+/* Cursor move completion callback (sends cursor position updated in the meantime) */
+static void virtiogpu_moved(virtio_req_t *vreq)
+{
+	virtiogpu_dev_t *vgpu = (virtiogpu_dev_t *)vreq->arg;
+
+	mutexLock(vgpu->mlock);
+
+	if (vgpu->mpend) {
+		vgpu->mpend = 0;
+		_virtiogpu_movecursor(vgpu, vgpu->mreq, vgpu->mx, vgpu->my, vgpu->msid);
+		if (_virtiogpu_post(vgpu, &vgpu->curq, &vgpu->mreq, 1) > 0) {
+			mutexUnlock(vgpu->mlock);
+			return;
+		}
+	}
+	vgpu->mbusy = 0;
+	condSignal(vgpu->mcond);
+
+	mutexUnlock(vgpu->mlock);
+}
+
+
+/* Moves cursor (doesn't wait for completion, moves issued while previous one is in progress are coalesced) */
+static int virtiogpu_movecursor(virtiogpu_dev_t *vgpu, unsigned int x, unsigned int y, unsigned int sid)
+{
+	int ret = EOK;
+
+	mutexLock(vgpu->mlock);
+
+	if (vgpu->mbusy) {
+		vgpu->mx = x;
+		vgpu->my = y;
+		vgpu->msid = sid;
+		vgpu->mpend = 1;
+	}
+	else {
+		_virtiogpu_movecursor(vgpu, vgpu->mreq, x, y, sid);
+		if ((ret = _virtiogpu_post(vgpu, &vgpu->curq, &vgpu->mreq, 1)) > 0) {
+			vgpu->mbusy = 1;
+			ret = EOK;
+		}
+	}
+
+	mutexUnlock(vgpu->mlock);
 
 	return ret;
 }
@@ -666,7 +793,7 @@ static int virtiogpu_setcursor(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsi
 	virtio_dev_t *vdev = &vgpu->vdev;
 	int ret;
 
-	mutexLock(req->lock);
+	mutexLock(vgpu->rlock);
 
 	req->rseg.buff = &req->hdr;
 	req->rseg.len = sizeof(req->hdr) + sizeof(req->cursor);
@@ -684,30 +811,55 @@ static int virtiogpu_setcursor(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsi
 
 	ret = _virtiogpu_send(vgpu, &vgpu->curq, req, 0);
 
-	mutexUnlock(req->lock);
+	mutexUnlock(vgpu->rlock);
 
 	return ret;
 }
 
 
+/* Releases resource buffer */
+static void virtiogpu_unmap(virtiogpu_resource_t *res)
+{
+	virtio_bufUnregister(&res->reg);
+	virtio_memFree(res->buff, res->len);
+}
+
+
+/* Allocates and registers resource buffer */
+static int virtiogpu_map(virtiogpu_resource_t *res, unsigned int len)
+{
+	int err;
+
+	res->len = (len + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+	if ((res->buff = virtio_memAlloc(res->len, NULL)) == NULL)
+		return -ENOMEM;
+
+	if ((err = virtio_bufRegister(&res->reg, res->buff, res->len)) < 0) {
+		virtio_memFree(res->buff, res->len);
+		return err;
+	}
+
+	return EOK;
+}
+
+
 /* Creates resource */
 static int virtiogpu_create(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, unsigned int format, unsigned int width, unsigned int height, virtiogpu_resource_t *res)
 {
 	int err;
 
-	res->len = (4 * height * width + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
-	if ((res->buff = mmap(NULL, res->len, PROT_READ | PROT_WRITE, MAP_UNCACHED | MAP_ANONYMOUS, OID_CONTIGUOUS, 0)) == MAP_FAILED)
-		return -ENOMEM;
+	if ((err = virtiogpu_map(res, 4 * height * width)) < 0)
+		return err;
 
 	if ((err = virtiogpu_alloc(vgpu, req, format, width, height)) < 0) {
-		munmap(res->buff, res->len);
+		virtiogpu_unmap(res);
 		return err;
 	}
 	res->rid = err;
 
-	if ((err = virtiogpu_attach(vgpu, req, res->rid, res->buff, res->len)) < 0) {
+	if ((err = virtiogpu_attach(vgpu, req, res)) < 0) {
 		virtiogpu_free(vgpu, req, res->rid);
-		munmap(res->buff, res->len);
+		virtiogpu_unmap(res);
 		return err;
 	}
 
@@ -720,91 +872,195 @@ static void virtiogpu_destroy(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, virti
 {
 	virtiogpu_detach(vgpu, req, res->rid);
 	virtiogpu_free(vgpu, req, res->rid);
-	munmap(res->buff, res->len);
+	virtiogpu_unmap(res);
 }
 
 
-#ifndef USE_POLLING
-/* Interrupt handler */
-static int virtiogpu_int(unsigned int n, void *arg)
+/* Releases partially created resource (0 - buffer mapped, 1 - host resource allocated, 2 - buffer attached) */
+static void virtiogpu_release(virtiogpu_dev_t *vgpu, virtiogpu_req_t *req, virtiogpu_resource_t *res, int state)
 {
-	virtiogpu_dev_t *vgpu = (virtiogpu_dev_t *)arg;
-	virtio_dev_t *vdev = &vgpu->vdev;
+	if (state > 1)
+		virtiogpu_detach(vgpu, req, res->rid);
 
-	virtqueue_disableIRQ(vdev, &vgpu->ctlq);
-	virtqueue_disableIRQ(vdev, &vgpu->curq);
-	vgpu->isr = virtio_isr(vdev);
+	if (state > 0)
+		virtiogpu_free(vgpu, req, res->rid);
 
-	return vgpu->cond;
+	virtiogpu_unmap(res);
 }
-#endif
 
 
-/* Interrupt/polling thread */
-static void virtiogpu_intthr(void *arg)
+/* Returns host resource creation state from processed allocation and attach requests (request contexts have to be locked) */
+static int virtiogpu_created(virtiogpu_dev_t *vgpu, virtiogpu_req_t *alloc, virtiogpu_req_t *attach, unsigned int rid)
+{
+	if (virtiogpu_resp(vgpu, alloc) != 0x1100) {
+		vgpu->rbmp |= rid;
+		return 0;
+	}
+
+	return (virtiogpu_resp(vgpu, attach) != 0x1100) ? 1 : 2;
+}
+
+
+/* Brings up display (display info, EDID, resources creation and scanout requests are sent in two batches) */
+static int virtiogpu_boot(virtiogpu_dev_t *vgpu, virtiogpu_info_t *vinfo, unsigned char *edid, virtiogpu_boot_t *boot)
 {
-	virtiogpu_dev_t *vgpu = (virtiogpu_dev_t *)arg;
 	virtio_dev_t *vdev = &vgpu->vdev;
-	virtiogpu_req_t *req;
-	unsigned int isr;
+	virtiogpu_req_t *reqs[VIRTIOGPU_BATCH];
+	int i, n, ret, fbst = -1, curst = -1;
+
+	/* Extra request contexts for overlapped requests */
+	reqs[0] = vgpu->req;
+	reqs[1] = vgpu->breq;
+	for (i = 2; i < VIRTIOGPU_BATCH; i++) {
+		if ((reqs[i] = virtiogpu_get()) == NULL) {
+			while (--i > 1)
+				virtiogpu_put(reqs[i]);
+			return -ENOMEM;
+		}
+	}
 
-	mutexLock(vgpu->lock);
-	vgpu->isr = 0;
+	mutexLock(vgpu->rlock);
 
-	while (!vgpu->done) {
-		while (!(isr = vgpu->isr))
-			condWait(vgpu->cond, vgpu->lock, 0);
-		vgpu->isr = 0;
+	do {
+		/* Display info, EDID and cursor resource (cursor size doesn't depend on display info) */
+		if ((ret = virtiogpu_map(&vgpu->cur, 4 * 64 * 64)) < 0)
+			break;
 
-		/* Handle processed requests */
-		if (isr & (1 << 0)) {
-#ifdef USE_POLLING
-			/* Poll for processed request (in polling mode requests are submitted and processed synchronously) */
-			while (((req = virtqueue_dequeue(vdev, &vgpu->ctlq, NULL)) == NULL) && ((req = virtqueue_dequeue(vdev, &vgpu->curq, NULL)) == NULL));
+		n = 0;
+		_virtiogpu_info(vgpu, reqs[n++]);
+		if (virtio_readFeatures(vdev) & (1ULL << 1))
+			_virtiogpu_edid(vgpu, reqs[n++], 0);
+		vgpu->cur.rid = _virtiogpu_alloc(vgpu, reqs[n++], virtiogpu_argb(), 64, 64);
+		_virtiogpu_attach(vgpu, reqs[n++], &vgpu->cur);
 
-			mutexLock(req->lock);
-			req->done = 1;
-			condSignal(req->cond);
-			mutexUnlock(req->lock);
-#else
-			while ((req = virtqueue_dequeue(vdev, &vgpu->ctlq, NULL)) != NULL) {
-				mutexLock(req->lock);
-				req->done = 1;
-				condSignal(req->cond);
-				mutexUnlock(req->lock);
-			}
+		ret = _virtiogpu_sendBatch(vgpu, &vgpu->ctlq, reqs, n, 0);
+		curst = virtiogpu_created(vgpu, reqs[n - 2], reqs[n - 1], vgpu->cur.rid);
+		gettime(&boot->info, NULL);
 
-			while ((req = virtqueue_dequeue(vdev, &vgpu->curq, NULL)) != NULL) {
-				mutexLock(req->lock);
-				req->done = 1;
-				condSignal(req->cond);
-				mutexUnlock(req->lock);
-			}
-#endif
+		if ((ret < 0) || (curst < 2) || (virtiogpu_resp(vgpu, reqs[0]) != 0x1101) || ((n > 3) && (virtiogpu_resp(vgpu, reqs[1]) != 0x1104))) {
+			ret = -EFAULT;
+			break;
 		}
 
-#ifndef USE_POLLING
-		virtqueue_enableIRQ(vdev, &vgpu->ctlq);
-		virtqueue_enableIRQ(vdev, &vgpu->curq);
+		virtiogpu_getinfo(vgpu, reqs[0], vinfo);
+		if (n > 3)
+			virtiogpu_getedid(vgpu, reqs[1], edid, NULL);
 
-		/* Get requests that might have come after last virtqueue_dequeue() and before virtqueue_enableIRQ() */
-		while ((req = virtqueue_dequeue(vdev, &vgpu->ctlq, NULL)) != NULL) {
-			mutexLock(req->lock);
-			req->done = 1;
-			condSignal(req->cond);
-			mutexUnlock(req->lock);
-		}
+		/* Framebuffer resource and scanout */
+		if ((ret = virtiogpu_map(&vgpu->fb, 4 * vinfo->pmodes[0].r.h * vinfo->pmodes[0].r.w)) < 0)
+			break;
+
+		vgpu->fb.rid = _virtiogpu_alloc(vgpu, reqs[0], virtiogpu_rgba(), vinfo->pmodes[0].r.w, vinfo->pmodes[0].r.h);
+		_virtiogpu_attach(vgpu, reqs[1], &vgpu->fb);
+		_virtiogpu_scanout(vgpu, reqs[2], 0, 0, vinfo->pmodes[0].r.w, vinfo->pmodes[0].r.h, 0, vgpu->fb.rid);
+
+		ret = _virtiogpu_sendBatch(vgpu, &vgpu->ctlq, reqs, 3, 0);
+		fbst = virtiogpu_created(vgpu, reqs[0], reqs[1], vgpu->fb.rid);
+		gettime(&boot->scanout, NULL);
 
-		while ((req = virtqueue_dequeue(vdev, &vgpu->curq, NULL)) != NULL) {
-			mutexLock(req->lock);
-			req->done = 1;
-			condSignal(req->cond);
-			mutexUnlock(req->lock);
+		if ((ret < 0) || (fbst < 2) || (virtiogpu_resp(vgpu, reqs[2]) != 0x1100)) {
+			ret = -EFAULT;
+			break;
 		}
-#endif
+
+		ret = EOK;
+	} while (0);
+
+	mutexUnlock(vgpu->rlock);
+
+	for (i = 2; i < VIRTIOGPU_BATCH; i++)
+		virtiogpu_put(reqs[i]);
+
+	if (ret < 0) {
+		if (fbst >= 0)
+			virtiogpu_release(vgpu, vgpu->req, &vgpu->fb, fbst);
+
+		if (curst >= 0)
+			virtiogpu_release(vgpu, vgpu->req, &vgpu->cur, curst);
+	}
+
+	return ret;
+}
+
+
+/* Logs boot timeline (enabled with LIBGRAPH_BOOTLOG environment variable) */
+static void virtiogpu_bootlog(virtiogpu_boot_t *boot)
+{
+	if (getenv("LIBGRAPH_BOOTLOG") == NULL)
+		return;
+
+	fprintf(stderr, "virtiogpu: boot timeline (us): device %lld, requests %lld, info %lld, scanout %lld, total %lld\n",
+		(long long)(boot->dev - boot->start), (long long)(boot->reqs - boot->dev), (long long)(boot->info - boot->reqs),
+		(long long)(boot->scanout - boot->info), (long long)(boot->scanout - boot->start));
+}
+
+
+/* Destroys request contexts (waits for cursor move completion) */
+static void virtiogpu_donereqs(virtiogpu_dev_t *vgpu)
+{
+	mutexLock(vgpu->mlock);
+	vgpu->mpend = 0;
+	while (vgpu->mbusy)
+		condWait(vgpu->mcond, vgpu->mlock, 0);
+	mutexUnlock(vgpu->mlock);
+
+	resourceDestroy(vgpu->mcond);
+	resourceDestroy(vgpu->mlock);
+	resourceDestroy(vgpu->rlock);
+	virtiogpu_put(vgpu->mreq);
+	virtiogpu_put(vgpu->breq);
+	virtiogpu_put(vgpu->req);
+}
+
+
+/* Creates request contexts */
+static int virtiogpu_initreqs(virtiogpu_dev_t *vgpu)
+{
+	int err;
+
+	if ((vgpu->req = virtiogpu_get()) == NULL)
+		return -ENOMEM;
+
+	if ((vgpu->breq = virtiogpu_get()) == NULL) {
+		virtiogpu_put(vgpu->req);
+		return -ENOMEM;
+	}
+
+	if ((vgpu->mreq = virtiogpu_get()) == NULL) {
+		virtiogpu_put(vgpu->breq);
+		virtiogpu_put(vgpu->req);
+		return -ENOMEM;
+	}
+	vgpu->mreq->vreq.cb = virtiogpu_moved;
+	vgpu->mreq->vreq.arg = vgpu;
+	vgpu->mbusy = 0;
+	vgpu->mpend = 0;
+
+	if ((err = mutexCreate(&vgpu->rlock)) < 0) {
+		virtiogpu_put(vgpu->mreq);
+		virtiogpu_put(vgpu->breq);
+		virtiogpu_put(vgpu->req);
+		return err;
+	}
+
+	if ((err = mutexCreate(&vgpu->mlock)) < 0) {
+		resourceDestroy(vgpu->rlock);
+		virtiogpu_put(vgpu->mreq);
+		virtiogpu_put(vgpu->breq);
+		virtiogpu_put(vgpu->req);
+		return err;
+	}
+
+	if ((err = condCreate(&vgpu->mcond)) < 0) {
+		resourceDestroy(vgpu->mlock);
+		resourceDestroy(vgpu->rlock);
+		virtiogpu_put(vgpu->mreq);
+		virtiogpu_put(vgpu->breq);
+		virtiogpu_put(vgpu->req);
+		return err;
 	}
 
-	endthread();
+	return EOK;
 }
 
 
@@ -813,7 +1069,7 @@ int virtiogpu_cursorpos(graph_t *graph, unsigned int x, unsigned int y)
 	virtiogpu_dev_t *vgpu = (virtiogpu_dev_t *)graph->adapter;
 	int err;
 
-	if (vgpu->curst && ((err = virtiogpu_movecursor(vgpu, vgpu->req, x, y, 0)) < 0))
+	if (vgpu->curst && ((err = virtiogpu_movecursor(vgpu, x, y, 0)) < 0))
 		return err;
 
 	vgpu->curx = x;
@@ -900,27 +1156,12 @@ int virtiogpu_colorget(graph_t *graph, unsigned char *colors, unsigned int first
 }
 
 
-static inline int _virtqueue_isbusy(virtio_dev_t *vdev, virtqueue_t *vq)
-{
-	return virtio_vtog16(vdev, *(volatile uint16_t *)&vq->avail->idx) != virtio_vtog16(vdev, *(volatile uint16_t *)&vq->used->idx);
-}
-
-
 int virtiogpu_isbusy(graph_t *graph)
 {
 	virtiogpu_dev_t *vgpu = (virtiogpu_dev_t *)graph->adapter;
 	virtio_dev_t *vdev = &vgpu->vdev;
-	int ret;
-
-	mutexLock(vgpu->ctlq.lock);
-	mutexLock(vgpu->curq.lock);
-
-	ret = _virtqueue_isbusy(vdev, &vgpu->ctlq) || _virtqueue_isbusy(vdev, &vgpu->curq);
 
-	mutexUnlock(vgpu->curq.lock);
-	mutexUnlock(vgpu->ctlq.lock);
-
-	return ret;
+	return virtqueue_busy(vdev, &vgpu->ctlq) || virtqueue_busy(vdev, &vgpu->curq);
 }
 
 
@@ -931,15 +1172,7 @@ int virtiogpu_commit(graph_t *graph)
 
 	/* Transfer and flush framebuffer */
 	mutexLock(graph->lock);
-
-	do {
-		if ((ret = virtiogpu_transfer(vgpu, vgpu->req, 0, 0, graph->width, graph->height, 0, vgpu->fb.rid)) < 0)
-			break;
-
-		if ((ret = virtiogpu_flush(vgpu, vgpu->req, 0, 0, graph->width, graph->height, vgpu->fb.rid)) < 0)
-			break;
-	} while (0);
-
+	ret = virtiogpu_update(vgpu, 0, 0, graph->width, graph->height, 0, vgpu->fb.rid);
 	mutexUnlock(graph->lock);
 
 	/* Try to reschedule */
@@ -960,7 +1193,35 @@ int virtiogpu_trigger(graph_t *graph)
 
 int virtiogpu_vsync(graph_t *graph)
 {
-	return 1;
+	time_t now;
+
+	gettime(&now, NULL);
+	graph_vsynctick(graph, now);
+
+	return EOK;
+}
+
+
+int virtiogpu_waitvsync(graph_t *graph)
+{
+	virtiogpu_dev_t *vgpu = (virtiogpu_dev_t *)graph->adapter;
+	graph_vsched_t *vs = &graph->vsched;
+	time_t now, next;
+
+	gettime(&now, NULL);
+	graph_vsynctick(graph, now);
+	next = vs->last + vs->period;
+
+	/* Previous frame commit might have completed before its retrace */
+	if (next <= vgpu->vsync)
+		next += vs->period;
+	vgpu->vsync = next;
+
+	/* No scanout retrace, pace commits so that flush fence completes on virtual retrace */
+	if (next - vs->cost > now)
+		usleep(next - vs->cost - now);
+
+	return EOK;
 }
 
 
@@ -1004,9 +1265,9 @@ static void virtiogpu_destroydev(virtiogpu_dev_t *vgpu)
 {
 	virtio_dev_t *vdev = &vgpu->vdev;
 
-	resourceDestroy(vgpu->cond);
-	resourceDestroy(vgpu->lock);
-	resourceDestroy(vgpu->inth);
+	virtio_unregister(&vgpu->client);
+	/* Stop device before releasing virtqueues memory */
+	virtio_reset(vdev);
 	virtqueue_destroy(vdev, &vgpu->ctlq);
 	virtqueue_destroy(vdev, &vgpu->curq);
 	virtio_destroyDev(vdev);
@@ -1021,11 +1282,24 @@ static int virtiogpu_initdev(virtiogpu_dev_t *vgpu)
 	if ((err = virtio_initDev(vdev)) < 0)
 		return err;
 
-	vgpu->done = 0;
 	vgpu->rbmp = -1;
 	vgpu->curst = 0;
 	vgpu->curx = 0;
 	vgpu->cury = 0;
+	vgpu->vsync = 0;
+
+	/* Poll for completions while they keep arriving */
+	vgpu->vqs[0] = &vgpu->ctlq;
+	vgpu->vqs[1] = &vgpu->curq;
+	vgpu->client.vdev = vdev;
+	vgpu->client.vqs = vgpu->vqs;
+	vgpu->client.nvqs = sizeof(vgpu->vqs) / sizeof(vgpu->vqs[0]);
+	vgpu->client.config = NULL;
+	vgpu->client.arg = vgpu;
+	virtqueue_pollInit(&vgpu->client.poll);
+#ifdef USE_POLLING
+	vgpu->client.poll.irq = 0;
+#endif
 
 	do {
 		/* Negotiate EDID support */
@@ -1040,51 +1314,12 @@ static int virtiogpu_initdev(virtiogpu_dev_t *vgpu)
 			break;
 		}
 
-		if ((err = mutexCreate(&vgpu->lock)) < 0) {
-			virtqueue_destroy(vdev, &vgpu->curq);
-			virtqueue_destroy(vdev, &vgpu->ctlq);
-			break;
-		}
-
-		if ((err = condCreate(&vgpu->cond)) < 0) {
-			resourceDestroy(vgpu->lock);
+		if ((err = virtio_register(&vgpu->client)) < 0) {
 			virtqueue_destroy(vdev, &vgpu->curq);
 			virtqueue_destroy(vdev, &vgpu->ctlq);
 			break;
 		}
 
-		if ((err = beginthread(virtiogpu_intthr, 4, vgpu->istack, sizeof(vgpu->istack), vgpu)) < 0) {
-			resourceDestroy(vgpu->cond);
-			resourceDestroy(vgpu->lock);
-			virtqueue_destroy(vdev, &vgpu->curq);
-			virtqueue_destroy(vdev, &vgpu->ctlq);
-			break;
-		}
-
-		/* TODO: fix race condition below */
-		/* Added 100ms delay for virtiogpu_intthr() to go to sleep on vgpu->cond before first request */
-		usleep(100000);
-
-#ifdef USE_POLLING
-		virtqueue_disableIRQ(vdev, &vgpu->ctlq);
-		virtqueue_disableIRQ(vdev, &vgpu->curq);
-#else
-		if ((err = interrupt(vdev->info.irq, virtiogpu_int, vgpu, vgpu->cond, &vgpu->inth)) < 0) {
-			/* End interrupt/polling thread */
-			mutexLock(vgpu->lock);
-			vgpu->isr |= (1 << 1);
-			vgpu->done = 1;
-			condSignal(vgpu->cond);
-			mutexUnlock(vgpu->lock);
-			while (threadJoin(0) < 0);
-
-			resourceDestroy(vgpu->cond);
-			resourceDestroy(vgpu->lock);
-			virtqueue_destroy(vdev, &vgpu->curq);
-			virtqueue_destroy(vdev, &vgpu->ctlq);
-			break;
-		}
-#endif
 		virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 2));
 
 		return EOK;
@@ -1104,16 +1339,7 @@ void virtiogpu_close(graph_t *graph)
 	/* Destroy resources */
 	virtiogpu_destroy(vgpu, vgpu->req, &vgpu->fb);
 	virtiogpu_destroy(vgpu, vgpu->req, &vgpu->cur);
-	virtiogpu_put(vgpu->req);
-
-	/* TODO: uninstall interrupt handler */
-	/* End interrupt/polling thread */
-	mutexLock(vgpu->lock);
-	vgpu->isr |= (1 << 1);
-	vgpu->done = 1;
-	condSignal(vgpu->cond);
-	mutexUnlock(vgpu->lock);
-	while (threadJoin(0) < 0);
+	virtiogpu_donereqs(vgpu);
 
 	/* Destroy device */
 	virtiogpu_destroydev(vgpu);
@@ -1124,6 +1350,7 @@ void virtiogpu_close(graph_t *graph)
 int virtiogpu_open(graph_t *graph)
 {
 	unsigned char edid[1024];
+	virtiogpu_boot_t boot;
 	virtiogpu_info_t vinfo;
 	virtiogpu_dev_t *vgpu;
 	virtio_dev_t vdev;
@@ -1139,52 +1366,27 @@ int virtiogpu_open(graph_t *graph)
 			vgpu->vdev = vdev;
 
 			/* Initialize device */
+			gettime(&boot.start, NULL);
 			if ((err = virtiogpu_initdev(vgpu)) < 0) {
 				free(vgpu);
 				if (err != -ENODEV)
 					return err;
 				continue;
 			}
+			gettime(&boot.dev, NULL);
 
 			do {
-				/* Create request context */
-				if ((vgpu->req = virtiogpu_get()) == NULL) {
-					err = -ENOMEM;
-					break;
-				}
-
-				/* Get display info */
-				if ((err = virtiogpu_info(vgpu, vgpu->req, &vinfo)) < 0) {
-					virtiogpu_put(vgpu->req);
-					break;
-				}
-
-				/* Get EDID */
-				if ((virtio_readFeatures(&vgpu->vdev) & (1ULL << 1)) && ((err = virtiogpu_edid(vgpu, vgpu->req, 0, edid, NULL)) < 0)) {
-					virtiogpu_put(vgpu->req);
+				/* Create request contexts */
+				if ((err = virtiogpu_initreqs(vgpu)) < 0)
 					break;
-				}
-
-				/* Create framebuffer */
-				if ((err = virtiogpu_create(vgpu, vgpu->req, virtiogpu_rgba(), vinfo.pmodes[0].r.w, vinfo.pmodes[0].r.h, &vgpu->fb)) < 0) {
-					virtiogpu_put(vgpu->req);
-					break;
-				}
+				gettime(&boot.reqs, NULL);
 
-				/* Create cursor */
-				if ((err = virtiogpu_create(vgpu, vgpu->req, virtiogpu_argb(), 64, 64, &vgpu->cur)) < 0) {
-					virtiogpu_destroy(vgpu, vgpu->req, &vgpu->fb);
-					virtiogpu_put(vgpu->req);
-					break;
-				}
-
-				/* Set scanout */
-				if ((err = virtiogpu_scanout(vgpu, vgpu->req, 0, 0, vinfo.pmodes[0].r.w, vinfo.pmodes[0].r.h, 0, vgpu->fb.rid)) < 0) {
-					virtiogpu_destroy(vgpu, vgpu->req, &vgpu->cur);
-					virtiogpu_destroy(vgpu, vgpu->req, &vgpu->fb);
-					virtiogpu_put(vgpu->req);
+				/* Get display info and EDID, create cursor and framebuffer, set scanout */
+				if ((err = virtiogpu_boot(vgpu, &vinfo, edid, &boot)) < 0) {
+					virtiogpu_donereqs(vgpu);
 					break;
 				}
+				virtiogpu_bootlog(&boot);
 
 				/* Initialize graph info */
 				graph->adapter = vgpu;
@@ -1197,6 +1399,7 @@ int virtiogpu_open(graph_t *graph)
 				graph->close = virtiogpu_close;
 				graph->mode = virtiogpu_mode;
 				graph->vsync = virtiogpu_vsync;
+				graph->waitvsync = virtiogpu_waitvsync;
 				graph->isbusy = virtiogpu_isbusy;
 				graph->trigger = virtiogpu_trigger;
 				graph->commit = virtiogpu_commit;
@@ -1210,14 +1413,6 @@ int virtiogpu_open(graph_t *graph)
 				return EOK;
 			} while (0);
 
-			/* End interrupt/polling thread */
-			mutexLock(vgpu->lock);
-			vgpu->isr |= (1 << 1);
-			vgpu->done = 1;
-			condSignal(vgpu->cond);
-			mutexUnlock(vgpu->lock);
-			while (threadJoin(0) < 0);
-
 			/* Destroy device */
 			virtiogpu_destroydev(vgpu);
 			free(vgpu);
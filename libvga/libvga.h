@@ -21,6 +21,13 @@
 #define VGA_TEXTSZ (VGA_MEMSZ >> 1)
 
 
+/* Tracked VGA memory and color map data */
+#define VGA_FONT1  (1 << 0)
+#define VGA_FONT2  (1 << 1)
+#define VGA_TEXT   (1 << 2)
+#define VGA_CMAP   (1 << 3)
+
+
 typedef struct {
 	unsigned char misc;     /* Miscellaneous register */
 	unsigned char crtc[25]; /* CRT controller registers */
@@ -34,6 +41,16 @@ typedef struct {
 } vga_state_t;
 
 
+/* Hardware access statistics */
+typedef struct {
+	unsigned int in;            /* Port reads */
+	unsigned int out;           /* Port writes */
+	unsigned int memrd;         /* VGA memory bytes read */
+	unsigned int memwr;         /* VGA memory bytes written */
+	unsigned long long cost;    /* Estimated bus time [ns] */
+} vga_trace_t;
+
+
 typedef struct {
 	void *misc;             /* Miscellaneous register base */
 	void *crtc;             /* CRT controller registers base */
@@ -41,8 +58,22 @@ typedef struct {
 	void *gfx;              /* Graphics controller registers base */
 	void *attr;             /* Attribute controller registers base */
 	void *dac;              /* Digital to Analog Converter registers base */
-	void *mem;              /* Mapped VGA memory base address */
+	void *mem;              /* Mapped VGA memory base address (direct writes have to be followed by vga_invalidate()) */
 	unsigned int memsz;     /* Mapped VGA memory size */
+
+	/* Registers shadow (write-through cache) */
+	struct {
+		unsigned char misc;     /* Miscellaneous register */
+		unsigned char crtc[25]; /* CRT controller registers */
+		unsigned char seq[5];   /* Sequencer registers */
+		unsigned char gfx[9];   /* Graphics controller registers */
+		unsigned char attr[21]; /* Attribute controller registers */
+	} shadow;
+
+	/* VGA memory and color map tracking */
+	unsigned int valid;             /* Tracked data validity flags */
+	unsigned int hash[3];           /* Font1, font2 and text hashes */
+	unsigned char cmap[VGA_CMAPSZ]; /* Color map shadow */
 } vga_t;
 
 
@@ -51,6 +82,9 @@ typedef struct {
 /*****************************************/
 
 
+/* Standard registers reads are served from registers shadow, unchanged registers writes are skipped */
+
+
 /* Reads from input status register */
 extern unsigned char vga_status(vga_t *vga);
 
@@ -111,6 +145,22 @@ extern void vga_disablecmap(vga_t *vga);
 extern void vga_enablecmap(vga_t *vga);
 
 
+/* Reloads registers shadow from hardware (registers modified outside of the library) */
+extern void vga_resync(vga_t *vga);
+
+
+/* Invalidates tracked VGA memory or color map data (modified outside of the library) */
+extern void vga_invalidate(vga_t *vga, unsigned int flags);
+
+
+/* Fills VGA memory (selected write planes), invalidates tracked fonts and text */
+extern void vga_fillmem(vga_t *vga, unsigned char val, unsigned int len);
+
+
+/* Returns hardware access statistics since last reset (only available with tracing backend) */
+extern int vga_trace(vga_t *vga, vga_trace_t *trace, int reset);
+
+
 /* Destroys VGA handle */
 extern void vga_done(vga_t *vga);
 
@@ -0,0 +1,176 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VGA library test (hardware access cost of mode, color map, fonts and text switches)
+ *
+ * Copyright 2021 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libgraph.h>
+#include <libvga.h>
+
+
+/* Prints hardware accesses done since last report */
+static void test_report(vga_t *vga, const char *op)
+{
+	vga_trace_t trace;
+
+	vga_trace(vga, &trace, 1);
+	printf("test_libvga: %-34s %5u in %5u out %6u memrd %6u memwr %10llu ns\n", op, trace.in, trace.out, trace.memrd, trace.memwr, trace.cost);
+}
+
+
+/* Measures VGA state save and restore */
+static int test_state(void)
+{
+	static unsigned char cmap[2][VGA_CMAPSZ], font1[VGA_FONTSZ], font2[VGA_FONTSZ], text[VGA_TEXTSZ];
+	vga_state_t saved = { .cmap = cmap[0], .font1 = font1, .font2 = font2, .text = text };
+	vga_state_t state;
+	unsigned int i;
+	vga_t vga;
+	int err;
+
+	if ((err = vga_init(&vga)) < 0) {
+		fprintf(stderr, "test_libvga: failed to initialize VGA\n");
+		return err;
+	}
+
+	if ((err = vga_trace(&vga, NULL, 1)) < 0) {
+		printf("test_libvga: hardware access tracing not supported, skipping test\n");
+		vga_done(&vga);
+		return EOK;
+	}
+
+	vga_save(&vga, &saved);
+	test_report(&vga, "vga_save");
+
+	/* Mode with all registers changed */
+	state = saved;
+	state.misc ^= 0x0c;
+	for (i = 0; i < sizeof(state.crtc); i++)
+		state.crtc[i] ^= 0x5a;
+	for (i = 1; i < sizeof(state.seq); i++)
+		state.seq[i] ^= 0x05;
+	for (i = 0; i < sizeof(state.gfx); i++)
+		state.gfx[i] ^= 0x05;
+	for (i = 0; i < sizeof(state.attr); i++)
+		state.attr[i] ^= 0x05;
+
+	vga_restoremode(&vga, &state);
+	test_report(&vga, "vga_restoremode (changed)");
+
+	vga_restoremode(&vga, &state);
+	test_report(&vga, "vga_restoremode (unchanged)");
+
+	vga_restoremode(&vga, &saved);
+	test_report(&vga, "vga_restoremode (back)");
+
+	/* Fonts and text copies */
+	vga_savetext(&vga, &saved);
+	test_report(&vga, "vga_savetext");
+
+	vga_restoretext(&vga, &saved);
+	test_report(&vga, "vga_restoretext (unchanged)");
+
+	text[0] ^= 0xff;
+	vga_restoretext(&vga, &saved);
+	test_report(&vga, "vga_restoretext (text changed)");
+
+	vga_invalidate(&vga, VGA_FONT1 | VGA_FONT2 | VGA_TEXT);
+	vga_restoretext(&vga, &saved);
+	test_report(&vga, "vga_restoretext (invalidated)");
+
+	/* Color map */
+	vga_savecmap(&vga, &saved);
+	test_report(&vga, "vga_savecmap");
+
+	memcpy(cmap[1], cmap[0], VGA_CMAPSZ);
+	cmap[1][3 * 7] ^= 0x3f;
+	state.cmap = cmap[1];
+	vga_restorecmap(&vga, &state);
+	test_report(&vga, "vga_restorecmap (1 color changed)");
+
+	vga_restorecmap(&vga, &saved);
+	test_report(&vga, "vga_restorecmap (back)");
+
+	/* Saved data has to be read back */
+	memset(cmap[1], 0, VGA_CMAPSZ);
+	state.cmap = cmap[1];
+	vga_savecmap(&vga, &state);
+	if (memcmp(cmap[0], cmap[1], VGA_CMAPSZ)) {
+		fprintf(stderr, "test_libvga: color map mismatch\n");
+		err = -EIO;
+	}
+	vga_trace(&vga, NULL, 1);
+
+	vga_done(&vga);
+
+	return err;
+}
+
+
+/* Measures VGA device graphics mode switch */
+static int test_mode(void)
+{
+	graph_t graph;
+	vga_t *vga;
+	int err;
+
+	if ((err = graph_init()) < 0) {
+		fprintf(stderr, "test_libvga: failed to initialize graph library\n");
+		return err;
+	}
+
+	if ((err = graph_open(&graph, 0x2000, GRAPH_VGADEV)) < 0) {
+		fprintf(stderr, "test_libvga: failed to open VGA graphics adapter\n");
+		graph_done();
+		return err;
+	}
+
+	/* VGA adapter data starts with VGA handle */
+	vga = (vga_t *)graph.adapter;
+
+	if (vga_trace(vga, NULL, 1) == EOK) {
+		if ((err = graph_mode(&graph, GRAPH_320x200x8, GRAPH_60Hz)) < 0)
+			fprintf(stderr, "test_libvga: failed to set graphics mode\n");
+		else
+			test_report(vga, "vgadev_mode (320x200x8)");
+
+		if ((err == EOK) && ((err = graph_mode(&graph, GRAPH_320x200x8, GRAPH_60Hz)) == EOK))
+			test_report(vga, "vgadev_mode (320x200x8 again)");
+	}
+
+	graph_close(&graph);
+	graph_done();
+
+	return err;
+}
+
+
+int main(void)
+{
+	int ret;
+
+	do {
+		printf("test_libvga: starting VGA state test...\n");
+		if ((ret = test_state()) < 0)
+			break;
+
+		printf("test_libvga: starting VGA device mode test...\n");
+		if ((ret = test_mode()) < 0)
+			break;
+
+		printf("test_libvga: test finished successfully\n");
+	} while (0);
+
+	return ret;
+}
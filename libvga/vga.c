@@ -57,10 +57,215 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "libvga.h"
+#include "vgahw.h"
+
+
+unsigned char vga_status(vga_t *vga)
+{
+	return vgahw_status(vga);
+}
+
+
+unsigned char vga_readmisc(vga_t *vga)
+{
+	return vga->shadow.misc;
+}
+
+
+void vga_writemisc(vga_t *vga, unsigned char val)
+{
+	if (vga->shadow.misc == val)
+		return;
+
+	vga->shadow.misc = val;
+	vgahw_writemisc(vga, val);
+}
+
+
+unsigned char vga_readcrtc(vga_t *vga, unsigned char reg)
+{
+	if (reg < sizeof(vga->shadow.crtc))
+		return vga->shadow.crtc[reg];
+
+	return vgahw_readcrtc(vga, reg);
+}
+
+
+void vga_writecrtc(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	if (reg < sizeof(vga->shadow.crtc)) {
+		/* CRTC[0-7] write protection (only CRTC[7] bit 4 remains writable) */
+		if ((reg < 0x08) && (vga->shadow.crtc[0x11] & 0x80)) {
+			if (reg != 0x07)
+				return;
+			val = (vga->shadow.crtc[0x07] & ~0x10) | (val & 0x10);
+		}
+
+		if (vga->shadow.crtc[reg] == val)
+			return;
+		vga->shadow.crtc[reg] = val;
+	}
+
+	vgahw_writecrtc(vga, reg, val);
+}
+
+
+unsigned char vga_readseq(vga_t *vga, unsigned char reg)
+{
+	if (reg < sizeof(vga->shadow.seq))
+		return vga->shadow.seq[reg];
+
+	return vgahw_readseq(vga, reg);
+}
+
+
+void vga_writeseq(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	if (reg < sizeof(vga->shadow.seq)) {
+		if (vga->shadow.seq[reg] == val)
+			return;
+		vga->shadow.seq[reg] = val;
+	}
+
+	vgahw_writeseq(vga, reg, val);
+}
+
+
+unsigned char vga_readgfx(vga_t *vga, unsigned char reg)
+{
+	if (reg < sizeof(vga->shadow.gfx))
+		return vga->shadow.gfx[reg];
+
+	return vgahw_readgfx(vga, reg);
+}
+
+
+void vga_writegfx(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	if (reg < sizeof(vga->shadow.gfx)) {
+		if (vga->shadow.gfx[reg] == val)
+			return;
+		vga->shadow.gfx[reg] = val;
+	}
+
+	vgahw_writegfx(vga, reg, val);
+}
+
+
+unsigned char vga_readattr(vga_t *vga, unsigned char reg)
+{
+	if (reg < sizeof(vga->shadow.attr))
+		return vga->shadow.attr[reg];
+
+	return vgahw_readattr(vga, reg);
+}
+
+
+void vga_writeattr(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	if (reg < sizeof(vga->shadow.attr)) {
+		if (vga->shadow.attr[reg] == val)
+			return;
+		vga->shadow.attr[reg] = val;
+	}
+
+	vgahw_writeattr(vga, reg, val);
+}
+
+
+unsigned char vga_readdac(vga_t *vga, unsigned char reg)
+{
+	return vgahw_readdac(vga, reg);
+}
+
+
+void vga_writedac(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	/* Color map is modified through DAC data register */
+	if (reg == 0x03)
+		vga->valid &= ~VGA_CMAP;
+
+	vgahw_writedac(vga, reg, val);
+}
+
+
+void vga_disablecmap(vga_t *vga)
+{
+	vgahw_disablecmap(vga);
+}
+
+
+void vga_enablecmap(vga_t *vga)
+{
+	vgahw_enablecmap(vga);
+}
+
+
+void vga_resync(vga_t *vga)
+{
+	unsigned int i;
+
+	/* VGA memory and color map might have been modified too */
+	vga->valid = 0;
+
+	vga->shadow.misc = vgahw_readmisc(vga);
+
+	for (i = 0; i < sizeof(vga->shadow.crtc); i++)
+		vga->shadow.crtc[i] = vgahw_readcrtc(vga, i);
+
+	for (i = 0; i < sizeof(vga->shadow.seq); i++)
+		vga->shadow.seq[i] = vgahw_readseq(vga, i);
+
+	for (i = 0; i < sizeof(vga->shadow.gfx); i++)
+		vga->shadow.gfx[i] = vgahw_readgfx(vga, i);
+
+	vgahw_enablecmap(vga);
+	for (i = 0; i < sizeof(vga->shadow.attr); i++)
+		vga->shadow.attr[i] = vgahw_readattr(vga, i);
+	vgahw_disablecmap(vga);
+}
+
+
+void vga_invalidate(vga_t *vga, unsigned int flags)
+{
+	vga->valid &= ~flags;
+}
+
+
+void vga_fillmem(vga_t *vga, unsigned char val, unsigned int len)
+{
+	vga->valid &= ~(VGA_FONT1 | VGA_FONT2 | VGA_TEXT);
+	vgahw_fillmem(vga, val, len);
+}
+
+
+int vga_trace(vga_t *vga, vga_trace_t *trace, int reset)
+{
+	return vgahw_trace(vga, trace, reset);
+}
+
+
+void vga_done(vga_t *vga)
+{
+	vgahw_done(vga);
+}
+
+
+int vga_init(vga_t *vga)
+{
+	int err;
+
+	if ((err = vgahw_init(vga)) < 0)
+		return err;
+
+	vga_resync(vga);
+
+	return EOK;
+}
 
 
 void vga_lock(vga_t *vga)
@@ -128,10 +333,9 @@ void vga_savemode(vga_t *vga, vga_state_t *state)
 	for (i = 0; i < sizeof(state->gfx); i++)
 		state->gfx[i] = vga_readgfx(vga, i);
 
-	vga_enablecmap(vga);
+	/* Attribute registers are read from shadow (no need to enable color map) */
 	for (i = 0; i < sizeof(state->attr); i++)
 		state->attr[i] = vga_readattr(vga, i);
-	vga_disablecmap(vga);
 }
 
 
@@ -166,6 +370,12 @@ void vga_savecmap(vga_t *vga, vga_state_t *state)
 	if (state->cmap == NULL)
 		return;
 
+	/* Color map shadow is up to date */
+	if (vga->valid & VGA_CMAP) {
+		memcpy(state->cmap, vga->cmap, VGA_CMAPSZ);
+		return;
+	}
+
 	/* Assume DAC is readable */
 	vga_writedac(vga, 0x00, 0xff);
 	vga_writedac(vga, 0x01, 0x00);
@@ -179,29 +389,85 @@ void vga_savecmap(vga_t *vga, vga_state_t *state)
 	}
 
 	vga_disablecmap(vga);
+
+	memcpy(vga->cmap, state->cmap, VGA_CMAPSZ);
+	vga->valid |= VGA_CMAP;
 }
 
 
 void vga_restorecmap(vga_t *vga, vga_state_t *state)
 {
-	unsigned int i;
+	unsigned int i, j, idx, valid = vga->valid & VGA_CMAP;
 
 	if (state->cmap == NULL)
 		return;
 
 	/* Assume DAC is writable */
 	vga_writedac(vga, 0x00, 0xff);
-	vga_writedac(vga, 0x02, 0x00);
 
-	for (i = 0; i < VGA_CMAPSZ; i++) {
-		vga_writedac(vga, 0x03, state->cmap[i]);
+	/* Write only colors that differ from color map shadow (DAC writes invalidate it) */
+	for (i = 0, idx = VGA_CMAPSZ; i < VGA_CMAPSZ; i += 3) {
+		if (valid && !memcmp(vga->cmap + i, state->cmap + i, 3))
+			continue;
 
-		/* DAC delay */
-		vga_status(vga);
-		vga_status(vga);
+		/* DAC write index auto-increments, set it only after skipped colors */
+		if (idx != i)
+			vga_writedac(vga, 0x02, i / 3);
+
+		for (j = i; j < i + 3; j++) {
+			vga_writedac(vga, 0x03, state->cmap[j]);
+
+			/* DAC delay */
+			vga_status(vga);
+			vga_status(vga);
+		}
+		idx = i + 3;
 	}
 
 	vga_disablecmap(vga);
+
+	memcpy(vga->cmap, state->cmap, VGA_CMAPSZ);
+	vga->valid |= VGA_CMAP;
+}
+
+
+/* Returns buffer hash (FNV-1a) */
+static unsigned int vga_hash(const unsigned char *buff, unsigned int len)
+{
+	unsigned int hash = 2166136261U;
+
+	while (len--) {
+		hash ^= *buff++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+
+/* Returns data that needs to be copied (saved data is always read, restored data only if it doesn't match tracked VGA memory contents) */
+static unsigned int vga_dirtytext(vga_t *vga, vga_state_t *state, unsigned char dir, unsigned int *hash)
+{
+	unsigned char *buff[] = { state->font1, state->font2, state->text };
+	static const unsigned int len[] = { VGA_FONTSZ, VGA_FONTSZ, VGA_TEXTSZ };
+	unsigned int i, dirty = 0;
+
+	for (i = 0; i < sizeof(buff) / sizeof(buff[0]); i++) {
+		if (buff[i] == NULL)
+			continue;
+
+		/* Caller buffer contents say nothing about VGA memory contents */
+		if (!dir) {
+			dirty |= (1 << i);
+			continue;
+		}
+
+		hash[i] = vga_hash(buff[i], len[i]);
+		if (!(vga->valid & (1 << i)) || (vga->hash[i] != hash[i]))
+			dirty |= (1 << i);
+	}
+
+	return dirty;
 }
 
 
@@ -209,6 +475,11 @@ void vga_restorecmap(vga_t *vga, vga_state_t *state)
 static void vga_copytext(vga_t *vga, vga_state_t *state, unsigned char dir)
 {
 	unsigned char misc, gr01, gr03, gr04, gr05, gr06, gr08, seq02, seq04;
+	unsigned int dirty, hash[3];
+
+	/* Skip restoring fonts and text already matching VGA memory (and registers setup if there's nothing to copy) */
+	if (!(dirty = vga_dirtytext(vga, state, dir, hash)))
+		return;
 
 	/* Save registers */
 	misc = vga_readmisc(vga);
@@ -232,42 +503,51 @@ static void vga_copytext(vga_t *vga, vga_state_t *state, unsigned char dir)
 	vga_writegfx(vga, 0x06, 0x05); /* Set graphics */
 	vga_writegfx(vga, 0x08, 0xff); /* Write all bits in a byte */
 
-	if (state->font1 != NULL) {
+	if (dirty & VGA_FONT1) {
 		/* Read/Write plane 2 */
 		vga_writeseq(vga, 0x02, 0x04);
 		vga_writegfx(vga, 0x04, 0x02);
-		if (dir)
-			memcpy(vga->mem, state->font1, VGA_FONTSZ);
-		else
-			memcpy(state->font1, vga->mem, VGA_FONTSZ);
+		if (dir) {
+			vgahw_writemem(vga, state->font1, VGA_FONTSZ);
+		}
+		else {
+			vgahw_readmem(vga, state->font1, VGA_FONTSZ);
+			hash[0] = vga_hash(state->font1, VGA_FONTSZ);
+		}
 	}
 
-	if (state->font2 != NULL) {
+	if (dirty & VGA_FONT2) {
 		/* Read/Write plane 3 */
 		vga_writeseq(vga, 0x02, 0x08);
 		vga_writegfx(vga, 0x04, 0x03);
-		if (dir)
-			memcpy(vga->mem, state->font2, VGA_FONTSZ);
-		else
-			memcpy(state->font2, vga->mem, VGA_FONTSZ);
+		if (dir) {
+			vgahw_writemem(vga, state->font2, VGA_FONTSZ);
+		}
+		else {
+			vgahw_readmem(vga, state->font2, VGA_FONTSZ);
+			hash[1] = vga_hash(state->font2, VGA_FONTSZ);
+		}
 	}
 
-	if (state->text != NULL) {
+	if (dirty & VGA_TEXT) {
 		/* Read/Write plane 0 */
 		vga_writeseq(vga, 0x02, 0x01);
 		vga_writegfx(vga, 0x04, 0x00);
 		if (dir)
-			memcpy(vga->mem, state->text, VGA_TEXTSZ >> 1);
+			vgahw_writemem(vga, state->text, VGA_TEXTSZ >> 1);
 		else
-			memcpy(state->text, vga->mem, VGA_TEXTSZ >> 1);
+			vgahw_readmem(vga, state->text, VGA_TEXTSZ >> 1);
 
 		/* Read/Write plane 1 */
 		vga_writeseq(vga, 0x02, 0x02);
 		vga_writegfx(vga, 0x04, 0x01);
 		if (dir)
-			memcpy(vga->mem, state->text + (VGA_TEXTSZ >> 1), VGA_TEXTSZ >> 1);
+			vgahw_writemem(vga, state->text + (VGA_TEXTSZ >> 1), VGA_TEXTSZ >> 1);
 		else
-			memcpy(state->text + (VGA_TEXTSZ >> 1), vga->mem, VGA_TEXTSZ >> 1);
+			vgahw_readmem(vga, state->text + (VGA_TEXTSZ >> 1), VGA_TEXTSZ >> 1);
+
+		if (!dir)
+			hash[2] = vga_hash(state->text, VGA_TEXTSZ);
 	}
 
 	/* Restore registers */
@@ -283,6 +563,15 @@ static void vga_copytext(vga_t *vga, vga_state_t *state, unsigned char dir)
 	/* Restore mode */
 	vga_writemisc(vga, misc);
 	vga_unblank(vga);
+
+	/* Update tracked VGA memory contents */
+	if (dirty & VGA_FONT1)
+		vga->hash[0] = hash[0];
+	if (dirty & VGA_FONT2)
+		vga->hash[1] = hash[1];
+	if (dirty & VGA_TEXT)
+		vga->hash[2] = hash[2];
+	vga->valid |= dirty;
 }
 
 
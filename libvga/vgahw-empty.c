@@ -13,106 +13,130 @@
 
 #include <errno.h>
 
-#include "libvga.h"
+#include "vgahw.h"
 
 
-unsigned char vga_status(vga_t *vga)
+unsigned char vgahw_status(vga_t *vga)
 {
 	return 0;
 }
 
 
-unsigned char vga_readmisc(vga_t *vga)
+unsigned char vgahw_readmisc(vga_t *vga)
 {
 	return 0;
 }
 
 
-void vga_writemisc(vga_t *vga, unsigned char val)
+void vgahw_writemisc(vga_t *vga, unsigned char val)
 {
 	return;
 }
 
 
-unsigned char vga_readcrtc(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readcrtc(vga_t *vga, unsigned char reg)
 {
 	return 0;
 }
 
 
-void vga_writecrtc(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writecrtc(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	return;
 }
 
 
-unsigned char vga_readseq(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readseq(vga_t *vga, unsigned char reg)
 {
 	return 0;
 }
 
 
-void vga_writeseq(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writeseq(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	return;
 }
 
 
-unsigned char vga_readgfx(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readgfx(vga_t *vga, unsigned char reg)
 {
 	return 0;
 }
 
 
-void vga_writegfx(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writegfx(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	return;
 }
 
 
-unsigned char vga_readattr(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readattr(vga_t *vga, unsigned char reg)
 {
 	return 0;
 }
 
 
-void vga_writeattr(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writeattr(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	return;
 }
 
 
-unsigned char vga_readdac(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readdac(vga_t *vga, unsigned char reg)
 {
 	return 0;
 }
 
 
-void vga_writedac(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writedac(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	return;
 }
 
 
-void vga_disablecmap(vga_t *vga)
+void vgahw_readmem(vga_t *vga, void *buff, unsigned int len)
 {
 	return;
 }
 
 
-void vga_enablecmap(vga_t *vga)
+void vgahw_writemem(vga_t *vga, const void *buff, unsigned int len)
 {
 	return;
 }
 
 
-void vga_done(vga_t *vga)
+void vgahw_fillmem(vga_t *vga, unsigned char val, unsigned int len)
 {
 	return;
 }
 
 
-int vga_init(vga_t *vga)
+void vgahw_disablecmap(vga_t *vga)
+{
+	return;
+}
+
+
+void vgahw_enablecmap(vga_t *vga)
+{
+	return;
+}
+
+
+int vgahw_trace(vga_t *vga, vga_trace_t *trace, int reset)
+{
+	return -ENOTSUP;
+}
+
+
+void vgahw_done(vga_t *vga)
+{
+	return;
+}
+
+
+int vgahw_init(vga_t *vga)
 {
 	return -ENODEV;
 }
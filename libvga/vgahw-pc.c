@@ -13,122 +13,147 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/io.h>
 #include <sys/mman.h>
 
-#include "libvga.h"
+#include "vgahw.h"
 
 
-unsigned char vga_status(vga_t *vga)
+unsigned char vgahw_status(vga_t *vga)
 {
 	return inb(vga->crtc + 6);
 }
 
 
-unsigned char vga_readmisc(vga_t *vga)
+unsigned char vgahw_readmisc(vga_t *vga)
 {
 	return inb(vga->misc + 10);
 }
 
 
-void vga_writemisc(vga_t *vga, unsigned char val)
+void vgahw_writemisc(vga_t *vga, unsigned char val)
 {
 	outb(vga->misc, val);
 }
 
 
-unsigned char vga_readcrtc(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readcrtc(vga_t *vga, unsigned char reg)
 {
 	outb(vga->crtc, reg);
 	return inb(vga->crtc + 1);
 }
 
 
-void vga_writecrtc(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writecrtc(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	outb(vga->crtc, reg);
 	outb(vga->crtc + 1, val);
 }
 
 
-unsigned char vga_readseq(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readseq(vga_t *vga, unsigned char reg)
 {
 	outb(vga->seq, reg);
 	return inb(vga->seq + 1);
 }
 
 
-void vga_writeseq(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writeseq(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	outb(vga->seq, reg);
 	outb(vga->seq + 1, val);
 }
 
 
-unsigned char vga_readgfx(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readgfx(vga_t *vga, unsigned char reg)
 {
 	outb(vga->gfx, reg);
 	return inb(vga->gfx + 1);
 }
 
 
-void vga_writegfx(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writegfx(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	outb(vga->gfx, reg);
 	outb(vga->gfx + 1, val);
 }
 
 
-unsigned char vga_readattr(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readattr(vga_t *vga, unsigned char reg)
 {
-	vga_status(vga);
+	vgahw_status(vga);
 	outb(vga->attr, reg);
 	return inb(vga->attr + 1);
 }
 
 
-void vga_writeattr(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writeattr(vga_t *vga, unsigned char reg, unsigned char val)
 {
-	vga_status(vga);
+	vgahw_status(vga);
 	outb(vga->attr, reg);
 	outb(vga->attr, val);
 }
 
 
-unsigned char vga_readdac(vga_t *vga, unsigned char reg)
+unsigned char vgahw_readdac(vga_t *vga, unsigned char reg)
 {
 	return inb(vga->dac + reg);
 }
 
 
-void vga_writedac(vga_t *vga, unsigned char reg, unsigned char val)
+void vgahw_writedac(vga_t *vga, unsigned char reg, unsigned char val)
 {
 	outb(vga->dac + reg, val);
 }
 
 
-void vga_disablecmap(vga_t *vga)
+void vgahw_readmem(vga_t *vga, void *buff, unsigned int len)
 {
-	vga_status(vga);
+	memcpy(buff, vga->mem, len);
+}
+
+
+void vgahw_writemem(vga_t *vga, const void *buff, unsigned int len)
+{
+	memcpy(vga->mem, buff, len);
+}
+
+
+void vgahw_fillmem(vga_t *vga, unsigned char val, unsigned int len)
+{
+	memset(vga->mem, val, len);
+}
+
+
+void vgahw_disablecmap(vga_t *vga)
+{
+	vgahw_status(vga);
 	outb(vga->attr, 0x20);
 }
 
 
-void vga_enablecmap(vga_t *vga)
+void vgahw_enablecmap(vga_t *vga)
 {
-	vga_status(vga);
+	vgahw_status(vga);
 	outb(vga->attr, 0x00);
 }
 
 
-void vga_done(vga_t *vga)
+int vgahw_trace(vga_t *vga, vga_trace_t *trace, int reset)
+{
+	return -ENOTSUP;
+}
+
+
+void vgahw_done(vga_t *vga)
 {
 	munmap(vga->mem, vga->memsz);
 }
 
 
-int vga_init(vga_t *vga)
+int vgahw_init(vga_t *vga)
 {
 	/* Set VGA ports */
 	vga->attr = (void *)0x3c0;
@@ -136,7 +161,7 @@ int vga_init(vga_t *vga)
 	vga->seq = (void *)0x3c4;
 	vga->dac = (void *)0x3c6;
 	vga->gfx = (void *)0x3ce;
-	vga->crtc = (vga_readmisc(vga) & 0x01) ? (void *)0x3d4 : (void *)0x3b4;
+	vga->crtc = (vgahw_readmisc(vga) & 0x01) ? (void *)0x3d4 : (void *)0x3b4;
 
 	/* Map VGA memory (64KB) */
 	vga->memsz = (VGA_MEMSZ + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
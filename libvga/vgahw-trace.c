@@ -0,0 +1,467 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VGA low level interface (port I/O tracing, registers and memory emulated in RAM)
+ *
+ * Copyright 2021 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vgahw.h"
+
+
+/* Estimated ISA bus access times [ns] */
+#define VGATRACE_INCOST    1000 /* 8-bit port read */
+#define VGATRACE_OUTCOST   1000 /* 8-bit port write */
+#define VGATRACE_MEMRDCOST 250  /* 8-bit VGA memory read */
+#define VGATRACE_MEMWRCOST 200  /* 8-bit VGA memory write */
+
+/* Emulated vertical retrace timing [ns] */
+#define VGATRACE_FRAME   14285714 /* 70Hz refresh rate */
+#define VGATRACE_RETRACE 64000    /* Retrace pulse length */
+
+
+struct {
+	/* Emulated registers */
+	unsigned char misc;          /* Miscellaneous register */
+	unsigned char crtcidx;       /* CRT controller index register */
+	unsigned char crtc[256];     /* CRT controller registers */
+	unsigned char seqidx;        /* Sequencer index register */
+	unsigned char seq[256];      /* Sequencer registers */
+	unsigned char gfxidx;        /* Graphics controller index register */
+	unsigned char gfx[256];      /* Graphics controller registers */
+	unsigned char attrff;        /* Attribute controller flip-flop (0 - index, 1 - data) */
+	unsigned char attridx;       /* Attribute controller index register (with palette address source bit) */
+	unsigned char attr[32];      /* Attribute controller registers */
+	unsigned char dacmask;       /* DAC pixel mask register */
+	unsigned char dacstate;      /* DAC state (0x00 - write, 0x03 - read) */
+	unsigned char dacrd;         /* DAC read index */
+	unsigned char dacwr;         /* DAC write index */
+	unsigned char daccnt;        /* DAC color component counter */
+	unsigned char dac[VGA_CMAPSZ]; /* DAC color map */
+
+	/* Emulated memory */
+	unsigned char *planes;       /* VGA memory planes (4 x 64KB) */
+
+	/* Tracing */
+	vga_trace_t trace;           /* Access statistics */
+	FILE *log;                   /* Accesses log */
+} vgatrace_common;
+
+
+static void vgatrace_account(const char *op, unsigned int port, unsigned int val, unsigned int cost)
+{
+	vgatrace_common.trace.cost += cost;
+
+	if (vgatrace_common.log != NULL)
+		fprintf(vgatrace_common.log, "%-5s 0x%03x 0x%02x %8llu\n", op, port, val, vgatrace_common.trace.cost);
+}
+
+
+/* Emulates input status register 1 vertical retrace bit */
+static unsigned char vgatrace_retrace(void)
+{
+	struct timespec ts;
+	unsigned long long now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0x00;
+
+	now = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	return ((now % VGATRACE_FRAME) < VGATRACE_RETRACE) ? 0x09 : 0x00;
+}
+
+
+static unsigned char vgatrace_inb(void *addr)
+{
+	unsigned int port = (uintptr_t)addr;
+	unsigned char val = 0xff;
+
+	switch (port) {
+		case 0x3c1:
+			val = vgatrace_common.attr[vgatrace_common.attridx & 0x1f];
+			break;
+
+		case 0x3c2:
+			/* Input status register 0 */
+			val = 0x00;
+			break;
+
+		case 0x3c4:
+			val = vgatrace_common.seqidx;
+			break;
+
+		case 0x3c5:
+			val = vgatrace_common.seq[vgatrace_common.seqidx];
+			break;
+
+		case 0x3c6:
+			val = vgatrace_common.dacmask;
+			break;
+
+		case 0x3c7:
+			val = vgatrace_common.dacstate;
+			break;
+
+		case 0x3c8:
+			val = vgatrace_common.dacwr;
+			break;
+
+		case 0x3c9:
+			val = vgatrace_common.dac[3 * vgatrace_common.dacrd + vgatrace_common.daccnt];
+			if (++vgatrace_common.daccnt == 3) {
+				vgatrace_common.daccnt = 0;
+				vgatrace_common.dacrd++;
+			}
+			break;
+
+		case 0x3cc:
+			val = vgatrace_common.misc;
+			break;
+
+		case 0x3ce:
+			val = vgatrace_common.gfxidx;
+			break;
+
+		case 0x3cf:
+			val = vgatrace_common.gfx[vgatrace_common.gfxidx];
+			break;
+
+		case 0x3b4:
+		case 0x3d4:
+			val = vgatrace_common.crtcidx;
+			break;
+
+		case 0x3b5:
+		case 0x3d5:
+			val = vgatrace_common.crtc[vgatrace_common.crtcidx];
+			break;
+
+		case 0x3ba:
+		case 0x3da:
+			/* Input status register 1, resets attribute controller flip-flop */
+			vgatrace_common.attrff = 0;
+			val = vgatrace_retrace();
+			break;
+
+		default:
+			break;
+	}
+
+	vgatrace_common.trace.in++;
+	vgatrace_account("in", port, val, VGATRACE_INCOST);
+
+	return val;
+}
+
+
+static void vgatrace_outb(void *addr, unsigned char val)
+{
+	unsigned int port = (uintptr_t)addr;
+
+	switch (port) {
+		case 0x3c0:
+			if (vgatrace_common.attrff)
+				vgatrace_common.attr[vgatrace_common.attridx & 0x1f] = val;
+			else
+				vgatrace_common.attridx = val & 0x3f;
+			vgatrace_common.attrff ^= 1;
+			break;
+
+		case 0x3c2:
+			vgatrace_common.misc = val;
+			break;
+
+		case 0x3c4:
+			vgatrace_common.seqidx = val;
+			break;
+
+		case 0x3c5:
+			vgatrace_common.seq[vgatrace_common.seqidx] = val;
+			break;
+
+		case 0x3c6:
+			vgatrace_common.dacmask = val;
+			break;
+
+		case 0x3c7:
+			vgatrace_common.dacrd = val;
+			vgatrace_common.daccnt = 0;
+			vgatrace_common.dacstate = 0x03;
+			break;
+
+		case 0x3c8:
+			vgatrace_common.dacwr = val;
+			vgatrace_common.daccnt = 0;
+			vgatrace_common.dacstate = 0x00;
+			break;
+
+		case 0x3c9:
+			vgatrace_common.dac[3 * vgatrace_common.dacwr + vgatrace_common.daccnt] = val & 0x3f;
+			if (++vgatrace_common.daccnt == 3) {
+				vgatrace_common.daccnt = 0;
+				vgatrace_common.dacwr++;
+			}
+			break;
+
+		case 0x3ce:
+			vgatrace_common.gfxidx = val;
+			break;
+
+		case 0x3cf:
+			vgatrace_common.gfx[vgatrace_common.gfxidx] = val;
+			break;
+
+		case 0x3b4:
+		case 0x3d4:
+			vgatrace_common.crtcidx = val;
+			break;
+
+		case 0x3b5:
+		case 0x3d5:
+			vgatrace_common.crtc[vgatrace_common.crtcidx] = val;
+			break;
+
+		default:
+			break;
+	}
+
+	vgatrace_common.trace.out++;
+	vgatrace_account("out", port, val, VGATRACE_OUTCOST);
+}
+
+
+unsigned char vgahw_status(vga_t *vga)
+{
+	return vgatrace_inb(vga->crtc + 6);
+}
+
+
+unsigned char vgahw_readmisc(vga_t *vga)
+{
+	return vgatrace_inb(vga->misc + 10);
+}
+
+
+void vgahw_writemisc(vga_t *vga, unsigned char val)
+{
+	vgatrace_outb(vga->misc, val);
+}
+
+
+unsigned char vgahw_readcrtc(vga_t *vga, unsigned char reg)
+{
+	vgatrace_outb(vga->crtc, reg);
+	return vgatrace_inb(vga->crtc + 1);
+}
+
+
+void vgahw_writecrtc(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	vgatrace_outb(vga->crtc, reg);
+	vgatrace_outb(vga->crtc + 1, val);
+}
+
+
+unsigned char vgahw_readseq(vga_t *vga, unsigned char reg)
+{
+	vgatrace_outb(vga->seq, reg);
+	return vgatrace_inb(vga->seq + 1);
+}
+
+
+void vgahw_writeseq(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	vgatrace_outb(vga->seq, reg);
+	vgatrace_outb(vga->seq + 1, val);
+}
+
+
+unsigned char vgahw_readgfx(vga_t *vga, unsigned char reg)
+{
+	vgatrace_outb(vga->gfx, reg);
+	return vgatrace_inb(vga->gfx + 1);
+}
+
+
+void vgahw_writegfx(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	vgatrace_outb(vga->gfx, reg);
+	vgatrace_outb(vga->gfx + 1, val);
+}
+
+
+unsigned char vgahw_readattr(vga_t *vga, unsigned char reg)
+{
+	vgahw_status(vga);
+	vgatrace_outb(vga->attr, reg);
+	return vgatrace_inb(vga->attr + 1);
+}
+
+
+void vgahw_writeattr(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	vgahw_status(vga);
+	vgatrace_outb(vga->attr, reg);
+	vgatrace_outb(vga->attr, val);
+}
+
+
+unsigned char vgahw_readdac(vga_t *vga, unsigned char reg)
+{
+	return vgatrace_inb(vga->dac + reg);
+}
+
+
+void vgahw_writedac(vga_t *vga, unsigned char reg, unsigned char val)
+{
+	vgatrace_outb(vga->dac + reg, val);
+}
+
+
+void vgahw_readmem(vga_t *vga, void *buff, unsigned int len)
+{
+	/* Read mode 0, plane selected with read map select register */
+	unsigned int plane = vgatrace_common.gfx[0x04] & 0x03;
+
+	memcpy(buff, vgatrace_common.planes + plane * VGA_MEMSZ, len);
+
+	vgatrace_common.trace.memrd += len;
+	vgatrace_account("memrd", plane, 0, len * VGATRACE_MEMRDCOST);
+}
+
+
+void vgahw_writemem(vga_t *vga, const void *buff, unsigned int len)
+{
+	/* Write mode 0 without rotation and logical operations, planes selected with map mask register */
+	unsigned int i, mask = vgatrace_common.seq[0x02] & 0x0f;
+
+	for (i = 0; i < 4; i++) {
+		if (mask & (1 << i))
+			memcpy(vgatrace_common.planes + i * VGA_MEMSZ, buff, len);
+	}
+
+	vgatrace_common.trace.memwr += len;
+	vgatrace_account("memwr", mask, 0, len * VGATRACE_MEMWRCOST);
+}
+
+
+void vgahw_fillmem(vga_t *vga, unsigned char val, unsigned int len)
+{
+	unsigned int i, mask = vgatrace_common.seq[0x02] & 0x0f;
+
+	for (i = 0; i < 4; i++) {
+		if (mask & (1 << i))
+			memset(vgatrace_common.planes + i * VGA_MEMSZ, val, len);
+	}
+
+	/* Direct memory window shows cleared screen too */
+	memset(vga->mem, val, (len < vga->memsz) ? len : vga->memsz);
+
+	vgatrace_common.trace.memwr += len;
+	vgatrace_account("memwr", mask, val, len * VGATRACE_MEMWRCOST);
+}
+
+
+void vgahw_disablecmap(vga_t *vga)
+{
+	vgahw_status(vga);
+	vgatrace_outb(vga->attr, 0x20);
+}
+
+
+void vgahw_enablecmap(vga_t *vga)
+{
+	vgahw_status(vga);
+	vgatrace_outb(vga->attr, 0x00);
+}
+
+
+int vgahw_trace(vga_t *vga, vga_trace_t *trace, int reset)
+{
+	if (trace != NULL)
+		*trace = vgatrace_common.trace;
+
+	if (reset) {
+		memset(&vgatrace_common.trace, 0, sizeof(vgatrace_common.trace));
+		if (vgatrace_common.log != NULL)
+			fflush(vgatrace_common.log);
+	}
+
+	return EOK;
+}
+
+
+void vgahw_done(vga_t *vga)
+{
+	if (vgatrace_common.log != NULL) {
+		if (vgatrace_common.log != stderr)
+			fclose(vgatrace_common.log);
+		vgatrace_common.log = NULL;
+	}
+	free(vgatrace_common.planes);
+	free(vga->mem);
+}
+
+
+int vgahw_init(vga_t *vga)
+{
+	char *path;
+
+	/* Set VGA ports */
+	vga->attr = (void *)0x3c0;
+	vga->misc = (void *)0x3c2;
+	vga->seq = (void *)0x3c4;
+	vga->dac = (void *)0x3c6;
+	vga->gfx = (void *)0x3ce;
+
+	/* Direct memory window (library accesses go through traced vgahw_*mem() calls, graphics drawn through vga->mem isn't traced) */
+	vga->memsz = VGA_MEMSZ;
+	if ((vga->mem = calloc(1, vga->memsz)) == NULL)
+		return -ENOMEM;
+
+	if ((vgatrace_common.planes = calloc(4, VGA_MEMSZ)) == NULL) {
+		free(vga->mem);
+		return -ENOMEM;
+	}
+
+	/* Power-on state: color mode, chain-4 disabled, all planes writable */
+	memset(vgatrace_common.crtc, 0, sizeof(vgatrace_common.crtc));
+	memset(vgatrace_common.seq, 0, sizeof(vgatrace_common.seq));
+	memset(vgatrace_common.gfx, 0, sizeof(vgatrace_common.gfx));
+	memset(vgatrace_common.attr, 0, sizeof(vgatrace_common.attr));
+	memset(vgatrace_common.dac, 0, sizeof(vgatrace_common.dac));
+	memset(&vgatrace_common.trace, 0, sizeof(vgatrace_common.trace));
+	vgatrace_common.misc = 0x67;
+	vgatrace_common.seq[0x02] = 0x0f;
+	vgatrace_common.seq[0x04] = 0x06;
+	vgatrace_common.gfx[0x08] = 0xff;
+	vgatrace_common.dacmask = 0xff;
+	vgatrace_common.attrff = 0;
+	vgatrace_common.attridx = 0x20;
+
+	/* Log all accesses to file (or standard error) given with LIBVGA_TRACE */
+	vgatrace_common.log = NULL;
+	if ((path = getenv("LIBVGA_TRACE")) != NULL) {
+		if (!strcmp(path, "-"))
+			vgatrace_common.log = stderr;
+		else
+			vgatrace_common.log = fopen(path, "w");
+	}
+
+	vga->crtc = (vgahw_readmisc(vga) & 0x01) ? (void *)0x3d4 : (void *)0x3b4;
+
+	return EOK;
+}
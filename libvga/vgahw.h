@@ -0,0 +1,112 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VGA low level interface (hardware access)
+ *
+ * Copyright 2021 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VGAHW_H_
+#define _VGAHW_H_
+
+#include <errno.h>
+
+#include "libvga.h"
+
+
+/* Host builds lack Phoenix-RTOS EOK */
+#ifndef EOK
+#define EOK 0
+#endif
+
+
+/* Reads from input status register */
+extern unsigned char vgahw_status(vga_t *vga);
+
+
+/* Reads from miscellaneous register */
+extern unsigned char vgahw_readmisc(vga_t *vga);
+
+
+/* Writes to miscellaneous register */
+extern void vgahw_writemisc(vga_t *vga, unsigned char val);
+
+
+/* Reads from CRT controller register */
+extern unsigned char vgahw_readcrtc(vga_t *vga, unsigned char reg);
+
+
+/* Writes to CRT controller register */
+extern void vgahw_writecrtc(vga_t *vga, unsigned char reg, unsigned char val);
+
+
+/* Reads from sequencer register */
+extern unsigned char vgahw_readseq(vga_t *vga, unsigned char reg);
+
+
+/* Writes to sequencer register */
+extern void vgahw_writeseq(vga_t *vga, unsigned char reg, unsigned char val);
+
+
+/* Reads from graphics controller register */
+extern unsigned char vgahw_readgfx(vga_t *vga, unsigned char reg);
+
+
+/* Writes to graphics controller register */
+extern void vgahw_writegfx(vga_t *vga, unsigned char reg, unsigned char val);
+
+
+/* Reads from attribute controller register */
+extern unsigned char vgahw_readattr(vga_t *vga, unsigned char reg);
+
+
+/* Writes to attribute controller register */
+extern void vgahw_writeattr(vga_t *vga, unsigned char reg, unsigned char val);
+
+
+/* Reads from DAC controller register */
+extern unsigned char vgahw_readdac(vga_t *vga, unsigned char reg);
+
+
+/* Writes to DAC controller register */
+extern void vgahw_writedac(vga_t *vga, unsigned char reg, unsigned char val);
+
+
+/* Copies data from VGA memory (selected read plane) */
+extern void vgahw_readmem(vga_t *vga, void *buff, unsigned int len);
+
+
+/* Copies data to VGA memory (selected write planes) */
+extern void vgahw_writemem(vga_t *vga, const void *buff, unsigned int len);
+
+
+/* Fills VGA memory (selected write planes) */
+extern void vgahw_fillmem(vga_t *vga, unsigned char val, unsigned int len);
+
+
+/* Disables color map */
+extern void vgahw_disablecmap(vga_t *vga);
+
+
+/* Enables color map */
+extern void vgahw_enablecmap(vga_t *vga);
+
+
+/* Returns hardware access statistics (tracing backend only) */
+extern int vgahw_trace(vga_t *vga, vga_trace_t *trace, int reset);
+
+
+/* Destroys VGA hardware handle */
+extern void vgahw_done(vga_t *vga);
+
+
+/* Initializes VGA hardware handle */
+extern int vgahw_init(vga_t *vga);
+
+
+#endif
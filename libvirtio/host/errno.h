@@ -0,0 +1,23 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build errno.h (Phoenix-RTOS error codes)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOHOST_ERRNO_H_
+#define _VIRTIOHOST_ERRNO_H_
+
+#include_next <errno.h>
+
+
+#define EOK 0
+
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build sys/interrupt.h (no hardware interrupts on host)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOHOST_SYS_INTERRUPT_H_
+#define _VIRTIOHOST_SYS_INTERRUPT_H_
+
+#include <sys/types.h>
+
+
+/* Always fails, host devices use loopback transport interrupts */
+extern int interrupt(unsigned int n, int (*f)(unsigned int, void *), void *arg, handle_t cond, handle_t *handle);
+
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build sys/list.h (Phoenix-RTOS list helpers aren't used by libvirtio)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOHOST_SYS_LIST_H_
+#define _VIRTIOHOST_SYS_LIST_H_
+
+
+#endif
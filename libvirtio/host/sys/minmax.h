@@ -0,0 +1,24 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build sys/minmax.h (Phoenix-RTOS min/max helpers)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOHOST_SYS_MINMAX_H_
+#define _VIRTIOHOST_SYS_MINMAX_H_
+
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build sys/mman.h (Phoenix-RTOS memory mapping)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOHOST_SYS_MMAN_H_
+#define _VIRTIOHOST_SYS_MMAN_H_
+
+#include_next <sys/mman.h>
+
+#include <sys/types.h>
+
+
+#define _PAGE_SIZE 0x1000
+
+
+/* Host memory is always cacheable, device memory isn't available */
+#define MAP_UNCACHED 0
+#define MAP_DEVICE   0
+
+
+#define OID_CONTIGUOUS -1
+#define OID_PHYSMEM    -2
+
+
+/* Maps anonymous memory (physically contiguous, 1:1 translated) */
+extern void *virtiohost_mmap(void *vaddr, size_t size, int prot, int flags, int oid, off_t offs);
+
+
+#define mmap virtiohost_mmap
+
+
+/* Returns physical address of given virtual address */
+extern int virtiohost_munmap(void *vaddr, size_t size);
+
+
+#define munmap virtiohost_munmap
+
+
+/* Returns physical address (contiguous mappings are identity mapped, other pages are swapped with their neighbours in aligned 2-page blocks) */
+extern addr_t va2pa(void *va);
+
+
+/* Returns virtual address of physical range (NULL if range isn't physically contiguous) */
+extern void *virtiohost_pa2va(addr_t pa, size_t len);
+
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build sys/threads.h (Phoenix-RTOS threads emulated with POSIX threads)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOHOST_SYS_THREADS_H_
+#define _VIRTIOHOST_SYS_THREADS_H_
+
+#include <time.h>
+#include <sys/types.h>
+
+
+extern int mutexCreate(handle_t *h);
+
+
+extern int mutexLock(handle_t h);
+
+
+extern int mutexTry(handle_t h);
+
+
+extern int mutexUnlock(handle_t h);
+
+
+extern int condCreate(handle_t *h);
+
+
+/* Waits on condition variable (timeout in microseconds, 0 - no timeout) */
+extern int condWait(handle_t h, handle_t m, time_t timeout);
+
+
+extern int condSignal(handle_t h);
+
+
+extern int condBroadcast(handle_t h);
+
+
+extern int resourceDestroy(handle_t h);
+
+
+/* Starts thread (stack is managed by host, priority is ignored) */
+extern int beginthread(void (*start)(void *), unsigned int priority, void *stack, unsigned int stacksz, void *arg);
+
+
+extern void endthread(void);
+
+
+/* Joins any finished thread (timeout in microseconds, 0 - no timeout) */
+extern int threadJoin(time_t timeout);
+
+
+#endif
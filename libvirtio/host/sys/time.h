@@ -0,0 +1,26 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build sys/time.h (Phoenix-RTOS time)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOHOST_SYS_TIME_H_
+#define _VIRTIOHOST_SYS_TIME_H_
+
+#include_next <sys/time.h>
+
+#include <time.h>
+
+
+/* Returns monotonic time in microseconds */
+extern int gettime(time_t *raw, time_t *offs);
+
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build sys/types.h (Phoenix-RTOS types)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOHOST_SYS_TYPES_H_
+#define _VIRTIOHOST_SYS_TYPES_H_
+
+#include_next <sys/types.h>
+
+#include <stdint.h>
+
+
+typedef unsigned int handle_t;
+
+
+typedef uintptr_t addr_t;
+
+
+#endif
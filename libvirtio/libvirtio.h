@@ -23,25 +23,44 @@
 typedef enum {
 	vdevNONE                = 0x00, /* No VirtIO device */
 	vdevPCI                 = 0x01, /* VirtIO PCI device */
-	vdevMMIO                = 0x02  /* VirtIO MMIO device */
+	vdevMMIO                = 0x02, /* VirtIO MMIO device */
+	vdevLOOP                = 0x03  /* VirtIO loopback device (emulated in memory, MMIO register layout) */
 } virtio_devtype_t;
 
 
+typedef struct {
+	uintptr_t va;                   /* Region virtual address (page aligned) */
+	size_t len;                     /* Region length (whole pages) */
+	addr_t pa;                      /* Region physical address (physically contiguous region) */
+	addr_t *pages;                  /* Region pages physical addresses (NULL for physically contiguous region) */
+} virtio_buf_t;
+
+
 typedef struct _virtio_seg_t virtio_seg_t;
 
 
+typedef struct _virtio_req_t virtio_req_t;
+
+
 struct _virtio_seg_t {
-	void *buff;                     /* Buffer exposed to device */
+	void *buff;                     /* Buffer exposed to device (any mapped memory, split into physically contiguous runs on enqueue) */
 	unsigned int len;               /* Buffer length */
+	virtio_buf_t *buf;              /* Registered region containing buffer (NULL if buffer isn't registered) */
 	virtio_seg_t *prev, *next;      /* Doubly linked list */
 };
 
 
-typedef struct {
+struct _virtio_req_t {
 	virtio_seg_t *segs;             /* Request segments list */
 	unsigned int rsegs;             /* Number of device readable segments */
 	unsigned int wsegs;             /* Number of device writable segments */
-} virtio_req_t;
+
+	/* Completion */
+	void (*cb)(virtio_req_t *req);  /* Completion callback (NULL for synchronous completion) */
+	void *arg;                      /* Completion callback argument */
+	unsigned int len;               /* Bytes written by device */
+	volatile int done;              /* Indicates request completion */
+};
 
 
 typedef struct {
@@ -72,6 +91,50 @@ typedef struct {
 } __attribute__((packed)) virtio_used_t;
 
 
+typedef struct {
+	uint64_t addr;                  /* Buffer physical address */
+	uint32_t len;                   /* Buffer length */
+	uint16_t id;                    /* Buffer ID */
+	uint16_t flags;                 /* Descriptor flags */
+} __attribute__((packed)) virtio_pdesc_t;
+
+
+typedef struct {
+	uint16_t desc;                  /* Event descriptor offset and wrap counter */
+	uint16_t flags;                 /* Notification suppression */
+} __attribute__((packed)) virtio_event_t;
+
+
+typedef struct {
+	void *mem;                      /* Indirect descriptor table memory */
+	addr_t pa;                      /* Indirect descriptor table physical address */
+	unsigned int memsz;             /* Indirect descriptor table memory size */
+} virtqueue_itbl_t;
+
+
+typedef struct {
+	addr_t pa;                      /* Physically contiguous run address */
+	unsigned int len;               /* Physically contiguous run length */
+} virtqueue_run_t;
+
+
+/* Number of virtqueue latency histogram buckets */
+#define VIRTQUEUE_HISTSZ 20
+
+
+typedef struct {
+	unsigned long long enqueued;    /* Enqueued requests */
+	unsigned long long dequeued;    /* Dequeued (processed) requests */
+	unsigned long long kicks;       /* Device notifications sent */
+	unsigned long long suppressed;  /* Device notifications suppressed by device */
+	unsigned long long waits;       /* Enqueues blocked waiting for free descriptors */
+	unsigned long long occupancy;   /* Sum of in-flight requests sampled on each enqueue (average = occupancy / enqueued) */
+	unsigned int inflight;          /* Requests in flight */
+	unsigned int peak;              /* Maximum number of requests in flight */
+	unsigned long long hist[VIRTQUEUE_HISTSZ]; /* Enqueue to dequeue latency histogram (bucket i < 2^i us, last bucket - the rest) */
+} virtqueue_stats_t;
+
+
 typedef struct {
 	/* Standard split virtqueue layout */
 	volatile virtio_desc_t *desc;   /* Descriptors */
@@ -80,23 +143,77 @@ typedef struct {
 	volatile virtio_used_t *used;   /* Used ring */
 	volatile uint16_t *aevent;      /* Avail event notification suppression */
 
+	/* Standard packed virtqueue layout */
+	volatile virtio_pdesc_t *pdesc; /* Descriptors ring */
+	volatile virtio_event_t *drv;   /* Driver event suppression */
+	volatile virtio_event_t *dev;   /* Device event suppression */
+
 	/* Custom helper fields */
-	void **buffs;                   /* Descriptors buffers */
+	void **buffs;                   /* Descriptors buffers (buffer IDs buffers for packed virtqueue) */
+	virtio_req_t **reqs;            /* Descriptor chains requests (buffer IDs requests for packed virtqueue) */
+	uint16_t *ids;                  /* Free buffer IDs list (unused by in-order packed virtqueue), shadow descriptors next links for split virtqueue */
+	uint16_t *nums;                 /* Buffer IDs (descriptor chains for split virtqueue) descriptors count */
+	unsigned int *lens;             /* Descriptor chains (buffer IDs) writable length reported for implicitly used buffers (in-order virtqueue only) */
+	void *ipool;                    /* Preallocated indirect descriptor tables */
+	addr_t ipoolpa;                 /* Preallocated indirect descriptor tables physical address */
+	unsigned int ipoolsz;           /* Preallocated indirect descriptor tables memory size */
+	virtqueue_itbl_t *ibig;         /* Oversized indirect descriptor tables (allocated on demand) */
+	virtqueue_run_t *runs;          /* Enqueued request physical runs (segments split at page boundaries, grown on demand) */
+	unsigned int runsz;             /* Physical runs table size */
 	void *mem;                      /* Allocated virtqueue memory */
+	addr_t mempa;                   /* Allocated virtqueue memory physical address */
 	unsigned int memsz;             /* Allocated virtqueue memory size */
 	unsigned int idx;               /* Virtqueue index */
 	unsigned int size;              /* Virtqueue size */
-	unsigned int noffs;             /* Virtqueue notification area offset (modern VirtIO PCI device only) */
+	unsigned int noffs;             /* Virtqueue notification register offset (modern VirtIO PCI device only) */
 	unsigned int nfree;             /* Number of free descriptors */
-	uint16_t free;                  /* Next free desriptor index */
+	unsigned int nwait;             /* Number of threads waiting for free descriptors */
+	unsigned int nsync;             /* Number of threads waiting for requests completion */
+	uint16_t free;                  /* Next free desriptor index (buffer ID for packed virtqueue), head of shadow free list */
 	uint16_t last;                  /* Last processed request index */
+	uint16_t next;                  /* Next available descriptor index (packed virtqueue only) */
+	uint16_t added;                 /* Requests (descriptors for packed virtqueue) added since last notification */
+	unsigned char packed;           /* Packed virtqueue layout */
+	unsigned char awrap;            /* Avail ring wrap counter (packed virtqueue only) */
+	unsigned char uwrap;            /* Used ring wrap counter (packed virtqueue only) */
+	unsigned char delayed;          /* Delayed interrupt requested (event index only) */
+	unsigned char inorder;          /* Descriptors are used in order (recycled in bulk without descriptor chains walk) */
+	unsigned char batch;            /* In-order used batch is being processed (device may report only last buffer of batch) */
+	uint16_t bid;                   /* In-order used batch last descriptor chain (buffer ID) */
+	unsigned int blen;              /* In-order used batch last buffer used length */
+	unsigned char broken;           /* Device used buffer which isn't in flight (requests aren't enqueued and dequeued anymore) */
+
+	/* Telemetry */
+	virtqueue_stats_t stats;        /* Virtqueue statistics */
+	time_t *stamps;                 /* Requests enqueue times (per descriptor chain/buffer ID, NULL if latency isn't measured) */
 
 	/* Synchronization */
 	handle_t cond;                  /* Free descriptors condition variable */
+	handle_t dcond;                 /* Requests completion condition variable */
 	handle_t lock;                  /* Virtqueue mutex */
 } virtqueue_t;
 
 
+typedef struct {
+	/* Tunables */
+	unsigned int budget;            /* Maximum number of requests completed per virtqueue in single polling round (0 - no limit) */
+	time_t timeout;                 /* Polling window without completions before falling back to interrupts [us] */
+	time_t backoff;                 /* Delay between polling rounds while device is processing requests without interrupts [us] */
+	unsigned int weight;            /* Maximum number of polling rounds with completions before yielding to other devices (0 - no limit) */
+	unsigned char irq;              /* Fall back to interrupts when idle (0 - sleep until all requests are completed) */
+	unsigned char resched;          /* Polling yielded before going idle, has to be resumed */
+
+	/* Counters */
+	unsigned long long rounds;      /* Polling rounds */
+	unsigned long long empty;       /* Polling rounds without completions */
+	unsigned long long exhausted;   /* Polling rounds that used up whole budget of a virtqueue */
+	unsigned long long completed;   /* Completed requests */
+	unsigned long long polled;      /* Requests completed by polling (after first round) */
+	unsigned long long idles;       /* Fallbacks to interrupts (or sleep) */
+	unsigned long long yields;      /* Polling yielded due to weight limit */
+} virtqueue_poll_t;
+
+
 typedef struct {
 	void *addr;                     /* Base register address */
 	size_t len;                     /* Registers memory length */
@@ -115,12 +232,36 @@ typedef struct {
 } virtio_devinfo_t;
 
 
+typedef struct _virtio_ops_t virtio_ops_t;
+
+
 typedef struct {
 	virtio_devinfo_t info;          /* VirtIO device core data */
 	uint64_t features;              /* VirtIO device features */
+	const virtio_ops_t *ops;        /* VirtIO transport operations (resolved by virtio_initDev()) */
 } virtio_dev_t;
 
 
+typedef struct _virtio_client_t virtio_client_t;
+
+
+struct _virtio_client_t {
+	/* Completion service client (filled by driver) */
+	virtio_dev_t *vdev;             /* Serviced VirtIO device */
+	virtqueue_t **vqs;              /* Serviced virtqueues */
+	unsigned int nvqs;              /* Number of serviced virtqueues */
+	virtqueue_poll_t poll;          /* Adaptive completion polling (poll.irq selects interrupt driven device) */
+	void (*config)(virtio_client_t *client); /* Configuration change handler (optional) */
+	void *arg;                      /* Driver argument */
+
+	/* Completion service internals */
+	void *srv;                      /* Servicing thread */
+	virtio_client_t *next;          /* Next device serviced by the same thread */
+	volatile unsigned int isr;      /* Pending interrupt status */
+	handle_t inth;                  /* Interrupt handle */
+};
+
+
 typedef struct {
 	unsigned char reset;            /* Indicates that context needs reset */
 	unsigned char ctx[32];          /* VirtIO device detection context */
@@ -141,10 +282,70 @@ static inline int virtio_modern(virtio_dev_t *vdev)
 }
 
 
-/* VirtIO memory barrier */
+/* VirtIO packed virtqueue layout negotiated */
+static inline int virtio_packed(virtio_dev_t *vdev)
+{
+	return !!(vdev->features & (1ULL << 34));
+}
+
+
+/* VirtIO indirect descriptors negotiated */
+static inline int virtio_indirect(virtio_dev_t *vdev)
+{
+	return !!(vdev->features & (1ULL << 28));
+}
+
+
+/* VirtIO event index notification suppression negotiated */
+static inline int virtio_eventIdx(virtio_dev_t *vdev)
+{
+	return !!(vdev->features & (1ULL << 29));
+}
+
+
+/* VirtIO in-order buffers use negotiated */
+static inline int virtio_inOrder(virtio_dev_t *vdev)
+{
+	return !!(vdev->features & (1ULL << 35));
+}
+
+
+/* VirtIO full memory barrier (orders all ring and device registers accesses) */
 static inline void virtio_mb(void)
 {
+	__sync_synchronize();
+}
+
+
+/* VirtIO read memory barrier (orders ring reads) */
+static inline void virtio_rmb(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	/* Loads aren't reordered with other loads */
+	__asm__ __volatile__("" ::: "memory");
+#elif defined(__riscv)
+	__asm__ __volatile__("fence r, r" ::: "memory");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("dmb ishld" ::: "memory");
+#else
+	__sync_synchronize();
+#endif
+}
+
+
+/* VirtIO write memory barrier (orders ring writes) */
+static inline void virtio_wmb(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	/* Stores aren't reordered with other stores */
 	__asm__ __volatile__("" ::: "memory");
+#elif defined(__riscv)
+	__asm__ __volatile__("fence w, w" ::: "memory");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("dmb ishst" ::: "memory");
+#else
+	__sync_synchronize();
+#endif
 }
 
 
@@ -202,18 +403,59 @@ extern void virtqueue_enableIRQ(virtio_dev_t *vdev, virtqueue_t *vq);
 extern void virtqueue_disableIRQ(virtio_dev_t *vdev, virtqueue_t *vq);
 
 
-/* Enqueues request in virtqueue */
+/* Requests virtqueue interrupt after n processed requests (falls back to virtqueue_enableIRQ() without event index) */
+extern void virtqueue_delayIRQ(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int n);
+
+
+/* Enqueues request in virtqueue (segments are split at page boundaries, each physically contiguous run takes one descriptor) */
 extern int virtqueue_enqueue(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t *req);
 
 
+/* Enqueues requests in virtqueue and exposes them to device at once, returns number of enqueued requests (device has to be notified by caller) */
+/* Requests are enqueued in order until first failure, short count means reqs[ret] and following requests weren't enqueued (caller has to check it), error is returned only if no request was enqueued */
+extern int virtqueue_enqueueBatch(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t **reqs, unsigned int n);
+
+
 /* Notifies device of available requests */
 extern void virtqueue_notify(virtio_dev_t *vdev, virtqueue_t *vq);
 
 
+/* Checks if virtqueue has requests pending */
+extern int virtqueue_busy(virtio_dev_t *vdev, virtqueue_t *vq);
+
+
 /* Dequeues request from virtqueue (returns request head buffer) */
 extern void *virtqueue_dequeue(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int *len);
 
 
+/* Dequeues up to n requests from virtqueue (returns number of dequeued requests, their head buffers and written bytes) */
+extern int virtqueue_dequeueBulk(virtio_dev_t *vdev, virtqueue_t *vq, void **buffs, unsigned int *lens, unsigned int n);
+
+
+/* Completes processed requests (invokes completion callbacks, wakes up synchronous waiters), returns number of completed requests */
+extern int virtqueue_complete(virtio_dev_t *vdev, virtqueue_t *vq);
+
+
+/* Initializes adaptive completion polling context (default tunables, zeroed counters) */
+extern void virtqueue_pollInit(virtqueue_poll_t *poll);
+
+
+/* Completes processed requests of virtqueues, polls while completions keep arriving, enables interrupts when idle (returns number of completed requests, sets poll->resched if yielded) */
+extern int virtqueue_poll(virtio_dev_t *vdev, virtqueue_t **vqs, unsigned int n, virtqueue_poll_t *poll);
+
+
+/* Waits for completion of request without completion callback (timeout in us, 0 waits infinitely) */
+extern int virtqueue_wait(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t *req, time_t timeout);
+
+
+/* Reads virtqueue statistics (optionally resets them, requests in flight count is kept) */
+extern void virtqueue_stats(virtqueue_t *vq, virtqueue_stats_t *stats, int reset);
+
+
+/* Enables/disables requests latency measurement (takes timestamp per enqueued and dequeued requests batch) */
+extern int virtqueue_timing(virtqueue_t *vq, int enable);
+
+
 /* Destroys virtqueue */
 extern void virtqueue_destroy(virtio_dev_t *vdev, virtqueue_t *vq);
 
@@ -222,6 +464,43 @@ extern void virtqueue_destroy(virtio_dev_t *vdev, virtqueue_t *vq);
 extern int virtqueue_init(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int idx, unsigned int size);
 
 
+/* Allocates zeroed physically contiguous DMA memory (returns its physical address in pa if not NULL) */
+extern void *virtio_memAlloc(size_t size, addr_t *pa);
+
+
+/* Releases DMA memory (size has to match allocation size) */
+extern void virtio_memFree(void *va, size_t size);
+
+
+/* Returns DMA memory physical address */
+extern addr_t virtio_memPA(void *va);
+
+
+/* Registers DMA memory region (caches its physical layout, buffers within region are translated without syscalls) */
+extern int virtio_bufRegister(virtio_buf_t *buf, void *va, size_t len);
+
+
+/* Unregisters DMA memory region */
+extern void virtio_bufUnregister(virtio_buf_t *buf);
+
+
+/* Returns physical address of registered region buffer */
+extern uint64_t virtio_bufPA(const virtio_buf_t *buf, const void *va);
+
+
+/* Registers device in completion service (processed requests are completed through request callbacks and synchronous waits) */
+/* Callbacks run on shared service thread stack (VIRTIOSRV_STACKSZ, 32 KiB by default), they shouldn't block or use more than 16 KiB of stack */
+extern int virtio_register(virtio_client_t *client);
+
+
+/* Unregisters device from completion service (waits for device servicing to finish) */
+extern void virtio_unregister(virtio_client_t *client);
+
+
+/* Wakes up completion service after requests submission (device without interrupts) */
+extern void virtio_wakeup(virtio_client_t *client);
+
+
 /* Reads from VirtIO device configuration space */
 extern uint8_t virtio_readConfig8(virtio_dev_t *vdev, unsigned int reg);
 
@@ -256,6 +535,10 @@ extern uint64_t virtio_readFeatures(virtio_dev_t *vdev);
 extern int virtio_writeFeatures(virtio_dev_t *vdev, uint64_t features);
 
 
+/* Excludes device features from negotiation (e.g. transport features accepted by default), has to be called before virtio_writeFeatures() */
+extern void virtio_dropFeatures(virtio_dev_t *vdev, uint64_t features);
+
+
 /* Reads VirtIO device status register */
 extern uint8_t virtio_readStatus(virtio_dev_t *vdev);
 
@@ -272,6 +555,10 @@ extern unsigned int virtio_isr(virtio_dev_t *vdev);
 extern void virtio_reset(virtio_dev_t *vdev);
 
 
+/* Returns loopback device scanout memory (NULL if scanout isn't set, 32bpp pixels) */
+extern void *virtio_loopScanout(virtio_dev_t *vdev, unsigned int *width, unsigned int *height);
+
+
 /* Destroys VirtIO device */
 extern void virtio_destroyDev(virtio_dev_t *vdev);
 
@@ -284,11 +571,11 @@ extern int virtio_initDev(virtio_dev_t *vdev);
 extern int virtio_find(const virtio_devinfo_t *info, virtio_dev_t *vdev, virtio_ctx_t *vctx);
 
 
-/* Destroys VirtIO library */
+/* Destroys VirtIO library (shared state is destroyed by last user) */
 extern void virtio_done(void);
 
 
-/* Initializes VirtIO library */
+/* Initializes VirtIO library (may be called by multiple drivers, each call has to be paired with virtio_done()) */
 extern int virtio_init(void);
 
 
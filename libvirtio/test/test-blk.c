@@ -0,0 +1,269 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO library test (VirtIO block driver test on loopback device)
+ *
+ * Copyright 2021 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include <libvirtioblk.h>
+
+#include "test.h"
+
+
+/* Tested disk region size (region contents are mirrored in memory) */
+#define TEST_BLKSZ (1024 * 1024)
+
+
+/* Number of unaligned read and write rounds */
+#define TEST_BLKROUNDS 256
+
+
+/* Maximum unaligned request length */
+#define TEST_BLKLEN (64 * 1024)
+
+
+/* Number of asynchronous requests batch */
+#define TEST_BLKREQS 64
+
+
+static volatile unsigned int test_blkdone;
+
+
+/* Counts completed asynchronous requests */
+static void test_blkcb(virtioblk_req_t *req)
+{
+	__sync_fetch_and_add(&test_blkdone, 1);
+}
+
+
+/* Reads back disk region and compares it with its memory copy */
+static int test_blkcheck(virtioblk_t *blk, const uint8_t *disk, uint8_t *buff, off_t offs, size_t len)
+{
+	ssize_t ret;
+
+	memset(buff, 0, len);
+	if ((ret = virtioblk_read(blk, offs, buff, len)) != len) {
+		fprintf(stderr, "test_libvirtio: block read at %lld (%zu bytes) failed (%zd)\n", (long long)offs, len, ret);
+		return (ret < 0) ? ret : -EIO;
+	}
+
+	if (memcmp(buff, disk + offs, len)) {
+		fprintf(stderr, "test_libvirtio: block read at %lld (%zu bytes) data mismatch\n", (long long)offs, len);
+		return -EIO;
+	}
+
+	return EOK;
+}
+
+
+/* Writes and reads back data at unaligned offsets from unaligned buffers */
+static int test_blkrw(virtioblk_t *blk, uint8_t *disk, uint8_t *buff)
+{
+	unsigned int i;
+	size_t len;
+	ssize_t ret;
+	off_t offs;
+	int err;
+
+	for (i = 0; i < TEST_BLKROUNDS; i++) {
+		len = 1 + rand() % TEST_BLKLEN;
+		offs = rand() % (TEST_BLKSZ - len);
+
+		memmove(disk + offs, buff + TEST_BLKSZ + i % 8, len);
+		if ((ret = virtioblk_write(blk, offs, buff + TEST_BLKSZ + i % 8, len)) != len) {
+			fprintf(stderr, "test_libvirtio: block write at %lld (%zu bytes) failed (%zd)\n", (long long)offs, len, ret);
+			return (ret < 0) ? ret : -EIO;
+		}
+
+		len = 1 + rand() % TEST_BLKLEN;
+		offs = rand() % (TEST_BLKSZ - len);
+
+		if ((err = test_blkcheck(blk, disk, buff + 7 - i % 8, offs, len)) < 0)
+			return err;
+	}
+
+	return EOK;
+}
+
+
+/* Submits asynchronous write requests (adjacent requests are merged), reads back written sectors */
+static int test_blksubmit(virtioblk_t *blk, uint8_t *disk, uint8_t *buff)
+{
+	static virtioblk_req_t reqs[TEST_BLKREQS];
+	virtioblk_req_t *preqs[TEST_BLKREQS];
+	unsigned int i, n;
+	time_t start, now;
+	uint64_t sector;
+
+	test_blkdone = 0;
+
+	/* Runs of 8 adjacent requests of varying length separated by single sector gaps */
+	for (i = 0, sector = 0; i < TEST_BLKREQS; i++) {
+		reqs[i].op = vblkWRITE;
+		reqs[i].sector = sector;
+		reqs[i].buff = buff + TEST_BLKSZ + i;
+		reqs[i].len = (1 + i % 5) * VIRTIOBLK_SECTSZ;
+		reqs[i].cb = test_blkcb;
+		reqs[i].arg = NULL;
+		preqs[i] = &reqs[i];
+
+		memcpy(disk + sector * VIRTIOBLK_SECTSZ, reqs[i].buff, reqs[i].len);
+		sector += reqs[i].len / VIRTIOBLK_SECTSZ + ((i % 8) == 7);
+	}
+
+	for (i = 0; i < TEST_BLKREQS; i += n) {
+		if ((n = virtioblk_submit(blk, preqs + i, TEST_BLKREQS - i)) == 0) {
+			fprintf(stderr, "test_libvirtio: block requests submission failed\n");
+			return -EIO;
+		}
+	}
+
+	gettime(&start, NULL);
+	while (test_blkdone < TEST_BLKREQS) {
+		virtioblk_poll(blk);
+
+		gettime(&now, NULL);
+		if (now - start > 1000000) {
+			fprintf(stderr, "test_libvirtio: block requests completion timeout\n");
+			return -ETIMEDOUT;
+		}
+	}
+
+	for (i = 0; i < TEST_BLKREQS; i++) {
+		if (reqs[i].err < 0) {
+			fprintf(stderr, "test_libvirtio: block request %u failed (%d)\n", i, reqs[i].err);
+			return reqs[i].err;
+		}
+	}
+
+	return test_blkcheck(blk, disk, buff, 0, sector * VIRTIOBLK_SECTSZ);
+}
+
+
+/* Checks flush, discard and requests exceeding device size */
+static int test_blkops(virtioblk_t *blk, virtioblk_info_t *info, uint8_t *disk, uint8_t *buff)
+{
+	virtioblk_req_t req, *preq = &req;
+	ssize_t ret;
+	int err;
+
+	if (info->flush && ((err = virtioblk_flush(blk)) < 0)) {
+		fprintf(stderr, "test_libvirtio: block flush failed (%d)\n", err);
+		return err;
+	}
+
+	if (info->discard) {
+		if ((err = virtioblk_discard(blk, 4 * VIRTIOBLK_SECTSZ, 16 * VIRTIOBLK_SECTSZ)) < 0) {
+			fprintf(stderr, "test_libvirtio: block discard failed (%d)\n", err);
+			return err;
+		}
+		memset(disk + 4 * VIRTIOBLK_SECTSZ, 0, 16 * VIRTIOBLK_SECTSZ);
+
+		if ((err = test_blkcheck(blk, disk, buff, 0, 24 * VIRTIOBLK_SECTSZ)) < 0)
+			return err;
+	}
+
+	/* Short read at device end */
+	if ((ret = virtioblk_read(blk, info->size - 100, buff, 1000)) != 100) {
+		fprintf(stderr, "test_libvirtio: block read at device end returned %zd\n", ret);
+		return -EIO;
+	}
+
+	if ((ret = virtioblk_write(blk, info->size, buff, 10)) != -ENOSPC) {
+		fprintf(stderr, "test_libvirtio: block write past device end returned %zd\n", ret);
+		return -EIO;
+	}
+
+	req.op = vblkREAD;
+	req.sector = info->size / VIRTIOBLK_SECTSZ;
+	req.buff = buff;
+	req.len = VIRTIOBLK_SECTSZ;
+	req.cb = NULL;
+	req.arg = NULL;
+
+	if ((virtioblk_submit(blk, &preq, 1) != 1) || ((err = virtioblk_wait(blk, &req)) != -EINVAL)) {
+		fprintf(stderr, "test_libvirtio: block request past device end didn't fail\n");
+		return -EIO;
+	}
+
+	return EOK;
+}
+
+
+int test_blk(void)
+{
+	virtioblk_info_t info;
+	uint8_t *disk, *buff;
+	virtioblk_t *blk;
+	unsigned int i;
+	int err;
+
+	if ((err = virtioblk_init()) < 0) {
+		fprintf(stderr, "test_libvirtio: failed to initialize block driver\n");
+		return err;
+	}
+
+	do {
+		if ((err = virtioblk_open(&blk)) < 0) {
+			fprintf(stderr, "test_libvirtio: failed to open loopback block device\n");
+			break;
+		}
+		virtioblk_info(blk, &info);
+
+		/* Disk region memory copy, unaligned buffers space and write data */
+		disk = malloc(TEST_BLKSZ);
+		buff = malloc(2 * TEST_BLKSZ);
+
+		if ((disk == NULL) || (buff == NULL)) {
+			free(disk);
+			free(buff);
+			virtioblk_close(blk);
+			err = -ENOMEM;
+			break;
+		}
+
+		for (i = 0; i < TEST_BLKSZ; i++) {
+			disk[i] = rand();
+			buff[TEST_BLKSZ + i] = rand();
+		}
+
+		printf("test_libvirtio: block device size %llu, %u queues, flush %u, discard %u\n", (unsigned long long)info.size, info.nqueues, info.flush, info.discard);
+
+		do {
+			if ((err = virtioblk_write(blk, 0, disk, TEST_BLKSZ)) != TEST_BLKSZ) {
+				fprintf(stderr, "test_libvirtio: block device region initialization failed\n");
+				err = (err < 0) ? err : -EIO;
+				break;
+			}
+
+			if ((err = test_blkrw(blk, disk, buff)) < 0)
+				break;
+
+			if ((err = test_blksubmit(blk, disk, buff)) < 0)
+				break;
+
+			err = test_blkops(blk, &info, disk, buff);
+		} while (0);
+
+		free(disk);
+		free(buff);
+		virtioblk_close(blk);
+	} while (0);
+
+	virtioblk_done();
+
+	return err;
+}
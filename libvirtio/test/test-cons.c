@@ -0,0 +1,322 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO library test (VirtIO console driver test on loopback device)
+ *
+ * Copyright 2021 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/threads.h>
+
+#include <libvirtiocons.h>
+
+#include "test.h"
+
+
+/* Number of concurrent transmit ring producers */
+#define TEST_CONSTHREADS 4
+
+
+/* Number of records written by each producer */
+#define TEST_CONSRECS 20000
+
+
+/* Producer thread stack size */
+#define TEST_CONSSTACKSZ 4096
+
+
+/* Read and flush timeout [us] */
+#define TEST_CONSTIMEOUT 1000000
+
+
+static struct {
+	virtiocons_t *cons;             /* Tested console device */
+	unsigned int port;              /* Tested port */
+	volatile unsigned int done;     /* Number of finished producers */
+	volatile size_t written;        /* Bytes written by producers */
+	volatile int err;               /* Producers status */
+} test_conscommon;
+
+
+/* Formats producer record (records of varying length pad transmit ring end at different offsets) */
+static int test_consrec(char *rec, unsigned int id, unsigned int seq)
+{
+	return sprintf(rec, "<%u:%u:%.*s>", id, seq, (int)((id * 13 + seq * 7) % 90), "................................................................................................");
+}
+
+
+/* Writes records to transmit ring (retries records dropped due to full ring) */
+static void test_consthr(void *arg)
+{
+	unsigned int seq, id = (unsigned int)(uintptr_t)arg;
+	char rec[128];
+	ssize_t ret;
+	int len;
+
+	for (seq = 0; (seq < TEST_CONSRECS) && (test_conscommon.err == EOK);) {
+		len = test_consrec(rec, id, seq);
+
+		if ((ret = virtiocons_write(test_conscommon.cons, test_conscommon.port, rec, len)) == len) {
+			__sync_fetch_and_add(&test_conscommon.written, len);
+			seq++;
+			continue;
+		}
+
+		if (ret != -ENOSPC) {
+			test_conscommon.err = (ret < 0) ? ret : -EIO;
+			break;
+		}
+		usleep(100);
+	}
+	__sync_fetch_and_add(&test_conscommon.done, 1);
+
+	endthread();
+}
+
+
+/* Reads back records written by concurrent producers (echo drops data not fitting receive buffers), checks records integrity and order */
+static int test_consproducers(virtiocons_t *cons, unsigned int port)
+{
+	static char stack[TEST_CONSTHREADS][TEST_CONSSTACKSZ] __attribute__((aligned(8)));
+	static char data[4096];
+	unsigned int i, id, seq, nthreads = 0, flushed = 0, recs = 0, next[TEST_CONSTHREADS] = { 0 };
+	virtiocons_portinfo_t info;
+	size_t len = 0, offs;
+	char rec[128], *end;
+	uint64_t sent;
+	ssize_t ret;
+	int err;
+
+	if ((err = virtiocons_portInfo(cons, port, &info)) < 0)
+		return err;
+	sent = info.sent;
+
+	test_conscommon.cons = cons;
+	test_conscommon.port = port;
+	test_conscommon.done = 0;
+	test_conscommon.written = 0;
+	test_conscommon.err = EOK;
+
+	for (i = 0; i < TEST_CONSTHREADS; i++, nthreads++) {
+		if ((err = beginthread(test_consthr, 4, stack[i], sizeof(stack[i]), (void *)(uintptr_t)i)) < 0)
+			break;
+	}
+
+	while ((err == EOK) && (test_conscommon.err == EOK)) {
+		if ((ret = virtiocons_read(cons, port, data + len, sizeof(data) - len - 1, TEST_CONSTIMEOUT / 10)) < 0) {
+			fprintf(stderr, "test_libvirtio: console port %u read failed (%zd)\n", port, ret);
+			err = ret;
+			break;
+		}
+
+		/* All records are transmitted and echoed after flush */
+		if (!ret && (test_conscommon.done == nthreads)) {
+			if (flushed++)
+				break;
+
+			if ((err = virtiocons_flush(cons, port, -1)) < 0) {
+				fprintf(stderr, "test_libvirtio: console port %u flush failed (%d)\n", port, err);
+				break;
+			}
+			continue;
+		}
+		len += ret;
+		data[len] = '\0';
+
+		/* Records of each producer are received in order (dropped records leave gaps) */
+		for (offs = 0; (end = strchr(data + offs, '>')) != NULL; offs = end - data + 1, recs++) {
+			if ((sscanf(data + offs, "<%u:%u:", &id, &seq) != 2) || (id >= nthreads) || (seq < next[id]) ||
+				(test_consrec(rec, id, seq) != end - data - offs + 1) || memcmp(rec, data + offs, end - data - offs + 1)) {
+				fprintf(stderr, "test_libvirtio: console port %u corrupted record '%.*s'\n", port, (int)(end - data - offs + 1), data + offs);
+				err = -EIO;
+				break;
+			}
+			next[id] = seq + 1;
+		}
+
+		memmove(data, data + offs, len - offs);
+		len -= offs;
+	}
+
+	/* Producers stop on error */
+	if (err < 0)
+		test_conscommon.err = err;
+
+	for (i = 0; i < nthreads; i++)
+		threadJoin(0);
+
+	if (err < 0)
+		return err;
+
+	if (test_conscommon.err < 0) {
+		fprintf(stderr, "test_libvirtio: console port %u write failed (%d)\n", port, test_conscommon.err);
+		return test_conscommon.err;
+	}
+
+	/* Every buffered record is transmitted */
+	if (((err = virtiocons_portInfo(cons, port, &info)) < 0) || (info.sent - sent != test_conscommon.written) || len) {
+		fprintf(stderr, "test_libvirtio: console port %u sent %llu of %zu bytes\n", port, (unsigned long long)(info.sent - sent), test_conscommon.written);
+		return (err < 0) ? err : -EIO;
+	}
+
+	printf("test_libvirtio: %u producers wrote %zu bytes, %u of %u records echoed\n", nthreads, test_conscommon.written, recs, nthreads * TEST_CONSRECS);
+
+	return EOK;
+}
+
+
+/* Checks flush with 0, positive and infinite timeouts, reads back echoed data */
+static int test_consflush(virtiocons_t *cons, unsigned int port)
+{
+	static char data[4096 + 5], echo[sizeof(data)];
+	unsigned int i;
+	ssize_t ret;
+	int err;
+
+	/* Nothing is buffered */
+	if ((err = virtiocons_flush(cons, port, 0)) < 0) {
+		fprintf(stderr, "test_libvirtio: console port %u flush of empty ring failed (%d)\n", port, err);
+		return err;
+	}
+
+	for (i = 0; i < sizeof(data) - 5; i++)
+		data[i] = 'a' + i % 26;
+	memcpy(data + i, "flush", 5);
+
+	if ((ret = virtiocons_write(cons, port, data, sizeof(data) - 5)) != sizeof(data) - 5) {
+		fprintf(stderr, "test_libvirtio: console port %u write failed (%zd)\n", port, ret);
+		return (ret < 0) ? ret : -EIO;
+	}
+
+	/* Doesn't wait for transmission */
+	if (((err = virtiocons_flush(cons, port, 0)) < 0) && (err != -ETIME)) {
+		fprintf(stderr, "test_libvirtio: console port %u flush without waiting failed (%d)\n", port, err);
+		return err;
+	}
+
+	if ((err = virtiocons_flush(cons, port, TEST_CONSTIMEOUT)) < 0) {
+		fprintf(stderr, "test_libvirtio: console port %u flush failed (%d)\n", port, err);
+		return err;
+	}
+
+	if ((ret = virtiocons_write(cons, port, data + sizeof(data) - 5, 5)) != 5) {
+		fprintf(stderr, "test_libvirtio: console port %u write failed (%zd)\n", port, ret);
+		return (ret < 0) ? ret : -EIO;
+	}
+
+	if ((err = virtiocons_flush(cons, port, -1)) < 0) {
+		fprintf(stderr, "test_libvirtio: console port %u flush failed (%d)\n", port, err);
+		return err;
+	}
+
+	for (i = 0; i < sizeof(echo); i += ret) {
+		if ((ret = virtiocons_read(cons, port, echo + i, sizeof(echo) - i, TEST_CONSTIMEOUT)) <= 0) {
+			fprintf(stderr, "test_libvirtio: console port %u echo read failed (%zd)\n", port, ret);
+			return (ret < 0) ? ret : -ETIMEDOUT;
+		}
+	}
+
+	if (memcmp(echo, data, sizeof(data)) || (virtiocons_read(cons, port, echo, sizeof(echo), 0) != 0)) {
+		fprintf(stderr, "test_libvirtio: console port %u echo data mismatch\n", port);
+		return -EIO;
+	}
+
+	return EOK;
+}
+
+
+/* Checks data exceeding free transmit ring space is dropped without blocking */
+static int test_consoverflow(virtiocons_t *cons, unsigned int port)
+{
+	static char data[4000];
+	virtiocons_portinfo_t info;
+	unsigned int i;
+	int err;
+
+	memset(data, '#', sizeof(data));
+
+	for (i = 0; i < 256; i++)
+		virtiocons_write(cons, port, data, sizeof(data));
+
+	if (((err = virtiocons_portInfo(cons, port, &info)) < 0) || !info.dropped) {
+		fprintf(stderr, "test_libvirtio: console port %u transmit ring overflow not detected\n", port);
+		return (err < 0) ? err : -EIO;
+	}
+
+	/* Drain echoed data */
+	if ((err = virtiocons_flush(cons, port, TEST_CONSTIMEOUT)) < 0) {
+		fprintf(stderr, "test_libvirtio: console port %u flush failed (%d)\n", port, err);
+		return err;
+	}
+	while (virtiocons_read(cons, port, data, sizeof(data), TEST_CONSTIMEOUT / 10) > 0);
+
+	return EOK;
+}
+
+
+int test_cons(void)
+{
+	virtiocons_portinfo_t pinfo;
+	virtiocons_info_t info;
+	virtiocons_t *cons;
+	unsigned int i;
+	int port, err;
+
+	if ((err = virtiocons_init()) < 0) {
+		fprintf(stderr, "test_libvirtio: failed to initialize console driver\n");
+		return err;
+	}
+
+	do {
+		if ((err = virtiocons_open(&cons)) < 0) {
+			fprintf(stderr, "test_libvirtio: failed to open loopback console device\n");
+			break;
+		}
+		virtiocons_info(cons, &info);
+
+		printf("test_libvirtio: console device %u ports, multiport %u\n", info.nports, info.multiport);
+
+		do {
+			/* Named port is added and opened through control messages */
+			for (i = 0; i < 1000; i++) {
+				if (((port = virtiocons_find(cons, "loop1")) >= 0) && (virtiocons_portInfo(cons, port, &pinfo) == EOK) && pinfo.open)
+					break;
+				usleep(1000);
+			}
+
+			if ((i == 1000) || (port != 1) || !pinfo.added || strcmp(pinfo.name, "loop1")) {
+				fprintf(stderr, "test_libvirtio: named console port not found\n");
+				err = -ENOENT;
+				break;
+			}
+
+			if ((err = test_consflush(cons, 0)) < 0)
+				break;
+
+			if ((err = test_consflush(cons, port)) < 0)
+				break;
+
+			if ((err = test_consproducers(cons, port)) < 0)
+				break;
+
+			err = test_consoverflow(cons, port);
+		} while (0);
+
+		virtiocons_close(cons);
+	} while (0);
+
+	virtiocons_done();
+
+	return err;
+}
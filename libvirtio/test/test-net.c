@@ -0,0 +1,247 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO library test (VirtIO network driver test on loopback device)
+ *
+ * Copyright 2021 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libvirtionet.h>
+
+#include "test.h"
+
+
+/* Maximum number of tested queue pairs */
+#define TEST_NETPAIRS 4
+
+
+/* Number of frames transmitted with single send call */
+#define TEST_NETBATCH 16
+
+
+/* Number of round trip rounds per queue pair */
+#define TEST_NETROUNDS 64
+
+
+/* Number of frames queued before deferred kick */
+#define TEST_NETDEFER 8
+
+
+/* Receive timeout [us] */
+#define TEST_NETTIMEOUT 1000000
+
+
+/* Partial checksum (TCP/IP frame layout) start and field offsets */
+#define TEST_NETCSUMSTART 34
+#define TEST_NETCSUMOFFS  16
+
+
+typedef struct {
+	uint8_t data[VIRTIONET_FRAMESZ]; /* Frame data */
+	virtionet_pkt_t pkt;            /* Frame descriptor */
+} test_netframe_t;
+
+
+/* Prepares frame of given length with data depending on queue pair and sequence number */
+static void test_netframe(test_netframe_t *frame, unsigned int q, unsigned int seq, size_t len, unsigned char flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		frame->data[i] = q * 31 + seq * 7 + i;
+	frame->data[0] = q;
+	frame->data[1] = seq;
+
+	frame->pkt.data = frame->data;
+	frame->pkt.len = len;
+	frame->pkt.flags = flags;
+	frame->pkt.csumstart = 0;
+	frame->pkt.csumoffs = 0;
+
+	if (flags & VIRTIONET_CSUM_PARTIAL) {
+		frame->pkt.csumstart = TEST_NETCSUMSTART;
+		frame->pkt.csumoffs = TEST_NETCSUMOFFS;
+		frame->data[TEST_NETCSUMSTART + TEST_NETCSUMOFFS] = 0;
+		frame->data[TEST_NETCSUMSTART + TEST_NETCSUMOFFS + 1] = 0;
+	}
+}
+
+
+/* Checks if ones' complement sum from partial checksum start offset is valid */
+static int test_netcsum(const uint8_t *data, size_t len)
+{
+	uint32_t sum = 0;
+	size_t i;
+
+	for (i = TEST_NETCSUMSTART; i + 1 < len; i += 2)
+		sum += ((uint32_t)data[i] << 8) | data[i + 1];
+	if (i < len)
+		sum += (uint32_t)data[i] << 8;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (sum == 0xffff);
+}
+
+
+/* Receives frames and compares them with transmitted frames */
+static int test_netrecv(virtionet_t *net, unsigned int q, const test_netframe_t *tx, unsigned int n, time_t timeout)
+{
+	static uint8_t bufs[TEST_NETBATCH][VIRTIONET_FRAMESZ];
+	virtionet_pkt_t pkts[TEST_NETBATCH];
+	unsigned int i, j;
+	int ret;
+
+	for (i = 0; i < n; i += ret) {
+		for (j = 0; j < n - i; j++) {
+			pkts[j].data = bufs[j];
+			pkts[j].len = sizeof(bufs[j]);
+		}
+
+		if ((ret = virtionet_recv(net, q, pkts, n - i, timeout)) <= 0) {
+			fprintf(stderr, "test_libvirtio: queue pair %u received %u of %u frames\n", q, i, n);
+			return (ret < 0) ? ret : -ETIMEDOUT;
+		}
+
+		for (j = 0; j < ret; j++) {
+			if (pkts[j].len != tx[i + j].pkt.len) {
+				fprintf(stderr, "test_libvirtio: queue pair %u frame %u length mismatch (%zu, expected %zu)\n", q, i + j, pkts[j].len, tx[i + j].pkt.len);
+				return -EIO;
+			}
+
+			/* Checksum field is filled by device */
+			if (tx[i + j].pkt.flags & VIRTIONET_CSUM_PARTIAL) {
+				if (!test_netcsum(bufs[j], pkts[j].len)) {
+					fprintf(stderr, "test_libvirtio: queue pair %u frame %u invalid checksum\n", q, i + j);
+					return -EIO;
+				}
+				memcpy(bufs[j] + TEST_NETCSUMSTART + TEST_NETCSUMOFFS, tx[i + j].data + TEST_NETCSUMSTART + TEST_NETCSUMOFFS, 2);
+			}
+
+			if (memcmp(bufs[j], tx[i + j].data, pkts[j].len)) {
+				fprintf(stderr, "test_libvirtio: queue pair %u frame %u data mismatch\n", q, i + j);
+				return -EIO;
+			}
+		}
+	}
+
+	return EOK;
+}
+
+
+/* Loops back frames of varying length (mergeable receive buffers) with and without partial checksums through all queue pairs */
+static int test_netpairs(virtionet_t *net, unsigned int npairs)
+{
+	static test_netframe_t frames[TEST_NETPAIRS][TEST_NETBATCH];
+	virtionet_pkt_t pkts[TEST_NETBATCH];
+	unsigned int i, j, q;
+	int ret, err;
+
+	for (i = 0; i < TEST_NETROUNDS; i++) {
+		/* Transmit through all pairs before receiving (frames can't leak into other pairs) */
+		for (q = 0; q < npairs; q++) {
+			for (j = 0; j < TEST_NETBATCH; j++) {
+				test_netframe(&frames[q][j], q, i * TEST_NETBATCH + j, 60 + rand() % (VIRTIONET_FRAMESZ - 59), (j % 2) ? VIRTIONET_CSUM_PARTIAL : 0);
+				pkts[j] = frames[q][j].pkt;
+			}
+
+			if ((ret = virtionet_send(net, q, pkts, TEST_NETBATCH, 0)) != TEST_NETBATCH) {
+				fprintf(stderr, "test_libvirtio: queue pair %u sent %d of %u frames\n", q, ret, TEST_NETBATCH);
+				return (ret < 0) ? ret : -EIO;
+			}
+		}
+
+		for (q = 0; q < npairs; q++) {
+			if ((err = test_netrecv(net, q, frames[q], TEST_NETBATCH, TEST_NETTIMEOUT)) < 0)
+				return err;
+		}
+	}
+
+	return EOK;
+}
+
+
+/* Queues frames without notifying device, checks they are transmitted after kick */
+static int test_netkick(virtionet_t *net, unsigned int q)
+{
+	static test_netframe_t frames[TEST_NETDEFER];
+	static uint8_t buff[VIRTIONET_FRAMESZ];
+	virtionet_pkt_t pkt;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < TEST_NETDEFER; i++) {
+		test_netframe(&frames[i], q, i, 60 + i * 100, 0);
+
+		if ((ret = virtionet_send(net, q, &frames[i].pkt, 1, 1)) != 1) {
+			fprintf(stderr, "test_libvirtio: queue pair %u deferred send failed (%d)\n", q, ret);
+			return (ret < 0) ? ret : -EIO;
+		}
+	}
+
+	pkt.data = buff;
+	pkt.len = sizeof(buff);
+	if ((ret = virtionet_recv(net, q, &pkt, 1, TEST_NETTIMEOUT / 10)) != 0) {
+		fprintf(stderr, "test_libvirtio: queue pair %u frames transmitted before kick\n", q);
+		return (ret < 0) ? ret : -EIO;
+	}
+
+	virtionet_kick(net, q);
+
+	return test_netrecv(net, q, frames, TEST_NETDEFER, TEST_NETTIMEOUT);
+}
+
+
+int test_net(void)
+{
+	virtionet_info_t info;
+	virtionet_t *net;
+	unsigned int q;
+	int err;
+
+	if ((err = virtionet_init()) < 0) {
+		fprintf(stderr, "test_libvirtio: failed to initialize network driver\n");
+		return err;
+	}
+
+	do {
+		if ((err = virtionet_open(&net)) < 0) {
+			fprintf(stderr, "test_libvirtio: failed to open loopback network device\n");
+			break;
+		}
+		virtionet_info(net, &info);
+
+		printf("test_libvirtio: network device %u queue pairs, link %u, csum %u, rxcsum %u, mrg %u\n", info.npairs, info.link, info.csum, info.rxcsum, info.mrg);
+
+		do {
+			if ((info.npairs < 2) || !info.csum || !info.mrg) {
+				fprintf(stderr, "test_libvirtio: loopback network device features not negotiated\n");
+				err = -ENOTSUP;
+				break;
+			}
+
+			if ((err = test_netpairs(net, (info.npairs < TEST_NETPAIRS) ? info.npairs : TEST_NETPAIRS)) < 0)
+				break;
+
+			for (q = 0; (q < info.npairs) && (err == EOK); q++)
+				err = test_netkick(net, q);
+		} while (0);
+
+		virtionet_close(net);
+	} while (0);
+
+	virtionet_done();
+
+	return err;
+}
@@ -0,0 +1,628 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO library test (virtqueue regression test, benchmark and drivers tests on loopback devices)
+ *
+ * Copyright 2021 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <libvirtio.h>
+
+#include "test.h"
+
+
+/* Virtqueue size (smaller than test batches, enqueue has to wait for free descriptors) */
+#define TEST_QSIZE 64
+
+
+/* Number of requests per batch */
+#define TEST_BATCH 48
+
+
+/* Number of regression test rounds (each round writes and reads back one batch) */
+#define TEST_ROUNDS 64
+
+
+/* Maximum request data length (in sectors) */
+#define TEST_SECTORS 9
+
+
+/* Number of multiple page buffers test rounds */
+#define TEST_PAGEROUNDS 32
+
+
+/* Maximum multiple page buffer length (in pages) */
+#define TEST_PAGES 8
+
+
+/* Number of benchmark requests */
+#define TEST_BENCHREQS 200000
+
+
+/* Number of GPU benchmark commits */
+#define TEST_COMMITS 20000
+
+
+/* GPU benchmark resource size */
+#define TEST_GPUW 64
+#define TEST_GPUH 64
+
+
+/* Tested virtqueue variants (transport features excluded from negotiation) */
+static const struct {
+	const char *name;               /* Variant name */
+	uint64_t drop;                  /* Dropped features */
+} test_variants[] = {
+	{ "split", (1ULL << 35) | (1ULL << 34) | (1ULL << 29) | (1ULL << 28) },
+	{ "split indirect event-idx", (1ULL << 35) | (1ULL << 34) },
+	{ "split in-order indirect", (1ULL << 34) | (1ULL << 29) },
+	{ "packed", (1ULL << 35) | (1ULL << 29) | (1ULL << 28) },
+	{ "packed indirect event-idx", (1ULL << 35) },
+	{ "packed in-order indirect", (1ULL << 29) },
+	{ "packed in-order", (1ULL << 29) | (1ULL << 28) }
+};
+
+
+typedef struct {
+	uint32_t type;                  /* Request type */
+	uint32_t prio;                  /* Request priority */
+	uint64_t sector;                /* Starting sector */
+} __attribute__((packed)) test_blkhdr_t;
+
+
+typedef struct {
+	test_blkhdr_t hdr;              /* Request header */
+	uint8_t status;                 /* Request status */
+	virtio_seg_t segs[3];           /* Header, data and status segments */
+	virtio_req_t vreq;              /* VirtIO request */
+} test_blkreq_t;
+
+
+typedef struct {
+	uint8_t cmd[64];                /* Command buffer */
+	uint8_t resp[64];               /* Response buffer */
+	virtio_seg_t segs[2];           /* Command and response segments */
+	virtio_req_t vreq;              /* VirtIO request */
+} test_gpureq_t;
+
+
+typedef struct {
+	virtio_dev_t vdev;              /* Loopback device */
+	virtqueue_t vq;                 /* Tested virtqueue */
+	virtqueue_t *vqs[1];            /* Serviced virtqueues */
+	virtio_client_t client;         /* Completion service client */
+} test_dev_t;
+
+
+/* Returns time elapsed since start [us] */
+static time_t test_elapsed(time_t start)
+{
+	time_t now;
+
+	gettime(&now, NULL);
+
+	return now - start;
+}
+
+
+/* Detects and initializes loopback device with single virtqueue (without dropped features) */
+static int test_open(test_dev_t *dev, unsigned int id, uint64_t drop)
+{
+	virtio_devinfo_t info = { .type = vdevLOOP, .id = id };
+	virtio_ctx_t vctx = { .reset = 1 };
+	virtio_dev_t *vdev = &dev->vdev;
+	int err;
+
+	if ((err = virtio_find(&info, vdev, &vctx)) < 0)
+		return err;
+
+	if ((err = virtio_initDev(vdev)) < 0)
+		return err;
+
+	do {
+		/* Only transport features are negotiated */
+		virtio_dropFeatures(vdev, drop);
+		if ((err = virtio_writeFeatures(vdev, 0)) < 0)
+			break;
+
+		if ((err = virtqueue_init(vdev, &dev->vq, 0, TEST_QSIZE)) < 0)
+			break;
+
+		dev->vqs[0] = &dev->vq;
+		dev->client.vdev = vdev;
+		dev->client.vqs = dev->vqs;
+		dev->client.nvqs = 1;
+		dev->client.config = NULL;
+		dev->client.arg = dev;
+		virtqueue_pollInit(&dev->client.poll);
+
+		if ((err = virtio_register(&dev->client)) < 0) {
+			virtqueue_destroy(vdev, &dev->vq);
+			break;
+		}
+
+		virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 2));
+
+		return EOK;
+	} while (0);
+
+	virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 7));
+	virtio_destroyDev(vdev);
+
+	return err;
+}
+
+
+/* Destroys loopback device */
+static void test_close(test_dev_t *dev)
+{
+	virtio_unregister(&dev->client);
+	virtio_reset(&dev->vdev);
+	virtqueue_destroy(&dev->vdev, &dev->vq);
+	virtio_destroyDev(&dev->vdev);
+}
+
+
+/* Prepares block request (data and len are ignored for requests without data) */
+static void test_blkreq(test_dev_t *dev, test_blkreq_t *req, uint32_t type, uint64_t sector, void *data, unsigned int len)
+{
+	unsigned int i = 0, j;
+
+	req->hdr.type = virtio_gtov32(&dev->vdev, type);
+	req->hdr.prio = 0;
+	req->hdr.sector = virtio_gtov64(&dev->vdev, sector);
+	req->status = 0xff;
+
+	req->segs[i].buff = &req->hdr;
+	req->segs[i].len = sizeof(req->hdr);
+	req->segs[i++].buf = NULL;
+
+	if (len) {
+		req->segs[i].buff = data;
+		req->segs[i].len = len;
+		req->segs[i++].buf = NULL;
+	}
+
+	req->segs[i].buff = &req->status;
+	req->segs[i].len = sizeof(req->status);
+	req->segs[i++].buf = NULL;
+
+	/* Circular segments list */
+	for (j = 0; j < i; j++) {
+		req->segs[j].next = &req->segs[(j + 1) % i];
+		req->segs[j].prev = &req->segs[(j + i - 1) % i];
+	}
+
+	req->vreq.segs = req->segs;
+	req->vreq.rsegs = (type == 0) ? 1 : i - 1;
+	req->vreq.wsegs = i - req->vreq.rsegs;
+	req->vreq.cb = NULL;
+	req->vreq.arg = req;
+}
+
+
+/* Submits block requests batch and waits for their completion */
+static int test_blkbatch(test_dev_t *dev, test_blkreq_t *reqs, unsigned int n)
+{
+	virtio_req_t *vreqs[TEST_BATCH];
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < n; i++)
+		vreqs[i] = &reqs[i].vreq;
+
+	for (i = 0; i < n; i += ret) {
+		if ((ret = virtqueue_enqueueBatch(&dev->vdev, &dev->vq, vreqs + i, n - i)) <= 0)
+			return (ret < 0) ? ret : -EIO;
+		virtqueue_notify(&dev->vdev, &dev->vq);
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((ret = virtqueue_wait(&dev->vdev, &dev->vq, vreqs[i], 1000000)) < 0)
+			return ret;
+	}
+
+	return EOK;
+}
+
+
+/* Writes and reads back data through block device virtqueue (unaligned buffers spanning pages, batches exceeding virtqueue size) */
+static int test_rings(test_dev_t *dev)
+{
+	static test_blkreq_t reqs[TEST_BATCH];
+	uint8_t *wbuf, *rbuf, *w, *r;
+	unsigned int i, j, len, offs;
+	uint64_t sector = 0;
+	int err = EOK;
+
+	if ((wbuf = malloc(TEST_BATCH * TEST_SECTORS * 512 + TEST_BATCH * 8)) == NULL)
+		return -ENOMEM;
+
+	if ((rbuf = malloc(TEST_BATCH * TEST_SECTORS * 512 + TEST_BATCH * 8)) == NULL) {
+		free(wbuf);
+		return -ENOMEM;
+	}
+
+	for (i = 0; (i < TEST_ROUNDS) && (err == EOK); i++) {
+		for (j = 0; j < TEST_BATCH * TEST_SECTORS * 512 + TEST_BATCH * 8; j++)
+			wbuf[j] = rand();
+		memset(rbuf, 0, TEST_BATCH * TEST_SECTORS * 512 + TEST_BATCH * 8);
+
+		/* Write requests of varying length at odd buffer offsets */
+		for (j = 0, offs = 0; j < TEST_BATCH; j++, offs += len + 8) {
+			len = (1 + (i + j) % TEST_SECTORS) * 512;
+			test_blkreq(dev, &reqs[j], 1, sector + j * TEST_SECTORS, wbuf + offs + (j % 8), len);
+		}
+
+		if ((err = test_blkbatch(dev, reqs, TEST_BATCH)) < 0)
+			break;
+
+		for (j = 0; j < TEST_BATCH; j++) {
+			if ((reqs[j].status != 0) || (reqs[j].vreq.len != 1)) {
+				fprintf(stderr, "test_libvirtio: write %u/%u failed (status %d, len %u)\n", i, j, reqs[j].status, reqs[j].vreq.len);
+				err = -EIO;
+				break;
+			}
+		}
+
+		if (err < 0)
+			break;
+
+		/* Read back into differently aligned buffers */
+		for (j = 0, offs = 0; j < TEST_BATCH; j++, offs += len + 8) {
+			len = (1 + (i + j) % TEST_SECTORS) * 512;
+			test_blkreq(dev, &reqs[j], 0, sector + j * TEST_SECTORS, rbuf + offs + (7 - j % 8), len);
+		}
+
+		if ((err = test_blkbatch(dev, reqs, TEST_BATCH)) < 0)
+			break;
+
+		for (j = 0, offs = 0; j < TEST_BATCH; j++, offs += len + 8) {
+			len = (1 + (i + j) % TEST_SECTORS) * 512;
+			w = wbuf + offs + (j % 8);
+			r = rbuf + offs + (7 - j % 8);
+
+			if ((reqs[j].status != 0) || (reqs[j].vreq.len != len + 1) || memcmp(w, r, len)) {
+				fprintf(stderr, "test_libvirtio: read %u/%u failed (status %d, len %u)\n", i, j, reqs[j].status, reqs[j].vreq.len);
+				err = -EIO;
+				break;
+			}
+		}
+
+		sector = (sector + TEST_BATCH * TEST_SECTORS) % (1 << 14);
+	}
+
+	free(rbuf);
+	free(wbuf);
+
+	return err;
+}
+
+
+/* Counts physically discontiguous (split) and adjacent (merged) page boundaries of buffer */
+static void test_pageruns(const uint8_t *buff, unsigned int len, unsigned int *split, unsigned int *merged)
+{
+	uintptr_t va;
+
+	for (va = ((uintptr_t)buff & ~(_PAGE_SIZE - 1)) + _PAGE_SIZE; va < (uintptr_t)buff + len; va += _PAGE_SIZE) {
+		if (va2pa((void *)va) == va2pa((void *)(va - _PAGE_SIZE)) + _PAGE_SIZE)
+			(*merged)++;
+		else
+			(*split)++;
+	}
+}
+
+
+/* Writes and reads back unregistered buffers spanning multiple pages (segments are split into physically contiguous runs) */
+static int test_pages(test_dev_t *dev)
+{
+	static test_blkreq_t reqs[2];
+	unsigned int i, j, len, split = 0, merged = 0;
+	uint8_t *wbuf, *rbuf, *w, *r;
+	int err = EOK;
+
+	if ((wbuf = malloc((TEST_PAGES + 2) * _PAGE_SIZE)) == NULL)
+		return -ENOMEM;
+
+	if ((rbuf = malloc((TEST_PAGES + 2) * _PAGE_SIZE)) == NULL) {
+		free(wbuf);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < TEST_PAGEROUNDS; i++) {
+		for (j = 0; j < (TEST_PAGES + 2) * _PAGE_SIZE; j++)
+			wbuf[j] = rand();
+		memset(rbuf, 0, (TEST_PAGES + 2) * _PAGE_SIZE);
+
+		/* At least 4 pages long buffers at varying page offsets, starting at odd and even pages */
+		len = (4 + i % (TEST_PAGES - 3)) * _PAGE_SIZE - (i % 8) * 512;
+		w = wbuf + (i % 2) * _PAGE_SIZE + (i * 520) % _PAGE_SIZE;
+		r = rbuf + ((i / 2) % 2) * _PAGE_SIZE + (i * 1000 + 3) % _PAGE_SIZE;
+		test_pageruns(w, len, &split, &merged);
+		test_pageruns(r, len, &split, &merged);
+
+		test_blkreq(dev, &reqs[0], 1, i * 2 * TEST_PAGES * 8, w, len);
+		if ((err = test_blkbatch(dev, reqs, 1)) < 0)
+			break;
+
+		test_blkreq(dev, &reqs[1], 0, i * 2 * TEST_PAGES * 8, r, len);
+		if ((err = test_blkbatch(dev, reqs + 1, 1)) < 0)
+			break;
+
+		if ((reqs[0].status != 0) || (reqs[1].status != 0) || (reqs[1].vreq.len != len + 1) || memcmp(w, r, len)) {
+			fprintf(stderr, "test_libvirtio: %u bytes buffer %u/%u failed (status %d, %d, len %u)\n", len, i, TEST_PAGEROUNDS, reqs[0].status, reqs[1].status, reqs[1].vreq.len);
+			err = -EIO;
+			break;
+		}
+	}
+
+	if (err == EOK)
+		printf("test_libvirtio: %u buffers, %u page boundaries split, %u merged\n", 2 * i, split, merged);
+
+	free(rbuf);
+	free(wbuf);
+
+	return err;
+}
+
+
+/* Measures enqueue/notify/dequeue throughput with single descriptor chain requests (flush) */
+static int test_throughput(test_dev_t *dev)
+{
+	static test_blkreq_t reqs[TEST_BATCH];
+	virtqueue_stats_t stats;
+	unsigned int i, j;
+	time_t start, dt;
+	int err;
+
+	virtqueue_stats(&dev->vq, NULL, 1);
+	gettime(&start, NULL);
+
+	for (i = 0; i < TEST_BENCHREQS; i += TEST_BATCH) {
+		for (j = 0; j < TEST_BATCH; j++)
+			test_blkreq(dev, &reqs[j], 4, 0, NULL, 0);
+
+		if ((err = test_blkbatch(dev, reqs, TEST_BATCH)) < 0)
+			return err;
+
+		for (j = 0; j < TEST_BATCH; j++) {
+			if (reqs[j].status != 0)
+				return -EIO;
+		}
+	}
+
+	dt = test_elapsed(start);
+	virtqueue_stats(&dev->vq, &stats, 0);
+
+	printf("test_libvirtio: %u requests in %llu us (%llu requests/s), %llu kicks, %llu suppressed, %llu waits\n", i, (unsigned long long)dt,
+		(unsigned long long)i * 1000000 / (dt ? dt : 1), stats.kicks, stats.suppressed, stats.waits);
+
+	return EOK;
+}
+
+
+/* Prepares GPU control request */
+static void test_gpureq(test_dev_t *dev, test_gpureq_t *req, uint32_t type, unsigned int len)
+{
+	memset(req->cmd, 0, sizeof(req->cmd));
+	memset(req->resp, 0, sizeof(req->resp));
+	*(uint32_t *)req->cmd = virtio_gtov32(&dev->vdev, type);
+
+	req->segs[0].buff = req->cmd;
+	req->segs[0].len = len;
+	req->segs[0].buf = NULL;
+	req->segs[0].prev = req->segs[0].next = &req->segs[1];
+	req->segs[1].buff = req->resp;
+	req->segs[1].len = 24;
+	req->segs[1].buf = NULL;
+	req->segs[1].prev = req->segs[1].next = &req->segs[0];
+
+	req->vreq.segs = req->segs;
+	req->vreq.rsegs = 1;
+	req->vreq.wsegs = 1;
+	req->vreq.cb = NULL;
+	req->vreq.arg = req;
+}
+
+
+/* Sends GPU control requests batch, checks responses */
+static int test_gpubatch(test_dev_t *dev, test_gpureq_t *reqs, unsigned int n)
+{
+	virtio_req_t *vreqs[2];
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < n; i++)
+		vreqs[i] = &reqs[i].vreq;
+
+	if ((err = virtqueue_enqueueBatch(&dev->vdev, &dev->vq, vreqs, n)) != n)
+		return (err < 0) ? err : -EIO;
+	virtqueue_notify(&dev->vdev, &dev->vq);
+
+	for (i = 0; i < n; i++) {
+		if ((err = virtqueue_wait(&dev->vdev, &dev->vq, vreqs[i], 1000000)) < 0)
+			return err;
+
+		/* OK_NODATA response */
+		if (virtio_vtog32(&dev->vdev, *(uint32_t *)reqs[i].resp) != 0x1100)
+			return -EIO;
+	}
+
+	return EOK;
+}
+
+
+/* Measures GPU commit (transfer to host and flush) latency */
+static int test_commit(test_dev_t *dev)
+{
+	static test_gpureq_t reqs[2];
+	time_t start, t, dt, max = 0;
+	uint32_t *cmd;
+	addr_t pa;
+	unsigned int i;
+	void *fb;
+	int err;
+
+	if ((fb = virtio_memAlloc(TEST_GPUW * TEST_GPUH * 4, &pa)) == NULL)
+		return -ENOMEM;
+
+	do {
+		/* Create resource (B8G8R8X8 format) */
+		test_gpureq(dev, &reqs[0], 0x101, 40);
+		cmd = (uint32_t *)reqs[0].cmd;
+		cmd[6] = virtio_gtov32(&dev->vdev, 1);
+		cmd[7] = virtio_gtov32(&dev->vdev, 2);
+		cmd[8] = virtio_gtov32(&dev->vdev, TEST_GPUW);
+		cmd[9] = virtio_gtov32(&dev->vdev, TEST_GPUH);
+		if ((err = test_gpubatch(dev, reqs, 1)) < 0)
+			break;
+
+		/* Attach backing memory */
+		test_gpureq(dev, &reqs[0], 0x106, 48);
+		cmd = (uint32_t *)reqs[0].cmd;
+		cmd[6] = virtio_gtov32(&dev->vdev, 1);
+		cmd[7] = virtio_gtov32(&dev->vdev, 1);
+		*(uint64_t *)(reqs[0].cmd + 32) = virtio_gtov64(&dev->vdev, pa);
+		cmd[10] = virtio_gtov32(&dev->vdev, TEST_GPUW * TEST_GPUH * 4);
+		if ((err = test_gpubatch(dev, reqs, 1)) < 0)
+			break;
+
+		gettime(&start, NULL);
+
+		for (i = 0; i < TEST_COMMITS; i++) {
+			((uint32_t *)fb)[i % (TEST_GPUW * TEST_GPUH)] = i;
+
+			/* Transfer whole resource */
+			test_gpureq(dev, &reqs[0], 0x105, 56);
+			cmd = (uint32_t *)reqs[0].cmd;
+			cmd[8] = virtio_gtov32(&dev->vdev, TEST_GPUW);
+			cmd[9] = virtio_gtov32(&dev->vdev, TEST_GPUH);
+			cmd[12] = virtio_gtov32(&dev->vdev, 1);
+
+			/* Flush whole resource */
+			test_gpureq(dev, &reqs[1], 0x104, 48);
+			cmd = (uint32_t *)reqs[1].cmd;
+			cmd[8] = virtio_gtov32(&dev->vdev, TEST_GPUW);
+			cmd[9] = virtio_gtov32(&dev->vdev, TEST_GPUH);
+			cmd[10] = virtio_gtov32(&dev->vdev, 1);
+
+			gettime(&t, NULL);
+			if ((err = test_gpubatch(dev, reqs, 2)) < 0)
+				break;
+
+			if ((t = test_elapsed(t)) > max)
+				max = t;
+		}
+
+		if (err < 0)
+			break;
+
+		dt = test_elapsed(start);
+		printf("test_libvirtio: %u commits in %llu us (average %llu us, max %llu us)\n", i, (unsigned long long)dt, (unsigned long long)dt / i, (unsigned long long)max);
+	} while (0);
+
+	virtio_memFree(fb, TEST_GPUW * TEST_GPUH * 4);
+
+	return err;
+}
+
+
+int main(void)
+{
+	test_dev_t dev;
+	unsigned int i;
+	int ret = EOK;
+
+	if ((ret = virtio_init()) < 0) {
+		fprintf(stderr, "test_libvirtio: failed to initialize library\n");
+		return ret;
+	}
+
+	srand(1);
+
+	for (i = 0; i < sizeof(test_variants) / sizeof(test_variants[0]); i++) {
+		if ((ret = test_open(&dev, 0x02, test_variants[i].drop)) < 0) {
+			fprintf(stderr, "test_libvirtio: failed to initialize loopback block device\n");
+			break;
+		}
+
+		printf("test_libvirtio: starting %s virtqueue test (features %#llx)...\n", test_variants[i].name, (unsigned long long)virtio_readFeatures(&dev.vdev));
+		if ((ret = test_rings(&dev)) < 0)
+			fprintf(stderr, "test_libvirtio: %s virtqueue test failed\n", test_variants[i].name);
+
+		if (ret == EOK) {
+			if ((ret = test_pages(&dev)) < 0)
+				fprintf(stderr, "test_libvirtio: %s virtqueue multiple page buffers test failed\n", test_variants[i].name);
+		}
+
+		if (ret == EOK) {
+			if ((ret = test_throughput(&dev)) < 0)
+				fprintf(stderr, "test_libvirtio: %s virtqueue benchmark failed\n", test_variants[i].name);
+		}
+
+		test_close(&dev);
+
+		if (ret < 0)
+			break;
+	}
+
+	do {
+		if (ret < 0)
+			break;
+
+		if ((ret = test_open(&dev, 0x10, 0)) < 0) {
+			fprintf(stderr, "test_libvirtio: failed to initialize loopback GPU device\n");
+			break;
+		}
+
+		printf("test_libvirtio: starting GPU commit benchmark...\n");
+		if ((ret = test_commit(&dev)) < 0)
+			fprintf(stderr, "test_libvirtio: GPU commit benchmark failed\n");
+
+		test_close(&dev);
+		if (ret < 0)
+			break;
+
+#ifdef VIRTIO_HOST
+		/* Drivers use loopback devices on host builds only */
+		printf("test_libvirtio: starting block driver test...\n");
+		if ((ret = test_blk()) < 0) {
+			fprintf(stderr, "test_libvirtio: block driver test failed\n");
+			break;
+		}
+
+		printf("test_libvirtio: starting network driver test...\n");
+		if ((ret = test_net()) < 0) {
+			fprintf(stderr, "test_libvirtio: network driver test failed\n");
+			break;
+		}
+
+		printf("test_libvirtio: starting console driver test...\n");
+		if ((ret = test_cons()) < 0) {
+			fprintf(stderr, "test_libvirtio: console driver test failed\n");
+			break;
+		}
+#endif
+	} while (0);
+
+	virtio_done();
+
+	if (!ret)
+		printf("test_libvirtio: test finished successfully\n");
+
+	return ret;
+}
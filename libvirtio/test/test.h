@@ -0,0 +1,30 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO library test (VirtIO drivers tests on loopback devices)
+ *
+ * Copyright 2021 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _TEST_LIBVIRTIO_H_
+#define _TEST_LIBVIRTIO_H_
+
+
+/* Tests VirtIO block driver */
+extern int test_blk(void);
+
+
+/* Tests VirtIO network driver */
+extern int test_net(void);
+
+
+/* Tests VirtIO console driver */
+extern int test_cons(void);
+
+
+#endif
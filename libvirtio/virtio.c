@@ -20,6 +20,10 @@
 #include "virtio.h"
 
 
+/* Number of device status reads before device reset starts sleeping */
+#define VIRTIO_RESET_SPIN 1000
+
+
 typedef union {
 	/* Direct MMIO device detection status */
 	unsigned char found;
@@ -29,79 +33,317 @@ typedef union {
 } virtiommio_ctx_t;
 
 
-/* Returns VirtIO device configuraton space address */
-static void *virtio_configBase(virtio_dev_t *vdev)
+static struct {
+	unsigned int refs;              /* Number of library users (shared state is set up by first and torn down by last user) */
+	volatile int lock;              /* Library initialization spinlock (mutex can't be created before first init) */
+} virtio_common;
+
+
+/* Direct MMIO registers access */
+static uint8_t virtiommio_read8(void *base, unsigned int reg)
 {
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev))
-			return vdev->info.base.addr;
+	return *(volatile uint8_t *)((uintptr_t)base + reg);
+}
 
-		return vdev->info.cfg.addr;
-	}
 
-	return vdev->info.base.addr;
+static uint16_t virtiommio_read16(void *base, unsigned int reg)
+{
+	return *(volatile uint16_t *)((uintptr_t)base + reg);
 }
 
 
-/* Returns VirtIO device configuration space registers offset */
-static unsigned int virtio_configReg(virtio_dev_t *vdev, unsigned int reg)
+static uint32_t virtiommio_read32(void *base, unsigned int reg)
 {
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev))
-			return reg + 0x14;
+	return *(volatile uint32_t *)((uintptr_t)base + reg);
+}
 
-		return reg;
-	}
 
-	return reg + 0x100;
+static uint64_t virtiommio_read64(void *base, unsigned int reg)
+{
+	uintptr_t addr = (uintptr_t)base + reg;
+	uint64_t val;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	val = *(volatile uint32_t *)(addr + 4);
+	val <<= 32;
+	val |= *(volatile uint32_t *)addr;
+#else
+	val = *(volatile uint32_t *)addr;
+	val <<= 32;
+	val |= *(volatile uint32_t *)(addr + 4);
+#endif
+
+	return val;
 }
 
 
-/* Returns modern VirtIO device configuration generation */
-static unsigned int virtio_configGen(virtio_dev_t *vdev)
+static void virtiommio_write8(void *base, unsigned int reg, uint8_t val)
 {
-	if (vdev->info.type == vdevPCI)
-		return virtio_read8(vdev, vdev->info.base.addr, 0x15);
+	*(volatile uint8_t *)((uintptr_t)base + reg) = val;
+}
+
+
+static void virtiommio_write16(void *base, unsigned int reg, uint16_t val)
+{
+	*(volatile uint16_t *)((uintptr_t)base + reg) = val;
+}
 
+
+static void virtiommio_write32(void *base, unsigned int reg, uint32_t val)
+{
+	*(volatile uint32_t *)((uintptr_t)base + reg) = val;
+}
+
+
+static void virtiommio_write64(void *base, unsigned int reg, uint64_t val)
+{
+	uintptr_t addr = (uintptr_t)base + reg;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	*(volatile uint32_t *)(addr + 4) = val >> 32;
+	*(volatile uint32_t *)addr = val;
+#else
+	*(volatile uint32_t *)addr = val >> 32;
+	*(volatile uint32_t *)(addr + 4) = val;
+#endif
+}
+
+
+/* MMIO transport registers layout (shared by direct MMIO and loopback devices) */
+static void *virtiommio_config(virtio_dev_t *vdev, unsigned int *reg)
+{
+	*reg += 0x100;
+
+	return vdev->info.base.addr;
+}
+
+
+static unsigned int virtiommio_configGen(virtio_dev_t *vdev)
+{
 	return virtio_read32(vdev, vdev->info.base.addr, 0xfc);
 }
 
 
+static uint64_t virtiommio_getFeatures(virtio_dev_t *vdev)
+{
+	uint64_t features;
+
+	virtio_write32(vdev, vdev->info.base.addr, 0x14, 1);
+	virtio_mb();
+	features = virtio_read32(vdev, vdev->info.base.addr, 0x10);
+	features <<= 32;
+	virtio_write32(vdev, vdev->info.base.addr, 0x14, 0);
+	virtio_mb();
+	features |= virtio_read32(vdev, vdev->info.base.addr, 0x10);
+
+	return features;
+}
+
+
+static void virtiommio_setFeatures(virtio_dev_t *vdev, uint64_t features)
+{
+	virtio_write32(vdev, vdev->info.base.addr, 0x24, 1);
+	virtio_mb();
+	virtio_write32(vdev, vdev->info.base.addr, 0x20, features >> 32);
+	virtio_write32(vdev, vdev->info.base.addr, 0x24, 0);
+	virtio_mb();
+	virtio_write32(vdev, vdev->info.base.addr, 0x20, features);
+}
+
+
+static uint8_t virtiommio_readStatus(virtio_dev_t *vdev)
+{
+	return virtio_read32(vdev, vdev->info.base.addr, 0x70);
+}
+
+
+static void virtiommio_writeStatus(virtio_dev_t *vdev, uint8_t status)
+{
+	virtio_write32(vdev, vdev->info.base.addr, 0x70, status);
+	virtio_mb();
+}
+
+
+static unsigned int virtiommio_isr(virtio_dev_t *vdev)
+{
+	uint32_t isr = virtiommio_read32(vdev->info.base.addr, 0x60);
+
+	virtiommio_write32(vdev->info.base.addr, 0x64, isr);
+
+	return virtio_vtog32(vdev, isr);
+}
+
+
+static void virtiommio_select(virtio_dev_t *vdev, unsigned int idx)
+{
+	virtio_write32(vdev, vdev->info.base.addr, 0x30, idx);
+	virtio_mb();
+}
+
+
+static int virtiommio_enable(virtio_dev_t *vdev, unsigned int *size)
+{
+	unsigned int maxsz;
+
+	if (!(maxsz = virtio_read32(vdev, vdev->info.base.addr, 0x34)) || virtio_read32(vdev, vdev->info.base.addr, 0x44))
+		return -ENOENT;
+
+	if (*size > maxsz)
+		*size = maxsz;
+
+	return EOK;
+}
+
+
+static int virtiommio_activate(virtio_dev_t *vdev, virtqueue_t *vq, uint64_t desc, uint64_t drv, uint64_t dev)
+{
+	virtio_write32(vdev, vdev->info.base.addr, 0x38, vq->size);
+
+	virtio_write32(vdev, vdev->info.base.addr, 0x80, desc);
+	virtio_write32(vdev, vdev->info.base.addr, 0x84, desc >> 32);
+	virtio_write32(vdev, vdev->info.base.addr, 0x90, drv);
+	virtio_write32(vdev, vdev->info.base.addr, 0x94, drv >> 32);
+	virtio_write32(vdev, vdev->info.base.addr, 0xa0, dev);
+	virtio_write32(vdev, vdev->info.base.addr, 0xa4, dev >> 32);
+
+	virtio_mb();
+	virtio_write32(vdev, vdev->info.base.addr, 0x44, 1);
+
+	return EOK;
+}
+
+
+static void virtiommio_notify(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	virtiommio_write32(vdev->info.base.addr, 0x50, virtio_gtov32(vdev, vq->idx));
+}
+
+
+/* Legacy (version 1) MMIO transport virtqueue registers */
+static int virtiommio_enableLegacy(virtio_dev_t *vdev, unsigned int *size)
+{
+	unsigned int maxsz;
+
+	if (!(maxsz = virtio_read32(vdev, vdev->info.base.addr, 0x34)) || virtio_read32(vdev, vdev->info.base.addr, 0x40))
+		return -ENOENT;
+
+	if (*size > maxsz)
+		*size = maxsz;
+
+	return EOK;
+}
+
+
+static int virtiommio_activateLegacy(virtio_dev_t *vdev, virtqueue_t *vq, uint64_t desc, uint64_t drv, uint64_t dev)
+{
+	if ((desc /= _PAGE_SIZE) >> 32)
+		return -EFAULT;
+
+	virtio_write32(vdev, vdev->info.base.addr, 0x38, vq->size);
+	virtio_write32(vdev, vdev->info.base.addr, 0x3c, _PAGE_SIZE);
+	virtio_write32(vdev, vdev->info.base.addr, 0x40, desc);
+
+	return EOK;
+}
+
+
+/* Loopback device interrupt status and notification (registers are emulated) */
+static unsigned int virtioloop_isr(virtio_dev_t *vdev)
+{
+	uint32_t isr = virtioloop_read32(vdev->info.base.addr, 0x60);
+
+	virtioloop_write32(vdev->info.base.addr, 0x64, isr);
+
+	return virtio_vtog32(vdev, isr);
+}
+
+
+static void virtioloop_notify(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	virtioloop_write32(vdev->info.base.addr, 0x50, virtio_gtov32(vdev, vq->idx));
+}
+
+
+/* Modern (version 2) direct MMIO device */
+static const virtio_ops_t virtiommio_ops = {
+	virtiommio_read8, virtiommio_read16, virtiommio_read32, virtiommio_read64,
+	virtiommio_write8, virtiommio_write16, virtiommio_write32, virtiommio_write64,
+	virtiommio_config, virtiommio_configGen, virtiommio_getFeatures, virtiommio_setFeatures,
+	virtiommio_readStatus, virtiommio_writeStatus, virtiommio_isr,
+	virtiommio_select, virtiommio_enable, virtiommio_activate, virtiommio_notify
+};
+
+
+/* Legacy (version 1) direct MMIO device */
+static const virtio_ops_t virtiommio_legacyOps = {
+	virtiommio_read8, virtiommio_read16, virtiommio_read32, virtiommio_read64,
+	virtiommio_write8, virtiommio_write16, virtiommio_write32, virtiommio_write64,
+	virtiommio_config, NULL, virtiommio_getFeatures, virtiommio_setFeatures,
+	virtiommio_readStatus, virtiommio_writeStatus, virtiommio_isr,
+	virtiommio_select, virtiommio_enableLegacy, virtiommio_activateLegacy, virtiommio_notify
+};
+
+
+/* Loopback device (MMIO version 2 registers layout) */
+static const virtio_ops_t virtioloop_ops = {
+	virtioloop_read8, virtioloop_read16, virtioloop_read32, virtioloop_read64,
+	virtioloop_write8, virtioloop_write16, virtioloop_write32, virtioloop_write64,
+	virtiommio_config, virtiommio_configGen, virtiommio_getFeatures, virtiommio_setFeatures,
+	virtiommio_readStatus, virtiommio_writeStatus, virtioloop_isr,
+	virtiommio_select, virtiommio_enable, virtiommio_activate, virtioloop_notify
+};
+
+
+/* Returns VirtIO device configuration space address and translates register offset */
+static inline void *virtio_config(virtio_dev_t *vdev, unsigned int *reg)
+{
+	return vdev->ops->config(vdev, reg);
+}
+
+
 uint8_t virtio_readConfig8(virtio_dev_t *vdev, unsigned int reg)
 {
-	return virtio_read8(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg));
+	void *base = virtio_config(vdev, &reg);
+
+	return virtio_read8(vdev, base, reg);
 }
 
 
 uint16_t virtio_readConfig16(virtio_dev_t *vdev, unsigned int reg)
 {
-	return virtio_read16(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg));
+	void *base = virtio_config(vdev, &reg);
+
+	return virtio_read16(vdev, base, reg);
 }
 
 
 uint32_t virtio_readConfig32(virtio_dev_t *vdev, unsigned int reg)
 {
-	return virtio_read32(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg));
+	void *base = virtio_config(vdev, &reg);
+
+	return virtio_read32(vdev, base, reg);
 }
 
 
 uint64_t virtio_readConfig64(virtio_dev_t *vdev, unsigned int reg)
 {
+	void *base = virtio_config(vdev, &reg);
 	unsigned int gen1, gen2;
 	uint64_t val;
 
-	if (virtio_legacy(vdev)) {
+	/* Legacy device doesn't provide configuration generation */
+	if (vdev->ops->configGen == NULL) {
 		do {
-			val = virtio_read64(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg));
-		} while (val != virtio_read64(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg)));
+			val = virtio_read64(vdev, base, reg);
+		} while (val != virtio_read64(vdev, base, reg));
 
 		return val;
 	}
 
 	do {
-		gen1 = virtio_configGen(vdev);
-		val = virtio_read64(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg));
-		gen2 = virtio_configGen(vdev);
+		gen1 = vdev->ops->configGen(vdev);
+		val = virtio_read64(vdev, base, reg);
+		gen2 = vdev->ops->configGen(vdev);
 	} while (gen1 != gen2);
 
 	return val;
@@ -110,83 +352,39 @@ uint64_t virtio_readConfig64(virtio_dev_t *vdev, unsigned int reg)
 
 void virtio_writeConfig8(virtio_dev_t *vdev, unsigned int reg, uint8_t val)
 {
-	virtio_write8(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg), val);
+	void *base = virtio_config(vdev, &reg);
+
+	virtio_write8(vdev, base, reg, val);
 }
 
 
 void virtio_writeConfig16(virtio_dev_t *vdev, unsigned int reg, uint16_t val)
 {
-	virtio_write16(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg), val);
+	void *base = virtio_config(vdev, &reg);
+
+	virtio_write16(vdev, base, reg, val);
 }
 
 
 void virtio_writeConfig32(virtio_dev_t *vdev, unsigned int reg, uint32_t val)
 {
-	virtio_write32(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg), val);
+	void *base = virtio_config(vdev, &reg);
+
+	virtio_write32(vdev, base, reg, val);
 }
 
 
 void virtio_writeConfig64(virtio_dev_t *vdev, unsigned int reg, uint64_t val)
 {
-	virtio_write64(vdev, virtio_configBase(vdev), virtio_configReg(vdev, reg), val);
+	void *base = virtio_config(vdev, &reg);
+
+	virtio_write64(vdev, base, reg, val);
 }
 
 
 uint64_t virtio_getFeatures(virtio_dev_t *vdev)
 {
-	uint64_t features;
-
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev))
-			return virtio_read32(vdev, vdev->info.base.addr, 0x00);
-
-		virtio_write32(vdev, vdev->info.base.addr, 0x00, 1);
-		virtio_mb();
-		features = virtio_read32(vdev, vdev->info.base.addr, 0x04);
-		features <<= 32;
-		virtio_write32(vdev, vdev->info.base.addr, 0x00, 0);
-		virtio_mb();
-		features |= virtio_read32(vdev, vdev->info.base.addr, 0x04);
-
-		return features;
-	}
-
-	virtio_write32(vdev, vdev->info.base.addr, 0x14, 1);
-	virtio_mb();
-	features = virtio_read32(vdev, vdev->info.base.addr, 0x10);
-	features <<= 32;
-	virtio_write32(vdev, vdev->info.base.addr, 0x14, 0);
-	virtio_mb();
-	features |= virtio_read32(vdev, vdev->info.base.addr, 0x10);
-
-	return features;
-}
-
-
-/* Writes VirtIO driver supported features */
-static void virtio_setFeatures(virtio_dev_t *vdev, uint64_t features)
-{
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev)) {
-			virtio_write32(vdev, vdev->info.base.addr, 0x04, features);
-			return;
-		}
-
-		virtio_write32(vdev, vdev->info.base.addr, 0x08, 1);
-		virtio_mb();
-		virtio_write32(vdev, vdev->info.base.addr, 0x0c, features >> 32);
-		virtio_write32(vdev, vdev->info.base.addr, 0x08, 0);
-		virtio_mb();
-		virtio_write32(vdev, vdev->info.base.addr, 0x0c, features);
-		return;
-	}
-
-	virtio_write32(vdev, vdev->info.base.addr, 0x24, 1);
-	virtio_mb();
-	virtio_write32(vdev, vdev->info.base.addr, 0x20, features >> 32);
-	virtio_write32(vdev, vdev->info.base.addr, 0x24, 0);
-	virtio_mb();
-	virtio_write32(vdev, vdev->info.base.addr, 0x20, features);
+	return vdev->ops->getFeatures(vdev);
 }
 
 
@@ -198,8 +396,9 @@ uint64_t virtio_readFeatures(virtio_dev_t *vdev)
 
 int virtio_writeFeatures(virtio_dev_t *vdev, uint64_t features)
 {
-	vdev->features &= features | (1ULL << 32);
-	virtio_setFeatures(vdev, vdev->features);
+	/* Transport features (INDIRECT_DESC, EVENT_IDX, VERSION_1, RING_PACKED, IN_ORDER) are handled by the library (unless dropped by driver) */
+	vdev->features &= features | (1ULL << 28) | (1ULL << 29) | (1ULL << 32) | (1ULL << 34) | (1ULL << 35);
+	vdev->ops->setFeatures(vdev, vdev->features);
 
 	if (virtio_legacy(vdev))
 		return EOK;
@@ -213,67 +412,39 @@ int virtio_writeFeatures(virtio_dev_t *vdev, uint64_t features)
 }
 
 
-uint8_t virtio_readStatus(virtio_dev_t *vdev)
+void virtio_dropFeatures(virtio_dev_t *vdev, uint64_t features)
 {
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev))
-			return virtio_read8(vdev, vdev->info.base.addr, 0x12);
+	vdev->features &= ~features;
+}
 
-		return virtio_read8(vdev, vdev->info.base.addr, 0x14);
-	}
 
-	return virtio_read32(vdev, vdev->info.base.addr, 0x70);
+uint8_t virtio_readStatus(virtio_dev_t *vdev)
+{
+	return vdev->ops->readStatus(vdev);
 }
 
 
 void virtio_writeStatus(virtio_dev_t *vdev, uint8_t status)
 {
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev)) {
-			virtio_write8(vdev, vdev->info.base.addr, 0x12, status);
-			virtio_mb();
-			return;
-		}
-
-		virtio_write8(vdev, vdev->info.base.addr, 0x14, status);
-		virtio_mb();
-		return;
-	}
-
-	virtio_write32(vdev, vdev->info.base.addr, 0x70, status);
-	virtio_mb();
+	vdev->ops->writeStatus(vdev, status);
 }
 
 
 unsigned int virtio_isr(virtio_dev_t *vdev)
 {
-	unsigned int isr;
-
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev))
-			return virtio_read8(vdev, vdev->info.base.addr, 0x13);
-
-		return virtio_read8(vdev, vdev->info.isr.addr, 0x00);
-	}
-
-	isr = virtio_read32(vdev, vdev->info.base.addr, 0x60);
-	virtio_write32(vdev, vdev->info.base.addr, 0x64, isr);
-
-	return isr;
+	return vdev->ops->isr(vdev);
 }
 
 
 void virtio_reset(virtio_dev_t *vdev)
 {
-	virtio_writeStatus(vdev, 0);
+	unsigned int i;
 
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev)) {
-			virtio_readStatus(vdev);
-			return;
-		}
+	virtio_writeStatus(vdev, 0);
 
-		while (virtio_readStatus(vdev))
+	/* Reset usually completes immediately, back off only if device is slow to respond */
+	for (i = 0; virtio_readStatus(vdev); i++) {
+		if (i >= VIRTIO_RESET_SPIN)
 			usleep(10);
 	}
 }
@@ -286,6 +457,11 @@ void virtio_destroyDev(virtio_dev_t *vdev)
 		return;
 	}
 
+	if (vdev->info.type == vdevLOOP) {
+		virtioloop_destroyDev(vdev);
+		return;
+	}
+
 	munmap(vdev->info.base.addr, (vdev->info.base.len + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1));
 }
 
@@ -298,8 +474,16 @@ int virtio_initDev(virtio_dev_t *vdev)
 	if (vdev->info.type == vdevPCI)
 		return virtiopci_initDev(vdev);
 
-	if ((vdev->info.base.addr = mmap(NULL, (vdev->info.base.len + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1), PROT_READ | PROT_WRITE, MAP_DEVICE | MAP_UNCACHED, OID_PHYSMEM, (uintptr_t)vdev->info.base.addr)) == MAP_FAILED)
-		return -ENOMEM;
+	if (vdev->info.type == vdevLOOP) {
+		if ((err = virtioloop_initDev(vdev)) < 0)
+			return err;
+		vdev->ops = &virtioloop_ops;
+	}
+	else {
+		if ((vdev->info.base.addr = mmap(NULL, (vdev->info.base.len + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1), PROT_READ | PROT_WRITE, MAP_DEVICE | MAP_UNCACHED, OID_PHYSMEM, (uintptr_t)vdev->info.base.addr)) == MAP_FAILED)
+			return -ENOMEM;
+		vdev->ops = &virtiommio_ops;
+	}
 
 	vdev->features = 0ULL;
 	if (virtio_read32(vdev, vdev->info.base.addr, 0x00) != 0x74726976) {
@@ -311,7 +495,13 @@ int virtio_initDev(virtio_dev_t *vdev)
 
 	do {
 		if ((ver = virtio_read32(vdev, vdev->info.base.addr, 0x04)) == 1) {
+			/* Loopback device implements version 2 layout only */
+			if (vdev->ops != &virtiommio_ops) {
+				err = -ENOTSUP;
+				break;
+			}
 			vdev->features = 0;
+			vdev->ops = &virtiommio_legacyOps;
 		}
 		else if (ver == 2) {
 			vdev->features = (1ULL << 32);
@@ -360,8 +550,8 @@ int virtio_find(const virtio_devinfo_t *info, virtio_dev_t *vdev, virtio_ctx_t *
 		memset(vctx, 0, sizeof(virtio_ctx_t));
 	vdev->info = *info;
 
-	/* Direct MMIO configuration */
-	if (info->base.len) {
+	/* Direct MMIO configuration (single loopback device) */
+	if (info->base.len || (info->type == vdevLOOP)) {
 		if (ctx->found)
 			return -ENODEV;
 
@@ -374,13 +564,56 @@ int virtio_find(const virtio_devinfo_t *info, virtio_dev_t *vdev, virtio_ctx_t *
 }
 
 
+/* Serializes library initialization and destruction */
+static void virtio_lock(void)
+{
+	while (__sync_lock_test_and_set(&virtio_common.lock, 1))
+		usleep(1000);
+}
+
+
+static void virtio_unlock(void)
+{
+	__sync_lock_release(&virtio_common.lock);
+}
+
+
 void virtio_done(void)
 {
-	return;
+	virtio_lock();
+
+	/* Rings and buffers of other drivers live in shared DMA slabs */
+	if ((virtio_common.refs > 0) && !--virtio_common.refs) {
+		virtiosrv_done();
+		virtiomem_done();
+	}
+
+	virtio_unlock();
 }
 
 
 int virtio_init(void)
 {
+	int err;
+
+	virtio_lock();
+
+	/* DMA allocator and service threads are shared by all drivers */
+	if (!virtio_common.refs) {
+		if ((err = virtiomem_init()) < 0) {
+			virtio_unlock();
+			return err;
+		}
+
+		if ((err = virtiosrv_init()) < 0) {
+			virtiomem_done();
+			virtio_unlock();
+			return err;
+		}
+	}
+	virtio_common.refs++;
+
+	virtio_unlock();
+
 	return EOK;
 }
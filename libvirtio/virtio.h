@@ -14,117 +14,131 @@
 #ifndef _VIRTIO_H_
 #define _VIRTIO_H_
 
+#include <stddef.h>
+
+#include <sys/mman.h>
+
 #include "libvirtio.h"
+#include "virtioloop.h"
 #include "virtiopci.h"
 
 
+/* VirtIO transport operations (resolved once per device, no per-access transport checks) */
+struct _virtio_ops_t {
+	/* Registers access (raw device endian values) */
+	uint8_t (*read8)(void *base, unsigned int reg);
+	uint16_t (*read16)(void *base, unsigned int reg);
+	uint32_t (*read32)(void *base, unsigned int reg);
+	uint64_t (*read64)(void *base, unsigned int reg);
+	void (*write8)(void *base, unsigned int reg, uint8_t val);
+	void (*write16)(void *base, unsigned int reg, uint16_t val);
+	void (*write32)(void *base, unsigned int reg, uint32_t val);
+	void (*write64)(void *base, unsigned int reg, uint64_t val);
+
+	/* Device registers */
+	void *(*config)(virtio_dev_t *vdev, unsigned int *reg);     /* Returns configuration space base and translates register offset */
+	unsigned int (*configGen)(virtio_dev_t *vdev);              /* Returns configuration generation (NULL for legacy device) */
+	uint64_t (*getFeatures)(virtio_dev_t *vdev);
+	void (*setFeatures)(virtio_dev_t *vdev, uint64_t features);
+	uint8_t (*readStatus)(virtio_dev_t *vdev);
+	void (*writeStatus)(virtio_dev_t *vdev, uint8_t status);
+	unsigned int (*isr)(virtio_dev_t *vdev);                    /* Reads (and acknowledges) interrupt status */
+
+	/* Virtqueue registers */
+	void (*select)(virtio_dev_t *vdev, unsigned int idx);
+	int (*enable)(virtio_dev_t *vdev, unsigned int *size);      /* Checks if selected virtqueue is available and validates its size */
+	int (*activate)(virtio_dev_t *vdev, virtqueue_t *vq, uint64_t desc, uint64_t drv, uint64_t dev);
+	void (*notify)(virtio_dev_t *vdev, virtqueue_t *vq);
+};
+
+
 /* Reads VirtIO device supported features */
 extern uint64_t virtio_getFeatures(virtio_dev_t *vdev);
 
 
-static inline uint8_t virtio_read8(virtio_dev_t *vdev, void *base, unsigned int reg)
+/* DMA memory mapping attributes (cache coherent platforms keep DMA memory cacheable, device accesses are snooped) */
+#ifndef VIRTIO_DMAATTR
+#if defined(__i386__) || defined(__x86_64__)
+#define VIRTIO_DMAATTR 0
+#else
+#define VIRTIO_DMAATTR MAP_UNCACHED
+#endif
+#endif
+
+
+/* Returns physical address of registered region buffer */
+static inline uint64_t _virtio_bufPA(const virtio_buf_t *buf, const void *va)
 {
-	if (vdev->info.type == vdevPCI)
-		return virtiopci_read8(base, reg);
+	uintptr_t offs = (uintptr_t)va - buf->va;
 
-	return *(volatile uint8_t *)((uintptr_t)base + reg);
+	if (buf->pages == NULL)
+		return buf->pa + offs;
+
+	return buf->pages[offs / _PAGE_SIZE] + (offs & (_PAGE_SIZE - 1));
 }
 
 
-static inline uint16_t virtio_read16(virtio_dev_t *vdev, void *base, unsigned int reg)
+/* Destroys DMA memory allocator */
+extern void virtiomem_done(void);
+
+
+/* Initializes DMA memory allocator */
+extern int virtiomem_init(void);
+
+
+/* Destroys completion service */
+extern void virtiosrv_done(void);
+
+
+/* Initializes completion service */
+extern int virtiosrv_init(void);
+
+
+static inline uint8_t virtio_read8(virtio_dev_t *vdev, void *base, unsigned int reg)
 {
-	if (vdev->info.type == vdevPCI)
-		return virtio_vtog16(vdev, virtiopci_read16(base, reg));
+	return vdev->ops->read8(base, reg);
+}
+
 
-	return virtio_vtog16(vdev, *(volatile uint16_t *)((uintptr_t)base + reg));
+static inline uint16_t virtio_read16(virtio_dev_t *vdev, void *base, unsigned int reg)
+{
+	return virtio_vtog16(vdev, vdev->ops->read16(base, reg));
 }
 
 
 static inline uint32_t virtio_read32(virtio_dev_t *vdev, void *base, unsigned int reg)
 {
-	if (vdev->info.type == vdevPCI)
-		return virtio_vtog32(vdev, virtiopci_read32(base, reg));
-
-	return virtio_vtog32(vdev, *(volatile uint32_t *)((uintptr_t)base + reg));
+	return virtio_vtog32(vdev, vdev->ops->read32(base, reg));
 }
 
 
 static inline uint64_t virtio_read64(virtio_dev_t *vdev, void *base, unsigned int reg)
 {
-	uintptr_t addr = (uintptr_t)base + reg;
-	uint64_t val;
-
-	if (vdev->info.type == vdevPCI)
-		return virtio_vtog64(vdev, virtiopci_read64(base, reg));
-
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-	val = *(volatile uint32_t *)(addr + 4);
-	val <<= 32;
-	val |= *(volatile uint32_t *)addr;
-#else
-	val = *(volatile uint32_t *)addr;
-	val <<= 32;
-	val |= *(volatile uint32_t *)(addr + 4);
-#endif
-
-	return virtio_vtog64(vdev, val);
+	return virtio_vtog64(vdev, vdev->ops->read64(base, reg));
 }
 
 
 static inline void virtio_write8(virtio_dev_t *vdev, void *base, unsigned int reg, uint8_t val)
 {
-	if (vdev->info.type == vdevPCI) {
-		virtiopci_write8(base, reg, val);
-		return;
-	}
-
-	*(volatile uint8_t *)((uintptr_t)base + reg) = val;
+	vdev->ops->write8(base, reg, val);
 }
 
 
 static inline void virtio_write16(virtio_dev_t *vdev, void *base, unsigned int reg, uint16_t val)
 {
-	val = virtio_gtov16(vdev, val);
-
-	if (vdev->info.type == vdevPCI) {
-		virtiopci_write16(base, reg, val);
-		return;
-	}
-
-	*(volatile uint16_t *)((uintptr_t)base + reg) = val;
+	vdev->ops->write16(base, reg, virtio_gtov16(vdev, val));
 }
 
 
 static inline void virtio_write32(virtio_dev_t *vdev, void *base, unsigned int reg, uint32_t val)
 {
-	val = virtio_gtov32(vdev, val);
-
-	if (vdev->info.type == vdevPCI) {
-		virtiopci_write32(base, reg, val);
-		return;
-	}
-
-	*(volatile uint32_t *)((uintptr_t)base + reg) = val;
+	vdev->ops->write32(base, reg, virtio_gtov32(vdev, val));
 }
 
 
 static inline void virtio_write64(virtio_dev_t *vdev, void *base, unsigned int reg, uint64_t val)
 {
-	uintptr_t addr = (uintptr_t)base + reg;
-	val = virtio_gtov64(vdev, val);
-
-	if (vdev->info.type == vdevPCI) {
-		virtiopci_write64(base, reg, val);
-		return;
-	}
-
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-	*(volatile uint32_t *)(addr + 4) = val >> 32;
-	*(volatile uint32_t *)addr = val;
-#else
-	*(volatile uint32_t *)addr = val >> 32;
-	*(volatile uint32_t *)(addr + 4) = val;
-#endif
+	vdev->ops->write64(base, reg, virtio_gtov64(vdev, val));
 }
 
 
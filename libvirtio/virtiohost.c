@@ -0,0 +1,511 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO host build (Phoenix-RTOS primitives emulated with POSIX threads)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/interrupt.h>
+#include <sys/mman.h>
+#include <sys/threads.h>
+#include <sys/time.h>
+
+#undef mmap
+#undef munmap
+
+
+/* Maximum number of synchronization primitives */
+#define VIRTIOHOST_HANDLES 1024
+
+
+/* Maximum number of finished, not joined threads */
+#define VIRTIOHOST_THREADS 64
+
+
+/* Maximum number of physically contiguous mappings */
+#define VIRTIOHOST_MAPS 256
+
+
+/* Physical addresses of other memory (above user space addresses, pages are swapped in aligned 2-page blocks) */
+#define VIRTIOHOST_PHYSWIN ((addr_t)1 << (8 * sizeof(addr_t) - 1))
+#define VIRTIOHOST_PHYSSWP (2 * _PAGE_SIZE)
+
+
+typedef struct {
+	enum { resNONE, resMUTEX, resCOND } type; /* Resource type */
+	union {
+		pthread_mutex_t mutex;      /* Mutex */
+		struct {
+			pthread_cond_t cond;    /* Condition variable */
+			pthread_mutex_t lock;   /* Waiters and pending wakeup mutex (signaling thread may not hold waiters mutex) */
+			unsigned int waiters;   /* Number of waiting threads */
+			unsigned char pending;  /* Wakeup signaled without waiters (consumed by next wait) */
+		};
+	};
+} virtiohost_res_t;
+
+
+typedef struct {
+	void *va;                       /* Mapping address */
+	size_t size;                    /* Mapping size */
+} virtiohost_map_t;
+
+
+typedef struct {
+	void (*start)(void *);          /* Thread entry point */
+	void *arg;                      /* Thread argument */
+} virtiohost_thr_t;
+
+
+static struct {
+	virtiohost_res_t *res[VIRTIOHOST_HANDLES]; /* Resources (handle is table index) */
+	pthread_t ended[VIRTIOHOST_THREADS]; /* Finished threads */
+	unsigned int nended;            /* Number of finished threads */
+	virtiohost_map_t maps[VIRTIOHOST_MAPS]; /* Physically contiguous mappings */
+	unsigned int nmaps;             /* Number of physically contiguous mappings */
+	pthread_mutex_t lock;           /* Resources, threads and mappings mutex */
+	pthread_cond_t cond;            /* Thread finished condition variable */
+} virtiohost_common = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+
+/* Allocates resource handle (0 handle is never used) */
+static int virtiohost_alloc(handle_t *h, virtiohost_res_t *res)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&virtiohost_common.lock);
+
+	for (i = 1; i < VIRTIOHOST_HANDLES; i++) {
+		if (virtiohost_common.res[i] == NULL) {
+			virtiohost_common.res[i] = res;
+			pthread_mutex_unlock(&virtiohost_common.lock);
+			*h = i;
+			return EOK;
+		}
+	}
+
+	pthread_mutex_unlock(&virtiohost_common.lock);
+
+	return -ENOMEM;
+}
+
+
+/* Returns resource of given type */
+static virtiohost_res_t *virtiohost_get(handle_t h, int type)
+{
+	virtiohost_res_t *res;
+
+	if (h >= VIRTIOHOST_HANDLES)
+		return NULL;
+
+	pthread_mutex_lock(&virtiohost_common.lock);
+	res = virtiohost_common.res[h];
+	pthread_mutex_unlock(&virtiohost_common.lock);
+
+	if ((res == NULL) || (res->type != type))
+		return NULL;
+
+	return res;
+}
+
+
+int mutexCreate(handle_t *h)
+{
+	virtiohost_res_t *res;
+	int err;
+
+	if ((res = malloc(sizeof(*res))) == NULL)
+		return -ENOMEM;
+
+	res->type = resMUTEX;
+	pthread_mutex_init(&res->mutex, NULL);
+
+	if ((err = virtiohost_alloc(h, res)) < 0) {
+		pthread_mutex_destroy(&res->mutex);
+		free(res);
+	}
+
+	return err;
+}
+
+
+int mutexLock(handle_t h)
+{
+	virtiohost_res_t *res;
+
+	if ((res = virtiohost_get(h, resMUTEX)) == NULL)
+		return -EINVAL;
+
+	return -pthread_mutex_lock(&res->mutex);
+}
+
+
+int mutexTry(handle_t h)
+{
+	virtiohost_res_t *res;
+
+	if ((res = virtiohost_get(h, resMUTEX)) == NULL)
+		return -EINVAL;
+
+	return pthread_mutex_trylock(&res->mutex) ? -EBUSY : EOK;
+}
+
+
+int mutexUnlock(handle_t h)
+{
+	virtiohost_res_t *res;
+
+	if ((res = virtiohost_get(h, resMUTEX)) == NULL)
+		return -EINVAL;
+
+	return -pthread_mutex_unlock(&res->mutex);
+}
+
+
+int condCreate(handle_t *h)
+{
+	virtiohost_res_t *res;
+	pthread_condattr_t attr;
+	int err;
+
+	if ((res = malloc(sizeof(*res))) == NULL)
+		return -ENOMEM;
+
+	res->type = resCOND;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&res->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&res->lock, NULL);
+	res->waiters = 0;
+	res->pending = 0;
+
+	if ((err = virtiohost_alloc(h, res)) < 0) {
+		pthread_mutex_destroy(&res->lock);
+		pthread_cond_destroy(&res->cond);
+		free(res);
+	}
+
+	return err;
+}
+
+
+/* Returns absolute monotonic time after given timeout [us] */
+static void virtiohost_deadline(struct timespec *ts, time_t timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += timeout / 1000000;
+	ts->tv_nsec += (timeout % 1000000) * 1000;
+
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+
+/* Phoenix-RTOS wakeup semantics: wakeup signaled without waiters is remembered and consumed by next wait */
+int condWait(handle_t h, handle_t m, time_t timeout)
+{
+	virtiohost_res_t *cond, *mutex;
+	struct timespec ts;
+	int err = 0;
+
+	if (((cond = virtiohost_get(h, resCOND)) == NULL) || ((mutex = virtiohost_get(m, resMUTEX)) == NULL))
+		return -EINVAL;
+
+	if (timeout)
+		virtiohost_deadline(&ts, timeout);
+
+	pthread_mutex_lock(&cond->lock);
+
+	if (cond->pending) {
+		cond->pending = 0;
+		pthread_mutex_unlock(&cond->lock);
+		return EOK;
+	}
+
+	/* Waiters mutex is released after registering as waiter, no wakeup is lost in between */
+	cond->waiters++;
+	pthread_mutex_unlock(&mutex->mutex);
+
+	if (!timeout)
+		pthread_cond_wait(&cond->cond, &cond->lock);
+	else
+		err = pthread_cond_timedwait(&cond->cond, &cond->lock, &ts);
+
+	cond->waiters--;
+	pthread_mutex_unlock(&cond->lock);
+	pthread_mutex_lock(&mutex->mutex);
+
+	return err ? -ETIME : EOK;
+}
+
+
+/* Wakes up waiting threads (or marks wakeup pending if there are none) */
+static int virtiohost_wakeup(handle_t h, int all)
+{
+	virtiohost_res_t *res;
+
+	if ((res = virtiohost_get(h, resCOND)) == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&res->lock);
+
+	if (!res->waiters)
+		res->pending = 1;
+	else if (all)
+		pthread_cond_broadcast(&res->cond);
+	else
+		pthread_cond_signal(&res->cond);
+
+	pthread_mutex_unlock(&res->lock);
+
+	return EOK;
+}
+
+
+int condSignal(handle_t h)
+{
+	return virtiohost_wakeup(h, 0);
+}
+
+
+int condBroadcast(handle_t h)
+{
+	return virtiohost_wakeup(h, 1);
+}
+
+
+int resourceDestroy(handle_t h)
+{
+	virtiohost_res_t *res;
+
+	if (h >= VIRTIOHOST_HANDLES)
+		return -EINVAL;
+
+	pthread_mutex_lock(&virtiohost_common.lock);
+
+	if ((res = virtiohost_common.res[h]) == NULL) {
+		pthread_mutex_unlock(&virtiohost_common.lock);
+		return -EINVAL;
+	}
+	virtiohost_common.res[h] = NULL;
+
+	pthread_mutex_unlock(&virtiohost_common.lock);
+
+	if (res->type == resMUTEX) {
+		pthread_mutex_destroy(&res->mutex);
+	}
+	else {
+		pthread_mutex_destroy(&res->lock);
+		pthread_cond_destroy(&res->cond);
+	}
+	free(res);
+
+	return EOK;
+}
+
+
+/* Queues finished thread for threadJoin() */
+static void virtiohost_end(void *arg)
+{
+	pthread_mutex_lock(&virtiohost_common.lock);
+
+	while (virtiohost_common.nended == VIRTIOHOST_THREADS)
+		pthread_cond_wait(&virtiohost_common.cond, &virtiohost_common.lock);
+
+	virtiohost_common.ended[virtiohost_common.nended++] = pthread_self();
+	pthread_cond_broadcast(&virtiohost_common.cond);
+
+	pthread_mutex_unlock(&virtiohost_common.lock);
+}
+
+
+static void *virtiohost_thr(void *arg)
+{
+	virtiohost_thr_t thr = *(virtiohost_thr_t *)arg;
+
+	free(arg);
+
+	pthread_cleanup_push(virtiohost_end, NULL);
+	thr.start(thr.arg);
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+
+int beginthread(void (*start)(void *), unsigned int priority, void *stack, unsigned int stacksz, void *arg)
+{
+	virtiohost_thr_t *thr;
+	pthread_t tid;
+
+	if ((thr = malloc(sizeof(*thr))) == NULL)
+		return -ENOMEM;
+
+	thr->start = start;
+	thr->arg = arg;
+
+	if (pthread_create(&tid, NULL, virtiohost_thr, thr)) {
+		free(thr);
+		return -ENOMEM;
+	}
+
+	return EOK;
+}
+
+
+void endthread(void)
+{
+	pthread_exit(NULL);
+}
+
+
+int threadJoin(time_t timeout)
+{
+	struct timespec ts;
+	pthread_t tid;
+
+	if (timeout)
+		virtiohost_deadline(&ts, timeout);
+
+	pthread_mutex_lock(&virtiohost_common.lock);
+
+	while (!virtiohost_common.nended) {
+		if (!timeout) {
+			pthread_cond_wait(&virtiohost_common.cond, &virtiohost_common.lock);
+		}
+		else if (pthread_cond_timedwait(&virtiohost_common.cond, &virtiohost_common.lock, &ts)) {
+			pthread_mutex_unlock(&virtiohost_common.lock);
+			return -ETIME;
+		}
+	}
+	tid = virtiohost_common.ended[--virtiohost_common.nended];
+	pthread_cond_broadcast(&virtiohost_common.cond);
+
+	pthread_mutex_unlock(&virtiohost_common.lock);
+
+	pthread_join(tid, NULL);
+
+	return EOK;
+}
+
+
+int gettime(time_t *raw, time_t *offs)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (raw != NULL)
+		*raw = (time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	if (offs != NULL)
+		*offs = 0;
+
+	return EOK;
+}
+
+
+int interrupt(unsigned int n, int (*f)(unsigned int, void *), void *arg, handle_t cond, handle_t *handle)
+{
+	return -ENOSYS;
+}
+
+
+void *virtiohost_mmap(void *vaddr, size_t size, int prot, int flags, int oid, off_t offs)
+{
+	void *va;
+
+	/* Physical memory isn't accessible */
+	if (oid != OID_CONTIGUOUS)
+		return MAP_FAILED;
+
+	if ((va = mmap(vaddr, size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return MAP_FAILED;
+
+	pthread_mutex_lock(&virtiohost_common.lock);
+
+	if (virtiohost_common.nmaps == VIRTIOHOST_MAPS) {
+		pthread_mutex_unlock(&virtiohost_common.lock);
+		munmap(va, size);
+		return MAP_FAILED;
+	}
+	virtiohost_common.maps[virtiohost_common.nmaps].va = va;
+	virtiohost_common.maps[virtiohost_common.nmaps++].size = size;
+
+	pthread_mutex_unlock(&virtiohost_common.lock);
+
+	return va;
+}
+
+
+int virtiohost_munmap(void *vaddr, size_t size)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&virtiohost_common.lock);
+
+	for (i = 0; i < virtiohost_common.nmaps; i++) {
+		if (virtiohost_common.maps[i].va == vaddr) {
+			virtiohost_common.maps[i] = virtiohost_common.maps[--virtiohost_common.nmaps];
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&virtiohost_common.lock);
+
+	return munmap(vaddr, size);
+}
+
+
+addr_t va2pa(void *va)
+{
+	virtiohost_map_t *map;
+	unsigned int i;
+
+	pthread_mutex_lock(&virtiohost_common.lock);
+
+	/* Contiguous mappings are identity mapped */
+	for (i = 0; i < virtiohost_common.nmaps; i++) {
+		map = &virtiohost_common.maps[i];
+
+		if (((uintptr_t)va >= (uintptr_t)map->va) && ((uintptr_t)va - (uintptr_t)map->va < map->size)) {
+			pthread_mutex_unlock(&virtiohost_common.lock);
+			return (addr_t)va;
+		}
+	}
+
+	pthread_mutex_unlock(&virtiohost_common.lock);
+
+	/* Other pages are physically adjacent only within aligned 2-page blocks */
+	return ((addr_t)va ^ VIRTIOHOST_PHYSSWP) | VIRTIOHOST_PHYSWIN;
+}
+
+
+void *virtiohost_pa2va(addr_t pa, size_t len)
+{
+	if (!(pa & VIRTIOHOST_PHYSWIN))
+		return (void *)pa;
+
+	/* Range has to be physically contiguous */
+	if (len && ((pa & ~(VIRTIOHOST_PHYSSWP - 1)) != ((pa + len - 1) & ~(VIRTIOHOST_PHYSSWP - 1))))
+		return NULL;
+
+	return (void *)((pa & ~VIRTIOHOST_PHYSWIN) ^ VIRTIOHOST_PHYSSWP);
+}
@@ -0,0 +1,1625 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO loopback device (emulates VirtIO GPU 2D, block, network and console devices in memory)
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/threads.h>
+
+#include "virtio.h"
+
+
+/* Emulated display size */
+#ifndef VIRTIOLOOP_WIDTH
+#define VIRTIOLOOP_WIDTH 1024
+#endif
+
+#ifndef VIRTIOLOOP_HEIGHT
+#define VIRTIOLOOP_HEIGHT 768
+#endif
+
+
+/* Emulated disk size */
+#ifndef VIRTIOLOOP_DISKSZ
+#define VIRTIOLOOP_DISKSZ (16 * 1024 * 1024)
+#endif
+
+
+/* Number of network device queue pairs (transmitted frames are received by the same pair) */
+#define VIRTIOLOOP_PAIRS 2
+
+
+/* Number of console device ports (transmitted data is echoed back to the port) */
+#define VIRTIOLOOP_PORTS 2
+
+
+/* Number of device virtqueues (GPU control and cursor queues, block request queues, network queue pairs and control queue, console port queues and control queues) */
+#define VIRTIOLOOP_QUEUES (2 * VIRTIOLOOP_PORTS + 2)
+
+
+/* Maximum virtqueue size */
+#define VIRTIOLOOP_QSIZE 256
+
+
+/* Maximum number of request buffers */
+#define VIRTIOLOOP_SEGS 64
+
+
+/* Maximum request and response size */
+#define VIRTIOLOOP_CMDSZ 4096
+#define VIRTIOLOOP_RESPSZ 2048
+
+
+/* Device thread stack size */
+#define VIRTIOLOOP_STACKSZ 8192
+
+
+/* Device values are little endian (VERSION_1 device) */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	#define virtioloop_le16(n) ((uint16_t)(n))
+	#define virtioloop_le32(n) ((uint32_t)(n))
+	#define virtioloop_le64(n) ((uint64_t)(n))
+#else
+	#define virtioloop_le16(n) __builtin_bswap16(n)
+	#define virtioloop_le32(n) __builtin_bswap32(n)
+	#define virtioloop_le64(n) __builtin_bswap64(n)
+#endif
+
+
+typedef struct _virtioloop_res_t {
+	uint32_t rid;                   /* Resource ID */
+	uint32_t w;                     /* Resource width */
+	uint32_t h;                     /* Resource height */
+	uint8_t *data;                  /* Host resource memory */
+	struct {
+		uint64_t addr;              /* Backing buffer address */
+		uint32_t len;               /* Backing buffer length */
+	} *ents;                        /* Attached backing buffers */
+	unsigned int nents;             /* Number of attached backing buffers */
+	struct _virtioloop_res_t *next; /* Next resource */
+} virtioloop_res_t;
+
+
+typedef struct {
+	uint32_t num;                   /* Virtqueue size */
+	uint32_t ready;                 /* Virtqueue ready */
+	uint64_t desc;                  /* Descriptors physical address */
+	uint64_t drv;                   /* Driver area (avail ring) physical address */
+	uint64_t dev;                   /* Device area (used ring) physical address */
+	volatile virtio_desc_t *vdesc;  /* Mapped descriptors */
+	volatile virtio_avail_t *avail; /* Mapped avail ring */
+	volatile virtio_used_t *used;   /* Mapped used ring */
+	volatile uint16_t *uevent;      /* Mapped used event notification suppression */
+	volatile uint16_t *aevent;      /* Mapped avail event notification suppression */
+	volatile virtio_pdesc_t *pdesc; /* Mapped descriptors ring (packed virtqueue) */
+	volatile virtio_event_t *drvevt; /* Mapped driver event suppression (packed virtqueue) */
+	volatile virtio_event_t *devevt; /* Mapped device event suppression (packed virtqueue) */
+	uint16_t last;                  /* Next avail ring index to process (next descriptor for packed virtqueue) */
+	uint16_t uidx;                  /* Next used ring index (next used descriptor for packed virtqueue) */
+	unsigned char packed;           /* Packed virtqueue layout */
+	unsigned char awrap;            /* Avail wrap counter (packed virtqueue only) */
+	unsigned char uwrap;            /* Used wrap counter (packed virtqueue only) */
+} virtioloop_queue_t;
+
+
+typedef struct {
+	void *va;                       /* Mapped buffer */
+	uint32_t len;                   /* Buffer length */
+	uint8_t write;                  /* Device writable buffer */
+} virtioloop_seg_t;
+
+
+typedef struct {
+	/* Transport registers */
+	uint32_t id;                    /* Device ID */
+	uint32_t dfsel;                 /* Device features word select */
+	uint32_t gfsel;                 /* Driver features word select */
+	uint32_t qsel;                  /* Selected virtqueue */
+	uint32_t status;                /* Device status */
+	uint32_t isr;                   /* Interrupt status */
+	uint64_t dfeatures;             /* Device features */
+	uint64_t gfeatures;             /* Driver features */
+	uint8_t cfg[64];                /* Configuration space */
+	virtioloop_queue_t queues[VIRTIOLOOP_QUEUES];
+
+	/* Interrupt emulation */
+	int (*handler)(unsigned int, void *); /* Interrupt handler */
+	void *arg;                      /* Interrupt handler argument */
+	handle_t icond;                 /* Condition variable signaled by interrupt handler return */
+	unsigned char inirq;            /* Interrupt handler running */
+
+	/* GPU state */
+	virtioloop_res_t *res;          /* Resources */
+	virtioloop_res_t *scanout;      /* Scanout resource */
+	uint32_t cx;                    /* Cursor horizontal coordinate */
+	uint32_t cy;                    /* Cursor vertical coordinate */
+	uint32_t crid;                  /* Cursor resource ID */
+
+	/* Block device state */
+	uint8_t *disk;                  /* Disk memory */
+
+	/* Network and console device state */
+	unsigned int drops;             /* Frames (data) dropped due to lack of receive buffers */
+	uint16_t pairs;                 /* Active network queue pairs */
+	int rxirq;                      /* Receive virtqueue interrupt pending */
+
+	/* Device thread */
+	unsigned int notify;            /* Pending virtqueues notifications */
+	volatile unsigned int done;     /* End device thread? */
+	void *stack;                    /* Device thread stack */
+	handle_t lock;                  /* Device mutex */
+	handle_t cond;                  /* Notification condition variable */
+	handle_t ucond;                 /* Interrupt handler done condition variable */
+
+	/* Request processing buffers */
+	virtioloop_seg_t segs[VIRTIOLOOP_SEGS];
+	virtioloop_seg_t rsegs[VIRTIOLOOP_SEGS];
+	struct {
+		uint16_t id;                /* Buffer ID */
+		uint16_t n;                 /* Number of buffer ring descriptors */
+		uint32_t len;               /* Number of bytes written to buffer */
+	} rused[VIRTIOLOOP_QSIZE];      /* Receive buffers used by data (written after all data is received) */
+	uint8_t cmd[VIRTIOLOOP_CMDSZ];
+	uint8_t resp[VIRTIOLOOP_RESPSZ];
+} virtioloop_dev_t;
+
+
+/* Maps guest memory (loopback device shares guest address space on host builds) */
+static void *virtioloop_map(uint64_t pa, size_t len)
+{
+#ifdef VIRTIO_HOST
+	return virtiohost_pa2va(pa, len);
+#else
+	uintptr_t offs = pa & (_PAGE_SIZE - 1);
+	void *va;
+
+	if ((va = mmap(NULL, (offs + len + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1), PROT_READ | PROT_WRITE, MAP_DEVICE | VIRTIO_DMAATTR, OID_PHYSMEM, pa - offs)) == MAP_FAILED)
+		return NULL;
+
+	return (void *)((uintptr_t)va + offs);
+#endif
+}
+
+
+/* Unmaps guest memory */
+static void virtioloop_unmap(void *va, size_t len)
+{
+#ifndef VIRTIO_HOST
+	uintptr_t offs = (uintptr_t)va & (_PAGE_SIZE - 1);
+
+	munmap((void *)((uintptr_t)va - offs), (offs + len + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1));
+#endif
+}
+
+
+static inline uint16_t virtioloop_get16(const uint8_t *buff, unsigned int offs)
+{
+	uint16_t val;
+
+	memcpy(&val, buff + offs, sizeof(val));
+
+	return virtioloop_le16(val);
+}
+
+
+static inline uint32_t virtioloop_get32(const uint8_t *buff, unsigned int offs)
+{
+	uint32_t val;
+
+	memcpy(&val, buff + offs, sizeof(val));
+
+	return virtioloop_le32(val);
+}
+
+
+static inline uint64_t virtioloop_get64(const uint8_t *buff, unsigned int offs)
+{
+	uint64_t val;
+
+	memcpy(&val, buff + offs, sizeof(val));
+
+	return virtioloop_le64(val);
+}
+
+
+static inline void virtioloop_put16(uint8_t *buff, unsigned int offs, uint16_t val)
+{
+	val = virtioloop_le16(val);
+	memcpy(buff + offs, &val, sizeof(val));
+}
+
+
+static inline void virtioloop_put32(uint8_t *buff, unsigned int offs, uint32_t val)
+{
+	val = virtioloop_le32(val);
+	memcpy(buff + offs, &val, sizeof(val));
+}
+
+
+static inline void virtioloop_put64(uint8_t *buff, unsigned int offs, uint64_t val)
+{
+	val = virtioloop_le64(val);
+	memcpy(buff + offs, &val, sizeof(val));
+}
+
+
+/* Returns GPU resource */
+static virtioloop_res_t *virtioloop_resource(virtioloop_dev_t *dev, uint32_t rid)
+{
+	virtioloop_res_t *res;
+
+	for (res = dev->res; res != NULL; res = res->next) {
+		if (res->rid == rid)
+			return res;
+	}
+
+	return NULL;
+}
+
+
+/* Detaches GPU resource backing buffers */
+static void virtioloop_detach(virtioloop_res_t *res)
+{
+	free(res->ents);
+	res->ents = NULL;
+	res->nents = 0;
+}
+
+
+/* Destroys GPU resource */
+static void virtioloop_unref(virtioloop_dev_t *dev, virtioloop_res_t *res)
+{
+	virtioloop_res_t **r;
+
+	for (r = &dev->res; *r != res; r = &(*r)->next);
+	*r = res->next;
+
+	if (dev->scanout == res)
+		dev->scanout = NULL;
+
+	virtioloop_detach(res);
+	free(res->data);
+	free(res);
+}
+
+
+/* Copies resource backing memory into host resource memory */
+static int virtioloop_fetch(virtioloop_res_t *res, uint64_t offs, uint8_t *dst, size_t len)
+{
+	unsigned int i;
+	size_t n;
+	void *src;
+
+	for (i = 0; (i < res->nents) && len; i++) {
+		if (offs >= res->ents[i].len) {
+			offs -= res->ents[i].len;
+			continue;
+		}
+
+		n = res->ents[i].len - offs;
+		if (n > len)
+			n = len;
+
+		if ((src = virtioloop_map(res->ents[i].addr + offs, n)) == NULL)
+			return -ENOMEM;
+		memcpy(dst, src, n);
+		virtioloop_unmap(src, n);
+
+		dst += n;
+		len -= n;
+		offs = 0;
+	}
+
+	return len ? -EINVAL : EOK;
+}
+
+
+/* Executes GPU control request, returns response type (response data is written by request handler) */
+static uint32_t virtioloop_gpuctl(virtioloop_dev_t *dev, const uint8_t *cmd, unsigned int len, uint8_t *resp, unsigned int *rlen)
+{
+	virtioloop_res_t *res;
+	uint32_t x, y, w, h, rid, i, n;
+	uint64_t offs;
+
+	*rlen = 24;
+
+	switch (virtioloop_get32(cmd, 0)) {
+		/* Get display info */
+		case 0x100:
+			memset(resp + 24, 0, 16 * 24);
+			virtioloop_put32(resp, 24 + 8, VIRTIOLOOP_WIDTH);
+			virtioloop_put32(resp, 24 + 12, VIRTIOLOOP_HEIGHT);
+			virtioloop_put32(resp, 24 + 16, 1);
+			*rlen += 16 * 24;
+			return 0x1101;
+
+		/* Get EDID */
+		case 0x10a:
+			if ((len < 32) || virtioloop_get32(cmd, 24))
+				return 0x1202;
+
+			/* Minimal EDID block (header and checksum) */
+			memset(resp + 24, 0, 8 + 1024);
+			virtioloop_put32(resp, 24, 128);
+			memset(resp + 32 + 1, 0xff, 6);
+			resp[32 + 127] = (uint8_t)(256 - (6 * 0xff) % 256);
+			*rlen += 8 + 1024;
+			return 0x1104;
+
+		/* Create 2D resource */
+		case 0x101:
+			if (len < 40)
+				return 0x1205;
+
+			rid = virtioloop_get32(cmd, 24);
+			w = virtioloop_get32(cmd, 32);
+			h = virtioloop_get32(cmd, 36);
+			if (!rid || (virtioloop_resource(dev, rid) != NULL))
+				return 0x1203;
+
+			if (!w || !h || ((uint64_t)w * h > (1ULL << 28)))
+				return 0x1205;
+
+			if ((res = malloc(sizeof(*res))) == NULL)
+				return 0x1201;
+
+			if ((res->data = calloc((size_t)w * h, 4)) == NULL) {
+				free(res);
+				return 0x1201;
+			}
+			res->rid = rid;
+			res->w = w;
+			res->h = h;
+			res->ents = NULL;
+			res->nents = 0;
+			res->next = dev->res;
+			dev->res = res;
+			return 0x1100;
+
+		/* Destroy resource */
+		case 0x102:
+			if ((len < 32) || ((res = virtioloop_resource(dev, virtioloop_get32(cmd, 24))) == NULL))
+				return 0x1203;
+
+			virtioloop_unref(dev, res);
+			return 0x1100;
+
+		/* Set scanout */
+		case 0x103:
+			if (len < 48)
+				return 0x1205;
+
+			if (virtioloop_get32(cmd, 40))
+				return 0x1202;
+
+			if (!(rid = virtioloop_get32(cmd, 44))) {
+				dev->scanout = NULL;
+				return 0x1100;
+			}
+
+			if ((res = virtioloop_resource(dev, rid)) == NULL)
+				return 0x1203;
+
+			x = virtioloop_get32(cmd, 24);
+			y = virtioloop_get32(cmd, 28);
+			w = virtioloop_get32(cmd, 32);
+			h = virtioloop_get32(cmd, 36);
+			if (((uint64_t)x + w > res->w) || ((uint64_t)y + h > res->h))
+				return 0x1205;
+
+			dev->scanout = res;
+			return 0x1100;
+
+		/* Flush resource (scanout reads host resource memory directly) */
+		case 0x104:
+			if ((len < 48) || (virtioloop_resource(dev, virtioloop_get32(cmd, 40)) == NULL))
+				return 0x1203;
+
+			return 0x1100;
+
+		/* Transfer to host 2D resource */
+		case 0x105:
+			if (len < 56)
+				return 0x1205;
+
+			if ((res = virtioloop_resource(dev, virtioloop_get32(cmd, 48))) == NULL)
+				return 0x1203;
+
+			x = virtioloop_get32(cmd, 24);
+			y = virtioloop_get32(cmd, 28);
+			w = virtioloop_get32(cmd, 32);
+			h = virtioloop_get32(cmd, 36);
+			offs = virtioloop_get64(cmd, 40);
+			if (!res->nents || ((uint64_t)x + w > res->w) || ((uint64_t)y + h > res->h))
+				return 0x1205;
+
+			for (i = 0; i < h; i++) {
+				if (virtioloop_fetch(res, offs + (uint64_t)i * res->w * 4, res->data + ((size_t)(y + i) * res->w + x) * 4, (size_t)w * 4) < 0)
+					return 0x1205;
+			}
+			return 0x1100;
+
+		/* Attach resource backing buffers */
+		case 0x106:
+			if (len < 32)
+				return 0x1205;
+
+			if ((res = virtioloop_resource(dev, virtioloop_get32(cmd, 24))) == NULL)
+				return 0x1203;
+
+			n = virtioloop_get32(cmd, 28);
+			if (!n || res->nents || (len < 32 + 16 * (uint64_t)n))
+				return 0x1205;
+
+			if ((res->ents = malloc(n * sizeof(*res->ents))) == NULL)
+				return 0x1201;
+
+			for (i = 0; i < n; i++) {
+				res->ents[i].addr = virtioloop_get64(cmd, 32 + 16 * i);
+				res->ents[i].len = virtioloop_get32(cmd, 32 + 16 * i + 8);
+			}
+			res->nents = n;
+			return 0x1100;
+
+		/* Detach resource backing buffers */
+		case 0x107:
+			if ((len < 32) || ((res = virtioloop_resource(dev, virtioloop_get32(cmd, 24))) == NULL))
+				return 0x1203;
+
+			virtioloop_detach(res);
+			return 0x1100;
+
+		default:
+			return 0x1200;
+	}
+}
+
+
+/* Maps packed virtqueue request buffers starting at given descriptor, returns number of mapped buffers */
+static unsigned int virtioloop_gatherPacked(virtioloop_queue_t *vq, uint16_t head, virtioloop_seg_t *segs, void **itbl, unsigned int *ilen)
+{
+	volatile virtio_pdesc_t *tbl = vq->pdesc;
+	unsigned int i = head, n = 0, size = vq->num;
+	uint16_t flags;
+
+	*itbl = NULL;
+	*ilen = 0;
+
+	while (n < VIRTIOLOOP_SEGS) {
+		flags = virtioloop_le16(tbl[i].flags);
+
+		/* Indirect descriptor table (table descriptors are chained implicitly) */
+		if ((*itbl == NULL) && (flags & 0x4)) {
+			*ilen = virtioloop_le32(tbl[i].len);
+			if ((*itbl = virtioloop_map(virtioloop_le64(tbl[i].addr), *ilen)) == NULL)
+				break;
+			tbl = *itbl;
+			size = *ilen / sizeof(virtio_pdesc_t);
+			i = 0;
+			if (!size)
+				break;
+			continue;
+		}
+
+		segs[n].len = virtioloop_le32(tbl[i].len);
+		segs[n].write = !!(flags & 0x2);
+		if ((segs[n].va = virtioloop_map(virtioloop_le64(tbl[i].addr), segs[n].len)) == NULL)
+			break;
+		n++;
+
+		if (*itbl != NULL) {
+			if (++i == size)
+				break;
+		}
+		else {
+			if (!(flags & 0x1))
+				break;
+
+			if (++i == size)
+				i = 0;
+		}
+	}
+
+	return n;
+}
+
+
+/* Maps request buffers starting at given descriptor, returns number of mapped buffers */
+static unsigned int virtioloop_gather(virtioloop_dev_t *dev, unsigned int q, uint16_t head, virtioloop_seg_t *segs, void **itbl, unsigned int *ilen)
+{
+	virtioloop_queue_t *vq = &dev->queues[q];
+	volatile virtio_desc_t *tbl = vq->vdesc;
+	unsigned int i, n = 0, size = vq->num;
+	uint16_t flags;
+
+	if (vq->packed)
+		return virtioloop_gatherPacked(vq, head, segs, itbl, ilen);
+
+	*itbl = NULL;
+	*ilen = 0;
+
+	for (i = head; (i < size) && (n < VIRTIOLOOP_SEGS); i = virtioloop_le16(tbl[i].next)) {
+		flags = virtioloop_le16(tbl[i].flags);
+
+		/* Indirect descriptor table */
+		if (flags & 0x4) {
+			if (*itbl != NULL)
+				break;
+
+			*ilen = virtioloop_le32(tbl[i].len);
+			if ((*itbl = virtioloop_map(virtioloop_le64(tbl[i].addr), *ilen)) == NULL)
+				break;
+			tbl = *itbl;
+			size = *ilen / sizeof(virtio_desc_t);
+			i = 0;
+			flags = virtioloop_le16(tbl[i].flags);
+		}
+
+		segs[n].len = virtioloop_le32(tbl[i].len);
+		segs[n].write = !!(flags & 0x2);
+		if ((segs[n].va = virtioloop_map(virtioloop_le64(tbl[i].addr), segs[n].len)) == NULL)
+			break;
+		n++;
+
+		if (!(flags & 0x1))
+			break;
+	}
+
+	return n;
+}
+
+
+/* Unmaps request buffers */
+static void virtioloop_release(virtioloop_seg_t *segs, unsigned int n, void *itbl, unsigned int ilen)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		virtioloop_unmap(segs[i].va, segs[i].len);
+
+	if (itbl != NULL)
+		virtioloop_unmap(itbl, ilen);
+}
+
+
+/* Returns next available request head descriptor or -1 if there are no available requests (device has to be locked) */
+static int virtioloop_avail(virtioloop_queue_t *vq)
+{
+	uint16_t flags;
+
+	/* Available packed virtqueue descriptor has AVAIL flag equal to and USED flag inverse of avail wrap counter */
+	if (vq->packed) {
+		flags = virtioloop_le16(vq->pdesc[vq->last].flags);
+		if ((!!(flags & (1 << 7)) != vq->awrap) || (!!(flags & (1 << 15)) == vq->awrap))
+			return -1;
+		virtio_rmb();
+
+		return vq->last;
+	}
+
+	if (vq->last == virtioloop_le16(vq->avail->idx))
+		return -1;
+	virtio_rmb();
+
+	return virtioloop_le16(vq->avail->ring[vq->last & (vq->num - 1)]);
+}
+
+
+/* Takes available request off the virtqueue, returns number of its ring descriptors (device has to be locked) */
+static unsigned int virtioloop_consume(virtioloop_queue_t *vq, uint16_t head, uint16_t *id)
+{
+	unsigned int i = head, n = 1;
+
+	if (!vq->packed) {
+		*id = head;
+		vq->last++;
+		return 1;
+	}
+
+	/* Buffer ID is stored in last descriptor of the chain */
+	while ((n < vq->num) && (virtioloop_le16(vq->pdesc[i].flags) & 0x1)) {
+		if (++i == vq->num)
+			i = 0;
+		n++;
+	}
+	*id = virtioloop_le16(vq->pdesc[i].id);
+
+	if ((vq->last += n) >= vq->num) {
+		vq->last -= vq->num;
+		vq->awrap ^= 1;
+	}
+
+	return n;
+}
+
+
+/* Writes used buffer (skipping n packed virtqueue descriptors), returns number of written used ring entries (device has to be locked) */
+static unsigned int virtioloop_used(virtioloop_queue_t *vq, uint16_t id, uint32_t len, unsigned int n)
+{
+	volatile virtio_used_elem_t *elem;
+	volatile virtio_pdesc_t *desc;
+
+	/* Packed virtqueue descriptor is used (and published) by setting its AVAIL and USED flags to used wrap counter */
+	if (vq->packed) {
+		desc = &vq->pdesc[vq->uidx];
+		desc->id = virtioloop_le16(id);
+		desc->len = virtioloop_le32(len);
+		virtio_wmb();
+		desc->flags = virtioloop_le16(vq->uwrap ? ((1 << 7) | (1 << 15)) : 0);
+
+		if ((vq->uidx += n) >= vq->num) {
+			vq->uidx -= vq->num;
+			vq->uwrap ^= 1;
+		}
+
+		return n;
+	}
+
+	elem = &vq->used->ring[vq->uidx & (vq->num - 1)];
+	elem->id = virtioloop_le32(id);
+	elem->len = virtioloop_le32(len);
+	vq->uidx++;
+
+	return 1;
+}
+
+
+/* Checks if driver should be interrupted after publishing n used ring entries starting at old index (device has to be locked) */
+static int virtioloop_irq(virtioloop_dev_t *dev, virtioloop_queue_t *vq, uint16_t old, unsigned int n)
+{
+	uint16_t event, flags, offs;
+
+	if (!n)
+		return 0;
+
+	if (vq->packed) {
+		flags = virtioloop_le16(vq->drvevt->flags);
+		if ((flags != 0x2) || !(dev->gfeatures & (1ULL << 29)))
+			return (flags != 0x1);
+
+		if (n >= vq->num)
+			return 1;
+
+		/* Event descriptor offset and old used index relative to current used wrap */
+		event = virtioloop_le16(vq->drvevt->desc);
+		offs = event & 0x7fff;
+		if ((event >> 15) != vq->uwrap)
+			offs -= vq->num;
+		if (vq->uidx <= old)
+			old -= vq->num;
+
+		return (uint16_t)(vq->uidx - offs - 1) < (uint16_t)(vq->uidx - old);
+	}
+
+	if (dev->gfeatures & (1ULL << 29)) {
+		event = virtioloop_le16(*vq->uevent);
+		return (uint16_t)(vq->uidx - event - 1) < (uint16_t)(vq->uidx - old);
+	}
+
+	return !(virtioloop_le16(vq->avail->flags) & 0x1);
+}
+
+
+/* Receives data into receive queue buffers (network frame or console data), returns non-zero if driver should be interrupted (device has to be locked) */
+static int virtioloop_rx(virtioloop_dev_t *dev, unsigned int q, const uint8_t *data, unsigned int size)
+{
+	virtioloop_queue_t *vq = &dev->queues[q];
+	uint16_t first = 0, last = vq->last, old = vq->uidx;
+	unsigned int i, n, m, ilen, len, offs = 0, nbufs = 0, nused = 0;
+	int head, mrg = (dev->id != 1) || (dev->gfeatures & (1ULL << 15));
+	unsigned char awrap = vq->awrap;
+	void *itbl;
+
+	if (!vq->ready)
+		return 0;
+
+	while (offs < size) {
+		/* Drop data (used buffers aren't written yet, they are returned to avail ring), only console data and mergeable frames span buffers */
+		if ((nbufs && !mrg) || ((head = virtioloop_avail(vq)) < 0)) {
+			vq->last = last;
+			vq->awrap = awrap;
+			dev->drops++;
+			return 0;
+		}
+
+		if (!nbufs)
+			first = head;
+
+		n = virtioloop_gather(dev, q, head, dev->rsegs, &itbl, &ilen);
+		for (i = 0, len = 0; (i < n) && (offs < size); i++) {
+			if (!dev->rsegs[i].write)
+				continue;
+
+			m = dev->rsegs[i].len;
+			if (m > size - offs)
+				m = size - offs;
+			memcpy(dev->rsegs[i].va, data + offs, m);
+			offs += m;
+			len += m;
+		}
+		virtioloop_release(dev->rsegs, n, itbl, ilen);
+
+		dev->rused[nbufs].n = virtioloop_consume(vq, head, &dev->rused[nbufs].id);
+		dev->rused[nbufs++].len = len;
+	}
+
+	/* Number of buffers used by network frame is stored in the first buffer header */
+	if ((dev->id == 1) && (nbufs > 1)) {
+		n = virtioloop_gather(dev, q, first, dev->rsegs, &itbl, &ilen);
+		if (n && dev->rsegs[0].write && (dev->rsegs[0].len >= 12))
+			virtioloop_put16(dev->rsegs[0].va, 10, nbufs);
+		virtioloop_release(dev->rsegs, n, itbl, ilen);
+	}
+
+	/* Publish used buffers (packed virtqueue descriptors are published by their flags) */
+	for (i = 0; i < nbufs; i++)
+		nused += virtioloop_used(vq, dev->rused[i].id, dev->rused[i].len, dev->rused[i].n);
+
+	if (!vq->packed) {
+		virtio_wmb();
+		vq->used->idx = virtioloop_le16(vq->uidx);
+	}
+	virtio_mb();
+
+	return virtioloop_irq(dev, vq, old, nused);
+}
+
+
+/* Executes block request, returns number of bytes written to request buffers */
+static unsigned int virtioloop_blk(virtioloop_dev_t *dev, unsigned int n)
+{
+	uint64_t offs, sector;
+	unsigned int h, i, len = 0;
+	uint8_t *status;
+	uint32_t type;
+
+	/* Header (may span physically discontiguous buffers) is followed by data buffers and status byte */
+	for (h = 0; (h < n) && !dev->segs[h].write && (len < 16); h++) {
+		offs = dev->segs[h].len;
+		if (offs > 16 - len)
+			offs = 16 - len;
+		memcpy(dev->cmd + len, dev->segs[h].va, offs);
+		len += offs;
+	}
+
+	if ((len < 16) || (h >= n) || !dev->segs[n - 1].write || !dev->segs[n - 1].len)
+		return 0;
+
+	type = virtioloop_get32(dev->cmd, 0);
+	sector = virtioloop_get64(dev->cmd, 8);
+	status = (uint8_t *)dev->segs[n - 1].va + dev->segs[n - 1].len - 1;
+	*status = 0;
+	len = 0;
+
+	switch (type) {
+		/* Read */
+		case 0:
+			for (i = h, offs = sector * 512; i < n - 1; offs += dev->segs[i++].len) {
+				if (!dev->segs[i].write || (offs + dev->segs[i].len > VIRTIOLOOP_DISKSZ)) {
+					*status = 1;
+					break;
+				}
+				memcpy(dev->segs[i].va, dev->disk + offs, dev->segs[i].len);
+				len += dev->segs[i].len;
+			}
+			break;
+
+		/* Write */
+		case 1:
+			for (i = h, offs = sector * 512; i < n - 1; offs += dev->segs[i++].len) {
+				if (dev->segs[i].write || (offs + dev->segs[i].len > VIRTIOLOOP_DISKSZ)) {
+					*status = 1;
+					break;
+				}
+				memcpy(dev->disk + offs, dev->segs[i].va, dev->segs[i].len);
+			}
+			break;
+
+		/* Flush (disk memory is always in sync) */
+		case 4:
+			break;
+
+		/* Discard and write zeroes (discarded sectors read back as zeroes) */
+		case 11:
+		case 13:
+			for (i = h; i < n - 1; i++) {
+				for (offs = 0; offs + 16 <= dev->segs[i].len; offs += 16) {
+					sector = virtioloop_get64(dev->segs[i].va, offs);
+					if ((sector + virtioloop_get32(dev->segs[i].va, offs + 8)) * 512 > VIRTIOLOOP_DISKSZ) {
+						*status = 1;
+						break;
+					}
+					memset(dev->disk + sector * 512, 0, (size_t)virtioloop_get32(dev->segs[i].va, offs + 8) * 512);
+				}
+			}
+			break;
+
+		default:
+			*status = 2;
+			break;
+	}
+
+	return len + 1;
+}
+
+
+/* Executes GPU request, returns number of bytes written to request buffers */
+static unsigned int virtioloop_gpu(virtioloop_dev_t *dev, unsigned int q, unsigned int n)
+{
+	unsigned int i, len = 0, rlen, offs;
+	uint32_t type;
+
+	/* Gather device readable buffers */
+	for (i = 0; (i < n) && !dev->segs[i].write; i++) {
+		offs = dev->segs[i].len;
+		if (offs > sizeof(dev->cmd) - len)
+			offs = sizeof(dev->cmd) - len;
+		memcpy(dev->cmd + len, dev->segs[i].va, offs);
+		len += offs;
+	}
+
+	if (len < 24)
+		return 0;
+
+	/* Cursor requests have no response */
+	if (q == 1) {
+		if ((len >= 52) && ((virtioloop_get32(dev->cmd, 0) == 0x300) || (virtioloop_get32(dev->cmd, 0) == 0x301))) {
+			dev->cx = virtioloop_get32(dev->cmd, 28);
+			dev->cy = virtioloop_get32(dev->cmd, 32);
+			if (virtioloop_get32(dev->cmd, 0) == 0x300)
+				dev->crid = virtioloop_get32(dev->cmd, 40);
+		}
+		return 0;
+	}
+
+	type = virtioloop_gpuctl(dev, dev->cmd, len, dev->resp, &rlen);
+
+	/* Response header (fenced requests return their fence) */
+	virtioloop_put32(dev->resp, 0, type);
+	virtioloop_put32(dev->resp, 4, virtioloop_get32(dev->cmd, 4) & 0x1);
+	virtioloop_put64(dev->resp, 8, (virtioloop_get32(dev->cmd, 4) & 0x1) ? virtioloop_get64(dev->cmd, 8) : 0);
+	virtioloop_put32(dev->resp, 16, virtioloop_get32(dev->cmd, 16));
+	virtioloop_put32(dev->resp, 20, 0);
+
+	/* Scatter response into device writable buffers */
+	for (len = 0; (i < n) && (len < rlen); i++) {
+		offs = dev->segs[i].len;
+		if (offs > rlen - len)
+			offs = rlen - len;
+		memcpy(dev->segs[i].va, dev->resp + len, offs);
+		len += offs;
+	}
+
+	return len;
+}
+
+
+/* Executes network control or transmit request, returns number of bytes written to request buffers */
+static unsigned int virtioloop_net(virtioloop_dev_t *dev, unsigned int q, unsigned int n)
+{
+	unsigned int i, len = 0, offs, start;
+	uint8_t *ack;
+	uint32_t sum = 0;
+
+	/* Gather device readable buffers */
+	for (i = 0; (i < n) && !dev->segs[i].write; i++) {
+		offs = dev->segs[i].len;
+		if (offs > sizeof(dev->cmd) - len)
+			offs = sizeof(dev->cmd) - len;
+		memcpy(dev->cmd + len, dev->segs[i].va, offs);
+		len += offs;
+	}
+
+	/* Control request (class, command and data) acknowledged with status byte */
+	if (q == 2 * VIRTIOLOOP_PAIRS) {
+		if ((i == n) || !dev->segs[n - 1].len || (len < 2))
+			return 0;
+
+		ack = (uint8_t *)dev->segs[n - 1].va + dev->segs[n - 1].len - 1;
+		*ack = 0;
+
+		/* Set number of active queue pairs */
+		if ((dev->cmd[0] == 4) && (dev->cmd[1] == 0)) {
+			if ((len < 4) || !virtioloop_get16(dev->cmd, 2) || (virtioloop_get16(dev->cmd, 2) > VIRTIOLOOP_PAIRS))
+				*ack = 1;
+			else
+				dev->pairs = virtioloop_get16(dev->cmd, 2);
+		}
+
+		return 1;
+	}
+
+	/* Transmitted frame (header is followed by frame data) */
+	if (len <= 12)
+		return 0;
+
+	/* Complete partial checksum */
+	if (dev->cmd[0] & 0x1) {
+		start = 12 + virtioloop_get16(dev->cmd, 6);
+		offs = start + virtioloop_get16(dev->cmd, 8);
+		if (offs + 2 > len)
+			return 0;
+
+		for (i = start; i + 1 < len; i += 2)
+			sum += ((uint32_t)dev->cmd[i] << 8) | dev->cmd[i + 1];
+		if (i < len)
+			sum += (uint32_t)dev->cmd[i] << 8;
+
+		while (sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+		sum = ~sum & 0xffff;
+
+		dev->cmd[offs] = sum >> 8;
+		dev->cmd[offs + 1] = sum;
+	}
+
+	/* Received frames checksums are valid, frame is looped back to receive queue of the pair */
+	memset(dev->cmd, 0, 12);
+	if (dev->gfeatures & (1ULL << 1))
+		dev->cmd[0] = 0x2;
+	virtioloop_put16(dev->cmd, 10, 1);
+	dev->rxirq |= virtioloop_rx(dev, q - 1, dev->cmd, len);
+
+	return 0;
+}
+
+
+/* Sends console control message (port ID, event, value and optional name) to control receive queue */
+static void virtioloop_consctl(virtioloop_dev_t *dev, uint32_t id, uint16_t event, uint16_t val, const char *name)
+{
+	unsigned int len = 8;
+
+	virtioloop_put32(dev->resp, 0, id);
+	virtioloop_put16(dev->resp, 4, event);
+	virtioloop_put16(dev->resp, 6, val);
+
+	if (name != NULL) {
+		memcpy(dev->resp + len, name, strlen(name));
+		len += strlen(name);
+	}
+
+	dev->rxirq |= virtioloop_rx(dev, 2, dev->resp, len);
+}
+
+
+/* Executes console control or transmit request, returns number of bytes written to request buffers */
+static unsigned int virtioloop_cons(virtioloop_dev_t *dev, unsigned int q, unsigned int n)
+{
+	unsigned int i, len = 0;
+	uint32_t id;
+	char name[8];
+
+	/* Transmitted data is echoed to receive queue of the port */
+	if (q != 3) {
+		for (i = 0; (i < n) && !dev->segs[i].write; i++)
+			dev->rxirq |= virtioloop_rx(dev, q - 1, dev->segs[i].va, dev->segs[i].len);
+		return 0;
+	}
+
+	/* Control message (port ID, event and value) */
+	for (i = 0; (i < n) && !dev->segs[i].write; i++) {
+		if (dev->segs[i].len > sizeof(dev->cmd) - len)
+			break;
+		memcpy(dev->cmd + len, dev->segs[i].va, dev->segs[i].len);
+		len += dev->segs[i].len;
+	}
+
+	if ((len < 8) || !virtioloop_get16(dev->cmd, 6))
+		return 0;
+	id = virtioloop_get32(dev->cmd, 0);
+
+	switch (virtioloop_get16(dev->cmd, 4)) {
+		/* Driver ready, add all ports */
+		case 0:
+			for (i = 0; i < VIRTIOLOOP_PORTS; i++)
+				virtioloop_consctl(dev, i, 1, 0, NULL);
+			break;
+
+		/* Port ready, first port is console port, other ports are named, host side of all ports is open */
+		case 3:
+			if (id >= VIRTIOLOOP_PORTS)
+				break;
+
+			if (!id) {
+				virtioloop_consctl(dev, id, 4, 1, NULL);
+			}
+			else {
+				memcpy(name, "loop0", sizeof("loop0"));
+				name[4] += id;
+				virtioloop_consctl(dev, id, 7, 1, name);
+			}
+			virtioloop_consctl(dev, id, 6, 1, NULL);
+			break;
+	}
+
+	return 0;
+}
+
+
+/* Processes request starting at given descriptor, returns number of bytes written to request buffers */
+static unsigned int virtioloop_request(virtioloop_dev_t *dev, unsigned int q, uint16_t head)
+{
+	unsigned int n, ilen, len = 0;
+	void *itbl;
+
+	n = virtioloop_gather(dev, q, head, dev->segs, &itbl, &ilen);
+
+	if (dev->id == 16)
+		len = virtioloop_gpu(dev, q, n);
+	else if (dev->id == 2)
+		len = virtioloop_blk(dev, n);
+	else if (dev->id == 1)
+		len = virtioloop_net(dev, q, n);
+	else if (dev->id == 3)
+		len = virtioloop_cons(dev, q, n);
+
+	virtioloop_release(dev->segs, n, itbl, ilen);
+
+	return len;
+}
+
+
+/* Processes available requests, returns non-zero if driver should be interrupted (device has to be locked) */
+static int virtioloop_process(virtioloop_dev_t *dev, unsigned int q)
+{
+	virtioloop_queue_t *vq = &dev->queues[q];
+	unsigned int len, n = 0, nused = 0;
+	uint16_t id, old = vq->uidx;
+	int head, irq;
+
+	/* Network and console receive buffers are used by transmitted data */
+	if ((((dev->id == 1) && (q < 2 * VIRTIOLOOP_PAIRS)) || (dev->id == 3)) && !(q & 1))
+		return 0;
+
+	for (;;) {
+		while ((head = virtioloop_avail(vq)) >= 0) {
+			len = virtioloop_request(dev, q, head);
+			n += virtioloop_consume(vq, head, &id);
+
+			/* In-order requests are used in batches (only last request of batch is reported) */
+			if (!(dev->gfeatures & (1ULL << 35)) || (virtioloop_avail(vq) < 0)) {
+				nused += virtioloop_used(vq, id, len, n);
+				n = 0;
+			}
+		}
+
+		/* Publish used requests (packed virtqueue descriptors are published by their flags) */
+		if (!vq->packed) {
+			virtio_wmb();
+			vq->used->idx = virtioloop_le16(vq->uidx);
+		}
+
+		/* Request notification of next available request */
+		if (dev->gfeatures & (1ULL << 29)) {
+			if (vq->packed) {
+				vq->devevt->desc = virtioloop_le16(vq->last | (vq->awrap << 15));
+				virtio_wmb();
+				vq->devevt->flags = virtioloop_le16(0x2);
+			}
+			else {
+				*vq->aevent = virtioloop_le16(vq->last);
+			}
+		}
+		virtio_mb();
+
+		if (virtioloop_avail(vq) < 0)
+			break;
+	}
+
+	/* Include receive virtqueues used by processed requests */
+	irq = dev->rxirq;
+	dev->rxirq = 0;
+
+	return irq | virtioloop_irq(dev, vq, old, nused);
+}
+
+
+/* Device thread */
+static void virtioloop_thr(void *arg)
+{
+	virtioloop_dev_t *dev = (virtioloop_dev_t *)arg;
+	int (*handler)(unsigned int, void *);
+	unsigned int q, notify;
+	int irq;
+
+	mutexLock(dev->lock);
+
+	while (!dev->done) {
+		if (!dev->notify) {
+			condWait(dev->cond, dev->lock, 0);
+			continue;
+		}
+		notify = dev->notify;
+		dev->notify = 0;
+
+		for (q = 0, irq = 0; q < VIRTIOLOOP_QUEUES; q++) {
+			if ((notify & (1 << q)) && dev->queues[q].ready && (dev->status & (1 << 2)))
+				irq |= virtioloop_process(dev, q);
+		}
+
+		if (!irq)
+			continue;
+		dev->isr |= (1 << 0);
+
+		/* Interrupt handler reads device registers */
+		if ((handler = dev->handler) != NULL) {
+			dev->inirq = 1;
+			mutexUnlock(dev->lock);
+
+			if (handler(0, dev->arg) >= 0)
+				condSignal(dev->icond);
+
+			mutexLock(dev->lock);
+			dev->inirq = 0;
+			condBroadcast(dev->ucond);
+		}
+	}
+
+	mutexUnlock(dev->lock);
+
+	endthread();
+}
+
+
+/* Disables virtqueue (device has to be locked) */
+static void virtioloop_disable(virtioloop_queue_t *vq)
+{
+	if (!vq->ready)
+		return;
+
+	if (vq->packed) {
+		virtioloop_unmap((void *)vq->pdesc, vq->num * sizeof(virtio_pdesc_t));
+		virtioloop_unmap((void *)vq->drvevt, sizeof(virtio_event_t));
+		virtioloop_unmap((void *)vq->devevt, sizeof(virtio_event_t));
+	}
+	else {
+		virtioloop_unmap((void *)vq->vdesc, vq->num * sizeof(virtio_desc_t));
+		virtioloop_unmap((void *)vq->avail, sizeof(virtio_avail_t) + (vq->num + 1) * sizeof(uint16_t));
+		virtioloop_unmap((void *)vq->used, sizeof(virtio_used_t) + vq->num * sizeof(virtio_used_elem_t) + sizeof(uint16_t));
+	}
+	vq->ready = 0;
+}
+
+
+/* Enables virtqueue (device has to be locked) */
+static void virtioloop_enable(virtioloop_dev_t *dev, virtioloop_queue_t *vq)
+{
+	if (vq->ready || !vq->num)
+		return;
+
+	/* Packed virtqueue descriptors ring, driver and device event suppression structures (wrap counters start at 1) */
+	if (dev->gfeatures & (1ULL << 34)) {
+		if ((vq->pdesc = virtioloop_map(vq->desc, vq->num * sizeof(virtio_pdesc_t))) == NULL)
+			return;
+
+		if ((vq->drvevt = virtioloop_map(vq->drv, sizeof(virtio_event_t))) == NULL) {
+			virtioloop_unmap((void *)vq->pdesc, vq->num * sizeof(virtio_pdesc_t));
+			return;
+		}
+
+		if ((vq->devevt = virtioloop_map(vq->dev, sizeof(virtio_event_t))) == NULL) {
+			virtioloop_unmap((void *)vq->drvevt, sizeof(virtio_event_t));
+			virtioloop_unmap((void *)vq->pdesc, vq->num * sizeof(virtio_pdesc_t));
+			return;
+		}
+
+		vq->packed = 1;
+		vq->awrap = 1;
+		vq->uwrap = 1;
+		vq->last = 0;
+		vq->uidx = 0;
+		vq->ready = 1;
+		return;
+	}
+
+	if ((vq->vdesc = virtioloop_map(vq->desc, vq->num * sizeof(virtio_desc_t))) == NULL)
+		return;
+
+	if ((vq->avail = virtioloop_map(vq->drv, sizeof(virtio_avail_t) + (vq->num + 1) * sizeof(uint16_t))) == NULL) {
+		virtioloop_unmap((void *)vq->vdesc, vq->num * sizeof(virtio_desc_t));
+		return;
+	}
+
+	if ((vq->used = virtioloop_map(vq->dev, sizeof(virtio_used_t) + vq->num * sizeof(virtio_used_elem_t) + sizeof(uint16_t))) == NULL) {
+		virtioloop_unmap((void *)vq->avail, sizeof(virtio_avail_t) + (vq->num + 1) * sizeof(uint16_t));
+		virtioloop_unmap((void *)vq->vdesc, vq->num * sizeof(virtio_desc_t));
+		return;
+	}
+
+	vq->uevent = (volatile uint16_t *)((uintptr_t)vq->avail + sizeof(virtio_avail_t) + vq->num * sizeof(uint16_t));
+	vq->aevent = (volatile uint16_t *)((uintptr_t)vq->used + sizeof(virtio_used_t) + vq->num * sizeof(virtio_used_elem_t));
+	vq->packed = 0;
+	vq->last = 0;
+	vq->uidx = 0;
+	vq->ready = 1;
+}
+
+
+/* Resets device (device has to be locked) */
+static void virtioloop_reset(virtioloop_dev_t *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < VIRTIOLOOP_QUEUES; i++) {
+		virtioloop_disable(&dev->queues[i]);
+		memset(&dev->queues[i], 0, sizeof(dev->queues[i]));
+	}
+
+	while (dev->res != NULL)
+		virtioloop_unref(dev, dev->res);
+
+	dev->dfsel = 0;
+	dev->gfsel = 0;
+	dev->qsel = 0;
+	dev->status = 0;
+	dev->isr = 0;
+	dev->gfeatures = 0;
+	dev->notify = 0;
+	dev->cx = 0;
+	dev->cy = 0;
+	dev->crid = 0;
+	dev->pairs = 1;
+	dev->rxirq = 0;
+}
+
+
+uint8_t virtioloop_read8(void *base, unsigned int reg)
+{
+	virtioloop_dev_t *dev = (virtioloop_dev_t *)base;
+
+	if ((reg < 0x100) || (reg - 0x100 >= sizeof(dev->cfg)))
+		return 0;
+
+	return dev->cfg[reg - 0x100];
+}
+
+
+uint16_t virtioloop_read16(void *base, unsigned int reg)
+{
+	return virtioloop_le16(virtioloop_read8(base, reg) | ((uint16_t)virtioloop_read8(base, reg + 1) << 8));
+}
+
+
+uint32_t virtioloop_read32(void *base, unsigned int reg)
+{
+	virtioloop_dev_t *dev = (virtioloop_dev_t *)base;
+	virtioloop_queue_t *vq;
+	uint32_t val = 0;
+
+	if (reg >= 0x100)
+		return virtioloop_le32(virtioloop_le16(virtioloop_read16(base, reg)) | ((uint32_t)virtioloop_le16(virtioloop_read16(base, reg + 2)) << 16));
+
+	mutexLock(dev->lock);
+
+	vq = (dev->qsel < VIRTIOLOOP_QUEUES) ? &dev->queues[dev->qsel] : NULL;
+
+	switch (reg) {
+		case 0x00: val = 0x74726976; break;
+		case 0x04: val = 2; break;
+		case 0x08: val = dev->id; break;
+		case 0x0c: val = 0x554d4551; break;
+		case 0x10: val = (dev->dfsel < 2) ? dev->dfeatures >> (32 * dev->dfsel) : 0; break;
+		case 0x34: val = (vq != NULL) ? VIRTIOLOOP_QSIZE : 0; break;
+		case 0x44: val = (vq != NULL) ? vq->ready : 0; break;
+		case 0x60: val = dev->isr; break;
+		case 0x70: val = dev->status; break;
+		case 0xfc: val = 0; break;
+	}
+
+	mutexUnlock(dev->lock);
+
+	return virtioloop_le32(val);
+}
+
+
+uint64_t virtioloop_read64(void *base, unsigned int reg)
+{
+	uint64_t val;
+
+	val = virtioloop_le32(virtioloop_read32(base, reg + 4));
+	val <<= 32;
+	val |= virtioloop_le32(virtioloop_read32(base, reg));
+
+	return virtioloop_le64(val);
+}
+
+
+void virtioloop_write8(void *base, unsigned int reg, uint8_t val)
+{
+	virtioloop_dev_t *dev = (virtioloop_dev_t *)base;
+
+	/* Configuration space is read only (events clear register is ignored) */
+	(void)dev;
+	(void)reg;
+	(void)val;
+}
+
+
+void virtioloop_write16(void *base, unsigned int reg, uint16_t val)
+{
+	val = virtioloop_le16(val);
+	virtioloop_write8(base, reg, val);
+	virtioloop_write8(base, reg + 1, val >> 8);
+}
+
+
+void virtioloop_write32(void *base, unsigned int reg, uint32_t val)
+{
+	virtioloop_dev_t *dev = (virtioloop_dev_t *)base;
+	virtioloop_queue_t *vq;
+
+	val = virtioloop_le32(val);
+
+	if (reg >= 0x100) {
+		virtioloop_write16(base, reg, virtioloop_le16((uint16_t)val));
+		virtioloop_write16(base, reg + 2, virtioloop_le16((uint16_t)(val >> 16)));
+		return;
+	}
+
+	mutexLock(dev->lock);
+
+	vq = (dev->qsel < VIRTIOLOOP_QUEUES) ? &dev->queues[dev->qsel] : NULL;
+
+	switch (reg) {
+		case 0x14:
+			dev->dfsel = val;
+			break;
+
+		case 0x20:
+			if (dev->gfsel < 2)
+				dev->gfeatures = (dev->gfeatures & ~(0xffffffffULL << (32 * dev->gfsel))) | ((uint64_t)val << (32 * dev->gfsel));
+			break;
+
+		case 0x24:
+			dev->gfsel = val;
+			break;
+
+		case 0x30:
+			dev->qsel = val;
+			break;
+
+		case 0x38:
+			if ((vq != NULL) && !vq->ready && val && (val <= VIRTIOLOOP_QSIZE) && !((val - 1) & val))
+				vq->num = val;
+			break;
+
+		case 0x44:
+			if (vq == NULL)
+				break;
+
+			if (val)
+				virtioloop_enable(dev, vq);
+			else
+				virtioloop_disable(vq);
+			break;
+
+		case 0x50:
+			if (val < VIRTIOLOOP_QUEUES) {
+				dev->notify |= 1 << val;
+				condSignal(dev->cond);
+			}
+			break;
+
+		case 0x64:
+			dev->isr &= ~val;
+			break;
+
+		case 0x70:
+			if (!val) {
+				virtioloop_reset(dev);
+				break;
+			}
+
+			/* Accept only offered features */
+			if ((val & (1 << 3)) && (dev->gfeatures & ~dev->dfeatures))
+				val &= ~(1 << 3);
+			dev->status = val;
+			break;
+
+		case 0x80: if (vq != NULL) vq->desc = (vq->desc & ~0xffffffffULL) | val; break;
+		case 0x84: if (vq != NULL) vq->desc = (vq->desc & 0xffffffffULL) | ((uint64_t)val << 32); break;
+		case 0x90: if (vq != NULL) vq->drv = (vq->drv & ~0xffffffffULL) | val; break;
+		case 0x94: if (vq != NULL) vq->drv = (vq->drv & 0xffffffffULL) | ((uint64_t)val << 32); break;
+		case 0xa0: if (vq != NULL) vq->dev = (vq->dev & ~0xffffffffULL) | val; break;
+		case 0xa4: if (vq != NULL) vq->dev = (vq->dev & 0xffffffffULL) | ((uint64_t)val << 32); break;
+	}
+
+	mutexUnlock(dev->lock);
+}
+
+
+void virtioloop_write64(void *base, unsigned int reg, uint64_t val)
+{
+	val = virtioloop_le64(val);
+	virtioloop_write32(base, reg, virtioloop_le32((uint32_t)val));
+	virtioloop_write32(base, reg + 4, virtioloop_le32((uint32_t)(val >> 32)));
+}
+
+
+int virtioloop_interrupt(virtio_dev_t *vdev, int (*handler)(unsigned int, void *), void *arg, handle_t cond)
+{
+	virtioloop_dev_t *dev = (virtioloop_dev_t *)vdev->info.base.addr;
+
+	mutexLock(dev->lock);
+
+	dev->handler = handler;
+	dev->arg = arg;
+	dev->icond = cond;
+
+	/* Wait for running interrupt handler */
+	while ((handler == NULL) && dev->inirq)
+		condWait(dev->ucond, dev->lock, 0);
+
+	mutexUnlock(dev->lock);
+
+	return EOK;
+}
+
+
+void *virtio_loopScanout(virtio_dev_t *vdev, unsigned int *width, unsigned int *height)
+{
+	virtioloop_dev_t *dev = (virtioloop_dev_t *)vdev->info.base.addr;
+	void *data = NULL;
+
+	if (vdev->info.type != vdevLOOP)
+		return NULL;
+
+	mutexLock(dev->lock);
+
+	if (dev->scanout != NULL) {
+		data = dev->scanout->data;
+		if (width != NULL)
+			*width = dev->scanout->w;
+		if (height != NULL)
+			*height = dev->scanout->h;
+	}
+
+	mutexUnlock(dev->lock);
+
+	return data;
+}
+
+
+void virtioloop_destroyDev(virtio_dev_t *vdev)
+{
+	virtioloop_dev_t *dev = (virtioloop_dev_t *)vdev->info.base.addr;
+
+	mutexLock(dev->lock);
+	dev->done = 1;
+	condSignal(dev->cond);
+	mutexUnlock(dev->lock);
+	while (threadJoin(0) < 0);
+
+	virtioloop_reset(dev);
+	resourceDestroy(dev->ucond);
+	resourceDestroy(dev->cond);
+	resourceDestroy(dev->lock);
+	free(dev->stack);
+	free(dev->disk);
+	free(dev);
+}
+
+
+int virtioloop_initDev(virtio_dev_t *vdev)
+{
+	virtioloop_dev_t *dev;
+	int err;
+
+	if ((dev = calloc(1, sizeof(*dev))) == NULL)
+		return -ENOMEM;
+
+	/* VERSION_1, RING_PACKED, IN_ORDER, EVENT_IDX and INDIRECT_DESC features */
+	dev->dfeatures = (1ULL << 35) | (1ULL << 34) | (1ULL << 32) | (1ULL << 29) | (1ULL << 28);
+
+	switch (vdev->info.id) {
+		/* GPU device (default) with EDID feature, single scanout, no capability sets */
+		case 0:
+		case 16:
+			dev->id = 16;
+			dev->dfeatures |= (1ULL << 1);
+			dev->cfg[8] = 1;
+			break;
+
+		/* Block device (RAM disk) with SEG_MAX, BLK_SIZE, FLUSH, MQ and DISCARD features */
+		case 2:
+			if ((dev->disk = calloc(1, VIRTIOLOOP_DISKSZ)) == NULL) {
+				free(dev);
+				return -ENOMEM;
+			}
+			dev->id = 2;
+			dev->dfeatures |= (1ULL << 2) | (1ULL << 6) | (1ULL << 9) | (1ULL << 12) | (1ULL << 13);
+			virtioloop_put64(dev->cfg, 0, VIRTIOLOOP_DISKSZ / 512);
+			virtioloop_put32(dev->cfg, 12, VIRTIOLOOP_SEGS - 2);
+			virtioloop_put32(dev->cfg, 20, 512);
+			dev->cfg[34] = VIRTIOLOOP_QUEUES;
+			virtioloop_put32(dev->cfg, 36, VIRTIOLOOP_DISKSZ / 512);
+			virtioloop_put32(dev->cfg, 40, 1);
+			virtioloop_put32(dev->cfg, 44, 1);
+			break;
+
+		/* Console device with SIZE and MULTIPORT features (transmitted data is echoed back) */
+		case 3:
+			dev->id = 3;
+			dev->dfeatures |= (1ULL << 0) | (1ULL << 1);
+			virtioloop_put16(dev->cfg, 0, 80);
+			virtioloop_put16(dev->cfg, 2, 25);
+			virtioloop_put32(dev->cfg, 4, VIRTIOLOOP_PORTS);
+			break;
+
+		/* Network device with CSUM, GUEST_CSUM, MAC, MRG_RXBUF, STATUS, CTRL_VQ and MQ features (transmitted frames are looped back) */
+		case 1:
+			dev->id = 1;
+			dev->dfeatures |= (1ULL << 0) | (1ULL << 1) | (1ULL << 5) | (1ULL << 15) | (1ULL << 16) | (1ULL << 17) | (1ULL << 22);
+			dev->cfg[0] = 0x52;
+			dev->cfg[1] = 0x54;
+			dev->cfg[2] = 0x00;
+			dev->cfg[3] = 0x12;
+			dev->cfg[4] = 0x34;
+			dev->cfg[5] = 0x56;
+			virtioloop_put16(dev->cfg, 6, 1);
+			virtioloop_put16(dev->cfg, 8, VIRTIOLOOP_PAIRS);
+			dev->pairs = 1;
+			break;
+
+		default:
+			free(dev);
+			return -ENODEV;
+	}
+
+	if ((dev->stack = malloc(VIRTIOLOOP_STACKSZ)) == NULL) {
+		free(dev->disk);
+		free(dev);
+		return -ENOMEM;
+	}
+
+	if ((err = mutexCreate(&dev->lock)) < 0) {
+		free(dev->stack);
+		free(dev->disk);
+		free(dev);
+		return err;
+	}
+
+	if ((err = condCreate(&dev->cond)) < 0) {
+		resourceDestroy(dev->lock);
+		free(dev->stack);
+		free(dev->disk);
+		free(dev);
+		return err;
+	}
+
+	if ((err = condCreate(&dev->ucond)) < 0) {
+		resourceDestroy(dev->cond);
+		resourceDestroy(dev->lock);
+		free(dev->stack);
+		free(dev->disk);
+		free(dev);
+		return err;
+	}
+
+	if ((err = beginthread(virtioloop_thr, 4, dev->stack, VIRTIOLOOP_STACKSZ, dev)) < 0) {
+		resourceDestroy(dev->ucond);
+		resourceDestroy(dev->cond);
+		resourceDestroy(dev->lock);
+		free(dev->stack);
+		free(dev->disk);
+		free(dev);
+		return err;
+	}
+
+	vdev->info.base.addr = dev;
+	vdev->info.base.len = sizeof(*dev);
+
+	return EOK;
+}
@@ -0,0 +1,59 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO loopback low level interface
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _VIRTIOLOOP_H_
+#define _VIRTIOLOOP_H_
+
+#include <stdint.h>
+
+#include "libvirtio.h"
+
+
+/* Loopback device registers follow VirtIO MMIO (version 2) layout */
+extern uint8_t virtioloop_read8(void *base, unsigned int reg);
+
+
+extern uint16_t virtioloop_read16(void *base, unsigned int reg);
+
+
+extern uint32_t virtioloop_read32(void *base, unsigned int reg);
+
+
+extern uint64_t virtioloop_read64(void *base, unsigned int reg);
+
+
+extern void virtioloop_write8(void *base, unsigned int reg, uint8_t val);
+
+
+extern void virtioloop_write16(void *base, unsigned int reg, uint16_t val);
+
+
+extern void virtioloop_write32(void *base, unsigned int reg, uint32_t val);
+
+
+extern void virtioloop_write64(void *base, unsigned int reg, uint64_t val);
+
+
+/* Installs loopback device interrupt handler (NULL handler uninstalls it and waits for running handler) */
+extern int virtioloop_interrupt(virtio_dev_t *vdev, int (*handler)(unsigned int, void *), void *arg, handle_t cond);
+
+
+/* Destroys VirtIO loopback device */
+extern void virtioloop_destroyDev(virtio_dev_t *vdev);
+
+
+/* Initializes VirtIO loopback device (starts device thread) */
+extern int virtioloop_initDev(virtio_dev_t *vdev);
+
+
+#endif
@@ -0,0 +1,278 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO DMA memory allocator
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/threads.h>
+
+#include "virtio.h"
+
+
+/* Smallest object size class (64 B) */
+#define VIRTIOMEM_MINSHIFT 6
+
+
+/* Largest object size class (16 KB), bigger objects are mapped directly */
+#define VIRTIOMEM_MAXSHIFT 14
+
+
+/* Number of object size classes */
+#define VIRTIOMEM_CLASSES (VIRTIOMEM_MAXSHIFT - VIRTIOMEM_MINSHIFT + 1)
+
+
+/* Minimum number of objects carved out of slab */
+#define VIRTIOMEM_SLABOBJS 4
+
+
+typedef struct _virtiomem_obj_t {
+	struct _virtiomem_obj_t *next;  /* Next free object */
+} virtiomem_obj_t;
+
+
+typedef struct {
+	void *va;                       /* Slab virtual address */
+	addr_t pa;                      /* Slab physical address */
+	size_t len;                     /* Slab size */
+} virtiomem_slab_t;
+
+
+static struct {
+	virtiomem_obj_t *free[VIRTIOMEM_CLASSES]; /* Free objects lists (per size class) */
+	virtiomem_slab_t *slabs;        /* Slabs (cached physical addresses) */
+	unsigned int nslabs;            /* Number of slabs */
+	unsigned int sz;                /* Slabs table size */
+	handle_t lock;                  /* Allocator mutex */
+} virtiomem_common;
+
+
+/* Returns object size class */
+static inline unsigned int virtiomem_class(size_t size)
+{
+	unsigned int shift = VIRTIOMEM_MINSHIFT;
+
+	while ((1UL << shift) < size)
+		shift++;
+
+	return shift - VIRTIOMEM_MINSHIFT;
+}
+
+
+/* Returns slab containing given address (allocator has to be locked) */
+static virtiomem_slab_t *virtiomem_slab(void *va)
+{
+	unsigned int i;
+
+	for (i = 0; i < virtiomem_common.nslabs; i++) {
+		if (((uintptr_t)va >= (uintptr_t)virtiomem_common.slabs[i].va) && ((uintptr_t)va - (uintptr_t)virtiomem_common.slabs[i].va < virtiomem_common.slabs[i].len))
+			return &virtiomem_common.slabs[i];
+	}
+
+	return NULL;
+}
+
+
+/* Carves new slab into size class objects (allocator has to be locked) */
+static int virtiomem_grow(unsigned int c)
+{
+	size_t size = 1UL << (c + VIRTIOMEM_MINSHIFT);
+	virtiomem_slab_t *slab;
+	virtiomem_obj_t *obj;
+	size_t offs;
+
+	if (virtiomem_common.nslabs == virtiomem_common.sz) {
+		if ((slab = realloc(virtiomem_common.slabs, 2 * (virtiomem_common.sz + 1) * sizeof(virtiomem_slab_t))) == NULL)
+			return -ENOMEM;
+		virtiomem_common.slabs = slab;
+		virtiomem_common.sz = 2 * (virtiomem_common.sz + 1);
+	}
+	slab = &virtiomem_common.slabs[virtiomem_common.nslabs];
+
+	slab->len = (VIRTIOMEM_SLABOBJS * size + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+	if ((slab->va = mmap(NULL, slab->len, PROT_READ | PROT_WRITE, VIRTIO_DMAATTR | MAP_ANONYMOUS, OID_CONTIGUOUS, 0)) == MAP_FAILED)
+		return -ENOMEM;
+	slab->pa = va2pa(slab->va);
+	virtiomem_common.nslabs++;
+
+	/* Objects are naturally aligned up to page size */
+	for (offs = slab->len; offs >= size; offs -= size) {
+		obj = (virtiomem_obj_t *)((uintptr_t)slab->va + offs - size);
+		obj->next = virtiomem_common.free[c];
+		virtiomem_common.free[c] = obj;
+	}
+
+	return EOK;
+}
+
+
+void *virtio_memAlloc(size_t size, addr_t *pa)
+{
+	virtiomem_slab_t *slab;
+	virtiomem_obj_t *obj;
+	unsigned int c;
+	void *va;
+
+	if (!size)
+		return NULL;
+
+	/* Map big objects directly */
+	if (size > (1UL << VIRTIOMEM_MAXSHIFT)) {
+		if ((va = mmap(NULL, (size + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1), PROT_READ | PROT_WRITE, VIRTIO_DMAATTR | MAP_ANONYMOUS, OID_CONTIGUOUS, 0)) == MAP_FAILED)
+			return NULL;
+		/* Contiguous memory isn't cleared */
+		memset(va, 0, size);
+
+		if (pa != NULL)
+			*pa = va2pa(va);
+
+		return va;
+	}
+	c = virtiomem_class(size);
+
+	mutexLock(virtiomem_common.lock);
+
+	if ((virtiomem_common.free[c] == NULL) && (virtiomem_grow(c) < 0)) {
+		mutexUnlock(virtiomem_common.lock);
+		return NULL;
+	}
+	obj = virtiomem_common.free[c];
+	virtiomem_common.free[c] = obj->next;
+
+	if (pa != NULL) {
+		slab = virtiomem_slab(obj);
+		*pa = slab->pa + ((uintptr_t)obj - (uintptr_t)slab->va);
+	}
+
+	mutexUnlock(virtiomem_common.lock);
+
+	/* Match anonymous mapping semantics */
+	memset(obj, 0, 1UL << (c + VIRTIOMEM_MINSHIFT));
+
+	return obj;
+}
+
+
+void virtio_memFree(void *va, size_t size)
+{
+	virtiomem_obj_t *obj = (virtiomem_obj_t *)va;
+	unsigned int c;
+
+	if ((va == NULL) || !size)
+		return;
+
+	if (size > (1UL << VIRTIOMEM_MAXSHIFT)) {
+		munmap(va, (size + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1));
+		return;
+	}
+	c = virtiomem_class(size);
+
+	mutexLock(virtiomem_common.lock);
+	obj->next = virtiomem_common.free[c];
+	virtiomem_common.free[c] = obj;
+	mutexUnlock(virtiomem_common.lock);
+}
+
+
+addr_t virtio_memPA(void *va)
+{
+	virtiomem_slab_t *slab;
+	addr_t pa;
+
+	mutexLock(virtiomem_common.lock);
+
+	if ((slab = virtiomem_slab(va)) == NULL) {
+		mutexUnlock(virtiomem_common.lock);
+		return va2pa(va);
+	}
+	pa = slab->pa + ((uintptr_t)va - (uintptr_t)slab->va);
+
+	mutexUnlock(virtiomem_common.lock);
+
+	return pa;
+}
+
+
+int virtio_bufRegister(virtio_buf_t *buf, void *va, size_t len)
+{
+	unsigned int i, j, n;
+	addr_t pa;
+
+	if (!len)
+		return -EINVAL;
+
+	buf->va = (uintptr_t)va & ~(_PAGE_SIZE - 1);
+	buf->len = ((uintptr_t)va + len - buf->va + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+	buf->pa = virtio_memPA((void *)buf->va);
+	buf->pages = NULL;
+
+	/* Keep per page physical addresses only for physically discontiguous region */
+	for (i = 1, n = buf->len / _PAGE_SIZE; i < n; i++) {
+		pa = virtio_memPA((void *)(buf->va + i * _PAGE_SIZE));
+
+		if (buf->pages == NULL) {
+			if (pa == buf->pa + i * _PAGE_SIZE)
+				continue;
+
+			if ((buf->pages = malloc(n * sizeof(addr_t))) == NULL)
+				return -ENOMEM;
+
+			for (j = 0; j < i; j++)
+				buf->pages[j] = buf->pa + j * _PAGE_SIZE;
+		}
+		buf->pages[i] = pa;
+	}
+
+	return EOK;
+}
+
+
+void virtio_bufUnregister(virtio_buf_t *buf)
+{
+	free(buf->pages);
+	buf->pages = NULL;
+}
+
+
+uint64_t virtio_bufPA(const virtio_buf_t *buf, const void *va)
+{
+	return _virtio_bufPA(buf, va);
+}
+
+
+void virtiomem_done(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < virtiomem_common.nslabs; i++)
+		munmap(virtiomem_common.slabs[i].va, virtiomem_common.slabs[i].len);
+
+	free(virtiomem_common.slabs);
+	resourceDestroy(virtiomem_common.lock);
+}
+
+
+int virtiomem_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < VIRTIOMEM_CLASSES; i++)
+		virtiomem_common.free[i] = NULL;
+
+	virtiomem_common.slabs = NULL;
+	virtiomem_common.nslabs = 0;
+	virtiomem_common.sz = 0;
+
+	return mutexCreate(&virtiomem_common.lock);
+}
@@ -16,49 +16,49 @@
 #include "virtio.h"
 
 
-uint8_t virtiopci_read8(void *base, unsigned int reg)
+uint8_t virtiopci_ioRead8(void *base, unsigned int reg)
 {
 	return 0;
 }
 
 
-uint16_t virtiopci_read16(void *base, unsigned int reg)
+uint16_t virtiopci_ioRead16(void *base, unsigned int reg)
 {
 	return 0;
 }
 
 
-uint32_t virtiopci_read32(void *base, unsigned int reg)
+uint32_t virtiopci_ioRead32(void *base, unsigned int reg)
 {
 	return 0;
 }
 
 
-uint64_t virtiopci_read64(void *base, unsigned int reg)
+uint64_t virtiopci_ioRead64(void *base, unsigned int reg)
 {
 	return 0;
 }
 
 
-void virtiopci_write8(void *base, unsigned int reg, uint8_t val)
+void virtiopci_ioWrite8(void *base, unsigned int reg, uint8_t val)
 {
 	return;
 }
 
 
-void virtiopci_write16(void *base, unsigned int reg, uint16_t val)
+void virtiopci_ioWrite16(void *base, unsigned int reg, uint16_t val)
 {
 	return;
 }
 
 
-void virtiopci_write32(void *base, unsigned int reg, uint32_t val)
+void virtiopci_ioWrite32(void *base, unsigned int reg, uint32_t val)
 {
 	return;
 }
 
 
-void virtiopci_write64(void *base, unsigned int reg, uint64_t val)
+void virtiopci_ioWrite64(void *base, unsigned int reg, uint64_t val)
 {
 	return;
 }
@@ -35,138 +35,65 @@ typedef union {
 } virtiopci_ctx_t;
 
 
-uint8_t virtiopci_read8(void *base, unsigned int reg)
+/* Returns IO space register port (IO space base address is tagged with bit 0) */
+static inline void *virtiopci_port(void *base, unsigned int reg)
 {
-	uintptr_t addr = (uintptr_t)base;
-
-	if (addr & 0x1) {
-		addr &= ~0x3;
-		addr += reg;
-
-		return inb((void *)addr);
-	}
-
-	return *(volatile uint8_t *)(addr + reg);
+	return (void *)(((uintptr_t)base & ~0x3) + reg);
 }
 
 
-uint16_t virtiopci_read16(void *base, unsigned int reg)
+uint8_t virtiopci_ioRead8(void *base, unsigned int reg)
 {
-	uintptr_t addr = (uintptr_t)base;
-
-	if (addr & 0x1) {
-		addr &= ~0x3;
-		addr += reg;
-
-		return inw((void *)addr);
-	}
-
-	return *(volatile uint16_t *)(addr + reg);
+	return inb(virtiopci_port(base, reg));
 }
 
 
-uint32_t virtiopci_read32(void *base, unsigned int reg)
+uint16_t virtiopci_ioRead16(void *base, unsigned int reg)
 {
-	uintptr_t addr = (uintptr_t)base;
-
-	if (addr & 0x1) {
-		addr &= ~0x3;
-		addr += reg;
+	return inw(virtiopci_port(base, reg));
+}
 
-		return inl((void *)addr);
-	}
 
-	return *(volatile uint32_t *)(addr + reg);
+uint32_t virtiopci_ioRead32(void *base, unsigned int reg)
+{
+	return inl(virtiopci_port(base, reg));
 }
 
 
-uint64_t virtiopci_read64(void *base, unsigned int reg)
+uint64_t virtiopci_ioRead64(void *base, unsigned int reg)
 {
-	uintptr_t addr = (uintptr_t)base;
 	uint64_t val;
 
-	if (addr & 0x1) {
-		addr &= ~0x3;
-		addr += reg;
-
-		val = inl((void *)(addr + 4));
-		val <<= 32;
-		val |= inl((void *)addr);
-
-		return val;
-	}
-
-	val = *(volatile uint32_t *)(addr + reg + 4);
+	val = inl(virtiopci_port(base, reg + 4));
 	val <<= 32;
-	val |= *(volatile uint32_t *)(addr + reg);
+	val |= inl(virtiopci_port(base, reg));
 
 	return val;
 }
 
 
-void virtiopci_write8(void *base, unsigned int reg, uint8_t val)
+void virtiopci_ioWrite8(void *base, unsigned int reg, uint8_t val)
 {
-	uintptr_t addr = (uintptr_t)base;
-
-	if (addr & 0x1) {
-		addr &= ~0x3;
-		addr += reg;
-
-		outb((void *)addr, val);
-		return;
-	}
-
-	*(volatile uint8_t *)(addr + reg) = val;
+	outb(virtiopci_port(base, reg), val);
 }
 
 
-void virtiopci_write16(void *base, unsigned int reg, uint16_t val)
+void virtiopci_ioWrite16(void *base, unsigned int reg, uint16_t val)
 {
-	uintptr_t addr = (uintptr_t)base;
-
-	if (addr & 0x1) {
-		addr &= ~0x3;
-		addr += reg;
-
-		outw((void *)addr, val);
-		return;
-	}
-
-	*(volatile uint16_t *)(addr + reg) = val;
+	outw(virtiopci_port(base, reg), val);
 }
 
 
-void virtiopci_write32(void *base, unsigned int reg, uint32_t val)
+void virtiopci_ioWrite32(void *base, unsigned int reg, uint32_t val)
 {
-	uintptr_t addr = (uintptr_t)base;
-
-	if (addr & 0x1) {
-		addr &= ~0x3;
-		addr += reg;
-
-		outl((void *)addr, val);
-		return;
-	}
-
-	*(volatile uint32_t *)(addr + reg) = val;
+	outl(virtiopci_port(base, reg), val);
 }
 
 
-void virtiopci_write64(void *base, unsigned int reg, uint64_t val)
+void virtiopci_ioWrite64(void *base, unsigned int reg, uint64_t val)
 {
-	uintptr_t addr = (uintptr_t)base;
-
-	if (addr & 0x1) {
-		addr &= ~0x3;
-		addr += reg;
-
-		outl((void *)(addr + 4), val >> 32);
-		outl((void *)addr, val);
-		return;
-	}
-
-	*(volatile uint32_t *)(addr + reg + 4) = val >> 32; 
-	*(volatile uint32_t *)(addr + reg) = val;
+	outl(virtiopci_port(base, reg + 4), val >> 32);
+	outl(virtiopci_port(base, reg), val);
 }
 
 
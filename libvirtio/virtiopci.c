@@ -19,6 +19,398 @@
 #include "virtio.h"
 
 
+/* Memory space registers access */
+static uint8_t virtiopci_memRead8(void *base, unsigned int reg)
+{
+	return *(volatile uint8_t *)((uintptr_t)base + reg);
+}
+
+
+static uint16_t virtiopci_memRead16(void *base, unsigned int reg)
+{
+	return *(volatile uint16_t *)((uintptr_t)base + reg);
+}
+
+
+static uint32_t virtiopci_memRead32(void *base, unsigned int reg)
+{
+	return *(volatile uint32_t *)((uintptr_t)base + reg);
+}
+
+
+static uint64_t virtiopci_memRead64(void *base, unsigned int reg)
+{
+	uintptr_t addr = (uintptr_t)base + reg;
+	uint64_t val;
+
+	val = *(volatile uint32_t *)(addr + 4);
+	val <<= 32;
+	val |= *(volatile uint32_t *)addr;
+
+	return val;
+}
+
+
+static void virtiopci_memWrite8(void *base, unsigned int reg, uint8_t val)
+{
+	*(volatile uint8_t *)((uintptr_t)base + reg) = val;
+}
+
+
+static void virtiopci_memWrite16(void *base, unsigned int reg, uint16_t val)
+{
+	*(volatile uint16_t *)((uintptr_t)base + reg) = val;
+}
+
+
+static void virtiopci_memWrite32(void *base, unsigned int reg, uint32_t val)
+{
+	*(volatile uint32_t *)((uintptr_t)base + reg) = val;
+}
+
+
+static void virtiopci_memWrite64(void *base, unsigned int reg, uint64_t val)
+{
+	uintptr_t addr = (uintptr_t)base + reg;
+
+	*(volatile uint32_t *)(addr + 4) = val >> 32;
+	*(volatile uint32_t *)addr = val;
+}
+
+
+/* Mixed IO and memory space registers access (used only if modern device maps some registers to IO space) */
+static uint8_t virtiopci_read8(void *base, unsigned int reg)
+{
+	if ((uintptr_t)base & 0x1)
+		return virtiopci_ioRead8(base, reg);
+
+	return virtiopci_memRead8(base, reg);
+}
+
+
+static uint16_t virtiopci_read16(void *base, unsigned int reg)
+{
+	if ((uintptr_t)base & 0x1)
+		return virtiopci_ioRead16(base, reg);
+
+	return virtiopci_memRead16(base, reg);
+}
+
+
+static uint32_t virtiopci_read32(void *base, unsigned int reg)
+{
+	if ((uintptr_t)base & 0x1)
+		return virtiopci_ioRead32(base, reg);
+
+	return virtiopci_memRead32(base, reg);
+}
+
+
+static uint64_t virtiopci_read64(void *base, unsigned int reg)
+{
+	if ((uintptr_t)base & 0x1)
+		return virtiopci_ioRead64(base, reg);
+
+	return virtiopci_memRead64(base, reg);
+}
+
+
+static void virtiopci_write8(void *base, unsigned int reg, uint8_t val)
+{
+	if ((uintptr_t)base & 0x1)
+		virtiopci_ioWrite8(base, reg, val);
+	else
+		virtiopci_memWrite8(base, reg, val);
+}
+
+
+static void virtiopci_write16(void *base, unsigned int reg, uint16_t val)
+{
+	if ((uintptr_t)base & 0x1)
+		virtiopci_ioWrite16(base, reg, val);
+	else
+		virtiopci_memWrite16(base, reg, val);
+}
+
+
+static void virtiopci_write32(void *base, unsigned int reg, uint32_t val)
+{
+	if ((uintptr_t)base & 0x1)
+		virtiopci_ioWrite32(base, reg, val);
+	else
+		virtiopci_memWrite32(base, reg, val);
+}
+
+
+static void virtiopci_write64(void *base, unsigned int reg, uint64_t val)
+{
+	if ((uintptr_t)base & 0x1)
+		virtiopci_ioWrite64(base, reg, val);
+	else
+		virtiopci_memWrite64(base, reg, val);
+}
+
+
+/* Legacy VirtIO PCI device registers layout */
+static void *virtiopci_configLegacy(virtio_dev_t *vdev, unsigned int *reg)
+{
+	*reg += 0x14;
+
+	return vdev->info.base.addr;
+}
+
+
+static uint64_t virtiopci_getFeaturesLegacy(virtio_dev_t *vdev)
+{
+	return virtio_read32(vdev, vdev->info.base.addr, 0x00);
+}
+
+
+static void virtiopci_setFeaturesLegacy(virtio_dev_t *vdev, uint64_t features)
+{
+	virtio_write32(vdev, vdev->info.base.addr, 0x04, features);
+}
+
+
+static uint8_t virtiopci_readStatusLegacy(virtio_dev_t *vdev)
+{
+	return virtio_read8(vdev, vdev->info.base.addr, 0x12);
+}
+
+
+static void virtiopci_writeStatusLegacy(virtio_dev_t *vdev, uint8_t status)
+{
+	virtio_write8(vdev, vdev->info.base.addr, 0x12, status);
+	virtio_mb();
+}
+
+
+static unsigned int virtiopci_isrLegacy(virtio_dev_t *vdev)
+{
+	return virtio_read8(vdev, vdev->info.base.addr, 0x13);
+}
+
+
+static void virtiopci_selectLegacy(virtio_dev_t *vdev, unsigned int idx)
+{
+	virtio_write16(vdev, vdev->info.base.addr, 0x0e, idx);
+	virtio_mb();
+}
+
+
+static int virtiopci_enableLegacy(virtio_dev_t *vdev, unsigned int *size)
+{
+	unsigned int maxsz;
+
+	if (!(maxsz = virtio_read16(vdev, vdev->info.base.addr, 0x0c)) || virtio_read32(vdev, vdev->info.base.addr, 0x08))
+		return -ENOENT;
+
+	/* Legacy virtqueue size is fixed by device */
+	*size = maxsz;
+
+	return EOK;
+}
+
+
+static int virtiopci_activateLegacy(virtio_dev_t *vdev, virtqueue_t *vq, uint64_t desc, uint64_t drv, uint64_t dev)
+{
+	if ((desc /= _PAGE_SIZE) >> 32)
+		return -EFAULT;
+
+	virtio_write32(vdev, vdev->info.base.addr, 0x08, desc);
+
+	return EOK;
+}
+
+
+static void virtiopci_notifyLegacy(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	virtio_write16(vdev, vdev->info.base.addr, 0x10, vq->idx);
+}
+
+
+/* Legacy device with IO space registers (no access type checks on interrupt and notification paths) */
+static unsigned int virtiopci_isrLegacyIo(virtio_dev_t *vdev)
+{
+	return virtiopci_ioRead8(vdev->info.base.addr, 0x13);
+}
+
+
+static void virtiopci_notifyLegacyIo(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	virtiopci_ioWrite16(vdev->info.base.addr, 0x10, virtio_gtov16(vdev, vq->idx));
+}
+
+
+/* Modern VirtIO PCI device registers layout */
+static void *virtiopci_config(virtio_dev_t *vdev, unsigned int *reg)
+{
+	return vdev->info.cfg.addr;
+}
+
+
+static unsigned int virtiopci_configGen(virtio_dev_t *vdev)
+{
+	return virtio_read8(vdev, vdev->info.base.addr, 0x15);
+}
+
+
+static uint64_t virtiopci_getFeatures(virtio_dev_t *vdev)
+{
+	uint64_t features;
+
+	virtio_write32(vdev, vdev->info.base.addr, 0x00, 1);
+	virtio_mb();
+	features = virtio_read32(vdev, vdev->info.base.addr, 0x04);
+	features <<= 32;
+	virtio_write32(vdev, vdev->info.base.addr, 0x00, 0);
+	virtio_mb();
+	features |= virtio_read32(vdev, vdev->info.base.addr, 0x04);
+
+	return features;
+}
+
+
+static void virtiopci_setFeatures(virtio_dev_t *vdev, uint64_t features)
+{
+	virtio_write32(vdev, vdev->info.base.addr, 0x08, 1);
+	virtio_mb();
+	virtio_write32(vdev, vdev->info.base.addr, 0x0c, features >> 32);
+	virtio_write32(vdev, vdev->info.base.addr, 0x08, 0);
+	virtio_mb();
+	virtio_write32(vdev, vdev->info.base.addr, 0x0c, features);
+}
+
+
+static uint8_t virtiopci_readStatus(virtio_dev_t *vdev)
+{
+	return virtio_read8(vdev, vdev->info.base.addr, 0x14);
+}
+
+
+static void virtiopci_writeStatus(virtio_dev_t *vdev, uint8_t status)
+{
+	virtio_write8(vdev, vdev->info.base.addr, 0x14, status);
+	virtio_mb();
+}
+
+
+static unsigned int virtiopci_isr(virtio_dev_t *vdev)
+{
+	return virtio_read8(vdev, vdev->info.isr.addr, 0x00);
+}
+
+
+static void virtiopci_select(virtio_dev_t *vdev, unsigned int idx)
+{
+	virtio_write16(vdev, vdev->info.base.addr, 0x16, idx);
+	virtio_mb();
+}
+
+
+static int virtiopci_enable(virtio_dev_t *vdev, unsigned int *size)
+{
+	unsigned int maxsz;
+
+	if (!(maxsz = virtio_read16(vdev, vdev->info.base.addr, 0x18)) || virtio_read16(vdev, vdev->info.base.addr, 0x1c))
+		return -ENOENT;
+
+	if (*size > maxsz)
+		*size = maxsz;
+
+	return EOK;
+}
+
+
+static int virtiopci_activate(virtio_dev_t *vdev, virtqueue_t *vq, uint64_t desc, uint64_t drv, uint64_t dev)
+{
+	/* Resolve notification register offset once */
+	vq->noffs = virtio_read16(vdev, vdev->info.base.addr, 0x1e) * vdev->info.xntf;
+
+	virtio_write16(vdev, vdev->info.base.addr, 0x18, vq->size);
+	virtio_write64(vdev, vdev->info.base.addr, 0x20, desc);
+	virtio_write64(vdev, vdev->info.base.addr, 0x28, drv);
+	virtio_write64(vdev, vdev->info.base.addr, 0x30, dev);
+
+	virtio_mb();
+	virtio_write16(vdev, vdev->info.base.addr, 0x1c, 1);
+
+	return EOK;
+}
+
+
+static void virtiopci_notify(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	virtio_write16(vdev, vdev->info.ntf.addr, vq->noffs, vq->idx);
+}
+
+
+/* Modern device with memory space registers (no access type checks on interrupt and notification paths) */
+static unsigned int virtiopci_isrMem(virtio_dev_t *vdev)
+{
+	return virtiopci_memRead8(vdev->info.isr.addr, 0x00);
+}
+
+
+static void virtiopci_notifyMem(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	virtiopci_memWrite16(vdev->info.ntf.addr, vq->noffs, virtio_gtov16(vdev, vq->idx));
+}
+
+
+/* Legacy device with IO space registers */
+static const virtio_ops_t virtiopci_legacyIoOps = {
+	virtiopci_ioRead8, virtiopci_ioRead16, virtiopci_ioRead32, virtiopci_ioRead64,
+	virtiopci_ioWrite8, virtiopci_ioWrite16, virtiopci_ioWrite32, virtiopci_ioWrite64,
+	virtiopci_configLegacy, NULL, virtiopci_getFeaturesLegacy, virtiopci_setFeaturesLegacy,
+	virtiopci_readStatusLegacy, virtiopci_writeStatusLegacy, virtiopci_isrLegacyIo,
+	virtiopci_selectLegacy, virtiopci_enableLegacy, virtiopci_activateLegacy, virtiopci_notifyLegacyIo
+};
+
+
+/* Legacy device with memory space registers */
+static const virtio_ops_t virtiopci_legacyMemOps = {
+	virtiopci_memRead8, virtiopci_memRead16, virtiopci_memRead32, virtiopci_memRead64,
+	virtiopci_memWrite8, virtiopci_memWrite16, virtiopci_memWrite32, virtiopci_memWrite64,
+	virtiopci_configLegacy, NULL, virtiopci_getFeaturesLegacy, virtiopci_setFeaturesLegacy,
+	virtiopci_readStatusLegacy, virtiopci_writeStatusLegacy, virtiopci_isrLegacy,
+	virtiopci_selectLegacy, virtiopci_enableLegacy, virtiopci_activateLegacy, virtiopci_notifyLegacy
+};
+
+
+/* Modern device with memory space registers */
+static const virtio_ops_t virtiopci_modernMemOps = {
+	virtiopci_memRead8, virtiopci_memRead16, virtiopci_memRead32, virtiopci_memRead64,
+	virtiopci_memWrite8, virtiopci_memWrite16, virtiopci_memWrite32, virtiopci_memWrite64,
+	virtiopci_config, virtiopci_configGen, virtiopci_getFeatures, virtiopci_setFeatures,
+	virtiopci_readStatus, virtiopci_writeStatus, virtiopci_isrMem,
+	virtiopci_select, virtiopci_enable, virtiopci_activate, virtiopci_notifyMem
+};
+
+
+/* Modern device with registers spread over IO and memory spaces */
+static const virtio_ops_t virtiopci_modernMixedOps = {
+	virtiopci_read8, virtiopci_read16, virtiopci_read32, virtiopci_read64,
+	virtiopci_write8, virtiopci_write16, virtiopci_write32, virtiopci_write64,
+	virtiopci_config, virtiopci_configGen, virtiopci_getFeatures, virtiopci_setFeatures,
+	virtiopci_readStatus, virtiopci_writeStatus, virtiopci_isr,
+	virtiopci_select, virtiopci_enable, virtiopci_activate, virtiopci_notify
+};
+
+
+/* Selects VirtIO PCI device transport operations based on registers address spaces */
+static const virtio_ops_t *virtiopci_ops(virtio_dev_t *vdev)
+{
+	if (virtio_legacy(vdev))
+		return ((uintptr_t)vdev->info.base.addr & 0x1) ? &virtiopci_legacyIoOps : &virtiopci_legacyMemOps;
+
+	if (((uintptr_t)vdev->info.base.addr | (uintptr_t)vdev->info.ntf.addr | (uintptr_t)vdev->info.isr.addr | (uintptr_t)vdev->info.cfg.addr) & 0x1)
+		return &virtiopci_modernMixedOps;
+
+	return &virtiopci_modernMemOps;
+}
+
+
 static void virtiopci_unmapReg(virtio_reg_t *reg)
 {
 	uintptr_t addr = (uintptr_t)reg->addr;
@@ -62,6 +454,9 @@ int virtiopci_initDev(virtio_dev_t *vdev)
 {
 	int err;
 
+	/* Registers address spaces are known before mapping (IO space registers aren't mapped) */
+	vdev->ops = virtiopci_ops(vdev);
+
 	if ((err = virtiopci_mapReg(&vdev->info.base)) < 0)
 		return err;
 
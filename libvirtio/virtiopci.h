@@ -31,28 +31,29 @@ typedef struct {
 } __attribute__((packed)) virtiopci_cap_t;
 
 
-extern uint8_t virtiopci_read8(void *base, unsigned int reg);
+/* IO space registers access (platform specific) */
+extern uint8_t virtiopci_ioRead8(void *base, unsigned int reg);
 
 
-extern uint16_t virtiopci_read16(void *base, unsigned int reg);
+extern uint16_t virtiopci_ioRead16(void *base, unsigned int reg);
 
 
-extern uint32_t virtiopci_read32(void *base, unsigned int reg);
+extern uint32_t virtiopci_ioRead32(void *base, unsigned int reg);
 
 
-extern uint64_t virtiopci_read64(void *base, unsigned int reg);
+extern uint64_t virtiopci_ioRead64(void *base, unsigned int reg);
 
 
-extern void virtiopci_write8(void *base, unsigned int reg, uint8_t val);
+extern void virtiopci_ioWrite8(void *base, unsigned int reg, uint8_t val);
 
 
-extern void virtiopci_write16(void *base, unsigned int reg, uint16_t val);
+extern void virtiopci_ioWrite16(void *base, unsigned int reg, uint16_t val);
 
 
-extern void virtiopci_write32(void *base, unsigned int reg, uint32_t val);
+extern void virtiopci_ioWrite32(void *base, unsigned int reg, uint32_t val);
 
 
-extern void virtiopci_write64(void *base, unsigned int reg, uint64_t val);
+extern void virtiopci_ioWrite64(void *base, unsigned int reg, uint64_t val);
 
 
 /* Destroys VirtIO PCI device */
@@ -0,0 +1,359 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO completion service
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <sys/interrupt.h>
+#include <sys/threads.h>
+
+#include "virtio.h"
+
+
+/* Number of completion service threads */
+#ifndef VIRTIOSRV_THREADS
+#define VIRTIOSRV_THREADS 1
+#endif
+
+
+/* Completion service thread stack size (runs completion callbacks of all serviced devices, including nested submissions) */
+#ifndef VIRTIOSRV_STACKSZ
+#define VIRTIOSRV_STACKSZ 32768
+#endif
+
+
+/* Default number of polling rounds before yielding to other devices */
+#define VIRTIOSRV_WEIGHT 64
+
+
+typedef struct {
+	virtio_client_t *clients;       /* Serviced devices */
+	virtio_client_t *next;          /* Next device to check for pending work (round robin) */
+	virtio_client_t *cur;           /* Currently serviced device */
+	unsigned int nclients;          /* Number of serviced devices */
+	volatile unsigned int done;     /* End thread? */
+	volatile unsigned int running;  /* Thread started? */
+	void *stack;                    /* Thread stack (NULL if thread isn't running) */
+	handle_t lock;                  /* Thread mutex */
+	handle_t cond;                  /* Pending work condition variable (signaled by interrupts) */
+	handle_t ucond;                 /* Device servicing done condition variable */
+} virtiosrv_thr_t;
+
+
+static struct {
+	virtiosrv_thr_t thrs[VIRTIOSRV_THREADS];
+	handle_t lock;                  /* Service mutex */
+} virtiosrv_common;
+
+
+/* Interrupt handler */
+static int virtiosrv_int(unsigned int n, void *arg)
+{
+	virtio_client_t *client = (virtio_client_t *)arg;
+	virtiosrv_thr_t *thr = (virtiosrv_thr_t *)client->srv;
+	unsigned int i;
+
+	for (i = 0; i < client->nvqs; i++)
+		virtqueue_disableIRQ(client->vdev, client->vqs[i]);
+	client->isr |= client->vdev->ops->isr(client->vdev);
+
+	return thr->cond;
+}
+
+
+/* Returns next device with pending work (round robin, thread has to be locked) */
+static virtio_client_t *virtiosrv_pending(virtiosrv_thr_t *thr, unsigned int *isr)
+{
+	virtio_client_t *client, *start;
+
+	if ((start = thr->next) == NULL)
+		start = thr->clients;
+
+	if ((client = start) == NULL)
+		return NULL;
+
+	do {
+		if ((*isr = client->isr)) {
+			client->isr = 0;
+			thr->next = client->next;
+			return client;
+		}
+
+		if ((client = client->next) == NULL)
+			client = thr->clients;
+	} while (client != start);
+
+	return NULL;
+}
+
+
+/* Completion service thread */
+static void virtiosrv_thr(void *arg)
+{
+	virtiosrv_thr_t *thr = (virtiosrv_thr_t *)arg;
+	virtio_client_t *client;
+	unsigned int isr;
+
+	mutexLock(thr->lock);
+
+	/* Report thread start */
+	thr->running = 1;
+	condBroadcast(thr->ucond);
+
+	while (!thr->done) {
+		if ((client = virtiosrv_pending(thr, &isr)) == NULL) {
+			condWait(thr->cond, thr->lock, 0);
+			continue;
+		}
+		thr->cur = client;
+
+		/* Completion callbacks may submit new requests */
+		mutexUnlock(thr->lock);
+
+		/* Handle processed requests (interrupt handler disables virtqueues interrupts, they're enabled again when polling goes idle) */
+		if (client->poll.irq || (isr & (1 << 0)))
+			virtqueue_poll(client->vdev, client->vqs, client->nvqs, &client->poll);
+
+		/* Handle configuration change */
+		if ((isr & (1 << 1)) && (client->config != NULL))
+			client->config(client);
+
+		mutexLock(thr->lock);
+
+		/* Resume yielded polling after other devices */
+		if (client->poll.resched)
+			client->isr |= (1 << 0);
+
+		thr->cur = NULL;
+		condBroadcast(thr->ucond);
+	}
+
+	mutexUnlock(thr->lock);
+
+	endthread();
+}
+
+
+/* Starts completion service thread */
+static int virtiosrv_start(virtiosrv_thr_t *thr)
+{
+	int err;
+
+	thr->clients = NULL;
+	thr->next = NULL;
+	thr->cur = NULL;
+	thr->nclients = 0;
+	thr->done = 0;
+	thr->running = 0;
+
+	if ((thr->stack = malloc(VIRTIOSRV_STACKSZ)) == NULL)
+		return -ENOMEM;
+
+	if ((err = mutexCreate(&thr->lock)) < 0) {
+		free(thr->stack);
+		thr->stack = NULL;
+		return err;
+	}
+
+	if ((err = condCreate(&thr->cond)) < 0) {
+		resourceDestroy(thr->lock);
+		free(thr->stack);
+		thr->stack = NULL;
+		return err;
+	}
+
+	if ((err = condCreate(&thr->ucond)) < 0) {
+		resourceDestroy(thr->cond);
+		resourceDestroy(thr->lock);
+		free(thr->stack);
+		thr->stack = NULL;
+		return err;
+	}
+
+	if ((err = beginthread(virtiosrv_thr, 4, thr->stack, VIRTIOSRV_STACKSZ, thr)) < 0) {
+		resourceDestroy(thr->ucond);
+		resourceDestroy(thr->cond);
+		resourceDestroy(thr->lock);
+		free(thr->stack);
+		thr->stack = NULL;
+		return err;
+	}
+
+	/* Wait for thread start (no devices are serviced before it) */
+	mutexLock(thr->lock);
+	while (!thr->running)
+		condWait(thr->ucond, thr->lock, 0);
+	mutexUnlock(thr->lock);
+
+	return EOK;
+}
+
+
+/* Stops completion service thread */
+static void virtiosrv_stop(virtiosrv_thr_t *thr)
+{
+	mutexLock(thr->lock);
+	thr->done = 1;
+	condSignal(thr->cond);
+	mutexUnlock(thr->lock);
+	while (threadJoin(0) < 0);
+
+	resourceDestroy(thr->ucond);
+	resourceDestroy(thr->cond);
+	resourceDestroy(thr->lock);
+	free(thr->stack);
+	thr->stack = NULL;
+}
+
+
+void virtio_wakeup(virtio_client_t *client)
+{
+	virtiosrv_thr_t *thr = (virtiosrv_thr_t *)client->srv;
+
+	mutexLock(thr->lock);
+	client->isr |= (1 << 0);
+	condSignal(thr->cond);
+	mutexUnlock(thr->lock);
+}
+
+
+void virtio_unregister(virtio_client_t *client)
+{
+	virtiosrv_thr_t *thr = (virtiosrv_thr_t *)client->srv;
+	virtio_client_t **c;
+
+	mutexLock(virtiosrv_common.lock);
+
+	/* Uninstall interrupt handler */
+	if (client->poll.irq) {
+		if (client->vdev->info.type == vdevLOOP)
+			virtioloop_interrupt(client->vdev, NULL, NULL, 0);
+		else
+			resourceDestroy(client->inth);
+	}
+
+	mutexLock(thr->lock);
+
+	for (c = &thr->clients; *c != client; c = &(*c)->next);
+	*c = client->next;
+	thr->nclients--;
+
+	if (thr->next == client)
+		thr->next = client->next;
+
+	/* Wait for device servicing to finish */
+	while (thr->cur == client)
+		condWait(thr->ucond, thr->lock, 0);
+
+	mutexUnlock(thr->lock);
+
+	mutexUnlock(virtiosrv_common.lock);
+}
+
+
+int virtio_register(virtio_client_t *client)
+{
+	virtiosrv_thr_t *thr = NULL;
+	unsigned int i;
+	int err = -ENOMEM;
+
+	if (!client->nvqs)
+		return -EINVAL;
+
+	mutexLock(virtiosrv_common.lock);
+
+	/* Pick running thread with least devices */
+	for (i = 0; i < VIRTIOSRV_THREADS; i++) {
+		if ((virtiosrv_common.thrs[i].stack != NULL) && ((thr == NULL) || (virtiosrv_common.thrs[i].nclients < thr->nclients)))
+			thr = &virtiosrv_common.thrs[i];
+	}
+
+	/* Start another thread only if all running threads are in use */
+	if ((thr == NULL) || thr->nclients) {
+		for (i = 0; i < VIRTIOSRV_THREADS; i++) {
+			if (virtiosrv_common.thrs[i].stack == NULL) {
+				if ((err = virtiosrv_start(&virtiosrv_common.thrs[i])) == EOK)
+					thr = &virtiosrv_common.thrs[i];
+				break;
+			}
+		}
+
+		if (thr == NULL) {
+			mutexUnlock(virtiosrv_common.lock);
+			return err;
+		}
+	}
+
+	if (!client->poll.weight)
+		client->poll.weight = VIRTIOSRV_WEIGHT;
+	client->srv = thr;
+	client->isr = 0;
+
+	mutexLock(thr->lock);
+	client->next = thr->clients;
+	thr->clients = client;
+	thr->nclients++;
+	mutexUnlock(thr->lock);
+
+	if (client->poll.irq) {
+		if (client->vdev->info.type == vdevLOOP)
+			err = virtioloop_interrupt(client->vdev, virtiosrv_int, client, thr->cond);
+		else
+			err = interrupt(client->vdev->info.irq, virtiosrv_int, client, thr->cond, &client->inth);
+
+		if (err < 0) {
+			mutexLock(thr->lock);
+			thr->clients = client->next;
+			thr->nclients--;
+			if (thr->next == client)
+				thr->next = client->next;
+			mutexUnlock(thr->lock);
+
+			mutexUnlock(virtiosrv_common.lock);
+			return err;
+		}
+	}
+	else {
+		/* Device without interrupts is woken up by driver */
+		for (i = 0; i < client->nvqs; i++)
+			virtqueue_disableIRQ(client->vdev, client->vqs[i]);
+	}
+
+	mutexUnlock(virtiosrv_common.lock);
+
+	return EOK;
+}
+
+
+void virtiosrv_done(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < VIRTIOSRV_THREADS; i++) {
+		if (virtiosrv_common.thrs[i].stack != NULL)
+			virtiosrv_stop(&virtiosrv_common.thrs[i]);
+	}
+
+	resourceDestroy(virtiosrv_common.lock);
+}
+
+
+int virtiosrv_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < VIRTIOSRV_THREADS; i++)
+		virtiosrv_common.thrs[i].stack = NULL;
+
+	return mutexCreate(&virtiosrv_common.lock);
+}
@@ -19,10 +19,19 @@
 #include <sys/list.h>
 #include <sys/mman.h>
 #include <sys/threads.h>
+#include <sys/time.h>
 
 #include "virtio.h"
 
 
+/* Preallocated indirect descriptor table size (number of descriptors) */
+#define VIRTQUEUE_INDIRECT 16
+
+
+/* Maximum number of requests completed under single virtqueue lock */
+#define VIRTQUEUE_COMPLETE 16
+
+
 static inline uint8_t virtqueue_read8(virtio_dev_t *vdev, volatile void *addr)
 {
 	return *(volatile uint8_t *)addr;
@@ -67,252 +76,1184 @@ static inline void virtqueue_write32(virtio_dev_t *vdev, volatile void *addr, ui
 
 static inline void virtqueue_write64(virtio_dev_t *vdev, volatile void *addr, uint64_t val)
 {
-	*(volatile uint64_t *)addr = virtio_gtov32(vdev, val);
+	*(volatile uint64_t *)addr = virtio_gtov64(vdev, val);
 }
 
 
-/* Selects virtqueue with given index */
-static void virtqueue_select(virtio_dev_t *vdev, unsigned int idx)
+/* Returns virtqueue memory physical address */
+static inline uint64_t virtqueue_pa(virtqueue_t *vq, void *va)
 {
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev)) {
-			virtio_write16(vdev, vdev->info.base.addr, 0x0e, idx);
-			virtio_mb();
-			return;
-		}
+	return vq->mempa + ((uintptr_t)va - (uintptr_t)vq->mem);
+}
 
-		virtio_write16(vdev, vdev->info.base.addr, 0x16, idx);
-		virtio_mb();
-		return;
-	}
 
-	virtio_write32(vdev, vdev->info.base.addr, 0x30, idx);
-	virtio_mb();
+/* Returns segment buffer physical address (registered buffers are translated without syscall) */
+static inline uint64_t virtqueue_segPA(virtio_seg_t *seg, uintptr_t va)
+{
+	if (seg->buf != NULL)
+		return _virtio_bufPA(seg->buf, (void *)va);
+
+	return va2pa((void *)va);
 }
 
 
-/* Checks if virtqueue is available and validates its size */
-static int virtqueue_enable(virtio_dev_t * vdev, unsigned int *size)
+/* Appends segment physical runs to virtqueue runs table (virtqueue has to be locked), returns number of runs in table */
+static int virtqueue_segRuns(virtqueue_t *vq, virtio_seg_t *seg, unsigned int n)
 {
-	unsigned int maxsz;
-
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev)) {
-			if (!(maxsz = virtio_read16(vdev, vdev->info.base.addr, 0x0c)) || virtio_read32(vdev, vdev->info.base.addr, 0x08))
-				return -ENOENT;
+	uintptr_t va = (uintptr_t)seg->buff, end = va + seg->len, start;
+	virtqueue_run_t *runs;
+	uint64_t pa, next = 0;
+	unsigned int sz;
+
+	pa = virtqueue_segPA(seg, va);
+
+	for (;;) {
+		if (n >= vq->runsz) {
+			sz = (vq->runsz) ? 2 * vq->runsz : VIRTQUEUE_INDIRECT;
+			if ((runs = realloc(vq->runs, sz * sizeof(virtqueue_run_t))) == NULL)
+				return -ENOMEM;
+			vq->runs = runs;
+			vq->runsz = sz;
+		}
+		start = va;
 
-			*size = maxsz;
-			return EOK;
+		/* Registered region without per page addresses is physically contiguous */
+		if ((seg->buf != NULL) && (seg->buf->pages == NULL)) {
+			va = end;
+		}
+		else {
+			/* Split at page boundaries, merge physically adjacent pages */
+			for (va = (va & ~(_PAGE_SIZE - 1)) + _PAGE_SIZE; va < end; va += _PAGE_SIZE) {
+				if ((next = virtqueue_segPA(seg, va)) != pa + (va - start))
+					break;
+			}
+
+			if (va > end)
+				va = end;
 		}
 
-		if (!(maxsz = virtio_read16(vdev, vdev->info.base.addr, 0x18)) || virtio_read16(vdev, vdev->info.base.addr, 0x1c))
-			return -ENOENT;
-		
-		if (*size > maxsz)
-			*size = maxsz;
+		vq->runs[n].pa = pa;
+		vq->runs[n++].len = va - start;
 
-		return EOK;
+		if (va == end)
+			return n;
+		pa = next;
 	}
+}
 
-	if (!(maxsz = virtio_read32(vdev, vdev->info.base.addr, 0x34)) || virtio_read32(vdev, vdev->info.base.addr, virtio_legacy(vdev) ? 0x40 : 0x44))
-		return -ENOENT;
 
-	if (*size > maxsz)
-		*size = maxsz;
+/* Splits request segments into physical runs (virtqueue has to be locked), returns number of runs (r - number of device readable runs) */
+static int virtqueue_runs(virtqueue_t *vq, virtio_req_t *req, unsigned int *r)
+{
+	virtio_seg_t *seg = req->segs;
+	unsigned int i;
+	int n = 0;
 
-	return EOK;
+	for (i = 0; i < req->rsegs + req->wsegs; i++) {
+		if (i == req->rsegs)
+			*r = n;
+
+		if ((n = virtqueue_segRuns(vq, seg, n)) < 0)
+			return n;
+		seg = seg->next;
+	}
+
+	if (!req->wsegs)
+		*r = n;
+
+	return n;
 }
 
 
 /* Activates virtqueue */
 static int virtqueue_activate(virtio_dev_t *vdev, virtqueue_t *vq)
 {
-	uint64_t addr;
+	/* Descriptors, driver and device areas */
+	if (vq->packed)
+		return vdev->ops->activate(vdev, vq, virtqueue_pa(vq, (void *)vq->pdesc), virtqueue_pa(vq, (void *)vq->drv), virtqueue_pa(vq, (void *)vq->dev));
 
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev)) {
-			if ((addr = va2pa((void *)vq->desc) / _PAGE_SIZE) >> 32)
-				return -EFAULT;
+	return vdev->ops->activate(vdev, vq, virtqueue_pa(vq, (void *)vq->desc), virtqueue_pa(vq, (void *)vq->avail), virtqueue_pa(vq, (void *)vq->used));
+}
 
-			virtio_write32(vdev, vdev->info.base.addr, 0x08, addr);
-			return EOK;
-		}
 
-		vq->noffs = virtio_read16(vdev, vdev->info.base.addr, 0x1e);
-		virtio_write16(vdev, vdev->info.base.addr, 0x18, vq->size);
-		virtio_write64(vdev, vdev->info.base.addr, 0x20, va2pa((void *)vq->desc));
-		virtio_write64(vdev, vdev->info.base.addr, 0x28, va2pa((void *)vq->avail));
-		virtio_write64(vdev, vdev->info.base.addr, 0x30, va2pa((void *)vq->used));
+/* Checks if event index lies within (prev, next] range (event index notification suppression) */
+static inline int virtqueue_needEvent(uint16_t event, uint16_t next, uint16_t prev)
+{
+	return (uint16_t)(next - event - 1) < (uint16_t)(next - prev);
+}
 
-		virtio_mb();
-		virtio_write16(vdev, vdev->info.base.addr, 0x1c, 1);
-		return EOK;
-	}
 
-	virtio_write32(vdev, vdev->info.base.addr, 0x38, vq->size);
+void virtqueue_enableIRQ(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	mutexLock(vq->lock);
 
-	if (virtio_legacy(vdev)) {
-		if ((addr = va2pa((void *)vq->desc) / _PAGE_SIZE) >> 32)
-			return -EFAULT;
+	vq->delayed = 0;
 
-		virtio_write32(vdev, vdev->info.base.addr, 0x3c, _PAGE_SIZE);
-		virtio_write32(vdev, vdev->info.base.addr, 0x40, addr);
-		return EOK;
+	if (vq->packed) {
+		virtqueue_write16(vdev, &vq->drv->flags, 0x0);
+		virtio_mb();
+		mutexUnlock(vq->lock);
+		return;
 	}
 
-	addr = va2pa((void *)vq->desc);
-	virtio_write32(vdev, vdev->info.base.addr, 0x80, addr);
-	virtio_write32(vdev, vdev->info.base.addr, 0x84, addr >> 32);
-
-	addr = va2pa((void *)vq->avail);
-	virtio_write32(vdev, vdev->info.base.addr, 0x90, addr);
-	virtio_write32(vdev, vdev->info.base.addr, 0x94, addr >> 32);
-
-	addr = va2pa((void *)vq->used);
-	virtio_write32(vdev, vdev->info.base.addr, 0xa0, addr);
-	virtio_write32(vdev, vdev->info.base.addr, 0xa4, addr >> 32);
+	/* Request interrupt on next processed request */
+	if (virtio_eventIdx(vdev))
+		virtqueue_write16(vdev, vq->uevent, vq->last);
 
+	virtqueue_write16(vdev, &vq->avail->flags, virtqueue_read16(vdev, &vq->avail->flags) & ~0x1);
 	virtio_mb();
-	virtio_write32(vdev, vdev->info.base.addr, 0x44, 1);
-	return EOK;
+
+	mutexUnlock(vq->lock);
 }
 
 
-void virtqueue_enableIRQ(virtio_dev_t *vdev, virtqueue_t *vq)
+void virtqueue_delayIRQ(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int n)
 {
+	uint16_t offs;
+
+	/* In-order device may report whole batch with single used entry, the event might never be reached */
+	if (!virtio_eventIdx(vdev) || vq->inorder || (n < 2)) {
+		virtqueue_enableIRQ(vdev, vq);
+		return;
+	}
+
+	mutexLock(vq->lock);
+
+	if (n > vq->size)
+		n = vq->size;
+	vq->delayed = 1;
+
+	if (vq->packed) {
+		/* Event descriptor offset (assuming single descriptor requests) with its wrap counter */
+		offs = vq->last + n - 1;
+		if (offs >= vq->size)
+			offs = (offs - vq->size) | (!vq->uwrap << 15);
+		else
+			offs |= vq->uwrap << 15;
+
+		virtqueue_write16(vdev, &vq->drv->desc, offs);
+		virtio_wmb();
+		virtqueue_write16(vdev, &vq->drv->flags, 0x2);
+		virtio_mb();
+		mutexUnlock(vq->lock);
+		return;
+	}
+
+	virtqueue_write16(vdev, vq->uevent, vq->last + n - 1);
 	virtqueue_write16(vdev, &vq->avail->flags, virtqueue_read16(vdev, &vq->avail->flags) & ~0x1);
 	virtio_mb();
+
+	mutexUnlock(vq->lock);
 }
 
 
 void virtqueue_disableIRQ(virtio_dev_t *vdev, virtqueue_t *vq)
 {
+	if (vq->packed) {
+		virtqueue_write16(vdev, &vq->drv->flags, 0x1);
+		return;
+	}
+
+	/* Device ignores avail ring flags with event index, move used event away from current used index */
+	if (virtio_eventIdx(vdev))
+		virtqueue_write16(vdev, vq->uevent, vq->last - 1 - vq->size / 2);
+
 	virtqueue_write16(vdev, &vq->avail->flags, virtqueue_read16(vdev, &vq->avail->flags) | 0x1);
 }
 
 
-int virtqueue_enqueue(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t *req)
+/* Fills out request indirect descriptor table, returns the table physical address */
+static uint64_t virtqueue_fillIndirect(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int n, unsigned int r, uint16_t id, virtqueue_itbl_t *itbl)
 {
 	volatile virtio_desc_t *desc;
-	virtio_seg_t *seg;
-	unsigned int i, n;
-	uint16_t id, idx;
+	volatile virtio_pdesc_t *pdesc;
+	unsigned int i, offs;
+	uint64_t addr;
+	void *tbl;
+
+	/* Use oversized table or preallocated table assigned to descriptor chain (buffer) ID */
+	if (itbl->mem != NULL) {
+		tbl = itbl->mem;
+		addr = itbl->pa;
+	}
+	else {
+		offs = id * VIRTQUEUE_INDIRECT * sizeof(virtio_desc_t);
+		tbl = (void *)((uintptr_t)vq->ipool + offs);
+		addr = vq->ipoolpa + offs;
+	}
+	vq->ibig[id] = *itbl;
 
-	if (!(n = req->rsegs + req->wsegs))
+	for (i = 0; i < n; i++) {
+		if (vq->packed) {
+			pdesc = (volatile virtio_pdesc_t *)tbl + i;
+			virtqueue_write64(vdev, &pdesc->addr, vq->runs[i].pa);
+			virtqueue_write32(vdev, &pdesc->len, vq->runs[i].len);
+			virtqueue_write16(vdev, &pdesc->flags, (i >= r) * 0x2);
+		}
+		else {
+			desc = (volatile virtio_desc_t *)tbl + i;
+			virtqueue_write64(vdev, &desc->addr, vq->runs[i].pa);
+			virtqueue_write32(vdev, &desc->len, vq->runs[i].len);
+			virtqueue_write16(vdev, &desc->flags, ((i < n - 1) * 0x1) | ((i >= r) * 0x2));
+			virtqueue_write16(vdev, &desc->next, i + 1);
+		}
+	}
+
+	return addr;
+}
+
+
+/* Releases request oversized indirect descriptor table */
+static void virtqueue_freeIndirect(virtqueue_t *vq, uint16_t id)
+{
+	if ((vq->ibig == NULL) || (vq->ibig[id].mem == NULL))
+		return;
+
+	virtio_memFree(vq->ibig[id].mem, vq->ibig[id].memsz);
+	vq->ibig[id].mem = NULL;
+}
+
+
+/* Returns request writable length (reported for implicitly used in-order buffers) */
+static unsigned int virtqueue_wlen(virtqueue_t *vq, unsigned int n, unsigned int r)
+{
+	unsigned int i, len = 0;
+
+	for (i = r; i < n; i++)
+		len += vq->runs[i].len;
+
+	return len;
+}
+
+
+/* Inserts request to split virtqueue at given avail ring index (avail index is updated by caller) */
+static void virtqueue_addSplit(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t *req, unsigned int n, unsigned int r, virtqueue_itbl_t *itbl, uint16_t idx, time_t now)
+{
+	volatile virtio_desc_t *desc;
+	unsigned int i;
+	uint16_t id;
+
+	id = vq->free;
+	vq->buffs[id] = req->segs->buff;
+	vq->reqs[id] = req;
+	if (vq->stamps != NULL)
+		vq->stamps[id] = now;
+
+	/* Descriptor chain length is tracked in shadow state (in-order descriptor chains are recycled in bulk) */
+	vq->nums[id] = ((n > 1) && (vq->ipool != NULL)) ? 1 : n;
+	if (vq->inorder)
+		vq->lens[id] = virtqueue_wlen(vq, n, r);
+
+	if ((n > 1) && (vq->ipool != NULL)) {
+		/* Single indirect descriptor */
+		desc = &vq->desc[id];
+		virtqueue_write64(vdev, &desc->addr, virtqueue_fillIndirect(vdev, vq, n, r, id, itbl));
+		virtqueue_write32(vdev, &desc->len, n * sizeof(virtio_desc_t));
+		virtqueue_write16(vdev, &desc->flags, 0x4);
+
+		vq->free = vq->ids[id];
+		vq->nfree--;
+	}
+	else {
+		/* Fill out request descriptors (request buffer and request are tracked by chain head, chain links are copied from shadow free list) */
+		for (i = 0; i < n; i++) {
+			desc = &vq->desc[vq->free];
+			virtqueue_write64(vdev, &desc->addr, vq->runs[i].pa);
+			virtqueue_write32(vdev, &desc->len, vq->runs[i].len);
+			virtqueue_write16(vdev, &desc->flags, ((i < n - 1) * 0x1) | ((i >= r) * 0x2));
+
+			if (i < n - 1)
+				virtqueue_write16(vdev, &desc->next, vq->ids[vq->free]);
+
+			vq->free = vq->ids[vq->free];
+		}
+		vq->nfree -= n;
+	}
+
+	/* Insert request to avail ring */
+	virtqueue_write16(vdev, &vq->avail->ring[idx & (vq->size - 1)], id);
+	vq->added++;
+}
+
+
+/* Inserts request to packed virtqueue (descriptors are reused in place), returns head descriptor flags to be written by caller */
+static uint16_t virtqueue_addPacked(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t *req, unsigned int n, unsigned int r, virtqueue_itbl_t *itbl, uint16_t *head, time_t now)
+{
+	volatile virtio_pdesc_t *desc;
+	unsigned int i;
+	uint16_t id, hflags, flags;
+
+	/* Allocate buffer ID (in-order buffer ID is head descriptor index) */
+	if (vq->inorder) {
+		id = vq->next;
+		vq->lens[id] = virtqueue_wlen(vq, n, r);
+	}
+	else {
+		id = vq->free;
+		vq->free = vq->ids[id];
+	}
+	vq->buffs[id] = req->segs->buff;
+	vq->reqs[id] = req;
+	if (vq->stamps != NULL)
+		vq->stamps[id] = now;
+	*head = vq->next;
+
+	if ((n > 1) && (vq->ipool != NULL)) {
+		/* Single indirect descriptor */
+		desc = &vq->pdesc[vq->next];
+		virtqueue_write64(vdev, &desc->addr, virtqueue_fillIndirect(vdev, vq, n, r, id, itbl));
+		virtqueue_write32(vdev, &desc->len, n * sizeof(virtio_pdesc_t));
+		virtqueue_write16(vdev, &desc->id, id);
+		hflags = 0x4 | (vq->awrap ? (1 << 7) : (1 << 15));
+
+		if (++vq->next == vq->size) {
+			vq->next = 0;
+			vq->awrap ^= 1;
+		}
+		vq->nums[id] = 1;
+		vq->nfree--;
+		vq->added++;
+
+		return hflags;
+	}
+	vq->nums[id] = n;
+
+	/* Fill out request descriptors except head descriptor flags */
+	hflags = 0;
+	for (i = 0; i < n; i++) {
+		desc = &vq->pdesc[vq->next];
+		virtqueue_write64(vdev, &desc->addr, vq->runs[i].pa);
+		virtqueue_write32(vdev, &desc->len, vq->runs[i].len);
+		virtqueue_write16(vdev, &desc->id, id);
+
+		/* Mark descriptor available (AVAIL flag equal to and USED flag inverse of avail wrap counter) */
+		flags = ((i < n - 1) * 0x1) | ((i >= r) * 0x2) | (vq->awrap ? (1 << 7) : (1 << 15));
+		if (i)
+			virtqueue_write16(vdev, &desc->flags, flags);
+		else
+			hflags = flags;
+
+		if (++vq->next == vq->size) {
+			vq->next = 0;
+			vq->awrap ^= 1;
+		}
+	}
+	vq->nfree -= n;
+	vq->added += n;
+
+	return hflags;
+}
+
+
+/* Validates request and splits it into physical runs, returns number of required ring descriptors (allocates oversized indirect descriptor table) */
+static int virtqueue_prepare(virtqueue_t *vq, virtio_req_t *req, unsigned int *n, unsigned int *r, virtqueue_itbl_t *itbl)
+{
+	unsigned int m;
+	int err;
+
+	itbl->mem = NULL;
+	itbl->memsz = 0;
+
+	if (!(req->rsegs + req->wsegs))
 		return -EINVAL;
-	else if (n > vq->size)
+
+	if ((err = virtqueue_runs(vq, req, r)) < 0)
+		return err;
+	*n = err;
+
+	/* Request with indirect descriptors takes single ring descriptor */
+	m = ((*n > 1) && (vq->ipool != NULL)) ? 1 : *n;
+	if (m > vq->size)
 		return -ENOSPC;
 
+	/* Allocate indirect descriptor table exceeding preallocated table size */
+	if ((m < *n) && (*n > VIRTQUEUE_INDIRECT)) {
+		itbl->memsz = *n * sizeof(virtio_desc_t);
+		if ((itbl->mem = virtio_memAlloc(itbl->memsz, &itbl->pa)) == NULL)
+			return -ENOMEM;
+	}
+
+	return m;
+}
+
+
+/* Checks if device should be notified of requests added since last notification */
+static int virtqueue_kick(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	uint16_t flags, event, next;
+
+	if (!vq->added)
+		return 0;
+
+	if (vq->packed) {
+		if ((flags = virtqueue_read16(vdev, &vq->dev->flags)) == 0x1)
+			return 0;
+
+		if ((flags != 0x2) || !virtio_eventIdx(vdev))
+			return 1;
+
+		/* Event descriptor offset relative to current avail wrap */
+		event = virtqueue_read16(vdev, &vq->dev->desc);
+		next = event & 0x7fff;
+		if ((event >> 15) != vq->awrap)
+			next -= vq->size;
+
+		return virtqueue_needEvent(next, vq->next, vq->next - vq->added);
+	}
+
+	if (virtio_eventIdx(vdev)) {
+		next = virtqueue_read16(vdev, &vq->avail->idx);
+		return virtqueue_needEvent(virtqueue_read16(vdev, vq->aevent), next, next - vq->added);
+	}
+
+	return !(virtqueue_read16(vdev, &vq->used->flags) & 0x01);
+}
+
+
+/* Checks if device should be notified and accounts notification (virtqueue has to be locked) */
+static int virtqueue_notified(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	int kick;
+
+	if (!vq->added)
+		return 0;
+
+	if ((kick = virtqueue_kick(vdev, vq)))
+		vq->stats.kicks++;
+	else
+		vq->stats.suppressed++;
+	vq->added = 0;
+
+	return kick;
+}
+
+
+int virtqueue_enqueueBatch(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t **reqs, unsigned int n)
+{
+	virtqueue_itbl_t itbl;
+	unsigned int i, nruns, rruns, pending = 0;
+	uint16_t idx = 0, head, hflags, fhead = 0, fflags = 0;
+	time_t now = 0;
+	int m, err = EOK;
+
 	mutexLock(vq->lock);
 
-	/* Wait for n free descriptors */
-	while (vq->nfree < n)
-		condWait(vq->cond, vq->lock, 0);
+	if (!vq->packed)
+		idx = virtqueue_read16(vdev, &vq->avail->idx);
 
-	/* Fill out request descriptors */
-	id = vq->free;
-	seg = req->segs;
 	for (i = 0; i < n; i++) {
-		desc = &vq->desc[vq->free];
-		vq->buffs[vq->free] = seg->buff;
-		virtqueue_write64(vdev, &desc->addr, va2pa(seg->buff));
-		virtqueue_write32(vdev, &desc->len, seg->len);
-		virtqueue_write16(vdev, &desc->flags, ((i < n - 1) * 0x1) | ((i >= req->rsegs) * 0x2));
+		if (vq->broken) {
+			err = -EIO;
+			break;
+		}
 
-		if (i < n - 1)
-			virtqueue_write16(vdev, &desc->next, desc->next);
+		if ((m = virtqueue_prepare(vq, reqs[i], &nruns, &rruns, &itbl)) < 0) {
+			err = m;
+			break;
+		}
+		reqs[i]->len = 0;
+		reqs[i]->done = 0;
+
+		if (vq->nfree < m) {
+			/* Publish pending requests and notify device before waiting for free descriptors */
+			if (pending) {
+				virtio_wmb();
+				if (vq->packed)
+					virtqueue_write16(vdev, &vq->pdesc[fhead].flags, fflags);
+				else
+					virtqueue_write16(vdev, &vq->avail->idx, idx);
+				pending = 0;
+			}
 
-		vq->free = desc->next;
-		seg = seg->next;
-	}
-	vq->nfree -= n;
+			virtio_mb();
+			if (virtqueue_notified(vdev, vq))
+				vdev->ops->notify(vdev, vq);
+
+			vq->stats.waits++;
+			vq->nwait++;
+			while ((vq->nfree < m) && !vq->broken)
+				condWait(vq->cond, vq->lock, 0);
+			vq->nwait--;
+
+			if (vq->broken) {
+				virtio_memFree(itbl.mem, itbl.memsz);
+				err = -EIO;
+				break;
+			}
+
+			/* Runs table could be reused (or grown) by other thread while waiting */
+			if ((m = virtqueue_runs(vq, reqs[i], &rruns)) < 0) {
+				virtio_memFree(itbl.mem, itbl.memsz);
+				err = m;
+				break;
+			}
+			nruns = m;
+		}
 
-	/* Insert request to avail ring */
-	idx = virtqueue_read16(vdev, &vq->avail->idx);
-	virtqueue_write16(vdev, &vq->avail->ring[idx & (vq->size - 1)], id);
-	virtio_mb();
+		/* Requests are stamped with enqueue time (one timestamp per batch) once buffer ID is allocated */
+		if ((vq->stamps != NULL) && !now)
+			gettime(&now, NULL);
+
+		if (++vq->stats.inflight > vq->stats.peak)
+			vq->stats.peak = vq->stats.inflight;
+		vq->stats.occupancy += vq->stats.inflight;
+		vq->stats.enqueued++;
+
+		if (vq->packed) {
+			hflags = virtqueue_addPacked(vdev, vq, reqs[i], nruns, rruns, &itbl, &head, now);
+
+			/* First pending request head makes all pending requests available at once */
+			if (!pending) {
+				fhead = head;
+				fflags = hflags;
+			}
+			else {
+				virtqueue_write16(vdev, &vq->pdesc[head].flags, hflags);
+			}
+		}
+		else {
+			virtqueue_addSplit(vdev, vq, reqs[i], nruns, rruns, &itbl, idx++, now);
+		}
+		pending++;
+	}
 
-	/* Update avail index */
-	virtqueue_write16(vdev, &vq->avail->idx, idx + 1);
+	/* Expose requests to device */
+	if (pending) {
+		virtio_wmb();
+		if (vq->packed)
+			virtqueue_write16(vdev, &vq->pdesc[fhead].flags, fflags);
+		else
+			virtqueue_write16(vdev, &vq->avail->idx, idx);
+	}
 
 	mutexUnlock(vq->lock);
 
+	/* Partially enqueued batch is reported with short count (error of first rejected request is dropped) */
+	return (i > 0) ? i : err;
+}
+
+
+int virtqueue_enqueue(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t *req)
+{
+	int err;
+
+	if ((err = virtqueue_enqueueBatch(vdev, vq, &req, 1)) < 0)
+		return err;
+
 	return EOK;
 }
 
 
 void virtqueue_notify(virtio_dev_t *vdev, virtqueue_t *vq)
 {
+	int kick;
+
 	/* Ensure avail index is visible to device */
 	virtio_mb();
 
-	if (virtqueue_read16(vdev, &vq->used->flags) & 0x01)
-		return;
+	mutexLock(vq->lock);
+	kick = virtqueue_notified(vdev, vq);
+	mutexUnlock(vq->lock);
 
-	if (vdev->info.type == vdevPCI) {
-		if (virtio_legacy(vdev)) {
-			virtio_write16(vdev, vdev->info.base.addr, 0x10, vq->idx);
-			return;
-		}
+	if (kick)
+		vdev->ops->notify(vdev, vq);
+}
 
-		virtio_write16(vdev, vdev->info.ntf.addr, vq->noffs * vdev->info.xntf, vq->idx);
-		return;
-	}
 
-	virtio_write32(vdev, vdev->info.base.addr, 0x50, vq->idx);
+int virtqueue_busy(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	int ret;
+
+	mutexLock(vq->lock);
+
+	/* In-order device may skip used ring entries, buffers are busy until dequeued */
+	if (vq->packed || vq->inorder)
+		ret = (vq->nfree < vq->size);
+	else
+		ret = (virtqueue_read16(vdev, &vq->avail->idx) != virtqueue_read16(vdev, &vq->used->idx));
+
+	mutexUnlock(vq->lock);
+
+	return ret;
 }
 
 
-void *virtqueue_dequeue(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int *len)
+/* Accounts processed request latency (now is read on first use) */
+static void virtqueue_latency(virtqueue_t *vq, uint16_t id, time_t *now)
+{
+	time_t lat;
+	unsigned int i;
+
+	if (!*now)
+		gettime(now, NULL);
+	lat = *now - vq->stamps[id];
+
+	for (i = 0; (i < VIRTQUEUE_HISTSZ - 1) && (lat >= (1LL << i)); i++);
+	vq->stats.hist[i]++;
+}
+
+
+/* Marks virtqueue as broken after device used buffer which isn't in flight (virtqueue has to be locked) */
+static void *virtqueue_broken(virtqueue_t *vq)
+{
+	vq->broken = 1;
+
+	/* Wake up threads waiting for free descriptors and requests completion */
+	condBroadcast(vq->cond);
+	condBroadcast(vq->dcond);
+
+	return NULL;
+}
+
+
+/* Checks if descriptor chain (buffer ID) reported by device is in flight */
+static inline int virtqueue_inflight(virtqueue_t *vq, uint32_t id)
+{
+	return (id < vq->size) && (vq->reqs[id] != NULL);
+}
+
+
+/* Removes processed request from split virtqueue (used ring entry has to be available) */
+static void *virtqueue_getSplit(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t **req, unsigned int *len, time_t *now)
 {
 	volatile virtio_used_elem_t *used;
-	uint16_t idx, next;
+	unsigned int i;
+	uint32_t id;
+	uint16_t idx;
 	void *buff;
 
-	mutexLock(vq->lock);
+	/* Get processed request */
+	used = &vq->used->ring[vq->last & (vq->size - 1)];
 
-	if (vq->last == virtqueue_read16(vdev, &vq->used->idx)) {
-		mutexUnlock(vq->lock);
-		return NULL;
+	/* Get processed request descriptor chain ID and its head buffer (descriptor chain has to be in flight) */
+	if (!virtqueue_inflight(vq, id = virtqueue_read32(vdev, &used->id)))
+		return virtqueue_broken(vq);
+	vq->last++;
+	buff = vq->buffs[id];
+	if (req != NULL)
+		*req = vq->reqs[id];
+
+	/* Get number of bytes written to request buffers */
+	if (len != NULL)
+		*len = virtqueue_read32(vdev, &used->len);
+
+	if (vq->stamps != NULL)
+		virtqueue_latency(vq, id, now);
+
+	/* Return descriptor chain to free list (chain is walked in shadow state, descriptors table isn't read back) */
+	for (idx = id, i = 1; i < vq->nums[id]; i++)
+		idx = vq->ids[idx];
+	vq->ids[idx] = vq->free;
+	vq->free = id;
+	vq->nfree += vq->nums[id];
+
+	virtqueue_freeIndirect(vq, id);
+	vq->buffs[id] = NULL;
+	vq->reqs[id] = NULL;
+
+	return buff;
+}
+
+
+/* Removes processed request from in-order split virtqueue (used ring entry or pending used batch has to be available) */
+static void *virtqueue_getSplitInOrder(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t **req, unsigned int *len, time_t *now)
+{
+	volatile virtio_used_elem_t *used;
+	uint32_t bid;
+	uint16_t id;
+	void *buff;
+
+	/* Oldest descriptor chain (descriptors are allocated and recycled in ring order) */
+	id = (vq->free + vq->nfree) & (vq->size - 1);
+
+	/* Start next used batch (buffers preceding reported buffer are used implicitly) */
+	if (!vq->batch) {
+		used = &vq->used->ring[vq->last & (vq->size - 1)];
+		if (!virtqueue_inflight(vq, bid = virtqueue_read32(vdev, &used->id)))
+			return virtqueue_broken(vq);
+		vq->last++;
+		vq->bid = bid;
+		vq->blen = virtqueue_read32(vdev, &used->len);
+		vq->batch = 1;
 	}
 
-	/* Get processed request */
-	used = &vq->used->ring[vq->last++ & (vq->size - 1)];
-	virtio_mb();
+	if (vq->reqs[id] == NULL)
+		return virtqueue_broken(vq);
+
+	buff = vq->buffs[id];
+	if (req != NULL)
+		*req = vq->reqs[id];
+
+	if (len != NULL)
+		*len = (id == vq->bid) ? vq->blen : vq->lens[id];
+
+	if (id == vq->bid)
+		vq->batch = 0;
+
+	if (vq->stamps != NULL)
+		virtqueue_latency(vq, id, now);
 
-	/* Get processed request descriptor chain ID and its head buffer */
-	next = virtqueue_read32(vdev, &used->id);
-	buff = vq->buffs[next];
+	/* Recycle descriptors without walking the chain */
+	vq->nfree += vq->nums[id];
+	virtqueue_freeIndirect(vq, id);
+	vq->buffs[id] = NULL;
+	vq->reqs[id] = NULL;
+
+	return buff;
+}
+
+
+/* Removes processed request from packed virtqueue */
+static void *virtqueue_getPacked(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t **req, unsigned int *len, time_t *now)
+{
+	volatile virtio_pdesc_t *desc = &vq->pdesc[vq->last];
+	unsigned char avail, used;
+	uint16_t flags, id;
+	void *buff;
+
+	/* Used descriptor has AVAIL and USED flags equal to used wrap counter */
+	flags = virtqueue_read16(vdev, &desc->flags);
+	avail = !!(flags & (1 << 7));
+	used = !!(flags & (1 << 15));
+	if ((avail != used) || (used != vq->uwrap))
+		return NULL;
+	virtio_rmb();
+
+	/* Get processed request buffer ID and its head buffer (buffer ID has to be in flight) */
+	if (!virtqueue_inflight(vq, id = virtqueue_read16(vdev, &desc->id)))
+		return virtqueue_broken(vq);
+	buff = vq->buffs[id];
+	if (req != NULL)
+		*req = vq->reqs[id];
 
 	/* Get number of bytes written to request buffers */
 	if (len != NULL)
-		*len = virtqueue_read32(vdev, &used->len);
+		*len = virtqueue_read32(vdev, &desc->len);
 
-	/* Free descriptors */
-	do {
-		idx = next;
-		next = virtqueue_read16(vdev, &vq->desc[idx].next);
-		vq->desc[idx].next = vq->free;
-		vq->buffs[idx] = NULL;
-		vq->free = idx;
-		vq->nfree++;
-	} while (virtqueue_read16(vdev, &vq->desc[idx].flags) & 0x1);
+	if (vq->stamps != NULL)
+		virtqueue_latency(vq, id, now);
+
+	/* Skip request descriptors */
+	if ((vq->last += vq->nums[id]) >= vq->size) {
+		vq->last -= vq->size;
+		vq->uwrap ^= 1;
+	}
+	vq->nfree += vq->nums[id];
+
+	/* Free buffer ID */
+	virtqueue_freeIndirect(vq, id);
+	vq->buffs[id] = NULL;
+	vq->reqs[id] = NULL;
+	vq->ids[id] = vq->free;
+	vq->free = id;
 
-	/* Signal free descriptors */
-	condSignal(vq->cond);
+	return buff;
+}
 
+
+/* Removes processed request from in-order packed virtqueue */
+static void *virtqueue_getPackedInOrder(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t **req, unsigned int *len, time_t *now)
+{
+	volatile virtio_pdesc_t *desc = &vq->pdesc[vq->last];
+	unsigned char avail, used;
+	uint16_t flags, id;
+	void *buff;
+
+	/* Oldest buffer ID is its head descriptor index */
+	id = vq->last;
+
+	/* Start next used batch (device writes single used descriptor at batch start and skips the rest of batch) */
+	if (!vq->batch) {
+		flags = virtqueue_read16(vdev, &desc->flags);
+		avail = !!(flags & (1 << 7));
+		used = !!(flags & (1 << 15));
+		if ((avail != used) || (used != vq->uwrap))
+			return NULL;
+		virtio_rmb();
+
+		if (!virtqueue_inflight(vq, vq->bid = virtqueue_read16(vdev, &desc->id)))
+			return virtqueue_broken(vq);
+		vq->blen = virtqueue_read32(vdev, &desc->len);
+		vq->batch = 1;
+	}
+
+	if (vq->reqs[id] == NULL)
+		return virtqueue_broken(vq);
+
+	buff = vq->buffs[id];
+	if (req != NULL)
+		*req = vq->reqs[id];
+
+	if (len != NULL)
+		*len = (id == vq->bid) ? vq->blen : vq->lens[id];
+
+	if (id == vq->bid)
+		vq->batch = 0;
+
+	if (vq->stamps != NULL)
+		virtqueue_latency(vq, id, now);
+
+	/* Skip request descriptors */
+	if ((vq->last += vq->nums[id]) >= vq->size) {
+		vq->last -= vq->size;
+		vq->uwrap ^= 1;
+	}
+	vq->nfree += vq->nums[id];
+
+	virtqueue_freeIndirect(vq, id);
+	vq->buffs[id] = NULL;
+	vq->reqs[id] = NULL;
+
+	return buff;
+}
+
+
+/* Removes up to n processed requests from virtqueue, returns number of removed requests (virtqueue has to be locked) */
+static unsigned int _virtqueue_dequeue(virtio_dev_t *vdev, virtqueue_t *vq, void **buffs, virtio_req_t **reqs, unsigned int *lens, unsigned int n)
+{
+	unsigned int i = 0;
+	time_t now = 0;
+	uint16_t idx;
+	void *buff;
+
+	/* Device state can't be trusted anymore */
+	if (vq->broken)
+		return 0;
+
+	if (vq->packed) {
+		for (; i < n; i++) {
+			if (vq->inorder)
+				buff = virtqueue_getPackedInOrder(vdev, vq, (reqs != NULL) ? &reqs[i] : NULL, (lens != NULL) ? &lens[i] : NULL, &now);
+			else
+				buff = virtqueue_getPacked(vdev, vq, (reqs != NULL) ? &reqs[i] : NULL, (lens != NULL) ? &lens[i] : NULL, &now);
+
+			if (buff == NULL)
+				break;
+
+			if (buffs != NULL)
+				buffs[i] = buff;
+		}
+	}
+	else if ((vq->last != (idx = virtqueue_read16(vdev, &vq->used->idx))) || vq->batch) {
+		/* Read used ring entries after used index */
+		virtio_rmb();
+
+		for (; (i < n) && ((vq->last != idx) || vq->batch); i++) {
+			if (vq->inorder)
+				buff = virtqueue_getSplitInOrder(vdev, vq, (reqs != NULL) ? &reqs[i] : NULL, (lens != NULL) ? &lens[i] : NULL, &now);
+			else
+				buff = virtqueue_getSplit(vdev, vq, (reqs != NULL) ? &reqs[i] : NULL, (lens != NULL) ? &lens[i] : NULL, &now);
+
+			if (vq->broken)
+				break;
+
+			if (buffs != NULL)
+				buffs[i] = buff;
+		}
+
+		/* Request interrupt on next processed request (unless disabled or delayed) */
+		if (virtio_eventIdx(vdev) && !vq->delayed && !(virtqueue_read16(vdev, &vq->avail->flags) & 0x1))
+			virtqueue_write16(vdev, vq->uevent, vq->last);
+	}
+
+	vq->stats.inflight -= i;
+	vq->stats.dequeued += i;
+
+	/* Wake up threads waiting for free descriptors */
+	if (i && vq->nwait)
+		condBroadcast(vq->cond);
+
+	return i;
+}
+
+
+int virtqueue_dequeueBulk(virtio_dev_t *vdev, virtqueue_t *vq, void **buffs, unsigned int *lens, unsigned int n)
+{
+	unsigned int ret;
+
+	mutexLock(vq->lock);
+	ret = _virtqueue_dequeue(vdev, vq, buffs, NULL, lens, n);
 	mutexUnlock(vq->lock);
 
+	return ret;
+}
+
+
+void *virtqueue_dequeue(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int *len)
+{
+	void *buff;
+
+	if (!virtqueue_dequeueBulk(vdev, vq, &buff, len, 1))
+		return NULL;
+
 	return buff;
 }
 
 
+/* Completes up to budget processed requests (0 - no limit), returns number of completed requests */
+static unsigned int _virtqueue_complete(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int budget)
+{
+	virtio_req_t *reqs[VIRTQUEUE_COMPLETE];
+	unsigned int lens[VIRTQUEUE_COMPLETE];
+	unsigned int i, n, sync, ret = 0;
+
+	do {
+		n = VIRTQUEUE_COMPLETE;
+		if (budget && (budget - ret < n))
+			n = budget - ret;
+
+		mutexLock(vq->lock);
+
+		n = _virtqueue_dequeue(vdev, vq, NULL, reqs, lens, n);
+
+		/* Complete synchronous requests (their owners may reuse them as soon as the lock is released) */
+		for (i = 0, sync = 0; i < n; i++) {
+			reqs[i]->len = lens[i];
+			if (reqs[i]->cb == NULL) {
+				reqs[i]->done = 1;
+				reqs[i] = NULL;
+				sync++;
+			}
+		}
+
+		if (sync && vq->nsync)
+			condBroadcast(vq->dcond);
+
+		mutexUnlock(vq->lock);
+
+		/* Invoke completion callbacks (callbacks may enqueue new requests) */
+		for (i = 0; i < n; i++) {
+			if (reqs[i] != NULL) {
+				reqs[i]->done = 1;
+				reqs[i]->cb(reqs[i]);
+			}
+		}
+		ret += n;
+	} while ((n == VIRTQUEUE_COMPLETE) && (!budget || (ret < budget)));
+
+	return ret;
+}
+
+
+int virtqueue_complete(virtio_dev_t *vdev, virtqueue_t *vq)
+{
+	return _virtqueue_complete(vdev, vq, 0);
+}
+
+
+void virtqueue_pollInit(virtqueue_poll_t *poll)
+{
+	poll->budget = 64;
+	poll->timeout = 50;
+	poll->backoff = 100;
+	poll->weight = 0;
+	poll->irq = 1;
+	poll->resched = 0;
+	poll->rounds = 0;
+	poll->empty = 0;
+	poll->exhausted = 0;
+	poll->completed = 0;
+	poll->polled = 0;
+	poll->idles = 0;
+	poll->yields = 0;
+}
+
+
+int virtqueue_poll(virtio_dev_t *vdev, virtqueue_t **vqs, unsigned int n, virtqueue_poll_t *poll)
+{
+	unsigned int i, m, done, rounds = 0;
+	time_t now, last;
+	int busy, ret = 0;
+
+	gettime(&last, NULL);
+	poll->resched = 0;
+
+	for (;;) {
+		/* Yield to other devices (interrupts stay disabled, polling has to be resumed by caller) */
+		if (poll->weight && (rounds == poll->weight)) {
+			poll->resched = 1;
+			poll->yields++;
+			poll->completed += ret;
+			return ret;
+		}
+
+		/* Polling round */
+		for (i = 0, done = 0; i < n; i++) {
+			m = _virtqueue_complete(vdev, vqs[i], poll->budget);
+			if (poll->budget && (m == poll->budget))
+				poll->exhausted++;
+			done += m;
+		}
+		poll->rounds++;
+
+		if (done) {
+			/* Requests found by later rounds were completed without interrupt */
+			if (ret)
+				poll->polled += done;
+			ret += done;
+			rounds++;
+			gettime(&last, NULL);
+			continue;
+		}
+		poll->empty++;
+
+		/* Keep polling until no requests complete within polling window */
+		gettime(&now, NULL);
+		if (now - last < poll->timeout)
+			continue;
+
+		if (poll->irq) {
+			/* Fall back to interrupts, complete requests processed before interrupts were enabled */
+			for (i = 0; i < n; i++)
+				virtqueue_enableIRQ(vdev, vqs[i]);
+
+			for (i = 0, done = 0; i < n; i++)
+				done += _virtqueue_complete(vdev, vqs[i], 0);
+
+			if (!done)
+				break;
+
+			/* Completions keep arriving, resume polling */
+			for (i = 0; i < n; i++)
+				virtqueue_disableIRQ(vdev, vqs[i]);
+		}
+		else {
+			/* No interrupts, sleep only after all submitted requests are completed (requests completed before last busy check are reaped) */
+			for (i = 0, busy = 0; i < n; i++)
+				busy |= virtqueue_busy(vdev, vqs[i]);
+
+			for (i = 0, done = 0; i < n; i++)
+				done += _virtqueue_complete(vdev, vqs[i], 0);
+
+			if (!done && !busy)
+				break;
+
+			/* Back off while device is processing requests */
+			if (!done && poll->backoff)
+				usleep(poll->backoff);
+		}
+
+		if (done) {
+			poll->polled += done;
+			ret += done;
+		}
+		gettime(&last, NULL);
+	}
+	poll->idles++;
+	poll->completed += ret;
+
+	return ret;
+}
+
+
+int virtqueue_wait(virtio_dev_t *vdev, virtqueue_t *vq, virtio_req_t *req, time_t timeout)
+{
+	time_t now, end = 0;
+	int err = EOK;
+
+	if (timeout) {
+		gettime(&now, NULL);
+		end = now + timeout;
+	}
+
+	mutexLock(vq->lock);
+	vq->nsync++;
+
+	while (!req->done) {
+		if (vq->broken) {
+			err = -EIO;
+			break;
+		}
+
+		if (end) {
+			gettime(&now, NULL);
+			if (now >= end) {
+				err = -ETIME;
+				break;
+			}
+			timeout = end - now;
+		}
+		condWait(vq->dcond, vq->lock, timeout);
+	}
+
+	vq->nsync--;
+	mutexUnlock(vq->lock);
+
+	return err;
+}
+
+
+void virtqueue_stats(virtqueue_t *vq, virtqueue_stats_t *stats, int reset)
+{
+	unsigned int inflight;
+
+	mutexLock(vq->lock);
+
+	if (stats != NULL)
+		*stats = vq->stats;
+
+	if (reset) {
+		inflight = vq->stats.inflight;
+		memset(&vq->stats, 0, sizeof(vq->stats));
+		vq->stats.inflight = inflight;
+		vq->stats.peak = inflight;
+	}
+
+	mutexUnlock(vq->lock);
+}
+
+
+int virtqueue_timing(virtqueue_t *vq, int enable)
+{
+	time_t *stamps = NULL, now;
+	unsigned int i;
+
+	/* Requests in flight are accounted as enqueued now */
+	if (enable) {
+		if ((stamps = malloc(vq->size * sizeof(time_t))) == NULL)
+			return -ENOMEM;
+
+		gettime(&now, NULL);
+		for (i = 0; i < vq->size; i++)
+			stamps[i] = now;
+	}
+
+	mutexLock(vq->lock);
+
+	if (!enable || (vq->stamps == NULL)) {
+		free(vq->stamps);
+		vq->stamps = stamps;
+		stamps = NULL;
+	}
+
+	mutexUnlock(vq->lock);
+
+	free(stamps);
+
+	return EOK;
+}
+
+
 void virtqueue_destroy(virtio_dev_t *vdev, virtqueue_t *vq)
 {
+	unsigned int i;
+
 	resourceDestroy(vq->lock);
 	resourceDestroy(vq->cond);
-	munmap(vq->mem, vq->memsz);
+	resourceDestroy(vq->dcond);
+	virtio_memFree(vq->mem, vq->memsz);
+
+	if (vq->ipool != NULL) {
+		for (i = 0; i < vq->size; i++)
+			virtqueue_freeIndirect(vq, i);
+		virtio_memFree(vq->ipool, vq->ipoolsz);
+	}
+
 	free(vq->buffs);
+	free(vq->ids);
+	free(vq->ibig);
+	free(vq->runs);
+	free(vq->stamps);
 }
 
 
@@ -330,57 +1271,154 @@ int virtqueue_init(virtio_dev_t *vdev, virtqueue_t *vq, unsigned int idx, unsign
 		return -EINVAL;
 
 	/* Select virtqueue and negotiate its size */
-	virtqueue_select(vdev, idx);
-	if ((err = virtqueue_enable(vdev, &size)) < 0)
+	vdev->ops->select(vdev, idx);
+	if ((err = vdev->ops->enable(vdev, &size)) < 0)
 		return err;
 
+	/* Packed layout requires VERSION_1 and RING_PACKED features */
+	vq->packed = virtio_modern(vdev) && virtio_packed(vdev);
+	vq->inorder = virtio_inOrder(vdev);
+
 	/* Calculate offsets */
-	aoffs = size * sizeof(virtio_desc_t);
-	ueoffs = aoffs + sizeof(virtio_avail_t) + size * sizeof(uint16_t);
-	uoffs = (ueoffs + sizeof(uint16_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
-	aeoffs = uoffs + sizeof(virtio_used_t) + size * sizeof(virtio_used_elem_t);
+	if (vq->packed) {
+		/* Descriptors ring followed by driver and device event suppression structures */
+		aoffs = size * sizeof(virtio_pdesc_t);
+		ueoffs = 0;
+		uoffs = aoffs + sizeof(virtio_event_t);
+		aeoffs = 0;
+		vq->memsz = (uoffs + sizeof(virtio_event_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+	}
+	else {
+		aoffs = size * sizeof(virtio_desc_t);
+		ueoffs = aoffs + sizeof(virtio_avail_t) + size * sizeof(uint16_t);
+		uoffs = (ueoffs + sizeof(uint16_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+		aeoffs = uoffs + sizeof(virtio_used_t) + size * sizeof(virtio_used_elem_t);
+		vq->memsz = (aeoffs + sizeof(uint16_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+	}
 
 	/* Initialize virtqueue memory */
-	if ((vq->buffs = malloc(size * sizeof(void *))) == NULL)
+	if ((vq->buffs = malloc(size * (sizeof(void *) + sizeof(virtio_req_t *)))) == NULL)
 		return -ENOMEM;
+	vq->reqs = (virtio_req_t **)(vq->buffs + size);
 
-	vq->memsz = (aeoffs + sizeof(uint16_t) + _PAGE_SIZE - 1) & ~(_PAGE_SIZE - 1);
+	/* Shadow descriptors state (guest-private, device shared memory is only written) */
+	if ((vq->ids = malloc(size * (2 * sizeof(uint16_t) + (vq->inorder ? sizeof(unsigned int) : 0)))) == NULL) {
+		free(vq->buffs);
+		return -ENOMEM;
+	}
+	vq->nums = vq->ids + size;
+	vq->lens = (vq->inorder) ? (unsigned int *)(vq->nums + size) : NULL;
 
 	/* TODO: allocate physcial memory below 4GB (legacy interface requires 32-bit physical address) */
-	if ((vq->mem = mmap(NULL, vq->memsz, PROT_READ | PROT_WRITE, MAP_UNCACHED | MAP_ANONYMOUS, OID_CONTIGUOUS, 0)) == MAP_FAILED) {
+	if ((vq->mem = virtio_memAlloc(vq->memsz, &vq->mempa)) == NULL) {
 		free(vq->buffs);
+		free(vq->ids);
 		return -ENOMEM;
 	}
 
 	if ((err = mutexCreate(&vq->lock)) < 0) {
-		munmap(vq->mem, vq->memsz);
+		virtio_memFree(vq->mem, vq->memsz);
 		free(vq->buffs);
+		free(vq->ids);
 		return err;
 	}
 
 	if ((err = condCreate(&vq->cond)) < 0) {
 		resourceDestroy(vq->lock);
-		munmap(vq->mem, vq->memsz);
+		virtio_memFree(vq->mem, vq->memsz);
 		free(vq->buffs);
+		free(vq->ids);
 		return err;
 	}
 
-	memset(vq->mem, 0, vq->memsz);
-	vq->desc = (virtio_desc_t *)vq->mem;
-	vq->avail = (virtio_avail_t *)((uintptr_t)vq->mem + aoffs);
-	vq->uevent = (uint16_t *)((uintptr_t)vq->mem + ueoffs);
-	vq->used = (virtio_used_t *)((uintptr_t)vq->mem + uoffs);
-	vq->aevent = (uint16_t *)((uintptr_t)vq->mem + aeoffs);
+	if ((err = condCreate(&vq->dcond)) < 0) {
+		resourceDestroy(vq->cond);
+		resourceDestroy(vq->lock);
+		virtio_memFree(vq->mem, vq->memsz);
+		free(vq->buffs);
+		free(vq->ids);
+		return err;
+	}
+
+	/* Preallocate indirect descriptor tables (one per descriptor chain/buffer ID) */
+	vq->ipool = NULL;
+	vq->ibig = NULL;
+	if (virtio_indirect(vdev)) {
+		vq->ipoolsz = size * VIRTQUEUE_INDIRECT * sizeof(virtio_desc_t);
+		if ((vq->ibig = calloc(size, sizeof(virtqueue_itbl_t))) == NULL) {
+			resourceDestroy(vq->dcond);
+			resourceDestroy(vq->cond);
+			resourceDestroy(vq->lock);
+			virtio_memFree(vq->mem, vq->memsz);
+			free(vq->buffs);
+			free(vq->ids);
+			return -ENOMEM;
+		}
+
+		if ((vq->ipool = virtio_memAlloc(vq->ipoolsz, &vq->ipoolpa)) == NULL) {
+			resourceDestroy(vq->dcond);
+			resourceDestroy(vq->cond);
+			resourceDestroy(vq->lock);
+			virtio_memFree(vq->mem, vq->memsz);
+			free(vq->buffs);
+			free(vq->ids);
+			free(vq->ibig);
+			return -ENOMEM;
+		}
+	}
 
+	memset(vq->mem, 0, vq->memsz);
 	vq->idx = idx;
 	vq->size = size;
 	vq->nfree = size;
 	vq->free = 0;
 	vq->last = 0;
-
-	for (i = 0; i < size; i++) {
-		vq->desc[i].next = i + 1;
-		vq->buffs[i] = NULL;
+	vq->next = 0;
+	vq->added = 0;
+	vq->awrap = 1;
+	vq->uwrap = 1;
+	vq->delayed = 0;
+	vq->batch = 0;
+	vq->broken = 0;
+	vq->nwait = 0;
+	vq->nsync = 0;
+	memset(&vq->stats, 0, sizeof(vq->stats));
+	vq->stamps = NULL;
+	vq->runs = NULL;
+	vq->runsz = 0;
+
+	if (vq->packed) {
+		vq->desc = NULL;
+		vq->avail = NULL;
+		vq->uevent = NULL;
+		vq->used = NULL;
+		vq->aevent = NULL;
+		vq->pdesc = (virtio_pdesc_t *)vq->mem;
+		vq->drv = (virtio_event_t *)((uintptr_t)vq->mem + aoffs);
+		vq->dev = (virtio_event_t *)((uintptr_t)vq->mem + uoffs);
+
+		for (i = 0; i < size; i++) {
+			vq->ids[i] = i + 1;
+			vq->buffs[i] = NULL;
+			vq->reqs[i] = NULL;
+		}
+	}
+	else {
+		vq->desc = (virtio_desc_t *)vq->mem;
+		vq->avail = (virtio_avail_t *)((uintptr_t)vq->mem + aoffs);
+		vq->uevent = (uint16_t *)((uintptr_t)vq->mem + ueoffs);
+		vq->used = (virtio_used_t *)((uintptr_t)vq->mem + uoffs);
+		vq->aevent = (uint16_t *)((uintptr_t)vq->mem + aeoffs);
+		vq->pdesc = NULL;
+		vq->drv = NULL;
+		vq->dev = NULL;
+
+		/* Free descriptors ring (in-order descriptors are allocated in ring order) */
+		for (i = 0; i < size; i++) {
+			vq->ids[i] = (i + 1) & (size - 1);
+			vq->buffs[i] = NULL;
+			vq->reqs[i] = NULL;
+		}
 	}
 
 	if ((err = virtqueue_activate(vdev, vq)) < 0) {
@@ -0,0 +1,127 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO block device driver
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _LIBVIRTIOBLK_H_
+#define _LIBVIRTIOBLK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#ifndef VIRTIO_HOST
+#include <sys/msg.h>
+#endif
+
+
+/* Block device sector size */
+#define VIRTIOBLK_SECTSZ 512
+
+
+typedef enum {
+	vblkREAD                = 0x00, /* Read sectors */
+	vblkWRITE               = 0x01, /* Write sectors */
+	vblkFLUSH               = 0x02, /* Flush device write cache */
+	vblkDISCARD             = 0x03  /* Discard sectors */
+} virtioblk_op_t;
+
+
+typedef struct _virtioblk_req_t virtioblk_req_t;
+
+
+struct _virtioblk_req_t {
+	virtioblk_op_t op;              /* Request operation */
+	uint64_t sector;                /* First sector */
+	void *buff;                     /* Data buffer (read and write only) */
+	size_t len;                     /* Data length (sector size multiple, discarded sectors length for discard) */
+
+	/* Completion */
+	void (*cb)(virtioblk_req_t *req); /* Completion callback (NULL for synchronous completion) */
+	void *arg;                      /* Completion callback argument */
+	volatile int err;               /* Request status */
+	volatile int done;              /* Indicates request completion */
+
+	/* Driver internals */
+	void *queue;                    /* Request queue */
+	unsigned int parts;             /* Number of pending device requests */
+};
+
+
+typedef struct {
+	uint64_t size;                  /* Device size in bytes */
+	unsigned int blksz;             /* Logical block size */
+	unsigned int nqueues;           /* Number of request queues */
+	unsigned char ro;               /* Read-only device */
+	unsigned char flush;            /* Device has write cache (flush supported) */
+	unsigned char discard;          /* Discard supported */
+} virtioblk_info_t;
+
+
+typedef struct _virtioblk_t virtioblk_t;
+
+
+/* Submits requests (adjacent sectors requests are merged, requests are exposed to device with single notification), returns number of submitted requests */
+extern int virtioblk_submit(virtioblk_t *blk, virtioblk_req_t **reqs, unsigned int n);
+
+
+/* Completes processed requests of all request queues, returns number of completed device requests */
+extern int virtioblk_poll(virtioblk_t *blk);
+
+
+/* Waits for completion of request without completion callback (polls while request is expected to complete soon), returns request status */
+extern int virtioblk_wait(virtioblk_t *blk, virtioblk_req_t *req);
+
+
+/* Reads data from device (any offset and length), returns number of read bytes */
+extern ssize_t virtioblk_read(virtioblk_t *blk, off_t offs, void *buff, size_t len);
+
+
+/* Writes data to device (any offset and length), returns number of written bytes */
+extern ssize_t virtioblk_write(virtioblk_t *blk, off_t offs, const void *buff, size_t len);
+
+
+/* Flushes device write cache */
+extern int virtioblk_flush(virtioblk_t *blk);
+
+
+/* Discards device sectors (sector aligned range) */
+extern int virtioblk_discard(virtioblk_t *blk, off_t offs, size_t len);
+
+
+/* Returns device info */
+extern void virtioblk_info(virtioblk_t *blk, virtioblk_info_t *info);
+
+
+#ifndef VIRTIO_HOST
+/* Handles block device message (read, write, sync and size attribute), returns -ENOSYS for unhandled message */
+extern int virtioblk_msg(virtioblk_t *blk, msg_t *msg);
+#endif
+
+
+/* Destroys block device */
+extern void virtioblk_close(virtioblk_t *blk);
+
+
+/* Detects and initializes next block device */
+extern int virtioblk_open(virtioblk_t **blk);
+
+
+/* Destroys VirtIO block driver */
+extern void virtioblk_done(void);
+
+
+/* Initializes VirtIO block driver */
+extern int virtioblk_init(void);
+
+
+#endif
@@ -0,0 +1,961 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO block device driver
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/threads.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <libvirtio.h>
+
+#include "libvirtioblk.h"
+
+
+/* Use polling on RISCV64 (interrupts trigger memory protection exception), polling thread sleeps when all requests are completed */
+#ifdef TARGET_RISCV64
+#define USE_POLLING
+#endif
+
+
+/* Maximum number of request queues */
+#define VIRTIOBLK_QUEUES 4
+
+
+/* Request queue virtqueue size */
+#define VIRTIOBLK_QSIZE 128
+
+
+/* Number of device requests (commands) per request queue */
+#define VIRTIOBLK_CMDS 32
+
+
+/* Maximum number of data descriptors per command */
+#define VIRTIOBLK_SEGS 32
+
+
+/* Maximum number of requests merged into single command */
+#define VIRTIOBLK_MERGE 16
+
+
+/* Synchronous request completion polling window [us] */
+#define VIRTIOBLK_POLL 50
+
+
+/* Maximum sleep before rechecking completions [us] */
+#define VIRTIOBLK_SLEEP 10000
+
+
+typedef struct {
+	/* Request header (device readable) */
+	struct {
+		uint32_t type;              /* Request type */
+		uint32_t ioprio;            /* Request priority */
+		uint64_t sector;            /* First sector */
+	} hdr;
+
+	/* Discard range (device readable) */
+	struct {
+		uint64_t sector;            /* First sector */
+		uint32_t n;                 /* Number of sectors */
+		uint32_t flags;             /* Range flags */
+	} range;
+
+	/* Request status (device writable) */
+	volatile uint8_t status;
+	uint8_t pad[7];                 /* Padding */
+} __attribute__((packed)) virtioblk_cmdbuf_t;
+
+
+typedef struct _virtioblk_cmd_t virtioblk_cmd_t;
+
+
+typedef struct _virtioblk_queue_t virtioblk_queue_t;
+
+
+struct _virtioblk_cmd_t {
+	virtioblk_cmdbuf_t *buf;        /* Command buffers (accessible by device) */
+	virtio_req_t vreq;              /* VirtIO request */
+	virtio_seg_t segs[VIRTIOBLK_SEGS + 2]; /* Header, data (discard range) and status segments */
+	virtioblk_op_t op;              /* Command operation */
+	unsigned int nsegs;             /* Number of data segments */
+	unsigned int ndescs;            /* Number of data descriptors (upper bound, segments are split into physical runs on enqueue) */
+	size_t len;                     /* Command data length */
+	uint64_t end;                   /* Sector following command data */
+	virtioblk_req_t *reqs[VIRTIOBLK_MERGE]; /* Merged requests */
+	unsigned int nreqs;             /* Number of merged requests */
+	virtioblk_queue_t *q;           /* Request queue */
+	virtioblk_cmd_t *next;          /* Next free command */
+};
+
+
+struct _virtioblk_queue_t {
+	virtqueue_t vq;                 /* Virtqueue */
+	virtioblk_cmd_t cmds[VIRTIOBLK_CMDS]; /* Commands */
+	virtioblk_cmd_t *free;          /* Free commands list */
+	virtioblk_cmdbuf_t *bufs;       /* Commands buffers (DMA memory) */
+	virtio_buf_t reg;               /* Commands buffers registration */
+	handle_t lock;                  /* Request queue mutex */
+	handle_t cond;                  /* Command release/request completion condition variable */
+};
+
+
+struct _virtioblk_t {
+	virtio_dev_t vdev;              /* VirtIO device */
+	virtioblk_queue_t queues[VIRTIOBLK_QUEUES]; /* Request queues */
+	unsigned int nqueues;           /* Number of request queues */
+	volatile unsigned int next;     /* Next submission queue */
+	volatile uint64_t sectors;      /* Device capacity */
+	unsigned int blksz;             /* Logical block size */
+	unsigned int segmax;            /* Maximum number of data descriptors per command */
+	unsigned int sizemax;           /* Maximum segment size (0 - no limit) */
+	uint32_t discardmax;            /* Maximum number of sectors per discard command */
+	unsigned char ro;               /* Read-only device */
+	unsigned char flush;            /* Flush supported */
+	unsigned char discard;          /* Discard supported */
+
+	/* Completion service */
+	virtqueue_t *vqs[VIRTIOBLK_QUEUES];
+	virtio_client_t client;
+};
+
+
+/* VirtIO block device descriptors */
+static const virtio_devinfo_t info[] = {
+	{ .type = vdevPCI, .id = 0x1042 },
+	{ .type = vdevPCI, .id = 0x1001 },
+#ifdef VIRTIO_HOST
+	/* Loopback block device (host builds) */
+	{ .type = vdevLOOP, .id = 0x02 },
+#endif
+#ifdef TARGET_RISCV64
+	/* Direct VirtIO MMIO QEMU block device descriptors */
+	{ .type = vdevMMIO, .id = 0x02, .irq = 8, .base = { (void *)0x10008000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x02, .irq = 7, .base = { (void *)0x10007000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x02, .irq = 6, .base = { (void *)0x10006000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x02, .irq = 5, .base = { (void *)0x10005000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x02, .irq = 4, .base = { (void *)0x10004000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x02, .irq = 3, .base = { (void *)0x10003000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x02, .irq = 2, .base = { (void *)0x10002000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x02, .irq = 1, .base = { (void *)0x10001000, 0x1000 } },
+#endif
+	{ .type = vdevNONE }
+};
+
+
+struct {
+	virtio_ctx_t vctx;              /* Device detection context */
+	unsigned int desc;              /* Processed descriptors */
+} virtioblk_common;
+
+
+/* Releases request reference, returns 1 if request callback has to be invoked (queue has to be locked) */
+static int _virtioblk_put(virtioblk_queue_t *q, virtioblk_req_t *req, int err)
+{
+	if ((err < 0) && (req->err == EOK))
+		req->err = err;
+
+	if (--req->parts)
+		return 0;
+
+	/* Synchronous request owner may reuse request as soon as the lock is released */
+	if (req->cb == NULL) {
+		req->done = 1;
+		condBroadcast(q->cond);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/* Invokes finished request completion callback */
+static void virtioblk_finish(virtioblk_req_t *req)
+{
+	req->done = 1;
+	req->cb(req);
+}
+
+
+/* Completes command and its requests */
+static void virtioblk_complete(virtio_req_t *vreq)
+{
+	virtioblk_cmd_t *cmd = (virtioblk_cmd_t *)vreq->arg;
+	virtioblk_queue_t *q = cmd->q;
+	virtioblk_req_t *reqs[VIRTIOBLK_MERGE];
+	unsigned int i, n = 0;
+	int err;
+
+	switch (cmd->buf->status) {
+		case 0:
+			err = EOK;
+			break;
+
+		case 2:
+			err = -ENOTSUP;
+			break;
+
+		default:
+			err = -EIO;
+			break;
+	}
+
+	mutexLock(q->lock);
+
+	for (i = 0; i < cmd->nreqs; i++) {
+		if (_virtioblk_put(q, cmd->reqs[i], err))
+			reqs[n++] = cmd->reqs[i];
+	}
+
+	cmd->next = q->free;
+	q->free = cmd;
+	condBroadcast(q->cond);
+
+	mutexUnlock(q->lock);
+
+	/* Invoke callbacks outside of the lock (callbacks may submit new requests) */
+	for (i = 0; i < n; i++)
+		virtioblk_finish(reqs[i]);
+}
+
+
+/* Exposes prepared commands to device with single notification */
+static void virtioblk_post(virtioblk_t *blk, virtioblk_queue_t *q, virtio_req_t **vreqs, unsigned int n)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < n; i += ret) {
+		if ((ret = virtqueue_enqueueBatch(&blk->vdev, &q->vq, vreqs + i, n - i)) <= 0)
+			break;
+	}
+	virtqueue_notify(&blk->vdev, &q->vq);
+
+#ifdef USE_POLLING
+	virtio_wakeup(&blk->client);
+#endif
+
+	/* Fail commands that couldn't be exposed to device */
+	for (; i < n; i++) {
+		((virtioblk_cmd_t *)vreqs[i]->arg)->buf->status = 0xff;
+		virtioblk_complete(vreqs[i]);
+	}
+}
+
+
+/* Returns free command, exposes pending commands to device before waiting for one */
+static virtioblk_cmd_t *virtioblk_get(virtioblk_t *blk, virtioblk_queue_t *q, virtio_req_t **vreqs, unsigned int *n)
+{
+	virtioblk_cmd_t *cmd;
+
+	for (;;) {
+		mutexLock(q->lock);
+
+		if ((cmd = q->free) != NULL) {
+			q->free = cmd->next;
+			mutexUnlock(q->lock);
+			return cmd;
+		}
+
+		mutexUnlock(q->lock);
+
+		if (*n) {
+			virtioblk_post(blk, q, vreqs, *n);
+			*n = 0;
+			continue;
+		}
+
+		/* Reclaim processed commands, wait for completion service otherwise */
+		if (virtqueue_complete(&blk->vdev, &q->vq) > 0)
+			continue;
+
+		mutexLock(q->lock);
+		if (q->free == NULL)
+			condWait(q->cond, q->lock, VIRTIOBLK_SLEEP);
+		mutexUnlock(q->lock);
+	}
+}
+
+
+/* Prepares empty command */
+static void virtioblk_prepare(virtioblk_t *blk, virtioblk_cmd_t *cmd, virtioblk_op_t op, uint64_t sector)
+{
+	static const uint32_t types[] = { 0, 1, 4, 11 };
+
+	cmd->op = op;
+	cmd->nsegs = 0;
+	cmd->ndescs = 0;
+	cmd->len = 0;
+	cmd->end = sector;
+	cmd->nreqs = 0;
+
+	cmd->buf->hdr.type = virtio_gtov32(&blk->vdev, types[op]);
+	cmd->buf->hdr.ioprio = 0;
+	cmd->buf->hdr.sector = virtio_gtov64(&blk->vdev, (op == vblkREAD || op == vblkWRITE) ? sector : 0);
+	cmd->buf->status = 0xff;
+}
+
+
+/* Links command segments */
+static virtio_req_t *virtioblk_seal(virtioblk_cmd_t *cmd)
+{
+	virtio_seg_t *segs = cmd->segs;
+	unsigned int i, n = cmd->nsegs + 2;
+
+	segs[n - 1].buff = (void *)&cmd->buf->status;
+	segs[n - 1].len = sizeof(cmd->buf->status);
+	segs[n - 1].buf = &cmd->q->reg;
+
+	for (i = 0; i < n; i++) {
+		segs[i].prev = &segs[(i + n - 1) % n];
+		segs[i].next = &segs[(i + 1) % n];
+	}
+
+	if (cmd->op == vblkREAD) {
+		cmd->vreq.rsegs = 1;
+		cmd->vreq.wsegs = cmd->nsegs + 1;
+	}
+	else {
+		cmd->vreq.rsegs = cmd->nsegs + 1;
+		cmd->vreq.wsegs = 1;
+	}
+
+	return &cmd->vreq;
+}
+
+
+/* Checks if request data may be appended to command */
+static int virtioblk_merge(virtioblk_t *blk, virtioblk_cmd_t *cmd, virtioblk_req_t *req, size_t pos)
+{
+	if ((req->op != vblkREAD) && (req->op != vblkWRITE))
+		return 0;
+
+	if ((cmd->op != req->op) || (cmd->ndescs >= blk->segmax) || (cmd->nreqs >= VIRTIOBLK_MERGE))
+		return 0;
+
+	return (cmd->end == req->sector + pos / VIRTIOBLK_SECTSZ);
+}
+
+
+/* Adds request data to command (single segment per request unless limited by device), returns number of added bytes */
+static size_t virtioblk_add(virtioblk_t *blk, virtioblk_cmd_t *cmd, virtioblk_req_t *req, size_t pos)
+{
+	virtio_seg_t *seg;
+	uintptr_t addr;
+	size_t len, n, ret = 0;
+
+	switch (req->op) {
+		case vblkFLUSH:
+			return 0;
+
+		case vblkDISCARD:
+			n = (req->len - pos) / VIRTIOBLK_SECTSZ;
+			if (n > 0xffffffff)
+				n = 0xffffffff;
+			if (blk->discardmax && (n > blk->discardmax))
+				n = blk->discardmax;
+
+			cmd->buf->range.sector = virtio_gtov64(&blk->vdev, req->sector + pos / VIRTIOBLK_SECTSZ);
+			cmd->buf->range.n = virtio_gtov32(&blk->vdev, n);
+			cmd->buf->range.flags = 0;
+
+			seg = &cmd->segs[1];
+			seg->buff = &cmd->buf->range;
+			seg->len = sizeof(cmd->buf->range);
+			seg->buf = &cmd->q->reg;
+			cmd->nsegs = 1;
+
+			return n * VIRTIOBLK_SECTSZ;
+
+		default:
+			break;
+	}
+
+	while ((pos < req->len) && (cmd->ndescs < blk->segmax)) {
+		/* Segment takes at most one descriptor per spanned page (physically adjacent pages are merged on enqueue) */
+		addr = (uintptr_t)req->buff + pos;
+		len = (blk->segmax - cmd->ndescs) * _PAGE_SIZE - (addr & (_PAGE_SIZE - 1));
+		if (len > req->len - pos)
+			len = req->len - pos;
+		if (blk->sizemax && (len > blk->sizemax))
+			len = blk->sizemax;
+
+		seg = &cmd->segs[1 + cmd->nsegs++];
+		seg->buff = (void *)addr;
+		seg->len = len;
+		seg->buf = NULL;
+		cmd->ndescs += ((addr & (_PAGE_SIZE - 1)) + len + _PAGE_SIZE - 1) / _PAGE_SIZE;
+		pos += len;
+		ret += len;
+	}
+
+	/* Command has to end at sector boundary, the rest of request data goes to next command */
+	while ((cmd->len + ret) % VIRTIOBLK_SECTSZ) {
+		seg = &cmd->segs[cmd->nsegs];
+		len = (cmd->len + ret) % VIRTIOBLK_SECTSZ;
+		if (len > seg->len)
+			len = seg->len;
+
+		seg->len -= len;
+		ret -= len;
+		if (!seg->len)
+			cmd->nsegs--;
+	}
+
+	cmd->len += ret;
+	cmd->end += ret / VIRTIOBLK_SECTSZ;
+
+	return ret;
+}
+
+
+/* Validates request, returns 1 if request doesn't require device access */
+static int virtioblk_check(virtioblk_t *blk, virtioblk_req_t *req)
+{
+	switch (req->op) {
+		case vblkWRITE:
+			if (blk->ro)
+				return -EROFS;
+			/* Fall-through */
+
+		case vblkREAD:
+			if ((req->buff == NULL) && req->len)
+				return -EINVAL;
+			break;
+
+		case vblkFLUSH:
+			/* Device without write cache is always in sync */
+			return blk->flush ? EOK : 1;
+
+		case vblkDISCARD:
+			if (!blk->discard)
+				return -ENOTSUP;
+			break;
+
+		default:
+			return -EINVAL;
+	}
+
+	if ((req->len % VIRTIOBLK_SECTSZ) || (req->sector > blk->sectors) || (req->len / VIRTIOBLK_SECTSZ > blk->sectors - req->sector))
+		return -EINVAL;
+
+	return req->len ? EOK : 1;
+}
+
+
+int virtioblk_submit(virtioblk_t *blk, virtioblk_req_t **reqs, unsigned int n)
+{
+	virtio_req_t *vreqs[VIRTIOBLK_CMDS];
+	virtioblk_cmd_t *cmd = NULL;
+	virtioblk_queue_t *q;
+	virtioblk_req_t *req;
+	unsigned int i, nvreqs = 0;
+	size_t pos, len;
+	int err;
+
+	/* Spread submitters over request queues */
+	q = &blk->queues[__sync_fetch_and_add(&blk->next, 1) % blk->nqueues];
+
+	for (i = 0; i < n; i++) {
+		req = reqs[i];
+		req->queue = q;
+		req->err = EOK;
+		req->done = 0;
+		/* Submission holds request reference until request is split into commands */
+		req->parts = 1;
+
+		if (!(err = virtioblk_check(blk, req))) {
+			pos = 0;
+			do {
+				if ((cmd == NULL) || !virtioblk_merge(blk, cmd, req, pos)) {
+					if (cmd != NULL)
+						vreqs[nvreqs++] = virtioblk_seal(cmd);
+
+					cmd = virtioblk_get(blk, q, vreqs, &nvreqs);
+					virtioblk_prepare(blk, cmd, req->op, req->sector + pos / VIRTIOBLK_SECTSZ);
+				}
+
+				mutexLock(q->lock);
+				req->parts++;
+				mutexUnlock(q->lock);
+
+				cmd->reqs[cmd->nreqs++] = req;
+				if (!(len = virtioblk_add(blk, cmd, req, pos)) && (pos < req->len)) {
+					/* No room left for sector of request data */
+					vreqs[nvreqs++] = virtioblk_seal(cmd);
+					cmd = NULL;
+				}
+				pos += len;
+			} while (pos < req->len);
+		}
+
+		mutexLock(q->lock);
+		err = _virtioblk_put(q, req, (err < 0) ? err : EOK);
+		mutexUnlock(q->lock);
+
+		if (err)
+			virtioblk_finish(req);
+	}
+
+	if (cmd != NULL)
+		vreqs[nvreqs++] = virtioblk_seal(cmd);
+
+	if (nvreqs)
+		virtioblk_post(blk, q, vreqs, nvreqs);
+
+	return n;
+}
+
+
+int virtioblk_poll(virtioblk_t *blk)
+{
+	unsigned int i;
+	int ret, n = 0;
+
+	for (i = 0; i < blk->nqueues; i++) {
+		if ((ret = virtqueue_complete(&blk->vdev, &blk->queues[i].vq)) > 0)
+			n += ret;
+	}
+
+	return n;
+}
+
+
+int virtioblk_wait(virtioblk_t *blk, virtioblk_req_t *req)
+{
+	virtioblk_queue_t *q = (virtioblk_queue_t *)req->queue;
+	time_t start, now;
+
+	/* Block requests usually complete shortly, poll before going to sleep */
+	gettime(&start, NULL);
+	now = start;
+	do {
+		if (req->done)
+			break;
+
+		if (virtqueue_complete(&blk->vdev, &q->vq) > 0)
+			continue;
+
+		gettime(&now, NULL);
+	} while (now - start < VIRTIOBLK_POLL);
+
+	mutexLock(q->lock);
+	while (!req->done) {
+		condWait(q->cond, q->lock, VIRTIOBLK_SLEEP);
+
+		if (!req->done) {
+			mutexUnlock(q->lock);
+			virtqueue_complete(&blk->vdev, &q->vq);
+			mutexLock(q->lock);
+		}
+	}
+	mutexUnlock(q->lock);
+
+	return req->err;
+}
+
+
+/* Executes sector aligned request synchronously */
+static int virtioblk_io(virtioblk_t *blk, virtioblk_op_t op, uint64_t sector, void *buff, size_t len)
+{
+	virtioblk_req_t req, *preq = &req;
+
+	req.op = op;
+	req.sector = sector;
+	req.buff = buff;
+	req.len = len;
+	req.cb = NULL;
+	req.arg = NULL;
+
+	virtioblk_submit(blk, &preq, 1);
+
+	return virtioblk_wait(blk, &req);
+}
+
+
+/* Reads or writes data at any offset and length */
+static ssize_t virtioblk_rw(virtioblk_t *blk, virtioblk_op_t op, off_t offs, void *buff, size_t len)
+{
+	uint64_t size = blk->sectors * VIRTIOBLK_SECTSZ;
+	size_t start, end;
+	char *bounce;
+	int err;
+
+	if (offs < 0)
+		return -EINVAL;
+
+	if ((op == vblkWRITE) && blk->ro)
+		return -EROFS;
+
+	if ((uint64_t)offs >= size)
+		return ((op == vblkWRITE) && len) ? -ENOSPC : 0;
+
+	if (len > size - offs)
+		len = size - offs;
+
+	if (!len)
+		return 0;
+
+	/* Sector aligned data is transferred directly */
+	if (!(offs % VIRTIOBLK_SECTSZ) && !(len % VIRTIOBLK_SECTSZ)) {
+		if ((err = virtioblk_io(blk, op, offs / VIRTIOBLK_SECTSZ, buff, len)) < 0)
+			return err;
+
+		return len;
+	}
+
+	/* Unaligned data goes through bounce buffer covering whole sectors */
+	start = offs % VIRTIOBLK_SECTSZ;
+	end = (start + len + VIRTIOBLK_SECTSZ - 1) & ~(VIRTIOBLK_SECTSZ - 1);
+	offs -= start;
+
+	if ((bounce = malloc(end)) == NULL)
+		return -ENOMEM;
+
+	do {
+		if (op == vblkREAD) {
+			if ((err = virtioblk_io(blk, vblkREAD, offs / VIRTIOBLK_SECTSZ, bounce, end)) < 0)
+				break;
+
+			memcpy(buff, bounce + start, len);
+			break;
+		}
+
+		/* Read partially written head and tail sectors */
+		if (start && ((err = virtioblk_io(blk, vblkREAD, offs / VIRTIOBLK_SECTSZ, bounce, VIRTIOBLK_SECTSZ)) < 0))
+			break;
+
+		if (((start + len) % VIRTIOBLK_SECTSZ) && (!start || (end > VIRTIOBLK_SECTSZ))) {
+			if ((err = virtioblk_io(blk, vblkREAD, (offs + end) / VIRTIOBLK_SECTSZ - 1, bounce + end - VIRTIOBLK_SECTSZ, VIRTIOBLK_SECTSZ)) < 0)
+				break;
+		}
+
+		memcpy(bounce + start, buff, len);
+		err = virtioblk_io(blk, vblkWRITE, offs / VIRTIOBLK_SECTSZ, bounce, end);
+	} while (0);
+
+	free(bounce);
+
+	if (err < 0)
+		return err;
+
+	return len;
+}
+
+
+ssize_t virtioblk_read(virtioblk_t *blk, off_t offs, void *buff, size_t len)
+{
+	return virtioblk_rw(blk, vblkREAD, offs, buff, len);
+}
+
+
+ssize_t virtioblk_write(virtioblk_t *blk, off_t offs, const void *buff, size_t len)
+{
+	return virtioblk_rw(blk, vblkWRITE, offs, (void *)buff, len);
+}
+
+
+int virtioblk_flush(virtioblk_t *blk)
+{
+	return virtioblk_io(blk, vblkFLUSH, 0, NULL, 0);
+}
+
+
+int virtioblk_discard(virtioblk_t *blk, off_t offs, size_t len)
+{
+	if ((offs < 0) || (offs % VIRTIOBLK_SECTSZ))
+		return -EINVAL;
+
+	return virtioblk_io(blk, vblkDISCARD, offs / VIRTIOBLK_SECTSZ, NULL, len);
+}
+
+
+void virtioblk_info(virtioblk_t *blk, virtioblk_info_t *info)
+{
+	info->size = blk->sectors * VIRTIOBLK_SECTSZ;
+	info->blksz = blk->blksz;
+	info->nqueues = blk->nqueues;
+	info->ro = blk->ro;
+	info->flush = blk->flush;
+	info->discard = blk->discard;
+}
+
+
+#ifndef VIRTIO_HOST
+int virtioblk_msg(virtioblk_t *blk, msg_t *msg)
+{
+	switch (msg->type) {
+		case mtRead:
+			msg->o.io.err = virtioblk_read(blk, msg->i.io.offs, msg->o.data, msg->o.size);
+			return EOK;
+
+		case mtWrite:
+			msg->o.io.err = virtioblk_write(blk, msg->i.io.offs, msg->i.data, msg->i.size);
+			return EOK;
+
+		case mtSync:
+			msg->o.io.err = virtioblk_flush(blk);
+			return EOK;
+
+		case mtGetAttr:
+			if (msg->i.attr.type != atSize) {
+				msg->o.attr.val = -EINVAL;
+				return EOK;
+			}
+
+			msg->o.attr.val = blk->sectors * VIRTIOBLK_SECTSZ;
+			return EOK;
+
+		default:
+			break;
+	}
+
+	return -ENOSYS;
+}
+#endif
+
+
+/* Updates device capacity on configuration change */
+static void virtioblk_config(virtio_client_t *client)
+{
+	virtioblk_t *blk = (virtioblk_t *)client->arg;
+
+	blk->sectors = virtio_readConfig64(&blk->vdev, 0x00);
+}
+
+
+static void virtioblk_donequeue(virtioblk_t *blk, virtioblk_queue_t *q)
+{
+	virtqueue_destroy(&blk->vdev, &q->vq);
+	resourceDestroy(q->cond);
+	resourceDestroy(q->lock);
+	virtio_bufUnregister(&q->reg);
+	virtio_memFree(q->bufs, VIRTIOBLK_CMDS * sizeof(virtioblk_cmdbuf_t));
+}
+
+
+static int virtioblk_initqueue(virtioblk_t *blk, virtioblk_queue_t *q, unsigned int idx)
+{
+	virtioblk_cmd_t *cmd;
+	unsigned int i;
+	int err;
+
+	if ((q->bufs = virtio_memAlloc(VIRTIOBLK_CMDS * sizeof(virtioblk_cmdbuf_t), NULL)) == NULL)
+		return -ENOMEM;
+
+	do {
+		if ((err = virtio_bufRegister(&q->reg, q->bufs, VIRTIOBLK_CMDS * sizeof(virtioblk_cmdbuf_t))) < 0)
+			break;
+
+		if ((err = mutexCreate(&q->lock)) < 0) {
+			virtio_bufUnregister(&q->reg);
+			break;
+		}
+
+		if ((err = condCreate(&q->cond)) < 0) {
+			resourceDestroy(q->lock);
+			virtio_bufUnregister(&q->reg);
+			break;
+		}
+
+		if ((err = virtqueue_init(&blk->vdev, &q->vq, idx, VIRTIOBLK_QSIZE)) < 0) {
+			resourceDestroy(q->cond);
+			resourceDestroy(q->lock);
+			virtio_bufUnregister(&q->reg);
+			break;
+		}
+
+		q->free = NULL;
+		for (i = VIRTIOBLK_CMDS; i--;) {
+			cmd = &q->cmds[i];
+			cmd->buf = &q->bufs[i];
+			cmd->q = q;
+			cmd->vreq.segs = cmd->segs;
+			cmd->vreq.cb = virtioblk_complete;
+			cmd->vreq.arg = cmd;
+			cmd->segs[0].buff = &cmd->buf->hdr;
+			cmd->segs[0].len = sizeof(cmd->buf->hdr);
+			cmd->segs[0].buf = &q->reg;
+			cmd->next = q->free;
+			q->free = cmd;
+		}
+
+		return EOK;
+	} while (0);
+
+	virtio_memFree(q->bufs, VIRTIOBLK_CMDS * sizeof(virtioblk_cmdbuf_t));
+
+	return err;
+}
+
+
+static void virtioblk_destroydev(virtioblk_t *blk)
+{
+	virtio_dev_t *vdev = &blk->vdev;
+	unsigned int i;
+
+	virtio_unregister(&blk->client);
+	/* Stop device before releasing request queues memory */
+	virtio_reset(vdev);
+
+	for (i = 0; i < blk->nqueues; i++)
+		virtioblk_donequeue(blk, &blk->queues[i]);
+	virtio_destroyDev(vdev);
+}
+
+
+static int virtioblk_initdev(virtioblk_t *blk)
+{
+	virtio_dev_t *vdev = &blk->vdev;
+	uint64_t features;
+	unsigned int i, n;
+	int err;
+
+	if ((err = virtio_initDev(vdev)) < 0)
+		return err;
+
+	blk->next = 0;
+
+	do {
+		/* Negotiate SIZE_MAX, SEG_MAX, RO, BLK_SIZE, FLUSH, MQ and DISCARD features */
+		if ((err = virtio_writeFeatures(vdev, (1 << 1) | (1 << 2) | (1 << 5) | (1 << 6) | (1 << 9) | (1 << 12) | (1 << 13))) < 0)
+			break;
+		features = virtio_readFeatures(vdev);
+
+		blk->sectors = virtio_readConfig64(vdev, 0x00);
+		blk->ro = !!(features & (1 << 5));
+		blk->flush = !!(features & (1 << 9));
+		blk->discard = !!(features & (1 << 13));
+
+		/* Segments have to be at least sector long (merged physical runs never exceed segment length) */
+		blk->sizemax = 0;
+		if (features & (1 << 1))
+			blk->sizemax = virtio_readConfig32(vdev, 0x08) & ~(VIRTIOBLK_SECTSZ - 1);
+
+		/* At least 2 segments are needed to move sector aligned data with unaligned buffer */
+		blk->segmax = VIRTIOBLK_SEGS;
+		if (features & (1 << 2)) {
+			blk->segmax = virtio_readConfig32(vdev, 0x0c);
+			if (blk->segmax > VIRTIOBLK_SEGS)
+				blk->segmax = VIRTIOBLK_SEGS;
+			else if (blk->segmax < 2)
+				blk->segmax = 2;
+		}
+
+		blk->blksz = (features & (1 << 6)) ? virtio_readConfig32(vdev, 0x14) : VIRTIOBLK_SECTSZ;
+		blk->discardmax = blk->discard ? virtio_readConfig32(vdev, 0x24) : 0;
+
+		n = 1;
+		if (features & (1 << 12)) {
+			n = virtio_readConfig16(vdev, 0x22);
+			if (n > VIRTIOBLK_QUEUES)
+				n = VIRTIOBLK_QUEUES;
+			else if (!n)
+				n = 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((err = virtioblk_initqueue(blk, &blk->queues[i], i)) < 0)
+				break;
+			blk->vqs[i] = &blk->queues[i].vq;
+		}
+
+		if (err < 0) {
+			while (i--)
+				virtioblk_donequeue(blk, &blk->queues[i]);
+			break;
+		}
+		blk->nqueues = n;
+
+		/* Poll for completions while they keep arriving */
+		blk->client.vdev = vdev;
+		blk->client.vqs = blk->vqs;
+		blk->client.nvqs = n;
+		blk->client.config = virtioblk_config;
+		blk->client.arg = blk;
+		virtqueue_pollInit(&blk->client.poll);
+#ifdef USE_POLLING
+		blk->client.poll.irq = 0;
+#endif
+
+		if ((err = virtio_register(&blk->client)) < 0) {
+			for (i = 0; i < n; i++)
+				virtioblk_donequeue(blk, &blk->queues[i]);
+			break;
+		}
+
+		virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 2));
+
+		return EOK;
+	} while (0);
+
+	virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 7));
+	virtio_destroyDev(vdev);
+
+	return err;
+}
+
+
+void virtioblk_close(virtioblk_t *blk)
+{
+	virtioblk_destroydev(blk);
+	free(blk);
+}
+
+
+int virtioblk_open(virtioblk_t **blk)
+{
+	virtioblk_t *vblk;
+	virtio_dev_t vdev;
+	int err;
+
+	for (; info[virtioblk_common.desc].type != vdevNONE; virtioblk_common.desc++, virtioblk_common.vctx.reset = 1) {
+		while ((err = virtio_find(&info[virtioblk_common.desc], &vdev, &virtioblk_common.vctx)) != -ENODEV) {
+			if (err < 0)
+				return err;
+
+			if ((vblk = malloc(sizeof(virtioblk_t))) == NULL)
+				return -ENOMEM;
+			vblk->vdev = vdev;
+
+			if ((err = virtioblk_initdev(vblk)) < 0) {
+				free(vblk);
+				if (err != -ENODEV)
+					return err;
+				continue;
+			}
+
+			*blk = vblk;
+
+			return EOK;
+		}
+	}
+
+	return -ENODEV;
+}
+
+
+void virtioblk_done(void)
+{
+	virtio_done();
+}
+
+
+int virtioblk_init(void)
+{
+	return virtio_init();
+}
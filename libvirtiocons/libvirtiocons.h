@@ -0,0 +1,89 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO console device driver
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _LIBVIRTIOCONS_H_
+#define _LIBVIRTIOCONS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+
+/* Maximum port name length (with terminating NULL character) */
+#define VIRTIOCONS_NAMESZ 64
+
+
+typedef struct {
+	char name[VIRTIOCONS_NAMESZ];   /* Port name (empty if not named by host) */
+	unsigned char added;            /* Port is added by device */
+	unsigned char console;          /* Port is console port */
+	unsigned char open;             /* Host side of port is open (buffered data is transmitted only to open port) */
+	size_t buffered;                /* Bytes buffered for transmission */
+	uint64_t sent;                  /* Transmitted bytes */
+	uint64_t dropped;               /* Bytes dropped due to full transmit buffer */
+} virtiocons_portinfo_t;
+
+
+typedef struct {
+	unsigned int nports;            /* Number of ports */
+	unsigned int cols;              /* Console columns (0 if unknown) */
+	unsigned int rows;              /* Console rows (0 if unknown) */
+	unsigned char multiport;        /* Multiple ports supported */
+} virtiocons_info_t;
+
+
+typedef struct _virtiocons_t virtiocons_t;
+
+
+/* Buffers data for transmission through port (never blocks, data exceeding free buffer space is dropped), returns number of buffered bytes */
+extern ssize_t virtiocons_write(virtiocons_t *cons, unsigned int port, const void *buff, size_t len);
+
+
+/* Waits for transmission of data buffered before the call (waits up to timeout [us], 0 - doesn't wait, -1 - waits infinitely), returns -ETIME if data isn't transmitted in time */
+extern int virtiocons_flush(virtiocons_t *cons, unsigned int port, time_t timeout);
+
+
+/* Reads data received through port (waits up to timeout [us] for data, 0 - doesn't wait, -1 - waits infinitely), returns number of read bytes */
+extern ssize_t virtiocons_read(virtiocons_t *cons, unsigned int port, void *buff, size_t len, time_t timeout);
+
+
+/* Returns number of port with given name */
+extern int virtiocons_find(virtiocons_t *cons, const char *name);
+
+
+/* Returns port info */
+extern int virtiocons_portInfo(virtiocons_t *cons, unsigned int port, virtiocons_portinfo_t *info);
+
+
+/* Returns device info */
+extern void virtiocons_info(virtiocons_t *cons, virtiocons_info_t *info);
+
+
+/* Destroys console device (buffered data is discarded) */
+extern void virtiocons_close(virtiocons_t *cons);
+
+
+/* Detects and initializes next console device */
+extern int virtiocons_open(virtiocons_t **cons);
+
+
+/* Destroys VirtIO console driver */
+extern void virtiocons_done(void);
+
+
+/* Initializes VirtIO console driver */
+extern int virtiocons_init(void);
+
+
+#endif
@@ -0,0 +1,1097 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO console device driver
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/threads.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <libvirtio.h>
+
+#include "libvirtiocons.h"
+
+
+/* Use polling on RISCV64 (interrupts trigger memory protection exception) */
+#ifdef TARGET_RISCV64
+#define USE_POLLING
+#endif
+
+
+/* Maximum number of ports */
+#define VIRTIOCONS_PORTS 4
+
+
+/* Virtqueues size */
+#define VIRTIOCONS_QSIZE 16
+
+
+/* Port transmit ring size (power of 2, producers buffer data without locking) */
+#define VIRTIOCONS_RINGSZ (32 * 1024)
+
+
+/* Port transmit buffers (ring data is batched into large buffers) */
+#define VIRTIOCONS_TXBUFS  4
+#define VIRTIOCONS_TXBUFSZ (8 * 1024)
+
+
+/* Port receive buffers */
+#define VIRTIOCONS_RXBUFS  8
+#define VIRTIOCONS_RXBUFSZ 1024
+
+
+/* Control buffers (control message with port name) */
+#define VIRTIOCONS_CTLBUFS  8
+#define VIRTIOCONS_CTLBUFSZ 128
+
+
+/* Transmit thread stack size */
+#define VIRTIOCONS_STACKSZ 4096
+
+
+/* Transmit thread idle wait [us] (bounds latency of data buffered while thread goes idle) */
+#define VIRTIOCONS_IDLEUS 50000
+
+
+/* Transmit ring record header (record length, flags, record data follows 4-byte aligned) */
+#define VIRTIOCONS_COMMIT (1U << 31) /* Record data is written */
+#define VIRTIOCONS_PAD    (1U << 30) /* Record pads ring end (next record starts at ring beginning) */
+#define VIRTIOCONS_LEN    (VIRTIOCONS_PAD - 1)
+
+
+typedef struct {
+	uint32_t id;                    /* Port ID */
+	uint16_t event;                 /* Control event */
+	uint16_t value;                 /* Event value */
+} __attribute__((packed)) virtiocons_ctl_t;
+
+
+typedef struct _virtiocons_buf_t virtiocons_buf_t;
+
+
+struct _virtiocons_buf_t {
+	virtio_req_t vreq;              /* VirtIO request */
+	virtio_seg_t seg;               /* Buffer segment */
+	uint8_t *data;                  /* Buffer memory */
+	void *owner;                    /* Owning port (device for control buffers) */
+	unsigned int end;               /* Transmit ring position following buffered data */
+	virtiocons_buf_t *next;         /* Next free buffer */
+};
+
+
+typedef struct {
+	virtqueue_t vq;                 /* Virtqueue */
+	virtiocons_buf_t *bufs;         /* Buffers */
+	unsigned int nbufs;             /* Number of buffers */
+	unsigned int bufsz;             /* Buffer size */
+	uint8_t *mem;                   /* Buffers memory */
+	virtio_buf_t reg;               /* Buffers memory registration */
+} virtiocons_pool_t;
+
+
+typedef struct {
+	virtiocons_t *cons;             /* Console device */
+
+	/* Transmit ring (space is reserved by producers, records are consumed by transmit thread) */
+	uint8_t *ring;                  /* Ring memory */
+	volatile unsigned int head;     /* Reserved space end */
+	volatile unsigned int tail;     /* Consumed space end */
+	volatile unsigned int acked;    /* Transmitted space end */
+	volatile uint64_t dropped;      /* Dropped bytes */
+
+	/* Transmit queue */
+	virtiocons_pool_t tx;           /* Transmit buffers pool */
+	virtiocons_buf_t *free;         /* Free buffers list */
+	unsigned int inflight;          /* Buffers processed by device */
+	uint64_t sent;                  /* Transmitted bytes */
+
+	/* Receive queue */
+	virtiocons_pool_t rx;           /* Receive buffers pool */
+	virtiocons_buf_t **ready;       /* Received buffers ring (device order) */
+	unsigned int rhead;             /* First received buffer */
+	unsigned int nready;            /* Number of received buffers */
+	unsigned int roffs;             /* Bytes already read from first received buffer */
+	virtio_req_t **recycle;         /* Consumed buffers waiting to be reposted */
+	handle_t rcond;                 /* Data received condition variable */
+
+	/* Port state */
+	char name[VIRTIOCONS_NAMESZ];   /* Port name */
+	unsigned char added;            /* Port is added by device */
+	unsigned char console;          /* Port is console port */
+	unsigned char open;             /* Host side of port is open */
+} virtiocons_port_t;
+
+
+struct _virtiocons_t {
+	virtio_dev_t vdev;              /* VirtIO device */
+	virtiocons_port_t ports[VIRTIOCONS_PORTS];
+	unsigned int nports;            /* Number of ports */
+	unsigned int cols;              /* Console columns */
+	unsigned int rows;              /* Console rows */
+	unsigned char multiport;        /* Multiple ports supported (control queues negotiated) */
+
+	/* Control queues */
+	virtiocons_pool_t ctlrx;        /* Control receive buffers pool */
+	virtiocons_pool_t ctltx;        /* Control transmit buffers pool */
+	virtiocons_buf_t *ctlfree;      /* Free control transmit buffers list */
+
+	/* Transmit thread */
+	volatile int idle;              /* Thread waits for data */
+	volatile int done;              /* End thread? */
+	void *stack;                    /* Thread stack */
+	handle_t lock;                  /* Device mutex */
+	handle_t cond;                  /* Transmit condition variable (data buffered, buffer transmitted, port opened) */
+
+	/* Completion service (port and control receive queues, port transmit queues) */
+	virtqueue_t *vqs[2 * VIRTIOCONS_PORTS + 1];
+	virtio_client_t client;
+};
+
+
+/* VirtIO console device descriptors */
+static const virtio_devinfo_t info[] = {
+	{ .type = vdevPCI, .id = 0x1043 },
+	{ .type = vdevPCI, .id = 0x1003 },
+#ifdef VIRTIO_HOST
+	/* Loopback console device (host builds) */
+	{ .type = vdevLOOP, .id = 0x03 },
+#endif
+#ifdef TARGET_RISCV64
+	/* Direct VirtIO MMIO QEMU console device descriptors */
+	{ .type = vdevMMIO, .id = 0x03, .irq = 8, .base = { (void *)0x10008000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x03, .irq = 7, .base = { (void *)0x10007000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x03, .irq = 6, .base = { (void *)0x10006000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x03, .irq = 5, .base = { (void *)0x10005000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x03, .irq = 4, .base = { (void *)0x10004000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x03, .irq = 3, .base = { (void *)0x10003000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x03, .irq = 2, .base = { (void *)0x10002000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x03, .irq = 1, .base = { (void *)0x10001000, 0x1000 } },
+#endif
+	{ .type = vdevNONE }
+};
+
+
+struct {
+	virtio_ctx_t vctx;              /* Device detection context */
+	unsigned int desc;              /* Processed descriptors */
+} virtiocons_common;
+
+
+/* Returns port receive virtqueue index (transmit virtqueue follows, control virtqueues precede second port queues) */
+static inline unsigned int virtiocons_qidx(unsigned int port)
+{
+	return port ? 2 * port + 2 : 0;
+}
+
+
+/* Buffers record in port transmit ring, returns non-zero if ring was empty (lock-free, safe for concurrent producers) */
+static int virtiocons_put(virtiocons_port_t *port, const uint8_t *data, unsigned int len)
+{
+	unsigned int head, tail, offs, pad, size = (sizeof(uint32_t) + len + 3) & ~3;
+
+	do {
+		/* Tail is read first (reserved space can't be older than consumed space) */
+		tail = port->tail;
+		__sync_synchronize();
+		head = port->head;
+
+		/* Record doesn't wrap around, space left at ring end is padded */
+		offs = head & (VIRTIOCONS_RINGSZ - 1);
+		pad = (VIRTIOCONS_RINGSZ - offs < size) ? VIRTIOCONS_RINGSZ - offs : 0;
+
+		if (head + pad + size - tail > VIRTIOCONS_RINGSZ)
+			return -ENOSPC;
+	} while (!__sync_bool_compare_and_swap(&port->head, head, head + pad + size));
+
+	/* Consumed space is zeroed, record is visible to consumer after its header is written */
+	if (pad) {
+		*(volatile uint32_t *)(port->ring + offs) = VIRTIOCONS_COMMIT | VIRTIOCONS_PAD;
+		offs = 0;
+	}
+	memcpy(port->ring + offs + sizeof(uint32_t), data, len);
+	__sync_synchronize();
+	*(volatile uint32_t *)(port->ring + offs) = VIRTIOCONS_COMMIT | len;
+
+	return (head == tail);
+}
+
+
+/* Checks if port transmit ring has committed record */
+static inline int virtiocons_pending(virtiocons_port_t *port)
+{
+	return !!(*(volatile uint32_t *)(port->ring + (port->tail & (VIRTIOCONS_RINGSZ - 1))) & VIRTIOCONS_COMMIT);
+}
+
+
+/* Moves committed transmit ring records to transmit buffer, returns number of moved bytes (transmit thread only) */
+static unsigned int _virtiocons_fill(virtiocons_port_t *port, virtiocons_buf_t *buf)
+{
+	unsigned int offs, size, tail = port->tail, len = 0;
+	uint32_t hdr;
+
+	for (;;) {
+		offs = tail & (VIRTIOCONS_RINGSZ - 1);
+		if (!((hdr = *(volatile uint32_t *)(port->ring + offs)) & VIRTIOCONS_COMMIT))
+			break;
+		__sync_synchronize();
+
+		if (hdr & VIRTIOCONS_PAD) {
+			size = VIRTIOCONS_RINGSZ - offs;
+		}
+		else {
+			if (len + (hdr & VIRTIOCONS_LEN) > port->tx.bufsz)
+				break;
+
+			memcpy(buf->data + len, port->ring + offs + sizeof(uint32_t), hdr & VIRTIOCONS_LEN);
+			len += hdr & VIRTIOCONS_LEN;
+			size = (sizeof(uint32_t) + (hdr & VIRTIOCONS_LEN) + 3) & ~3;
+		}
+
+		/* Release consumed space to producers */
+		memset(port->ring + offs, 0, size);
+		tail += size;
+	}
+
+	__sync_synchronize();
+	port->tail = tail;
+	buf->end = tail;
+
+	return len;
+}
+
+
+/* Transmits buffered data of port in batch (device has to be locked, transmit thread only), returns number of exposed buffers */
+static unsigned int _virtiocons_xmit(virtiocons_t *cons, virtiocons_port_t *port)
+{
+	virtio_req_t *vreqs[VIRTIOCONS_TXBUFS];
+	virtiocons_buf_t *buf;
+	unsigned int i, n = 0;
+	int ret;
+
+	if (!port->added || !port->open)
+		return 0;
+
+	while ((buf = port->free) != NULL) {
+		if (!(buf->seg.len = _virtiocons_fill(port, buf)))
+			break;
+		port->free = buf->next;
+		vreqs[n++] = &buf->vreq;
+	}
+
+	if (!n)
+		return 0;
+
+	if ((ret = virtqueue_enqueueBatch(&cons->vdev, &port->tx.vq, vreqs, n)) < 0)
+		ret = 0;
+
+	for (i = 0; i < n; i++) {
+		buf = (virtiocons_buf_t *)vreqs[i]->arg;
+
+		/* Data of rejected buffers is lost */
+		if (i >= ret) {
+			port->acked = buf->end;
+			buf->next = port->free;
+			port->free = buf;
+			continue;
+		}
+		port->sent += buf->seg.len;
+	}
+	port->inflight += ret;
+
+	if (ret) {
+		virtqueue_notify(&cons->vdev, &port->tx.vq);
+#ifdef USE_POLLING
+		virtio_wakeup(&cons->client);
+#endif
+	}
+
+	return n;
+}
+
+
+/* Transmit thread */
+static void virtiocons_thr(void *arg)
+{
+	virtiocons_t *cons = (virtiocons_t *)arg;
+	virtiocons_port_t *port;
+	unsigned int i, n;
+
+	mutexLock(cons->lock);
+
+	while (!cons->done) {
+		for (i = 0, n = 0; i < cons->nports; i++)
+			n += _virtiocons_xmit(cons, &cons->ports[i]);
+
+		if (n)
+			continue;
+
+		/* Producers wake up idle thread only (wakeup racing with going idle is caught by wait timeout) */
+		cons->idle = 1;
+		__sync_synchronize();
+
+		for (i = 0; i < cons->nports; i++) {
+			port = &cons->ports[i];
+			if (port->added && port->open && (port->free != NULL) && virtiocons_pending(port))
+				break;
+		}
+
+		if (i == cons->nports)
+			condWait(cons->cond, cons->lock, VIRTIOCONS_IDLEUS);
+		cons->idle = 0;
+	}
+
+	mutexUnlock(cons->lock);
+
+	endthread();
+}
+
+
+/* Releases transmitted buffer */
+static void virtiocons_txdone(virtio_req_t *vreq)
+{
+	virtiocons_buf_t *buf = (virtiocons_buf_t *)vreq->arg;
+	virtiocons_port_t *port = (virtiocons_port_t *)buf->owner;
+	virtiocons_t *cons = port->cons;
+
+	mutexLock(cons->lock);
+
+	if ((int)(buf->end - port->acked) > 0)
+		port->acked = buf->end;
+	port->inflight--;
+	buf->next = port->free;
+	port->free = buf;
+	condBroadcast(cons->cond);
+
+	mutexUnlock(cons->lock);
+}
+
+
+/* Queues received buffer */
+static void virtiocons_rxdone(virtio_req_t *vreq)
+{
+	virtiocons_buf_t *buf = (virtiocons_buf_t *)vreq->arg;
+	virtiocons_port_t *port = (virtiocons_port_t *)buf->owner;
+	virtiocons_t *cons = port->cons;
+
+	mutexLock(cons->lock);
+
+	port->ready[(port->rhead + port->nready++) % port->rx.nbufs] = buf;
+	condBroadcast(port->rcond);
+
+	mutexUnlock(cons->lock);
+}
+
+
+ssize_t virtiocons_write(virtiocons_t *cons, unsigned int port, const void *buff, size_t len)
+{
+	virtiocons_port_t *p;
+	size_t offs, n;
+	int ret, wake = 0;
+
+	if (port >= cons->nports)
+		return -EINVAL;
+	p = &cons->ports[port];
+
+	/* Large writes are split into records fitting transmit buffer */
+	for (offs = 0; offs < len; offs += n) {
+		n = ((len - offs) > p->tx.bufsz) ? p->tx.bufsz : len - offs;
+
+		if ((ret = virtiocons_put(p, (const uint8_t *)buff + offs, n)) < 0) {
+			__sync_fetch_and_add(&p->dropped, len - offs);
+			break;
+		}
+		wake |= ret;
+	}
+
+	/* Wake up idle transmit thread on first buffered data */
+	__sync_synchronize();
+	if (wake && cons->idle)
+		condBroadcast(cons->cond);
+
+	if (!offs && len)
+		return -ENOSPC;
+
+	return offs;
+}
+
+
+int virtiocons_flush(virtiocons_t *cons, unsigned int port, time_t timeout)
+{
+	virtiocons_port_t *p;
+	unsigned int head;
+	time_t now, end = 0;
+	int err = EOK;
+
+	if (port >= cons->nports)
+		return -EINVAL;
+	p = &cons->ports[port];
+	head = p->head;
+
+	if (timeout > 0) {
+		gettime(&now, NULL);
+		end = now + timeout;
+	}
+
+	mutexLock(cons->lock);
+
+	condBroadcast(cons->cond);
+
+	while ((int)(head - p->acked) > 0) {
+		if (timeout < 0) {
+			condWait(cons->cond, cons->lock, 0);
+			continue;
+		}
+
+		if (timeout) {
+			gettime(&now, NULL);
+			if (now < end) {
+				condWait(cons->cond, cons->lock, end - now);
+				continue;
+			}
+		}
+
+		err = -ETIME;
+		break;
+	}
+
+	mutexUnlock(cons->lock);
+
+	return err;
+}
+
+
+ssize_t virtiocons_read(virtiocons_t *cons, unsigned int port, void *buff, size_t len, time_t timeout)
+{
+	virtiocons_port_t *p;
+	virtiocons_buf_t *buf;
+	size_t n, offs = 0;
+	unsigned int nrecycle = 0;
+	time_t now, end = 0;
+
+	if (port >= cons->nports)
+		return -EINVAL;
+	p = &cons->ports[port];
+
+	if (timeout > 0) {
+		gettime(&now, NULL);
+		end = now + timeout;
+	}
+
+	mutexLock(cons->lock);
+
+	/* Wait for data */
+	while (!p->nready && timeout) {
+		if (timeout < 0) {
+			condWait(p->rcond, cons->lock, 0);
+			continue;
+		}
+
+		gettime(&now, NULL);
+		if (now >= end)
+			break;
+
+		condWait(p->rcond, cons->lock, end - now);
+	}
+
+	while ((offs < len) && p->nready) {
+		buf = p->ready[p->rhead];
+
+		if ((n = buf->vreq.len - p->roffs) > len - offs)
+			n = len - offs;
+		memcpy((uint8_t *)buff + offs, buf->data + p->roffs, n);
+		offs += n;
+
+		if ((p->roffs += n) < buf->vreq.len)
+			break;
+
+		p->recycle[nrecycle++] = &buf->vreq;
+		p->rhead = (p->rhead + 1) % p->rx.nbufs;
+		p->nready--;
+		p->roffs = 0;
+	}
+
+	/* Repost consumed buffers with single notification */
+	if (nrecycle) {
+		virtqueue_enqueueBatch(&cons->vdev, &p->rx.vq, p->recycle, nrecycle);
+		virtqueue_notify(&cons->vdev, &p->rx.vq);
+	}
+
+	mutexUnlock(cons->lock);
+
+	return offs;
+}
+
+
+int virtiocons_find(virtiocons_t *cons, const char *name)
+{
+	unsigned int i;
+	int ret = -ENOENT;
+
+	mutexLock(cons->lock);
+
+	for (i = 0; i < cons->nports; i++) {
+		if (cons->ports[i].added && !strcmp(cons->ports[i].name, name)) {
+			ret = i;
+			break;
+		}
+	}
+
+	mutexUnlock(cons->lock);
+
+	return ret;
+}
+
+
+int virtiocons_portInfo(virtiocons_t *cons, unsigned int port, virtiocons_portinfo_t *info)
+{
+	virtiocons_port_t *p;
+
+	if (port >= cons->nports)
+		return -EINVAL;
+	p = &cons->ports[port];
+
+	mutexLock(cons->lock);
+
+	memcpy(info->name, p->name, sizeof(info->name));
+	info->added = p->added;
+	info->console = p->console;
+	info->open = p->open;
+	info->buffered = p->head - p->acked;
+	info->sent = p->sent;
+	info->dropped = p->dropped;
+
+	mutexUnlock(cons->lock);
+
+	return EOK;
+}
+
+
+void virtiocons_info(virtiocons_t *cons, virtiocons_info_t *info)
+{
+	mutexLock(cons->lock);
+
+	info->nports = cons->nports;
+	info->cols = cons->cols;
+	info->rows = cons->rows;
+	info->multiport = cons->multiport;
+
+	mutexUnlock(cons->lock);
+}
+
+
+/* Sends control message (device has to be locked) */
+static int _virtiocons_ctl(virtiocons_t *cons, uint32_t id, uint16_t event, uint16_t value)
+{
+	virtio_dev_t *vdev = &cons->vdev;
+	virtiocons_buf_t *buf;
+	virtiocons_ctl_t *ctl;
+	void *buffs[VIRTIOCONS_CTLBUFS];
+	int i, n, err;
+
+	/* Reclaim sent messages (control transmit interrupts are disabled) */
+	n = virtqueue_dequeueBulk(vdev, &cons->ctltx.vq, buffs, NULL, VIRTIOCONS_CTLBUFS);
+	for (i = 0; i < n; i++) {
+		buf = &cons->ctltx.bufs[((uint8_t *)buffs[i] - cons->ctltx.mem) / cons->ctltx.bufsz];
+		buf->next = cons->ctlfree;
+		cons->ctlfree = buf;
+	}
+
+	if ((buf = cons->ctlfree) == NULL)
+		return -ENOSPC;
+
+	ctl = (virtiocons_ctl_t *)buf->data;
+	ctl->id = virtio_gtov32(vdev, id);
+	ctl->event = virtio_gtov16(vdev, event);
+	ctl->value = virtio_gtov16(vdev, value);
+	buf->seg.len = sizeof(*ctl);
+
+	if ((err = virtqueue_enqueue(vdev, &cons->ctltx.vq, &buf->vreq)) < 0)
+		return err;
+	cons->ctlfree = buf->next;
+	virtqueue_notify(vdev, &cons->ctltx.vq);
+
+	return EOK;
+}
+
+
+/* Handles received control message */
+static void virtiocons_ctldone(virtio_req_t *vreq)
+{
+	virtiocons_buf_t *buf = (virtiocons_buf_t *)vreq->arg;
+	virtiocons_t *cons = (virtiocons_t *)buf->owner;
+	virtio_dev_t *vdev = &cons->vdev;
+	virtiocons_ctl_t *ctl = (virtiocons_ctl_t *)buf->data;
+	virtiocons_port_t *port = NULL;
+	unsigned int len = vreq->len;
+	uint32_t id;
+
+	mutexLock(cons->lock);
+
+	if (len >= sizeof(*ctl)) {
+		id = virtio_vtog32(vdev, ctl->id);
+		if (id < cons->nports)
+			port = &cons->ports[id];
+
+		switch (virtio_vtog16(vdev, ctl->event)) {
+			/* Port added (unsupported ports are rejected), guest side of port is always open */
+			case 1:
+				if (port == NULL) {
+					_virtiocons_ctl(cons, id, 3, 0);
+					break;
+				}
+				port->added = 1;
+				port->open = 0;
+				port->name[0] = '\0';
+				_virtiocons_ctl(cons, id, 3, 1);
+				_virtiocons_ctl(cons, id, 6, 1);
+				break;
+
+			/* Port removed */
+			case 2:
+				if (port != NULL) {
+					port->added = 0;
+					port->open = 0;
+				}
+				break;
+
+			/* Console port */
+			case 4:
+				if (port != NULL)
+					port->console = 1;
+				break;
+
+			/* Console resized */
+			case 5:
+				if (len >= sizeof(*ctl) + 2 * sizeof(uint16_t)) {
+					cons->cols = virtio_vtog16(vdev, *(uint16_t *)(buf->data + sizeof(*ctl)));
+					cons->rows = virtio_vtog16(vdev, *(uint16_t *)(buf->data + sizeof(*ctl) + sizeof(uint16_t)));
+				}
+				break;
+
+			/* Host side of port opened/closed (transmission is resumed on open) */
+			case 6:
+				if (port != NULL) {
+					port->open = !!virtio_vtog16(vdev, ctl->value);
+					condBroadcast(cons->cond);
+				}
+				break;
+
+			/* Port name */
+			case 7:
+				if (port != NULL) {
+					len -= sizeof(*ctl);
+					if (len > sizeof(port->name) - 1)
+						len = sizeof(port->name) - 1;
+					memcpy(port->name, buf->data + sizeof(*ctl), len);
+					port->name[len] = '\0';
+				}
+				break;
+		}
+	}
+
+	mutexUnlock(cons->lock);
+
+	/* Repost control buffer */
+	if (virtqueue_enqueue(vdev, &cons->ctlrx.vq, vreq) == EOK)
+		virtqueue_notify(vdev, &cons->ctlrx.vq);
+}
+
+
+/* Updates console size on configuration change */
+static void virtiocons_config(virtio_client_t *client)
+{
+	virtiocons_t *cons = (virtiocons_t *)client->arg;
+
+	if (!(virtio_readFeatures(&cons->vdev) & (1 << 0)))
+		return;
+
+	mutexLock(cons->lock);
+	cons->cols = virtio_readConfig16(&cons->vdev, 0x00);
+	cons->rows = virtio_readConfig16(&cons->vdev, 0x02);
+	mutexUnlock(cons->lock);
+}
+
+
+static void virtiocons_donepool(virtiocons_t *cons, virtiocons_pool_t *pool)
+{
+	virtqueue_destroy(&cons->vdev, &pool->vq);
+	virtio_bufUnregister(&pool->reg);
+	virtio_memFree(pool->mem, pool->nbufs * pool->bufsz);
+	free(pool->bufs);
+}
+
+
+static int virtiocons_initpool(virtiocons_t *cons, virtiocons_pool_t *pool, unsigned int idx, unsigned int nbufs, unsigned int bufsz, void (*cb)(virtio_req_t *), int rx, void *owner)
+{
+	virtiocons_buf_t *buf;
+	unsigned int i;
+	int err;
+
+	if ((err = virtqueue_init(&cons->vdev, &pool->vq, idx, VIRTIOCONS_QSIZE)) < 0)
+		return err;
+
+	/* Single buffer per descriptor (pool never exceeds virtqueue capacity) */
+	pool->nbufs = (nbufs > pool->vq.size) ? pool->vq.size : nbufs;
+	pool->bufsz = bufsz;
+
+	do {
+		if ((pool->mem = virtio_memAlloc(pool->nbufs * pool->bufsz, NULL)) == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+
+		if ((err = virtio_bufRegister(&pool->reg, pool->mem, pool->nbufs * pool->bufsz)) < 0) {
+			virtio_memFree(pool->mem, pool->nbufs * pool->bufsz);
+			break;
+		}
+
+		if ((pool->bufs = malloc(pool->nbufs * sizeof(virtiocons_buf_t))) == NULL) {
+			virtio_bufUnregister(&pool->reg);
+			virtio_memFree(pool->mem, pool->nbufs * pool->bufsz);
+			err = -ENOMEM;
+			break;
+		}
+
+		for (i = 0; i < pool->nbufs; i++) {
+			buf = &pool->bufs[i];
+			buf->data = pool->mem + i * pool->bufsz;
+			buf->owner = owner;
+			buf->end = 0;
+			buf->next = (i + 1 < pool->nbufs) ? &pool->bufs[i + 1] : NULL;
+			buf->seg.buff = buf->data;
+			buf->seg.len = pool->bufsz;
+			buf->seg.buf = &pool->reg;
+			buf->seg.prev = &buf->seg;
+			buf->seg.next = &buf->seg;
+			buf->vreq.segs = &buf->seg;
+			buf->vreq.rsegs = rx ? 0 : 1;
+			buf->vreq.wsegs = rx ? 1 : 0;
+			buf->vreq.cb = cb;
+			buf->vreq.arg = buf;
+		}
+
+		return EOK;
+	} while (0);
+
+	virtqueue_destroy(&cons->vdev, &pool->vq);
+
+	return err;
+}
+
+
+static void virtiocons_doneport(virtiocons_t *cons, unsigned int i)
+{
+	virtiocons_port_t *port = &cons->ports[i];
+
+	virtiocons_donepool(cons, &port->tx);
+	virtiocons_donepool(cons, &port->rx);
+	resourceDestroy(port->rcond);
+	free(port->recycle);
+	free(port->ready);
+	free(port->ring);
+}
+
+
+static int virtiocons_initport(virtiocons_t *cons, unsigned int i)
+{
+	virtiocons_port_t *port = &cons->ports[i];
+	int err;
+
+	port->cons = cons;
+	port->head = 0;
+	port->tail = 0;
+	port->acked = 0;
+	port->dropped = 0;
+	port->inflight = 0;
+	port->sent = 0;
+	port->rhead = 0;
+	port->nready = 0;
+	port->roffs = 0;
+	port->name[0] = '\0';
+	port->console = 0;
+
+	/* Port without control queue is always present */
+	port->added = !cons->multiport;
+	port->open = !cons->multiport;
+
+	/* Zeroed ring holds no committed records */
+	if ((port->ring = calloc(1, VIRTIOCONS_RINGSZ)) == NULL)
+		return -ENOMEM;
+
+	do {
+		port->ready = malloc(VIRTIOCONS_RXBUFS * sizeof(*port->ready));
+		port->recycle = malloc(VIRTIOCONS_RXBUFS * sizeof(*port->recycle));
+		if ((port->ready == NULL) || (port->recycle == NULL)) {
+			err = -ENOMEM;
+			break;
+		}
+
+		if ((err = condCreate(&port->rcond)) < 0)
+			break;
+
+		if ((err = virtiocons_initpool(cons, &port->rx, virtiocons_qidx(i), VIRTIOCONS_RXBUFS, VIRTIOCONS_RXBUFSZ, virtiocons_rxdone, 1, port)) < 0) {
+			resourceDestroy(port->rcond);
+			break;
+		}
+
+		if ((err = virtiocons_initpool(cons, &port->tx, virtiocons_qidx(i) + 1, VIRTIOCONS_TXBUFS, VIRTIOCONS_TXBUFSZ, virtiocons_txdone, 0, port)) < 0) {
+			virtiocons_donepool(cons, &port->rx);
+			resourceDestroy(port->rcond);
+			break;
+		}
+		port->free = port->tx.bufs;
+
+		return EOK;
+	} while (0);
+
+	free(port->recycle);
+	free(port->ready);
+	free(port->ring);
+
+	return err;
+}
+
+
+static void virtiocons_destroydev(virtiocons_t *cons)
+{
+	virtio_dev_t *vdev = &cons->vdev;
+	unsigned int i;
+
+	mutexLock(cons->lock);
+	cons->done = 1;
+	condBroadcast(cons->cond);
+	mutexUnlock(cons->lock);
+	while (threadJoin(0) < 0);
+
+	virtio_unregister(&cons->client);
+	/* Stop device before releasing buffers memory */
+	virtio_reset(vdev);
+
+	for (i = 0; i < cons->nports; i++)
+		virtiocons_doneport(cons, i);
+
+	if (cons->multiport) {
+		virtiocons_donepool(cons, &cons->ctltx);
+		virtiocons_donepool(cons, &cons->ctlrx);
+	}
+	resourceDestroy(cons->cond);
+	resourceDestroy(cons->lock);
+	free(cons->stack);
+	virtio_destroyDev(vdev);
+}
+
+
+static int virtiocons_initdev(virtiocons_t *cons)
+{
+	virtio_dev_t *vdev = &cons->vdev;
+	virtiocons_port_t *port;
+	unsigned int i, j, n = 0;
+	uint64_t features;
+	int err;
+
+	if ((err = virtio_initDev(vdev)) < 0)
+		return err;
+
+	do {
+		/* Negotiate SIZE and MULTIPORT features */
+		if ((err = virtio_writeFeatures(vdev, (1 << 0) | (1 << 1))) < 0)
+			break;
+		features = virtio_readFeatures(vdev);
+
+		cons->multiport = !!(features & (1 << 1));
+		cons->cols = (features & (1 << 0)) ? virtio_readConfig16(vdev, 0x00) : 0;
+		cons->rows = (features & (1 << 0)) ? virtio_readConfig16(vdev, 0x02) : 0;
+		cons->nports = cons->multiport ? virtio_readConfig32(vdev, 0x04) : 1;
+		if (!cons->nports)
+			cons->nports = 1;
+		else if (cons->nports > VIRTIOCONS_PORTS)
+			cons->nports = VIRTIOCONS_PORTS;
+
+		cons->idle = 0;
+		cons->done = 0;
+
+		if ((cons->stack = malloc(VIRTIOCONS_STACKSZ)) == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+
+		if ((err = mutexCreate(&cons->lock)) < 0) {
+			free(cons->stack);
+			break;
+		}
+
+		if ((err = condCreate(&cons->cond)) < 0) {
+			resourceDestroy(cons->lock);
+			free(cons->stack);
+			break;
+		}
+
+		for (; n < cons->nports; n++) {
+			if ((err = virtiocons_initport(cons, n)) < 0)
+				break;
+			cons->vqs[2 * n] = &cons->ports[n].rx.vq;
+			cons->vqs[2 * n + 1] = &cons->ports[n].tx.vq;
+		}
+
+		/* Control queues follow first port queues */
+		if ((err == EOK) && cons->multiport) {
+			if ((err = virtiocons_initpool(cons, &cons->ctlrx, 2, VIRTIOCONS_CTLBUFS, VIRTIOCONS_CTLBUFSZ, virtiocons_ctldone, 1, cons)) == EOK) {
+				if ((err = virtiocons_initpool(cons, &cons->ctltx, 3, VIRTIOCONS_CTLBUFS, VIRTIOCONS_CTLBUFSZ, NULL, 0, cons)) < 0)
+					virtiocons_donepool(cons, &cons->ctlrx);
+			}
+		}
+
+		if (err < 0) {
+			while (n--)
+				virtiocons_doneport(cons, n);
+			resourceDestroy(cons->cond);
+			resourceDestroy(cons->lock);
+			free(cons->stack);
+			break;
+		}
+
+		/* Control messages are reclaimed on send */
+		if (cons->multiport) {
+			cons->ctlfree = cons->ctltx.bufs;
+			cons->vqs[2 * n] = &cons->ctlrx.vq;
+			virtqueue_disableIRQ(vdev, &cons->ctltx.vq);
+		}
+
+		cons->client.vdev = vdev;
+		cons->client.vqs = cons->vqs;
+		cons->client.nvqs = 2 * n + cons->multiport;
+		cons->client.config = virtiocons_config;
+		cons->client.arg = cons;
+		virtqueue_pollInit(&cons->client.poll);
+#ifdef USE_POLLING
+		cons->client.poll.irq = 0;
+#endif
+
+		if ((err = virtio_register(&cons->client)) < 0) {
+			if (cons->multiport) {
+				virtiocons_donepool(cons, &cons->ctltx);
+				virtiocons_donepool(cons, &cons->ctlrx);
+			}
+			while (n--)
+				virtiocons_doneport(cons, n);
+			resourceDestroy(cons->cond);
+			resourceDestroy(cons->lock);
+			free(cons->stack);
+			break;
+		}
+
+		/* Pre-post receive buffers */
+		for (i = 0; i < n; i++) {
+			port = &cons->ports[i];
+			for (j = 0; j < port->rx.nbufs; j++)
+				port->recycle[j] = &port->rx.bufs[j].vreq;
+			virtqueue_enqueueBatch(vdev, &port->rx.vq, port->recycle, port->rx.nbufs);
+		}
+
+		if (cons->multiport) {
+			for (i = 0; i < cons->ctlrx.nbufs; i++)
+				virtqueue_enqueue(vdev, &cons->ctlrx.vq, &cons->ctlrx.bufs[i].vreq);
+		}
+
+		virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 2));
+
+		for (i = 0; i < n; i++)
+			virtqueue_notify(vdev, &cons->ports[i].rx.vq);
+
+		/* Request ports from device */
+		if (cons->multiport) {
+			virtqueue_notify(vdev, &cons->ctlrx.vq);
+
+			mutexLock(cons->lock);
+			_virtiocons_ctl(cons, 0xffffffff, 0, 1);
+			mutexUnlock(cons->lock);
+		}
+
+		if ((err = beginthread(virtiocons_thr, 4, cons->stack, VIRTIOCONS_STACKSZ, cons)) < 0) {
+			virtio_unregister(&cons->client);
+			virtio_reset(vdev);
+			if (cons->multiport) {
+				virtiocons_donepool(cons, &cons->ctltx);
+				virtiocons_donepool(cons, &cons->ctlrx);
+			}
+			while (n--)
+				virtiocons_doneport(cons, n);
+			resourceDestroy(cons->cond);
+			resourceDestroy(cons->lock);
+			free(cons->stack);
+			break;
+		}
+
+		return EOK;
+	} while (0);
+
+	virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 7));
+	virtio_destroyDev(vdev);
+
+	return err;
+}
+
+
+void virtiocons_close(virtiocons_t *cons)
+{
+	virtiocons_destroydev(cons);
+	free(cons);
+}
+
+
+int virtiocons_open(virtiocons_t **cons)
+{
+	virtiocons_t *vcons;
+	virtio_dev_t vdev;
+	int err;
+
+	for (; info[virtiocons_common.desc].type != vdevNONE; virtiocons_common.desc++, virtiocons_common.vctx.reset = 1) {
+		while ((err = virtio_find(&info[virtiocons_common.desc], &vdev, &virtiocons_common.vctx)) != -ENODEV) {
+			if (err < 0)
+				return err;
+
+			if ((vcons = malloc(sizeof(virtiocons_t))) == NULL)
+				return -ENOMEM;
+			vcons->vdev = vdev;
+
+			if ((err = virtiocons_initdev(vcons)) < 0) {
+				free(vcons);
+				if (err != -ENODEV)
+					return err;
+				continue;
+			}
+
+			*cons = vcons;
+
+			return EOK;
+		}
+	}
+
+	return -ENODEV;
+}
+
+
+void virtiocons_done(void)
+{
+	virtio_done();
+}
+
+
+int virtiocons_init(void)
+{
+	return virtio_init();
+}
@@ -0,0 +1,86 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO network device driver
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _LIBVIRTIONET_H_
+#define _LIBVIRTIONET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+
+/* Maximum Ethernet frame length (with VLAN tag, without FCS) */
+#define VIRTIONET_FRAMESZ 1518
+
+
+/* Frame checksum flags */
+#define VIRTIONET_CSUM_PARTIAL (1 << 0) /* Checksum has to be completed (ones' complement sum from csumstart to frame end stored at csumstart + csumoffs) */
+#define VIRTIONET_CSUM_VALID   (1 << 1) /* Received frame checksums have been verified */
+
+
+typedef struct {
+	void *data;                     /* Frame data (starts with Ethernet header) */
+	size_t len;                     /* Frame length (frame buffer size on receive) */
+	uint16_t csumstart;             /* Partial checksum start offset */
+	uint16_t csumoffs;              /* Checksum field offset (relative to csumstart) */
+	unsigned char flags;            /* Frame checksum flags */
+} virtionet_pkt_t;
+
+
+typedef struct {
+	uint8_t mac[6];                 /* MAC address */
+	unsigned int npairs;            /* Number of transmit/receive queue pairs */
+	unsigned char link;             /* Link is up */
+	unsigned char csum;             /* Transmit checksum offload */
+	unsigned char rxcsum;           /* Receive checksum validation */
+	unsigned char mrg;              /* Mergeable receive buffers */
+} virtionet_info_t;
+
+
+typedef struct _virtionet_t virtionet_t;
+
+
+/* Transmits frames through queue pair (frames are copied, device is notified once per call unless more frames follow), returns number of queued frames */
+extern int virtionet_send(virtionet_t *net, unsigned int q, const virtionet_pkt_t *pkts, unsigned int n, int more);
+
+
+/* Notifies device of frames queued with more flag */
+extern void virtionet_kick(virtionet_t *net, unsigned int q);
+
+
+/* Receives up to n frames from queue pair (waits up to timeout [us] for first frame, 0 - doesn't wait, -1 - waits infinitely), returns number of received frames */
+extern int virtionet_recv(virtionet_t *net, unsigned int q, virtionet_pkt_t *pkts, unsigned int n, time_t timeout);
+
+
+/* Returns device info */
+extern void virtionet_info(virtionet_t *net, virtionet_info_t *info);
+
+
+/* Destroys network device */
+extern void virtionet_close(virtionet_t *net);
+
+
+/* Detects and initializes next network device */
+extern int virtionet_open(virtionet_t **net);
+
+
+/* Destroys VirtIO network driver */
+extern void virtionet_done(void);
+
+
+/* Initializes VirtIO network driver */
+extern int virtionet_init(void);
+
+
+#endif
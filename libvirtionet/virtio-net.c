@@ -0,0 +1,844 @@
+/*
+ * Phoenix-RTOS
+ *
+ * VirtIO network device driver
+ *
+ * Copyright 2020 Phoenix Systems
+ * Author: Lukasz Kosinski
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/threads.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <libvirtio.h>
+
+#include "libvirtionet.h"
+
+
+/* Use polling on RISCV64 (interrupts trigger memory protection exception) */
+#ifdef TARGET_RISCV64
+#define USE_POLLING
+#endif
+
+
+/* Maximum number of transmit/receive queue pairs */
+#define VIRTIONET_PAIRS 4
+
+
+/* Transmit and receive virtqueues size (number of buffers in pool) */
+#define VIRTIONET_QSIZE 128
+
+
+/* Receive buffer size (header and whole frame) */
+#define VIRTIONET_RXBUFSZ 2048
+
+
+/* Mergeable receive buffer size (frames may span multiple buffers) */
+#define VIRTIONET_MRGBUFSZ 1024
+
+
+/* Transmit buffer size (header and whole frame) */
+#define VIRTIONET_TXBUFSZ 2048
+
+
+/* Minimum number of receive buffers reposted with single notification */
+#define VIRTIONET_RXBATCH 16
+
+
+/* Maximum number of transmitted frames pending before device is notified */
+#define VIRTIONET_TXKICK 32
+
+
+typedef struct {
+	uint8_t flags;                  /* Header flags */
+	uint8_t gso;                    /* Segmentation offload type */
+	uint16_t hdrlen;                /* Protocol headers length */
+	uint16_t gsosz;                 /* Segment size */
+	uint16_t csumstart;             /* Partial checksum start offset */
+	uint16_t csumoffs;              /* Checksum field offset (relative to csumstart) */
+	uint16_t nbufs;                 /* Number of merged receive buffers (modern device or MRG_RXBUF only) */
+} __attribute__((packed)) virtionet_hdr_t;
+
+
+typedef struct {
+	uint8_t cls;                    /* Command class */
+	uint8_t cmd;                    /* Command */
+	uint16_t pairs;                 /* Number of queue pairs */
+	uint8_t ack;                    /* Command status (device writable) */
+} __attribute__((packed)) virtionet_ctl_t;
+
+
+typedef struct _virtionet_buf_t virtionet_buf_t;
+
+
+struct _virtionet_buf_t {
+	virtio_req_t vreq;              /* VirtIO request */
+	virtio_seg_t seg;               /* Buffer segment */
+	uint8_t *data;                  /* Buffer memory (header and frame) */
+	void *q;                        /* Owning queue */
+	virtionet_buf_t *next;          /* Next free buffer */
+};
+
+
+typedef struct {
+	virtqueue_t vq;                 /* Virtqueue */
+	virtionet_buf_t *bufs;          /* Buffers */
+	unsigned int nbufs;             /* Number of buffers */
+	unsigned int bufsz;             /* Buffer size */
+	uint8_t *mem;                   /* Buffers memory */
+	virtio_buf_t reg;               /* Buffers memory registration */
+} virtionet_pool_t;
+
+
+typedef struct {
+	virtionet_pool_t pool;          /* Receive buffers pool */
+	virtionet_buf_t **ready;        /* Received buffers ring (device order) */
+	unsigned int rhead;             /* First received buffer */
+	unsigned int nready;            /* Number of received buffers */
+	virtio_req_t **recycle;         /* Consumed buffers waiting to be reposted */
+	unsigned int nrecycle;          /* Number of consumed buffers */
+	unsigned int posted;            /* Number of buffers available to device */
+	handle_t lock;                  /* Receive queue mutex */
+	handle_t cond;                  /* Frame received condition variable */
+} virtionet_rxq_t;
+
+
+typedef struct {
+	virtionet_pool_t pool;          /* Transmit buffers pool */
+	virtionet_buf_t *free;          /* Free buffers list */
+	unsigned int pending;           /* Frames queued since last device notification */
+	handle_t lock;                  /* Transmit queue mutex */
+} virtionet_txq_t;
+
+
+struct _virtionet_t {
+	virtio_dev_t vdev;              /* VirtIO device */
+	virtionet_rxq_t rxqs[VIRTIONET_PAIRS]; /* Receive queues */
+	virtionet_txq_t txqs[VIRTIONET_PAIRS]; /* Transmit queues */
+	unsigned int npairs;            /* Number of active queue pairs */
+	unsigned int nqueues;           /* Number of initialized queue pairs */
+	unsigned int hdrsz;             /* Frame header size */
+	uint8_t mac[6];                 /* MAC address */
+	volatile unsigned char link;    /* Link is up */
+	unsigned char csum;             /* Transmit checksum offload */
+	unsigned char rxcsum;           /* Receive checksum validation */
+	unsigned char mrg;              /* Mergeable receive buffers */
+
+	/* Control queue */
+	virtqueue_t ctlq;               /* Control virtqueue */
+	virtionet_ctl_t *ctl;           /* Control command (DMA memory) */
+	unsigned char hasctl;           /* Control virtqueue negotiated */
+
+	/* Completion service (receive and control queues) */
+	virtqueue_t *vqs[VIRTIONET_PAIRS + 1];
+	virtio_client_t client;
+};
+
+
+/* VirtIO network device descriptors */
+static const virtio_devinfo_t info[] = {
+	{ .type = vdevPCI, .id = 0x1041 },
+	{ .type = vdevPCI, .id = 0x1000 },
+#ifdef VIRTIO_HOST
+	/* Loopback network device (host builds) */
+	{ .type = vdevLOOP, .id = 0x01 },
+#endif
+#ifdef TARGET_RISCV64
+	/* Direct VirtIO MMIO QEMU network device descriptors */
+	{ .type = vdevMMIO, .id = 0x01, .irq = 8, .base = { (void *)0x10008000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x01, .irq = 7, .base = { (void *)0x10007000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x01, .irq = 6, .base = { (void *)0x10006000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x01, .irq = 5, .base = { (void *)0x10005000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x01, .irq = 4, .base = { (void *)0x10004000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x01, .irq = 3, .base = { (void *)0x10003000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x01, .irq = 2, .base = { (void *)0x10002000, 0x1000 } },
+	{ .type = vdevMMIO, .id = 0x01, .irq = 1, .base = { (void *)0x10001000, 0x1000 } },
+#endif
+	{ .type = vdevNONE }
+};
+
+
+struct {
+	virtio_ctx_t vctx;              /* Device detection context */
+	unsigned int desc;              /* Processed descriptors */
+} virtionet_common;
+
+
+/* Completes partial checksum in software (ones' complement sum from start to frame end stored at start + offs) */
+static void virtionet_csum(uint8_t *data, size_t len, unsigned int start, unsigned int offs)
+{
+	uint32_t sum = 0;
+	size_t i;
+
+	for (i = start; i + 1 < len; i += 2)
+		sum += ((uint32_t)data[i] << 8) | data[i + 1];
+
+	if (i < len)
+		sum += (uint32_t)data[i] << 8;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+
+	data[start + offs] = sum >> 8;
+	data[start + offs + 1] = sum;
+}
+
+
+/* Queues received buffer (buffers are completed in device order by completion service) */
+static void virtionet_rxdone(virtio_req_t *vreq)
+{
+	virtionet_buf_t *buf = (virtionet_buf_t *)vreq->arg;
+	virtionet_rxq_t *rxq = (virtionet_rxq_t *)buf->q;
+
+	mutexLock(rxq->lock);
+
+	rxq->ready[(rxq->rhead + rxq->nready++) % rxq->pool.nbufs] = buf;
+	rxq->posted--;
+	condBroadcast(rxq->cond);
+
+	mutexUnlock(rxq->lock);
+}
+
+
+/* Reposts consumed receive buffers (queue has to be locked, device has to be notified by caller) */
+static void _virtionet_refill(virtionet_t *net, virtionet_rxq_t *rxq)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < rxq->nrecycle; i += ret) {
+		if ((ret = virtqueue_enqueueBatch(&net->vdev, &rxq->pool.vq, rxq->recycle + i, rxq->nrecycle - i)) <= 0)
+			break;
+	}
+
+	rxq->posted += i;
+	rxq->nrecycle -= i;
+	memmove(rxq->recycle, rxq->recycle + i, rxq->nrecycle * sizeof(*rxq->recycle));
+}
+
+
+int virtionet_recv(virtionet_t *net, unsigned int q, virtionet_pkt_t *pkts, unsigned int n, time_t timeout)
+{
+	virtionet_rxq_t *rxq = &net->rxqs[q % net->npairs];
+	virtionet_buf_t *buf;
+	virtionet_hdr_t hdr;
+	unsigned int i = 0, j, nbufs, skip, len, offs;
+	time_t now, end = 0;
+
+	if (timeout > 0) {
+		gettime(&now, NULL);
+		end = now + timeout;
+	}
+
+	mutexLock(rxq->lock);
+
+	while (i < n) {
+		/* Number of buffers used by next frame */
+		nbufs = 1;
+		if (rxq->nready) {
+			buf = rxq->ready[rxq->rhead];
+			memcpy(&hdr, buf->data, net->hdrsz);
+			if (net->mrg && (buf->vreq.len >= net->hdrsz))
+				nbufs = virtio_vtog16(&net->vdev, hdr.nbufs);
+
+			if (!nbufs || (nbufs > rxq->pool.nbufs))
+				nbufs = 1;
+		}
+
+		/* Wait for the first frame */
+		if (rxq->nready < nbufs) {
+			if (i || !timeout)
+				break;
+
+			if (timeout < 0) {
+				condWait(rxq->cond, rxq->lock, 0);
+				continue;
+			}
+
+			gettime(&now, NULL);
+			if (now >= end)
+				break;
+
+			condWait(rxq->cond, rxq->lock, end - now);
+			continue;
+		}
+
+		/* Copy frame (header is followed by frame data, merged buffers hold frame data only) */
+		for (j = 0, offs = 0; j < nbufs; j++) {
+			buf = rxq->ready[(rxq->rhead + j) % rxq->pool.nbufs];
+			skip = j ? 0 : net->hdrsz;
+			len = (buf->vreq.len > skip) ? buf->vreq.len - skip : 0;
+
+			if (offs + len <= pkts[i].len)
+				memcpy((uint8_t *)pkts[i].data + offs, buf->data + skip, len);
+			offs += len;
+
+			rxq->recycle[rxq->nrecycle++] = &buf->vreq;
+		}
+		rxq->rhead = (rxq->rhead + nbufs) % rxq->pool.nbufs;
+		rxq->nready -= nbufs;
+
+		/* Drop malformed frames and frames exceeding buffer */
+		if ((offs < 14) || (offs > pkts[i].len))
+			continue;
+
+		pkts[i].len = offs;
+		pkts[i].flags = 0;
+		if (hdr.flags & 0x2)
+			pkts[i].flags |= VIRTIONET_CSUM_VALID;
+
+		if (hdr.flags & 0x1) {
+			pkts[i].flags |= VIRTIONET_CSUM_PARTIAL;
+			pkts[i].csumstart = virtio_vtog16(&net->vdev, hdr.csumstart);
+			pkts[i].csumoffs = virtio_vtog16(&net->vdev, hdr.csumoffs);
+		}
+		i++;
+	}
+
+	/* Repost consumed buffers in batches, don't let device run out of buffers */
+	if ((rxq->nrecycle >= VIRTIONET_RXBATCH) || (rxq->nrecycle && (rxq->posted < rxq->pool.nbufs / 2))) {
+		_virtionet_refill(net, rxq);
+		virtqueue_notify(&net->vdev, &rxq->pool.vq);
+	}
+
+	mutexUnlock(rxq->lock);
+
+	return i;
+}
+
+
+/* Reclaims transmitted frames buffers (queue has to be locked) */
+static void _virtionet_reclaim(virtionet_t *net, virtionet_txq_t *txq)
+{
+	void *buffs[VIRTIONET_TXKICK];
+	virtionet_buf_t *buf;
+	int i, n;
+
+	while ((n = virtqueue_dequeueBulk(&net->vdev, &txq->pool.vq, buffs, NULL, VIRTIONET_TXKICK)) > 0) {
+		for (i = 0; i < n; i++) {
+			buf = &txq->pool.bufs[((uint8_t *)buffs[i] - txq->pool.mem) / txq->pool.bufsz];
+			buf->next = txq->free;
+			txq->free = buf;
+		}
+	}
+}
+
+
+/* Exposes frames to device, notifies device only if too many frames are pending (queue has to be locked) */
+static void _virtionet_xmit(virtionet_t *net, virtionet_txq_t *txq, virtio_req_t **vreqs, unsigned int n)
+{
+	virtionet_buf_t *buf;
+	unsigned int i;
+	int ret;
+
+	if ((ret = virtqueue_enqueueBatch(&net->vdev, &txq->pool.vq, vreqs, n)) < 0)
+		ret = 0;
+
+	/* Return buffers of rejected frames */
+	for (i = ret; i < n; i++) {
+		buf = (virtionet_buf_t *)vreqs[i]->arg;
+		buf->next = txq->free;
+		txq->free = buf;
+	}
+
+	if ((txq->pending += ret) >= VIRTIONET_TXKICK) {
+		virtqueue_notify(&net->vdev, &txq->pool.vq);
+		txq->pending = 0;
+	}
+}
+
+
+int virtionet_send(virtionet_t *net, unsigned int q, const virtionet_pkt_t *pkts, unsigned int n, int more)
+{
+	virtionet_txq_t *txq = &net->txqs[q % net->npairs];
+	virtio_req_t *vreqs[VIRTIONET_TXKICK];
+	virtionet_hdr_t *hdr;
+	virtionet_buf_t *buf;
+	unsigned int i, m = 0;
+	int err = EOK;
+
+	mutexLock(txq->lock);
+
+	for (i = 0; i < n; i++) {
+		if ((pkts[i].len < 14) || (pkts[i].len > VIRTIONET_FRAMESZ)) {
+			err = -EINVAL;
+			break;
+		}
+
+		if ((pkts[i].flags & VIRTIONET_CSUM_PARTIAL) && (pkts[i].csumstart + pkts[i].csumoffs + 2 > pkts[i].len)) {
+			err = -EINVAL;
+			break;
+		}
+
+		/* Reclaim transmitted buffers only when pool runs out (transmit interrupts are disabled) */
+		if (txq->free == NULL) {
+			_virtionet_reclaim(net, txq);
+
+			if (txq->free == NULL) {
+				err = -EAGAIN;
+				break;
+			}
+		}
+		buf = txq->free;
+		txq->free = buf->next;
+
+		hdr = (virtionet_hdr_t *)buf->data;
+		memset(hdr, 0, net->hdrsz);
+		memcpy(buf->data + net->hdrsz, pkts[i].data, pkts[i].len);
+
+		if (pkts[i].flags & VIRTIONET_CSUM_PARTIAL) {
+			if (net->csum) {
+				hdr->flags = 0x1;
+				hdr->csumstart = virtio_gtov16(&net->vdev, pkts[i].csumstart);
+				hdr->csumoffs = virtio_gtov16(&net->vdev, pkts[i].csumoffs);
+			}
+			else {
+				virtionet_csum(buf->data + net->hdrsz, pkts[i].len, pkts[i].csumstart, pkts[i].csumoffs);
+			}
+		}
+		buf->seg.len = net->hdrsz + pkts[i].len;
+		vreqs[m++] = &buf->vreq;
+
+		if (m == VIRTIONET_TXKICK) {
+			_virtionet_xmit(net, txq, vreqs, m);
+			m = 0;
+		}
+	}
+
+	if (m)
+		_virtionet_xmit(net, txq, vreqs, m);
+
+	/* Delay notification while more frames follow (device is notified if frames couldn't be queued) */
+	if (txq->pending && (!more || (i < n))) {
+		virtqueue_notify(&net->vdev, &txq->pool.vq);
+		txq->pending = 0;
+	}
+
+	mutexUnlock(txq->lock);
+
+	if (!i && (err < 0))
+		return err;
+
+	return i;
+}
+
+
+void virtionet_kick(virtionet_t *net, unsigned int q)
+{
+	virtionet_txq_t *txq = &net->txqs[q % net->npairs];
+
+	mutexLock(txq->lock);
+
+	if (txq->pending) {
+		virtqueue_notify(&net->vdev, &txq->pool.vq);
+		txq->pending = 0;
+	}
+
+	mutexUnlock(txq->lock);
+}
+
+
+void virtionet_info(virtionet_t *net, virtionet_info_t *info)
+{
+	memcpy(info->mac, net->mac, sizeof(info->mac));
+	info->npairs = net->npairs;
+	info->link = net->link;
+	info->csum = net->csum;
+	info->rxcsum = net->rxcsum;
+	info->mrg = net->mrg;
+}
+
+
+/* Sets number of active queue pairs */
+static int virtionet_setpairs(virtionet_t *net, unsigned int n)
+{
+	virtio_seg_t segs[3];
+	virtio_req_t req;
+	unsigned int i;
+	int err;
+
+	net->ctl->cls = 4;
+	net->ctl->cmd = 0;
+	net->ctl->pairs = virtio_gtov16(&net->vdev, n);
+	net->ctl->ack = 0xff;
+
+	segs[0].buff = &net->ctl->cls;
+	segs[0].len = 2;
+	segs[1].buff = &net->ctl->pairs;
+	segs[1].len = 2;
+	segs[2].buff = &net->ctl->ack;
+	segs[2].len = 1;
+
+	for (i = 0; i < 3; i++) {
+		segs[i].buf = NULL;
+		segs[i].prev = &segs[(i + 2) % 3];
+		segs[i].next = &segs[(i + 1) % 3];
+	}
+
+	req.segs = segs;
+	req.rsegs = 2;
+	req.wsegs = 1;
+	req.cb = NULL;
+
+	if ((err = virtqueue_enqueue(&net->vdev, &net->ctlq, &req)) < 0)
+		return err;
+	virtqueue_notify(&net->vdev, &net->ctlq);
+
+#ifdef USE_POLLING
+	virtio_wakeup(&net->client);
+#endif
+
+	virtqueue_wait(&net->vdev, &net->ctlq, &req, 0);
+
+	return (*(volatile uint8_t *)&net->ctl->ack == 0) ? EOK : -EIO;
+}
+
+
+/* Updates link status on configuration change */
+static void virtionet_config(virtio_client_t *client)
+{
+	virtionet_t *net = (virtionet_t *)client->arg;
+
+	if (virtio_readFeatures(&net->vdev) & (1 << 16))
+		net->link = virtio_readConfig16(&net->vdev, 0x06) & 0x1;
+}
+
+
+static void virtionet_donepool(virtionet_t *net, virtionet_pool_t *pool)
+{
+	virtqueue_destroy(&net->vdev, &pool->vq);
+	virtio_bufUnregister(&pool->reg);
+	virtio_memFree(pool->mem, pool->nbufs * pool->bufsz);
+	free(pool->bufs);
+}
+
+
+static int virtionet_initpool(virtionet_t *net, virtionet_pool_t *pool, unsigned int idx, unsigned int bufsz, int rx, void *q)
+{
+	virtionet_buf_t *buf;
+	unsigned int i;
+	int err;
+
+	if ((err = virtqueue_init(&net->vdev, &pool->vq, idx, VIRTIONET_QSIZE)) < 0)
+		return err;
+
+	/* Single buffer per descriptor (pool never exceeds virtqueue capacity) */
+	pool->nbufs = pool->vq.size;
+	pool->bufsz = bufsz;
+
+	do {
+		if ((pool->mem = virtio_memAlloc(pool->nbufs * pool->bufsz, NULL)) == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+
+		if ((err = virtio_bufRegister(&pool->reg, pool->mem, pool->nbufs * pool->bufsz)) < 0) {
+			virtio_memFree(pool->mem, pool->nbufs * pool->bufsz);
+			break;
+		}
+
+		if ((pool->bufs = malloc(pool->nbufs * sizeof(virtionet_buf_t))) == NULL) {
+			virtio_bufUnregister(&pool->reg);
+			virtio_memFree(pool->mem, pool->nbufs * pool->bufsz);
+			err = -ENOMEM;
+			break;
+		}
+
+		for (i = 0; i < pool->nbufs; i++) {
+			buf = &pool->bufs[i];
+			buf->data = pool->mem + i * pool->bufsz;
+			buf->q = q;
+			buf->next = NULL;
+			buf->seg.buff = buf->data;
+			buf->seg.len = pool->bufsz;
+			buf->seg.buf = &pool->reg;
+			buf->seg.prev = &buf->seg;
+			buf->seg.next = &buf->seg;
+			buf->vreq.segs = &buf->seg;
+			buf->vreq.rsegs = rx ? 0 : 1;
+			buf->vreq.wsegs = rx ? 1 : 0;
+			buf->vreq.cb = rx ? virtionet_rxdone : NULL;
+			buf->vreq.arg = buf;
+		}
+
+		return EOK;
+	} while (0);
+
+	virtqueue_destroy(&net->vdev, &pool->vq);
+
+	return err;
+}
+
+
+static void virtionet_donepair(virtionet_t *net, unsigned int i)
+{
+	virtionet_rxq_t *rxq = &net->rxqs[i];
+	virtionet_txq_t *txq = &net->txqs[i];
+
+	virtionet_donepool(net, &txq->pool);
+	resourceDestroy(txq->lock);
+
+	virtionet_donepool(net, &rxq->pool);
+	resourceDestroy(rxq->cond);
+	resourceDestroy(rxq->lock);
+	free(rxq->recycle);
+	free(rxq->ready);
+}
+
+
+static int virtionet_initpair(virtionet_t *net, unsigned int i)
+{
+	virtionet_rxq_t *rxq = &net->rxqs[i];
+	virtionet_txq_t *txq = &net->txqs[i];
+	unsigned int j;
+	int err;
+
+	if ((err = virtionet_initpool(net, &rxq->pool, 2 * i, net->mrg ? VIRTIONET_MRGBUFSZ : VIRTIONET_RXBUFSZ, 1, rxq)) < 0)
+		return err;
+
+	do {
+		rxq->ready = malloc(rxq->pool.nbufs * sizeof(*rxq->ready));
+		rxq->recycle = malloc(rxq->pool.nbufs * sizeof(*rxq->recycle));
+		if ((rxq->ready == NULL) || (rxq->recycle == NULL)) {
+			err = -ENOMEM;
+			break;
+		}
+
+		if ((err = mutexCreate(&rxq->lock)) < 0)
+			break;
+
+		if ((err = condCreate(&rxq->cond)) < 0) {
+			resourceDestroy(rxq->lock);
+			break;
+		}
+
+		if ((err = mutexCreate(&txq->lock)) < 0) {
+			resourceDestroy(rxq->cond);
+			resourceDestroy(rxq->lock);
+			break;
+		}
+
+		if ((err = virtionet_initpool(net, &txq->pool, 2 * i + 1, VIRTIONET_TXBUFSZ, 0, txq)) < 0) {
+			resourceDestroy(txq->lock);
+			resourceDestroy(rxq->cond);
+			resourceDestroy(rxq->lock);
+			break;
+		}
+
+		/* All receive buffers are pre-posted */
+		rxq->rhead = 0;
+		rxq->nready = 0;
+		rxq->posted = 0;
+		rxq->nrecycle = rxq->pool.nbufs;
+		for (j = 0; j < rxq->pool.nbufs; j++)
+			rxq->recycle[j] = &rxq->pool.bufs[j].vreq;
+
+		txq->free = NULL;
+		txq->pending = 0;
+		for (j = txq->pool.nbufs; j--;) {
+			txq->pool.bufs[j].next = txq->free;
+			txq->free = &txq->pool.bufs[j];
+		}
+
+		/* Transmitted buffers are reclaimed on transmit */
+		virtqueue_disableIRQ(&net->vdev, &txq->pool.vq);
+
+		return EOK;
+	} while (0);
+
+	free(rxq->recycle);
+	free(rxq->ready);
+	virtionet_donepool(net, &rxq->pool);
+
+	return err;
+}
+
+
+static void virtionet_destroydev(virtionet_t *net)
+{
+	virtio_dev_t *vdev = &net->vdev;
+	unsigned int i;
+
+	virtio_unregister(&net->client);
+	/* Stop device before releasing buffers memory */
+	virtio_reset(vdev);
+
+	for (i = 0; i < net->nqueues; i++)
+		virtionet_donepair(net, i);
+
+	if (net->hasctl) {
+		virtqueue_destroy(vdev, &net->ctlq);
+		virtio_memFree(net->ctl, sizeof(virtionet_ctl_t));
+	}
+	virtio_destroyDev(vdev);
+}
+
+
+static int virtionet_initdev(virtionet_t *net)
+{
+	virtio_dev_t *vdev = &net->vdev;
+	unsigned int i, n, max = 1;
+	uint64_t features;
+	int err;
+
+	if ((err = virtio_initDev(vdev)) < 0)
+		return err;
+
+	do {
+		/* Negotiate CSUM, GUEST_CSUM, MAC, MRG_RXBUF, STATUS, CTRL_VQ and MQ features */
+		if ((err = virtio_writeFeatures(vdev, (1 << 0) | (1 << 1) | (1 << 5) | (1 << 15) | (1 << 16) | (1 << 17) | (1 << 22))) < 0)
+			break;
+		features = virtio_readFeatures(vdev);
+
+		net->csum = !!(features & (1 << 0));
+		net->rxcsum = !!(features & (1 << 1));
+		net->mrg = !!(features & (1 << 15));
+		net->hasctl = !!(features & (1 << 17));
+		net->hdrsz = (virtio_modern(vdev) || net->mrg) ? sizeof(virtionet_hdr_t) : sizeof(virtionet_hdr_t) - sizeof(uint16_t);
+		net->link = (features & (1 << 16)) ? virtio_readConfig16(vdev, 0x06) & 0x1 : 1;
+
+		memset(net->mac, 0, sizeof(net->mac));
+		if (features & (1 << 5)) {
+			for (i = 0; i < sizeof(net->mac); i++)
+				net->mac[i] = virtio_readConfig8(vdev, i);
+		}
+
+		/* Multiqueue requires control virtqueue */
+		if (net->hasctl && (features & (1 << 22)) && ((max = virtio_readConfig16(vdev, 0x08)) == 0))
+			max = 1;
+
+		n = (max > VIRTIONET_PAIRS) ? VIRTIONET_PAIRS : max;
+		for (i = 0; i < n; i++) {
+			if ((err = virtionet_initpair(net, i)) < 0)
+				break;
+			net->vqs[i] = &net->rxqs[i].pool.vq;
+		}
+
+		if (err < 0) {
+			while (i--)
+				virtionet_donepair(net, i);
+			break;
+		}
+		net->npairs = n;
+		net->nqueues = n;
+
+		/* Control virtqueue follows all device queue pairs */
+		if (net->hasctl) {
+			if ((net->ctl = virtio_memAlloc(sizeof(virtionet_ctl_t), NULL)) == NULL)
+				err = -ENOMEM;
+			else if ((err = virtqueue_init(vdev, &net->ctlq, 2 * max, 8)) < 0)
+				virtio_memFree(net->ctl, sizeof(virtionet_ctl_t));
+
+			if (err < 0) {
+				for (i = 0; i < n; i++)
+					virtionet_donepair(net, i);
+				break;
+			}
+			net->vqs[n] = &net->ctlq;
+		}
+
+		/* Poll for completions while they keep arriving */
+		net->client.vdev = vdev;
+		net->client.vqs = net->vqs;
+		net->client.nvqs = n + net->hasctl;
+		net->client.config = virtionet_config;
+		net->client.arg = net;
+		virtqueue_pollInit(&net->client.poll);
+#ifdef USE_POLLING
+		net->client.poll.irq = 0;
+#endif
+
+		if ((err = virtio_register(&net->client)) < 0) {
+			if (net->hasctl) {
+				virtqueue_destroy(vdev, &net->ctlq);
+				virtio_memFree(net->ctl, sizeof(virtionet_ctl_t));
+			}
+			for (i = 0; i < n; i++)
+				virtionet_donepair(net, i);
+			break;
+		}
+
+		/* Pre-post receive buffers */
+		for (i = 0; i < n; i++)
+			_virtionet_refill(net, &net->rxqs[i]);
+
+		virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 2));
+
+		for (i = 0; i < n; i++)
+			virtqueue_notify(vdev, &net->rxqs[i].pool.vq);
+
+		/* Enable queue pairs (device starts with single pair), fall back to single pair on failure */
+		if ((n > 1) && (virtionet_setpairs(net, n) < 0))
+			net->npairs = 1;
+
+		return EOK;
+	} while (0);
+
+	virtio_writeStatus(vdev, virtio_readStatus(vdev) | (1 << 7));
+	virtio_destroyDev(vdev);
+
+	return err;
+}
+
+
+void virtionet_close(virtionet_t *net)
+{
+	virtionet_destroydev(net);
+	free(net);
+}
+
+
+int virtionet_open(virtionet_t **net)
+{
+	virtionet_t *vnet;
+	virtio_dev_t vdev;
+	int err;
+
+	for (; info[virtionet_common.desc].type != vdevNONE; virtionet_common.desc++, virtionet_common.vctx.reset = 1) {
+		while ((err = virtio_find(&info[virtionet_common.desc], &vdev, &virtionet_common.vctx)) != -ENODEV) {
+			if (err < 0)
+				return err;
+
+			if ((vnet = malloc(sizeof(virtionet_t))) == NULL)
+				return -ENOMEM;
+			vnet->vdev = vdev;
+
+			if ((err = virtionet_initdev(vnet)) < 0) {
+				free(vnet);
+				if (err != -ENODEV)
+					return err;
+				continue;
+			}
+
+			*net = vnet;
+
+			return EOK;
+		}
+	}
+
+	return -ENODEV;
+}
+
+
+void virtionet_done(void)
+{
+	virtio_done();
+}
+
+
+int virtionet_init(void)
+{
+	return virtio_init();
+}